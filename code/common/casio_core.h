@@ -0,0 +1,1127 @@
+
+#ifndef _CASIO_CORE_HEADER_FILE_H
+#define _CASIO_CORE_HEADER_FILE_H
+
+// Casio protocol core
+// The Mini Experimenter protocol engine, independent of the board: the link
+// state machine (start indicator, instruction, Send38K data and Receive38K
+// header and packet), the commands the calculator sends (0, 1, 3, 7, 8, 12 and
+// 2001 with batching), packet checksums, instruction decoding, command tokens,
+// the 15 byte list headers, ASCII and hex value encoding, and the measurement
+// and list packets. It is shared by the ESP32 build (esp-mini-exp/main/miniexp.cpp)
+// and the Thunderboard Sense 2 build (tbsense2/main.cpp), so a protocol fix made
+// here applies to both, and it compiles on a PC as well.
+//
+// Everything is a static member of casio_core<Platform>, where Platform is a
+// traits class supplied by each build:
+//
+//   typedef ... link_t;                                      // the board's state for one calculator link
+//   enum { chan_total, rx_len, verbose, pingpong, developer, hlpp }; // channels, casio_rx_buf size less one,
+//                                                            // and the debug print settings (0 or 1)
+//   static void send(link_t* lk, const uint8_t* buf, uint16_t len);  // UART send
+//   static void receive(link_t* lk, int len, int match);     // start receiving len bytes into casio_rx_buf,
+//                                                            // or up to the match character if it isn't -1.
+//                                                            // A board whose UART task assembles the packets
+//                                                            // itself (see casio_rx_data_len) does nothing
+//   static void print(const char* fmt, ...);                 // debug output
+//   static double read_sample(int chan);                     // latest reading of a channel, chan 0..
+//   static int64_t usec(void);                               // a microsecond clock
+//
+// and the board hooks that process() calls:
+//
+//   static char status(void);                                // '1' running, higher for a board with a network
+//   static int active_chans(link_t* lk);                     // channels in a measurement, readied for sampling
+//   static int read_row(link_t* lk, double* vals, char type); // the active channels for a measurement packet,
+//                                                            // returns how many
+//   static void chan_setup(link_t* lk, int chan, int type);  // command 1 set channel chan (0..) to type
+//   static void clear_channels(link_t* lk);                  // command 0 cleared every channel
+//   static void trigger(link_t* lk);                         // command 8, sampling starts
+//   static void sampling_done(link_t* lk);                   // the last sample of a run has been sent
+//   static int op_nargs(int op);                             // arguments of the board's own 2001 operations
+//   static double op_2001(link_t* lk, cmd_tok_t* op, int nargs, char in_batch); // one of them, see op()
+//   static unsigned int list_begin(link_t* lk);              // values in the list for a board hl_state
+//                                                            // (HL_BOARD onwards), 0 to send -1 instead
+//   static double list_value(void* lk, unsigned int idx);    // one value of that list
+//   static void list_end(link_t* lk, int state);             // the list for state has been sent, hl_state
+//                                                            // can be set again for the next Receive38K
+//
+// link_t is any struct with these members, the board adds whatever else it needs:
+//
+//   casio_cmd_t casio_cmd; char procedure, comm_state, sys_state, hl_state;
+//   chan_setup[chan_total].operation; samp_trig_setup.period_usec, .numsamp and .mode;
+//   uint8_t casio_rx_buf[rx_len+1], casio_tx_buf[]; uint16_t sampnum; int8_t stream_chan;
+//   double batch_res[BATCH_MAX]; int batch_len; unsigned int list_len;
+//
+// The calls are resolved at compile time, so there is no virtual dispatch,
+// and the small functions inline into the protocol handler.
+//
+// A build can define CASIO_CORE_HOT before including this file, to add an
+// attribute to the functions used for every packet (checksum, decoding and
+// the measurement packet). The ESP32 build forces them inline, so that they
+// end up in whichever memory its own callers are placed in.
+//
+// The defines and casio_cmd_t are plain C, so that C files can use a link struct.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CASIO_START_HEADER_ERROR -10
+#define CASIO_DIRECTION_ERROR -1
+#define CASIO_CHECKSUM_ERROR -2
+#define CASIO_HEADER_LEN 15
+#define CASIO_ASCII_VALUE_LEN 6             // characters in each ASCII value
+
+typedef struct cmd_tok_s {
+    int tokint;
+    double tokfloat;
+    char toktype;
+} cmd_tok_t;
+
+#define TOK_TYPE_INT 0
+#define TOK_TYPE_FLOAT 1
+#define TOK_MAX 32
+#define BATCH_MAX (TOK_MAX/2)                // results in one 2001 batch
+
+#define CASIO_START_INDICATOR 0x15
+#define CODEA_OK 0x13
+#define CODEB_OK 0x06
+#define CODEA_RETRY 0x05
+#define CODEB_RETRY 0x05
+#define CODEA_ERROR 0x22
+#define CODEB_ERROR 0x22
+#define DIR_CASIO_SEND 'N'
+#define DIR_CASIO_RECV 'R'
+#define TYPE_ASCII 'A'
+#define TYPE_HEX 'H'
+// link states
+#define COMM_IDLE 0
+#define COMM_WAITING_INSTRUCTION 1
+#define COMM_WAITING_DATA 2
+#define COMM_WAITING_RX_HEADER_ACK 3
+#define COMM_WAITING_RX_PACKET_ACK 4
+#define COMM_WAITING_PERFORM_ROLESWAP 5
+#define PROC_NULL 0
+#define PROC_SEND38K 1
+#define PROC_RECV38K 2
+#define SYS_IDLE 0
+#define SYS_INIT 1
+// what the next Receive38K gets
+#define HL_IDLE 0
+#define HL_SENDING 1
+#define HL_ME_GETSAMPLE1 2
+#define HL_ME_GETSAMPLE2 3
+#define HL_ME_GETSAMPLE3 4
+#define HL_STATUS_CHECK 5
+#define HL_ME_STATUS 6
+#define HL_ME_BATCH 7
+#define HL_BOARD 8                          // the board's own lists start here
+#define TRIG_MODE_NRT 0
+#define TRIG_MODE_RT 1
+
+typedef struct casio_cmd_s {
+    char direction;
+    char type;
+    char form;
+    uint16_t line;
+    uint32_t offset;
+    uint16_t psize;
+    char area;
+    char csum;
+    uint16_t datapacksize; // packet size including start and checksum
+    char direction2;
+    char type2;
+    char form2;
+    char csum2;
+    char command;
+} casio_cmd_t;
+
+#ifdef __cplusplus
+
+#ifndef CASIO_CORE_HOT
+#define CASIO_CORE_HOT
+#endif
+
+template <class Platform>
+struct casio_core {
+    typedef typename Platform::link_t link_t;
+    typedef link_t* port_t;
+
+    // checksum of a packet of len bytes, which excludes the start byte and the checksum byte itself
+    static CASIO_CORE_HOT int8_t checksum(const uint8_t* buf, int len, char* calc_result)
+    {
+        int i;
+        char tot=0;
+        if (len<3)
+            return(-1);
+        for (i=1; i<(len-1); i++) {
+            tot=tot+buf[i];
+        }
+        *calc_result=(0xff - tot)+1;
+        return(0);
+    }
+
+    // checks a 15 byte instruction and fills in cmd (a casio_cmd_t of either build).
+    // Returns 0, or one of the CASIO_..._ERROR codes
+    template <class Cmd>
+    static CASIO_CORE_HOT int8_t decode_instruction(Cmd* cmd, const uint8_t* buf)
+    {
+        char csum;
+        if (buf[0]!=':')
+            return(CASIO_START_HEADER_ERROR);
+        if ((buf[1]!='N') && (buf[1]!='R'))
+            return(CASIO_DIRECTION_ERROR);
+        checksum(buf, CASIO_HEADER_LEN, &csum);
+        if (csum!=(char)buf[14])
+            return(CASIO_CHECKSUM_ERROR);
+        if (buf[1]=='N') { // the calculator is sending
+            cmd->direction=buf[1];
+            cmd->type=buf[2];
+            cmd->form=buf[3];
+            cmd->line=(uint16_t)((buf[4]<<8) | buf[5]);
+            cmd->offset=(((uint32_t)buf[6])<<24) | (((uint32_t)buf[7])<<16) | (((uint32_t)buf[8])<<8) | ((uint32_t)buf[9]);
+            cmd->psize=(uint16_t)((buf[10]<<8) | buf[11]);
+            cmd->area=buf[13];
+            cmd->csum=buf[14];
+            cmd->direction2=0;
+        } else { // the calculator is receiving
+            cmd->direction2=buf[1];
+            cmd->type2=buf[2];
+            cmd->form2=buf[3];
+            cmd->csum2=buf[14];
+        }
+        return(0);
+    }
+
+    // splits a comma separated command into up to max tokens. Writes a '\0' at buf[len],
+    // which is where the checksum was. strtok_r, as each link can be tokenizing at once
+    static char get_tokens(uint8_t* buf, uint16_t len, cmd_tok_t* tok_arr, int max)
+    {
+        char* token;
+        char* save;
+        char tot=0;
+        buf[len]='\0';
+        token=strtok_r((char*)buf, ",", &save);
+        while (token!=NULL) {
+            sscanf(token, "%d", &(tok_arr[(unsigned char)tot].tokint));
+            tok_arr[(unsigned char)tot].toktype=TOK_TYPE_INT;
+            if (strstr(token, ".")!=NULL) {
+                sscanf(token, "%lf", &(tok_arr[(unsigned char)tot].tokfloat));
+                tok_arr[(unsigned char)tot].toktype=TOK_TYPE_FLOAT;
+            }
+            tot++;
+            if (tot>=max)
+                break;
+            token=strtok_r(NULL, ",", &save);
+        }
+        return(tot);
+    }
+
+    // converts a value into exactly 6 ASCII characters such as "1.2345" or "-0.500", with no end of string
+    static CASIO_CORE_HOT void float2ascii(double v, uint8_t* buf)
+    {
+        int i;
+        int n=0;
+        int len;
+        char neg=0;
+        char tbuf[16];
+        char digits[CASIO_ASCII_VALUE_LEN];
+        snprintf(tbuf, sizeof(tbuf), "%f", v);
+        // keep the first 6 characters, dropping anything that isn't part of a number
+        for (i=0; (i<CASIO_ASCII_VALUE_LEN) && (tbuf[i]!='\0'); i++) {
+            if (tbuf[i]=='-') {
+                neg=1;
+                digits[n++]='-';
+            } else if ((tbuf[i]=='.') || ((tbuf[i]>='0') && (tbuf[i]<='9'))) {
+                digits[n++]=tbuf[i];
+            }
+        }
+        // zero pad a short value from the beginning, keeping the sign first
+        len=n;
+        for (i=CASIO_ASCII_VALUE_LEN-1; i>=0; i--) {
+            len--;
+            if (len>=0) {
+                buf[i]=(digits[len]=='-') ? '0' : digits[len];
+            } else {
+                buf[i]='0';
+            }
+        }
+        if (neg)
+            buf[0]='-';
+    }
+
+    // converts a value in the calculator's -10 to +10 range into its 12-bit hex form
+    static CASIO_CORE_HOT uint16_t rescale(double v)
+    {
+        double scaled;
+        if (v>10.0) v=10.0;
+        if (v<-10.0) v=-10.0;
+        scaled=((10.92+v)*4096)/21.555;
+        return(((uint16_t)scaled) & 0x0fff);
+    }
+
+    // fills buf with a 15 byte header for a list of line values, psize bytes long
+    static CASIO_CORE_HOT void build_header(uint8_t* buf, char type, char form, uint16_t line, uint16_t psize, uint32_t offset=1, char area='A')
+    {
+        buf[0]=':';
+        buf[1]='N';
+        buf[2]=type;
+        buf[3]=form;
+        buf[4]=(line>>8) & 0x00ff;
+        buf[5]=line & 0x00ff;
+        buf[6]=(offset>>24) & 0x00ff;
+        buf[7]=(offset>>16) & 0x00ff;
+        buf[8]=(offset>>8) & 0x00ff;
+        buf[9]=offset & 0x00ff;
+        buf[10]=(psize>>8) & 0x00ff;
+        buf[11]=psize & 0x00ff;
+        buf[12]=0xff;
+        buf[13]=area;
+        checksum(buf, CASIO_HEADER_LEN, (char*)&buf[14]);
+    }
+
+    // length of an ASCII list of n values, without the ':' and checksum
+    static uint16_t ascii_list_len(unsigned int n)
+    {
+        return((n==0) ? 0 : (n*CASIO_ASCII_VALUE_LEN) + (n-1));
+    }
+
+    // builds a measurement packet of the n values, as an ASCII list or (type 'H') 12-bit hex values.
+    // Returns the packet length, including the ':' and the checksum
+    static CASIO_CORE_HOT int build_row(uint8_t* buf, char type, const double* vals, int n)
+    {
+        int i;
+        int pos=1;
+        uint16_t u;
+        buf[0]=':';
+        for (i=0; i<n; i++) {
+            if (type=='H') {
+                u=rescale(vals[i]);
+                buf[pos++]=(uint8_t)(u & 0x00ff);
+                buf[pos++]=(uint8_t)((u >> 8) & 0x00ff);
+            } else {
+                if (i>0)
+                    buf[pos++]=',';
+                float2ascii(vals[i], &buf[pos]);
+                pos=pos+CASIO_ASCII_VALUE_LEN;
+            }
+        }
+        pos++;
+        checksum(buf, pos, (char*)&buf[pos-1]);
+        return(pos);
+    }
+
+    // reads the channels set in mask into row[0..nchan-1] through the platform, zero for the others.
+    // Returns the time of the readings
+    static int64_t read_row(double* row, uint32_t mask, int nchan)
+    {
+        int i;
+        for (i=0; i<nchan; i++) {
+            row[i]=(mask & (0x01<<i)) ? Platform::read_sample(i) : 0.0;
+        }
+        return(Platform::usec());
+    }
+
+    // sends an ASCII list packet of numvals values, each 6 characters and separated by commas.
+    // The values are fetched one at a time with getval, and sent in chunks so that the packet
+    // can be much longer than buf. The checksum is accumulated along the way.
+    static void send_value_list(port_t port, uint8_t* buf, int bufsize, unsigned int numvals, double (*getval)(void* ctx, unsigned int idx), void* ctx)
+    {
+        unsigned int i;
+        int j;
+        int pos=1;
+        int start=1; // the ':' at the start of the packet isn't part of the checksum
+        char tot=0;
+        buf[0]=':';
+        for (i=0; i<numvals; i++) {
+            if (i>0) {
+                buf[pos]=',';
+                pos++;
+            }
+            float2ascii(getval(ctx, i), &buf[pos]);
+            pos=pos+CASIO_ASCII_VALUE_LEN;
+            if (pos>(bufsize-8)) {
+                for (j=start; j<pos; j++) {
+                    tot=tot+buf[j];
+                }
+                Platform::send(port, buf, pos);
+                pos=0;
+                start=0;
+            }
+        }
+        for (j=start; j<pos; j++) {
+            tot=tot+buf[j];
+        }
+        buf[pos]=(0xff - tot)+1;
+        pos++;
+        Platform::send(port, buf, pos);
+    }
+
+    static void send(port_t port, const uint8_t* buf, uint16_t len)
+    {
+        Platform::send(port, buf, len);
+    }
+
+    // ********** debug output **********
+
+    // prints len bytes of buf in hex, e.g. 3a,31,32,2c,31,40 where 0x3a is the start byte and
+    // 0x40 the checksum. Unless brief is set, the text follows, with '.' for unprintable bytes
+    static void hex_print(const uint8_t* buf, int len, char brief=0)
+    {
+        int i;
+        if (len<1) return;
+        Platform::print("%02x", buf[0]);
+        for (i=1; i<len; i++) {
+            Platform::print(",%02x", buf[i]);
+        }
+        if (brief) return;
+        Platform::print("  text: '");
+        asc_print(buf, len);
+    }
+
+    static void asc_print(const uint8_t* buf, int len)
+    {
+        int i;
+        for (i=0; i<len; i++) {
+            if ((buf[i]<32) || (buf[i]>126))
+                Platform::print(".");
+            else
+                Platform::print("%c", buf[i]);
+        }
+    }
+
+    // prints n dashes, the width left on a pingpong line
+    static void dash_print(int n)
+    {
+        int i;
+        for (i=0; i<n; i++) {
+            Platform::print("-");
+        }
+    }
+
+    // prints the instruction in lk->casio_cmd, in full or as one pingpong line
+    static void instruction_print(link_t* lk, char do_pingpong=0)
+    {
+        casio_cmd_t* cmd=&lk->casio_cmd;
+        char recv=(cmd->direction2!=0);
+        char typeprint=recv ? cmd->type2 : cmd->type;
+        char formprint=recv ? cmd->form2 : cmd->form;
+        if (do_pingpong) {
+            Platform::print("%s", recv ? "  |---------------R" : "  |---N");
+            Platform::print("%c", ((typeprint=='A') || (typeprint=='H')) ? typeprint : 'X');
+            Platform::print("%c", ((formprint=='V') || (formprint=='L')) ? formprint : 'X');
+            if (recv) {
+                Platform::print("------------->|\r\n");
+            } else {
+                Platform::print(",L=%u,O=%lu,P=%u,", cmd->line, (unsigned long)cmd->offset, cmd->psize);
+                // tidy the length for pingpong properly later
+                Platform::print("%c%s", cmd->area, (cmd->psize>9) ? "---------->|\r\n" : "----------->|\r\n");
+            }
+            return;
+        }
+        Platform::print("instruction: {\r\n");
+        Platform::print("%s", recv ? "  direction : recv,\r\n" : "  direction : send,\r\n");
+        switch(typeprint) {
+            case 'A':
+                Platform::print("  type : ascii,\r\n");
+                break;
+            case 'H':
+                Platform::print("  type : hex,\r\n");
+                break;
+            default:
+                Platform::print("  type : unknown '%c',\r\n", typeprint);
+                break;
+        }
+        switch(formprint) {
+            case 'V':
+                Platform::print("  form : variable,\r\n");
+                break;
+            case 'L':
+                Platform::print("  form : list,\r\n");
+                break;
+            default:
+                Platform::print("  form : unknown '%c',\r\n", formprint);
+                break;
+        }
+        if (!recv) {
+            // these fields only make sense for send from casio
+            Platform::print("  line : %u,\r\n", cmd->line);
+            Platform::print("  offset : %lu,\r\n", (unsigned long)cmd->offset);
+            Platform::print("  packet_size : %u,\r\n", cmd->psize);
+            switch(cmd->area) {
+                case 'A':
+                    Platform::print("  area : all,\r\n");
+                    break;
+                case 'S':
+                    Platform::print("  area : start,\r\n");
+                    break;
+                case 'M':
+                    Platform::print("  area : middle,\r\n");
+                    break;
+                case 'E':
+                    Platform::print("  area : end,\r\n");
+                    break;
+                default:
+                    Platform::print("  area : unknown '%c',\r\n", cmd->area);
+                    break;
+            }
+        }
+        Platform::print("  checksum : 0x%02x\r\n", (uint8_t)cmd->csum);
+        Platform::print("}\r\n");
+    }
+
+    // one high level pingpong line for a packet going to (R38K) or coming from (S38K) the calculator
+    static void print_hlpp(const char* dir, const uint8_t* buf, int len, char f)
+    {
+        int plen;
+        Platform::print("  |%s: ", dir);
+        if (f=='A') { // ASCII
+            if (len<20) {
+                plen=len;
+                asc_print(buf, plen);
+            } else {
+                plen=20;
+                asc_print(buf, plen-3);
+                Platform::print("etc");
+            }
+            dash_print(20-plen);
+            Platform::print("---|\r\n");
+        } else if (f=='H') { // Hex
+            Platform::print("0x");
+            if (len<6) {
+                plen=len;
+                hex_print(buf, plen, 1);
+            } else {
+                plen=6;
+                hex_print(buf, plen-1, 1);
+                Platform::print("..");
+            }
+            dash_print(17-plen);
+            Platform::print("-|\r\n");
+        } else {
+            // unknown format
+            Platform::print("unknown format!--------|\r\n");
+        }
+    }
+
+    // ********** the link protocol **********
+
+    static void clear_rx(link_t* lk)
+    {
+        memset(lk->casio_rx_buf, 0, Platform::rx_len);
+    }
+
+    static void send_response(link_t* lk, char r)
+    {
+        Platform::send(lk, (const uint8_t*)&r, 1);
+    }
+
+    // sends a packet of len bytes from casio_tx_buf, after filling in its checksum
+    static void send_packet(link_t* lk, int len)
+    {
+        checksum(lk->casio_tx_buf, len, (char*)&lk->casio_tx_buf[len-1]);
+        Platform::send(lk, lk->casio_tx_buf, len);
+    }
+
+    // goes back to waiting for a start indicator
+    static void wait_start(link_t* lk)
+    {
+        lk->comm_state=COMM_IDLE;
+        clear_rx(lk);
+        Platform::receive(lk, CASIO_HEADER_LEN, CASIO_START_INDICATOR);
+    }
+
+    // the calculator has sent a start indicator. Prepare for the 15 byte instruction and send CODEA_OK
+    static void start_instruction(link_t* lk)
+    {
+        lk->procedure=PROC_NULL;
+        lk->comm_state=COMM_WAITING_INSTRUCTION;
+        clear_rx(lk);
+        if (Platform::pingpong) {
+            Platform::print("  |                                |\r\n");
+            Platform::print("  |                          **COMM_IDLE**\r\n");
+            Platform::print("  |------0x15-CASIO-START-IND----->|\r\n");
+            Platform::print("  |<-----------CODEA_OK------------|\r\n");
+        }
+        if (Platform::developer) Platform::print("wait instruct:\r\n");
+        Platform::receive(lk, CASIO_HEADER_LEN, -1);
+        send_response(lk, CODEA_OK);
+    }
+
+    // header and packet for a list of n values, such as the results of a batch or one of the
+    // board's lists. The count is kept in list_len for the packet, a single -1 is sent if it's 0
+    static void send_list_header(link_t* lk, unsigned int n)
+    {
+        lk->list_len=n;
+        if (n==0) n=1;
+        lk->casio_cmd.command=0;
+        build_header(lk->casio_tx_buf, 'A', 'L', (uint16_t)n, ascii_list_len(n));
+        if (Platform::developer) Platform::print("sending list header for %u values, waiting for CODEB_OK\r\n", n);
+        if (Platform::pingpong) Platform::print("  |<---NAL,L=N,O=1,P=N,A-----------|\r\n");
+        Platform::send(lk, lk->casio_tx_buf, CASIO_HEADER_LEN);
+    }
+
+    static void send_list(link_t* lk, double (*getval)(void* ctx, unsigned int idx), void* ctx)
+    {
+        if (Platform::pingpong) Platform::print("  |<----------[LIST ASCII]---------|\r\n");
+        if (lk->list_len==0) {
+            lk->casio_tx_buf[0]=':';
+            float2ascii(-1.0, &lk->casio_tx_buf[1]);
+            send_packet(lk, CASIO_ASCII_VALUE_LEN+2);
+        } else {
+            send_value_list(lk, lk->casio_tx_buf, sizeof(lk->casio_tx_buf), lk->list_len, getval, ctx);
+        }
+    }
+
+    static double batch_value(void* ctx, unsigned int idx)
+    {
+        return(((link_t*)ctx)->batch_res[idx]);
+    }
+
+    // number of arguments each 2001 operation takes, so that a batch can be split up
+    static int op_nargs(int op)
+    {
+        switch(op) {
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+            case 5:
+                return(1);
+            default:
+                return(Platform::op_nargs(op));
+        }
+    }
+
+    // performs one 2001 operation. op[0] is the operation, followed by nargs arguments.
+    // On its own, an operation may prepare a response for the next Receive38K.
+    // In a batch, every operation instead returns a value for the combined result list.
+    // The status, sample and streaming operations are the same on every board, the rest
+    // are passed to the board
+    static double op(link_t* lk, cmd_tok_t* op, int nargs, char in_batch)
+    {
+        double res=1.0; // operations with nothing to report return 1
+        int arg=(nargs>=1) ? op[1].tokint : 0;
+        switch (op[0].tokint)
+        {
+            case 0: // provide a status
+                if (in_batch) {
+                    res=(double)(Platform::status()-'0');
+                } else {
+                    lk->hl_state=HL_ME_STATUS;
+                    if (Platform::developer) Platform::print("will send MiniExp status to casio on next Receive38K\r\n");
+                }
+                break;
+            case 1: // get sample
+            case 2:
+            case 3:
+                if (in_batch) {
+                    res=Platform::read_sample(op[0].tokint - 1);
+                } else {
+                    // on Receive38K, send the calculator a sample
+                    lk->hl_state=HL_ME_GETSAMPLE1 + op[0].tokint - 1;
+                    if (Platform::developer) Platform::print("will send sample to casio on next Receive38K\r\n");
+                }
+                break;
+            case 5: // sticky streaming: 2001,5,chan arms channel 1..3, 2001,5,0 disarms
+                if ((arg>=1) && (arg<=(HL_ME_GETSAMPLE3-HL_ME_GETSAMPLE1+1))) {
+                    lk->stream_chan=arg-1;
+                    if (Platform::developer) Platform::print("streaming armed, each Receive38K will get a channel %d sample\r\n", arg);
+                } else {
+                    lk->stream_chan=-1;
+                    if (Platform::developer) Platform::print("streaming disarmed\r\n");
+                }
+                break;
+            default:
+                res=Platform::op_2001(lk, op, nargs, in_batch);
+                break;
+        }
+        return(res);
+    }
+
+    // a 2001 command is either a single operation 2001,op,arg
+    // or a batch 2001,op,arg,op,arg,... executed in order, with one result each
+    static void command_2001(link_t* lk, cmd_tok_t* tok_arr, int numtok)
+    {
+        int pos=1;
+        int nops=0;
+        while (pos<numtok) {
+            pos=pos+1+op_nargs(tok_arr[pos].tokint);
+            nops++;
+        }
+        if (nops==1) {
+            op(lk, &tok_arr[1], numtok-2, 0);
+            return;
+        }
+        lk->batch_len=0;
+        pos=1;
+        while ((pos<numtok) && (lk->batch_len<BATCH_MAX)) {
+            int nargs=op_nargs(tok_arr[pos].tokint);
+            int avail=numtok-pos-1;
+            if (avail>nargs) avail=nargs;
+            lk->batch_res[lk->batch_len]=op(lk, &tok_arr[pos], avail, 1);
+            lk->batch_len++;
+            pos=pos+1+nargs;
+        }
+        lk->hl_state=HL_ME_BATCH;
+        if (Platform::developer) Platform::print("batch of %d operations done, will send results on next Receive38K\r\n", lk->batch_len);
+    }
+
+    // COMM_WAITING_INSTRUCTION: the 15 byte instruction has arrived
+    static void instruction(link_t* lk)
+    {
+        int8_t res;
+        if (Platform::developer) { Platform::print("recvd instruct:\r\n"); hex_print(lk->casio_rx_buf, CASIO_HEADER_LEN); Platform::print("'\r\n"); }
+        if (Platform::pingpong) Platform::print("  |                    COMM_WAITING_INSTRUCTION\r\n");
+        res=decode_instruction(&lk->casio_cmd, lk->casio_rx_buf);
+        switch(res) {
+            case CASIO_START_HEADER_ERROR:
+                if (Platform::developer) Platform::print("error, start_header is not ':'! revert to waiting for start indicator\r\n");
+                if (Platform::pingpong) Platform::print("  |------[START HEADER ERROR]----->|\r\n");
+                wait_start(lk);
+                return;
+            case CASIO_DIRECTION_ERROR:
+                if (Platform::developer) Platform::print("error, direction is not 'N' or 'R'!\r\n");
+                break;
+            case CASIO_CHECKSUM_ERROR:
+                if (Platform::developer) Platform::print("error, instruction checksum is wrong\r\n");
+                break;
+            default:
+                if (Platform::verbose) Platform::print("instruction decoded\r\n");
+                break;
+        }
+        lk->procedure=(lk->casio_rx_buf[1]==DIR_CASIO_SEND) ? PROC_SEND38K : PROC_RECV38K;
+        if (Platform::verbose) instruction_print(lk);
+        if (Platform::pingpong) instruction_print(lk, 1);
+        if (lk->casio_rx_buf[1]==DIR_CASIO_SEND) {
+            // casio will now send data, when we issue CODEB_OK
+            if (Platform::pingpong) Platform::print("  |<-----------CODEB_OK------------|\r\n");
+            clear_rx(lk);
+            if (lk->casio_cmd.type!=TYPE_ASCII) {
+                Platform::print("error, cannot handle type '%c'\r\n", lk->casio_cmd.type);
+            }
+            lk->casio_cmd.datapacksize=lk->casio_cmd.psize+2;
+            if (lk->casio_cmd.datapacksize>Platform::rx_len) {
+                Platform::print("error, length %u is larger than buffer size!\r\n", lk->casio_cmd.datapacksize);
+                lk->casio_cmd.datapacksize=Platform::rx_len;
+            }
+            Platform::receive(lk, lk->casio_cmd.datapacksize, -1);
+            lk->comm_state=COMM_WAITING_DATA;
+            send_response(lk, CODEB_OK);
+        } else { // DIR_CASIO_RECV
+            // we are now expected to receive CODEB after sending a header
+            Platform::receive(lk, 1, CODEB_OK);
+            lk->comm_state=COMM_WAITING_RX_HEADER_ACK;
+            send_header(lk);
+            if (lk->sys_state==SYS_IDLE)
+                lk->sys_state=SYS_INIT;
+        }
+    }
+
+    // Receive38K: sends the header of whatever hl_state has ready for the calculator
+    static void send_header(link_t* lk)
+    {
+        if ((lk->hl_state==HL_IDLE) && (lk->casio_cmd.form2=='V')) {
+            if (lk->stream_chan>=0) {
+                // streaming is armed, so no Send38K is needed before each sample
+                lk->hl_state=HL_ME_GETSAMPLE1 + lk->stream_chan;
+            } else if (lk->casio_cmd.command=='7') {
+                // the status check is answered until some other request comes along
+                lk->hl_state=HL_STATUS_CHECK;
+            }
+        }
+        switch(lk->hl_state) {
+            case HL_ME_STATUS:
+                build_header(lk->casio_tx_buf, 'A', 'V', 1, 1); // 1 character for the status
+                if (Platform::developer) Platform::print("sending MiniExp status header, waiting for CODEB_OK\r\n");
+                break;
+            case HL_ME_GETSAMPLE1:
+            case HL_ME_GETSAMPLE2:
+            case HL_ME_GETSAMPLE3:
+                build_header(lk->casio_tx_buf, 'A', 'V', 1, CASIO_ASCII_VALUE_LEN);
+                if (Platform::developer) Platform::print("sending value header, waiting for CODEB_OK\r\n");
+                break;
+            case HL_ME_BATCH:
+                send_list_header(lk, (unsigned int)lk->batch_len);
+                return;
+            case HL_STATUS_CHECK:
+                // "1,0,999,1" (9 bytes) for a list, to indicate status OK and channel 1 active, or "1" for a variable
+                build_header(lk->casio_tx_buf, 'A', 'L', 1, (lk->casio_cmd.form2=='L') ? 9 : 1);
+                if (Platform::developer) Platform::print("sending status check (command 7) header, waiting for CODEB_OK\r\n");
+                if (Platform::pingpong) Platform::print("  |<---NAL,L=1,O=1,P=%d,A-----------|\r\n", (lk->casio_cmd.form2=='L') ? 9 : 1);
+                break;
+            default:
+                if (lk->hl_state>=HL_BOARD) {
+                    send_list_header(lk, Platform::list_begin(lk));
+                    return;
+                }
+                if (lk->casio_cmd.form2!='L')
+                    return; // nothing to send
+                meas_header(lk);
+                break;
+        }
+        Platform::send(lk, lk->casio_tx_buf, CASIO_HEADER_LEN);
+    }
+
+    // the header for measurement packets, HL_IDLE or HL_SENDING
+    static void meas_header(link_t* lk)
+    {
+        unsigned int n;
+        char area=(lk->sampnum==0) ? 'A' : 'M'; // anything else on the first packet seems to generate an error
+        lk->casio_cmd.command=99; // magic code for now for voltage measurement request
+        if (Platform::verbose) Platform::print("building header for list response for measurement\r\n");
+        if (lk->casio_cmd.type2=='A') {
+            // Line is the number of values in the list
+            n=Platform::active_chans(lk);
+            build_header(lk->casio_tx_buf, 'A', 'L', (uint16_t)n, ascii_list_len(n), 1, area);
+            if (Platform::developer) Platform::print("asc_len set to %d\r\n", ascii_list_len(n));
+            if (Platform::pingpong) Platform::print("  |<---NAL,L=1,O=1,P=N,A-----------|\r\n");
+        } else if (lk->samp_trig_setup.mode==TRIG_MODE_NRT) { // non-real-time chunk, used for faster sampling. Doesn't work.
+            n=nrt_samples(lk);
+            if ((n<lk->samp_trig_setup.numsamp) && Platform::developer) Platform::print("only %u samples fit in a packet..\r\n", n);
+            // don't know yet how to extend beyond one packet : (
+            build_header(lk->casio_tx_buf, 'H', 'L', (uint16_t)n, (uint16_t)(n*2),
+                         (lk->sampnum>=512) ? lk->samp_trig_setup.numsamp : 1, area);
+            if (Platform::pingpong) Platform::print("  |<---NHL,L=NN,O=1,P=NN,A---------|\r\n");
+        } else { // real-time mode (slower sampling, data sent one sample at a time)
+            n=Platform::active_chans(lk);
+            build_header(lk->casio_tx_buf, 'H', 'L', 1, (uint16_t)(2*n), 1, area); // 2 bytes for each hex value
+            if (Platform::pingpong) Platform::print("  |<---NHL,L=1,O=1,P=2,A-----------|\r\n");
+        }
+        if (Platform::developer) Platform::print("sending list header\r\n");
+    }
+
+    // samples in a non-real-time packet, as many as were asked for if they fit in casio_tx_buf
+    static unsigned int nrt_samples(link_t* lk)
+    {
+        unsigned int n=lk->samp_trig_setup.numsamp;
+        if (n>(sizeof(lk->casio_tx_buf)-2)/3)
+            n=(sizeof(lk->casio_tx_buf)-2)/3; // the :END packet has 3 bytes per sample
+        return(n);
+    }
+
+    // COMM_WAITING_DATA: a Send38K packet has arrived
+    static void data(link_t* lk)
+    {
+        int i;
+        char doerror=0;
+        int numtok;
+        cmd_tok_t tok_arr[TOK_MAX];
+        if (Platform::developer) { Platform::print("recvd data pak:\r\n"); hex_print(lk->casio_rx_buf, lk->casio_cmd.datapacksize); Platform::print("'\r\n"); }
+        if (Platform::pingpong) Platform::print("  |                       COMM_WAITING_DATA\r\n");
+        if (Platform::hlpp && (lk->procedure==PROC_SEND38K)) {
+            print_hlpp("---S38K", lk->casio_rx_buf+1, lk->casio_cmd.datapacksize-2, lk->casio_cmd.type);
+        }
+        // is the first byte ':'? If not, then reject with a CODEB_ERROR for now
+        if (lk->casio_rx_buf[0]!=':') {
+            if (Platform::developer) Platform::print("error, invalid data, send CODEB_ERROR\r\n");
+            doerror=1;
+        }
+        numtok=get_tokens(&lk->casio_rx_buf[1], lk->casio_cmd.datapacksize-2, tok_arr, TOK_MAX);
+        if ((numtok>=TOK_MAX) && Platform::developer) Platform::print("Reached TOK_MAX number of allowed tokens\r\n");
+        if (Platform::verbose) Platform::print("num tokens found: %d\r\n", numtok);
+        // handle the commands!
+        switch(tok_arr[0].tokint) {
+            case 2001: // MiniExperimenter command
+                if (numtok>=3) {
+                    command_2001(lk, tok_arr, numtok);
+                }
+                break;
+            case 0: // don't know what this is. Lets use it to clear the channel list.
+                if (Platform::developer) Platform::print("received command 0\r\n");
+                for (i=0; i<Platform::chan_total; i++) {
+                    lk->chan_setup[i].operation=0;
+                }
+                Platform::clear_channels(lk);
+                lk->sampnum=0;
+                lk->stream_chan=-1;
+                break;
+            case 1: // channel setup command
+                if (Platform::developer) Platform::print("received channel setup data\r\n");
+                if (Platform::pingpong) Platform::print("  |--------1-CHAN_SETUP----------->|\r\n");
+                if (numtok>=3) {
+                    lk->samp_trig_setup.mode=TRIG_MODE_NRT; // we reset to this as a default if no command 12 arrives later
+                    if ((tok_arr[1].tokint>=1) && (tok_arr[1].tokint<=Platform::chan_total)) {
+                        lk->chan_setup[(tok_arr[1].tokint)-1].operation = tok_arr[2].tokint;
+                        if (Platform::developer) Platform::print("CH%d set to type %d\r\n", tok_arr[1].tokint, tok_arr[2].tokint);
+                        Platform::chan_setup(lk, tok_arr[1].tokint-1, tok_arr[2].tokint);
+                    }
+                }
+                break;
+            case 3: // sample rate and num samples
+                if (Platform::developer) Platform::print("received sampling rate\r\n");
+                if (Platform::pingpong) Platform::print("  |--------3-SAMPLERATE----------->|\r\n");
+                if (numtok>=3) {
+                    if (tok_arr[1].toktype==TOK_TYPE_INT) {
+                        lk->samp_trig_setup.period_usec=((uint32_t)(tok_arr[1].tokint))*1000000;
+                    } else {
+                        lk->samp_trig_setup.period_usec=(uint32_t)(tok_arr[1].tokfloat*1000000.0);
+                    }
+                    if (Platform::developer) Platform::print("sample rate: %lu usec\r\n", (unsigned long)lk->samp_trig_setup.period_usec);
+                    if (tok_arr[2].tokint==-1) {
+                        lk->samp_trig_setup.mode=TRIG_MODE_RT;
+                        lk->samp_trig_setup.numsamp=0; // sampled with each data request
+                        if (Platform::developer) Platform::print("num samples: per data request\r\n");
+                    } else {
+                        lk->samp_trig_setup.numsamp=(unsigned int)tok_arr[2].tokint;
+                        if (Platform::developer) Platform::print("num samples: %u\r\n", lk->samp_trig_setup.numsamp);
+                    }
+                }
+                break;
+            case 7: // status check command 7
+                lk->casio_cmd.command='7';
+                if (Platform::developer) Platform::print("received status check command '7'\r\n");
+                if (Platform::pingpong) Platform::print("  |--------7-STATUS_CHECK--------->|\r\n");
+                lk->hl_state=HL_STATUS_CHECK;
+                break;
+            case 8: // trigger command to start sampling
+                Platform::trigger(lk);
+                lk->sampnum=0;
+                lk->hl_state=HL_SENDING;
+                if (Platform::developer) Platform::print("entering state HL_SENDING\r\n");
+                if (Platform::pingpong) Platform::print("  |--------8-TRIGGER-------------->|\r\n");
+                break;
+            case 12: // real time mode
+                if (numtok==2) {
+                    if (tok_arr[1].tokint==1) {
+                        lk->samp_trig_setup.mode=TRIG_MODE_RT; // real-time mode, single result
+                        if (Platform::developer) Platform::print("entering realtime mode\r\n");
+                        if (Platform::pingpong) Platform::print("  |--------12-REALTIME------------>|\r\n");
+                    } else {
+                        lk->samp_trig_setup.mode=TRIG_MODE_NRT; // non-real-time, batched. can't get this to work..
+                        if (Platform::developer) Platform::print("entering unusable non-realtime mode (batch)\r\n");
+                        if (Platform::pingpong) Platform::print("  |--------12-NONREALTIME--------->|\r\n");
+                    }
+                }
+                break;
+            default:
+                if (Platform::pingpong) print_hlpp("--[PAK", lk->casio_rx_buf+1, lk->casio_cmd.datapacksize-2, 'A');
+                break;
+        }
+        // we can now send CODEB_OK and go back to idle state
+        if (Platform::pingpong) Platform::print("%s", doerror ? "  |<---------CODEB_ERROR-----------|\r\n" : "  |<-----------CODEB_OK------------|\r\n");
+        wait_start(lk);
+        send_response(lk, doerror ? CODEB_ERROR : CODEB_OK);
+    }
+
+    // COMM_WAITING_RX_HEADER_ACK with CODEB_OK: sends the packet that goes with the header
+    static void send_payload(link_t* lk)
+    {
+        int st=lk->hl_state;
+        switch (st) {
+            case HL_ME_STATUS:
+                if (Platform::developer) Platform::print("HL_ME_STATUS: sending ME status to Casio\r\n");
+                if (Platform::pingpong) Platform::print("  |<------[MINIEXP STATUS]---------|\r\n");
+                lk->casio_tx_buf[0]=':';
+                lk->casio_tx_buf[1]=Platform::status();
+                lk->hl_state=HL_IDLE;
+                lk->comm_state=COMM_WAITING_RX_PACKET_ACK;
+                send_packet(lk, 3);
+                break;
+            case HL_ME_GETSAMPLE1:
+            case HL_ME_GETSAMPLE2:
+            case HL_ME_GETSAMPLE3:
+                if (Platform::developer) Platform::print("HL_ME_GETSAMPLE: sending sample to Casio\r\n");
+                if (Platform::pingpong) Platform::print("  |<-----[MEASUREMENT ASCII]-------|\r\n");
+                lk->casio_tx_buf[0]=':';
+                float2ascii(Platform::read_sample(st - HL_ME_GETSAMPLE1), &lk->casio_tx_buf[1]);
+                if (Platform::hlpp) print_hlpp("<--R38K", &lk->casio_tx_buf[1], CASIO_ASCII_VALUE_LEN, 'A');
+                lk->hl_state=HL_IDLE;
+                lk->comm_state=COMM_WAITING_RX_PACKET_ACK;
+                send_packet(lk, CASIO_ASCII_VALUE_LEN+2); // the value, ':' and the checksum
+                break;
+            case HL_ME_BATCH:
+                if (Platform::developer) Platform::print("HL_ME_BATCH: sending batch results to Casio\r\n");
+                send_list(lk, batch_value, lk);
+                lk->hl_state=HL_IDLE;
+                lk->comm_state=COMM_WAITING_RX_PACKET_ACK;
+                break;
+            case HL_STATUS_CHECK:
+                if (Platform::pingpong) Platform::print("  |<-------1-STATUS_READY----------|\r\n");
+                if (Platform::hlpp) Platform::print("  |<--R38K: 1----------------------|\r\n");
+                if (lk->casio_cmd.form2=='L') { // list expected
+                    memcpy(&lk->casio_tx_buf[1], "1,0,999,1", 9);
+                } else { // value expected
+                    lk->casio_tx_buf[1]='1';
+                }
+                lk->casio_tx_buf[0]=':';
+                if (Platform::developer) Platform::print("sending status check packet, waiting for CODEB_OK\r\n");
+                lk->hl_state=HL_IDLE;
+                lk->comm_state=COMM_WAITING_RX_PACKET_ACK;
+                send_packet(lk, (lk->casio_cmd.form2=='L') ? 11 : 3);
+                break;
+            default:
+                if (st>=HL_BOARD) {
+                    if (Platform::developer) Platform::print("sending list of %u values to Casio\r\n", lk->list_len);
+                    send_list(lk, Platform::list_value, lk);
+                    lk->hl_state=HL_IDLE;
+                    lk->comm_state=COMM_WAITING_RX_PACKET_ACK;
+                    Platform::list_end(lk, st);
+                } else if (lk->casio_cmd.command==99) {
+                    send_meas(lk);
+                }
+                break;
+        }
+    }
+
+    // a measurement packet, for the header sent by meas_header
+    static void send_meas(link_t* lk)
+    {
+        int i;
+        int len=0;
+        int nvals;
+        double vals[Platform::chan_total];
+        if (Platform::verbose) Platform::print("building packet with voltage value response\r\n");
+        if (lk->casio_cmd.type2=='A') {
+            if (Platform::developer) Platform::print("sending meas pak\r\n");
+            if (Platform::pingpong) Platform::print("  |<-----[MEASUREMENT ASCII]-------|\r\n");
+            nvals=Platform::read_row(lk, vals, 'A');
+            len=build_row(lk->casio_tx_buf, 'A', vals, nvals);
+            if (Platform::developer) Platform::print("sending values '%.*s'\r\n", len-2, (const char*)&lk->casio_tx_buf[1]);
+            if (Platform::hlpp) print_hlpp("<--R38K", &lk->casio_tx_buf[1], len-2, 'A');
+        } else if (lk->casio_cmd.type2=='H') {
+            if (Platform::pingpong) Platform::print("  |<------[MEASUREMENT HEX]--------|\r\n");
+            nvals=Platform::read_row(lk, vals, 'H');
+            len=build_row(lk->casio_tx_buf, 'H', vals, nvals);
+            if ((lk->hl_state==HL_SENDING) && (lk->samp_trig_setup.mode==TRIG_MODE_NRT)) {
+                // non-real-time mode is used for fast sample rates. Doesn't work : (
+                unsigned int ns=nrt_samples(lk);
+                if (lk->sampnum>=lk->samp_trig_setup.numsamp) {
+                    // we have completed the bulk transfer of data.
+                    memset(lk->casio_tx_buf, 0xff, ns*3);
+                    memcpy(lk->casio_tx_buf, ":END", 4);
+                    len=(ns*3)+2;
+                    if (Platform::developer) Platform::print("Sending :END\r\n");
+                    lk->sampnum++;
+                } else {
+                    for (i=0; i<(int)ns; i++) {
+                        uint16_t u=rescale(Platform::read_sample(0));
+                        lk->casio_tx_buf[(i*2)+1]=(uint8_t)(u & 0x00ff);
+                        lk->casio_tx_buf[(i*2)+2]=(uint8_t)((u >> 8) & 0x00ff);
+                    }
+                    len=(ns*2)+2;
+                    lk->sampnum=lk->sampnum+ns;
+                }
+                checksum(lk->casio_tx_buf, len, (char*)&lk->casio_tx_buf[len-1]);
+            } else {
+                lk->sampnum++;
+            }
+            if (Platform::hlpp) print_hlpp("<--R38K", &lk->casio_tx_buf[1], len-2, 'H');
+        } else {
+            Platform::print("error, unrecognizable type '%c'!\r\n", lk->casio_cmd.type2);
+        }
+        if (Platform::developer) Platform::print("sending sample %u\r\n", lk->sampnum);
+        lk->comm_state=COMM_WAITING_RX_PACKET_ACK;
+        if ((lk->hl_state==HL_SENDING) && (lk->sampnum>=lk->samp_trig_setup.numsamp)) {
+            Platform::sampling_done(lk);
+            if (lk->samp_trig_setup.mode==TRIG_MODE_NRT) {
+                lk->hl_state=HL_IDLE;
+                lk->comm_state=COMM_WAITING_PERFORM_ROLESWAP;
+                if (Platform::developer) Platform::print("Entering state HL_IDLE\r\n");
+            }
+        }
+        Platform::send(lk, lk->casio_tx_buf, len);
+    }
+
+    // COMM_WAITING_RX_HEADER_ACK or COMM_WAITING_RX_PACKET_ACK: the calculator's answer to what we sent
+    static void ack(link_t* lk)
+    {
+        char header=(lk->comm_state==COMM_WAITING_RX_HEADER_ACK);
+        if (Platform::pingpong) Platform::print("%s", header ? "  |                  COMM_WAITING_RX_HEADER_ACK\r\n" : "  |                COMM_WAITING_RX_PACKET_ACK\r\n");
+        switch(lk->casio_rx_buf[0]) {
+            case CODEB_OK:
+                if (Platform::developer) Platform::print("%s", header ? "rcvd CODEB_OK\r\n" : "rcvd CODEB_OK. Fin\r\n");
+                if (Platform::pingpong) Platform::print("  |------------CODEB_OK----------->|\r\n");
+                if (header) {
+                    // we are now expected to receive a CODEB after sending a packet
+                    Platform::receive(lk, 1, CODEB_OK);
+                    send_payload(lk);
+                } else {
+                    lk->casio_cmd.direction=0;
+                    lk->casio_cmd.direction2=0;
+                    wait_start(lk);
+                }
+                break;
+            case CODEB_RETRY:
+                if (Platform::developer) Platform::print("received CODEB_RETRY\r\n");
+                if (Platform::pingpong) Platform::print("  |----------CODEB_RETRY---------->|\r\n");
+                break;
+            case CODEB_ERROR:
+                if (Platform::developer) Platform::print("received CODEB_ERROR\r\n");
+                if (Platform::pingpong) Platform::print("  |----------CODEB_ERROR---------->|\r\n");
+                break;
+            case CASIO_START_INDICATOR:
+                // we don't expect this, but it seems to occur occasionally, maybe when a status check
+                // variable request occurs. Recover the way COMM_IDLE would
+                if (Platform::developer) Platform::print("received unexpected start indication\r\n");
+                start_instruction(lk);
+                break;
+            default:
+                if (Platform::developer) Platform::print("received unexpected value '%u', expected CODEB\r\n", lk->casio_rx_buf[0]);
+                if (Platform::pingpong) Platform::print("  |---------CODEB_UNKNOWN!-------->|\r\n");
+                break;
+        }
+    }
+
+    // the last non-real-time packet has been sent, hand the link back to the calculator
+    static void roleswap(link_t* lk)
+    {
+        lk->casio_cmd.direction=0;
+        lk->casio_cmd.direction2=0;
+        wait_start(lk);
+        memset(lk->casio_tx_buf, 0xff, CASIO_HEADER_LEN);
+        memcpy(lk->casio_tx_buf, ":RAL", 4);
+        if (Platform::developer) Platform::print("Sending Roleswap\r\n");
+        send_packet(lk, CASIO_HEADER_LEN);
+    }
+
+    // runs the link protocol, once whatever Platform::receive() asked for has arrived in casio_rx_buf
+    static void process(link_t* lk)
+    {
+        switch(lk->comm_state) {
+            case COMM_IDLE:
+                lk->procedure=PROC_NULL;
+                if (memchr(lk->casio_rx_buf, CASIO_START_INDICATOR, Platform::rx_len)!=NULL) {
+                    start_instruction(lk);
+                } else {
+                    // we didn't receive a start indication from casio.
+                    if (Platform::developer) {
+                        Platform::print("received junk, ignoring:\r\n");
+                        hex_print(lk->casio_rx_buf, CASIO_HEADER_LEN);
+                        Platform::print("'\r\nwaiting start indicator\r\n");
+                    }
+                    if (Platform::pingpong) {
+                        Platform::print("  |                                |\r\n");
+                        Platform::print("  |                          **COMM_IDLE**\r\n");
+                        Platform::print("  |-JUNK-");
+                        hex_print(lk->casio_rx_buf, 3, 1);
+                        Platform::print("etc-->|\r\n");
+                    }
+                    wait_start(lk);
+                }
+                break;
+            case COMM_WAITING_INSTRUCTION:
+                instruction(lk);
+                break;
+            case COMM_WAITING_DATA:
+                data(lk);
+                break;
+            case COMM_WAITING_RX_HEADER_ACK:
+            case COMM_WAITING_RX_PACKET_ACK:
+                ack(lk);
+                break;
+            case COMM_WAITING_PERFORM_ROLESWAP:
+                roleswap(lk);
+                break;
+            default:
+                if (Platform::developer) Platform::print("unexpected comm state. Going to COMM_IDLE\r\n");
+                if (Platform::pingpong) Platform::print("  |                          COMM_UNKNOWN!\r\n");
+                wait_start(lk);
+                break;
+        }
+    }
+};
+
+#endif // __cplusplus
+
+#endif /* _CASIO_CORE_HEADER_FILE_H */
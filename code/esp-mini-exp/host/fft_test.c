@@ -0,0 +1,119 @@
+// checks the Q15 FFT against the double precision reference, and times it
+// build and run with: make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "fft.h"
+
+#define TEST_RUNS 200               // timed transforms of each size
+
+static int16_t buf[FFT_N_MAX*2];
+static double re[FFT_N_MAX];
+static double im[FFT_N_MAX];
+static uint32_t seed=12345;
+
+static int16_t noise(int amp)
+{
+    seed=seed*1664525 + 1013904223;
+    return((int16_t)((int)((seed>>16) % (2*amp+1)) - amp));
+}
+
+// fills buf with one of the test signals, at most half of full scale as fft_capture uses
+static void make_signal(int kind, int n)
+{
+    int i;
+    for (i=0; i<n; i++) {
+        switch(kind) {
+            case 0: // two tones, one of them between bins
+                buf[i*2]=(int16_t)lround(10000.0*sin(2.0*FFT_PI*(n/16)*i/n) + 6000.0*sin(2.0*FFT_PI*(n/5+0.5)*i/n));
+                buf[i*2+1]=0;
+                break;
+            case 1: // complex noise
+                buf[i*2]=noise(16383);
+                buf[i*2+1]=noise(16383);
+                break;
+            default: // impulse
+                buf[i*2]=(i==0) ? 16383 : 0;
+                buf[i*2+1]=0;
+                break;
+        }
+    }
+}
+
+// signal to error ratio of the Q15 transform of buf, in dB. maxerr gets the largest error in any value
+static double check(int n, double* maxerr)
+{
+    int i;
+    double sig=0.0;
+    double err=0.0;
+    double dr, di;
+    *maxerr=0.0;
+    for (i=0; i<n; i++) {
+        re[i]=buf[i*2];
+        im[i]=buf[i*2+1];
+    }
+    fft_ref(re, im, n);
+    if (fft_q15(buf, n)!=0)
+        return(-999.0);
+    for (i=0; i<n; i++) {
+        dr=re[i]/n;
+        di=im[i]/n;
+        sig+=dr*dr + di*di;
+        dr-=buf[i*2];
+        di-=buf[i*2+1];
+        err+=dr*dr + di*di;
+        if (fabs(dr)>*maxerr) *maxerr=fabs(dr);
+        if (fabs(di)>*maxerr) *maxerr=fabs(di);
+    }
+    return((err>0.0) ? 10.0*log10(sig/err) : 999.0);
+}
+
+int main(void)
+{
+    // each stage halves and rounds, so a little accuracy is lost at each one: about 3 dB a stage for
+    // the tones and noise, and the flat spectrum of an impulse is never more than one count out
+    static const double min_snr=45.0;
+    static const double max_impulse_err=1.0;
+    int n, kind, i;
+    int fails=0;
+    double snr[2];
+    double maxerr;
+    double usec;
+    struct timespec t0, t1;
+
+    if ((fft_q15(buf, 3)==0) || (fft_q15(buf, 1)==0) || (fft_q15(buf, FFT_N_MAX*2)==0)) {
+        printf("FAIL: fft_q15 accepts a size it can't transform\n");
+        fails++;
+    }
+    printf("   n  tones dB  noise dB  impulse err  usec\n");
+    for (n=4; n<=FFT_N_MAX; n<<=1) {
+        for (kind=0; kind<2; kind++) {
+            make_signal(kind, n);
+            snr[kind]=check(n, &maxerr);
+        }
+        make_signal(2, n);
+        check(n, &maxerr);
+        make_signal(1, n);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i=0; i<TEST_RUNS; i++) {
+            fft_q15(buf, n);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        usec=((t1.tv_sec - t0.tv_sec)*1e6 + (t1.tv_nsec - t0.tv_nsec)/1e3)/TEST_RUNS;
+        printf("%4d  %8.1f  %8.1f  %11.2f  %.2f\n", n, snr[0], snr[1], maxerr, usec);
+        for (kind=0; kind<2; kind++) {
+            if (snr[kind]<min_snr) {
+                printf("FAIL: %d point %s only %.1f dB\n", n, (kind==0) ? "tones" : "noise", snr[kind]);
+                fails++;
+            }
+        }
+        if (maxerr>max_impulse_err) {
+            printf("FAIL: %d point impulse %.2f counts out\n", n, maxerr);
+            fails++;
+        }
+    }
+    printf("fft_test: %s\n", fails ? "FAILED" : "passed");
+    return(fails ? 1 : 0);
+}
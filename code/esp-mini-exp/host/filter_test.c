@@ -0,0 +1,98 @@
+// checks the fixed point filter stages, and times them
+// build and run with: make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "filter.h"
+
+#define TEST_SAMPLES 2000000        // timed samples of each stage type
+#define TEST_PI 3.14159265358979323846
+
+static double now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec*1e6 + ts.tv_nsec/1e3);
+}
+
+// one stage of each type, as the console filter bench sets them up
+static void one_stage(filt_chain_t* c, int type)
+{
+    filter_clear(c);
+    filter_add(c, type, (type==FILT_MAVG) ? FILT_TAPS_MAX : 0.05, (type==FILT_FIR) ? FILT_TAPS_MAX : 0.0);
+}
+
+// amplitude of a tone at f (a fraction of the sample rate) after the filter, over the input amplitude
+static double gain(int type, double f)
+{
+    filt_chain_t c;
+    int i;
+    int y;
+    double lo=4095.0;
+    double hi=0.0;
+    one_stage(&c, type);
+    for (i=0; i<4000; i++) {
+        y=filter_run(&c, (uint16_t)lround(2048.0 + 1000.0*sin(2.0*TEST_PI*f*i)));
+        if (i<3000) continue; // settled
+        if (y<lo) lo=y;
+        if (y>hi) hi=y;
+    }
+    return((hi-lo)/2000.0);
+}
+
+int main(void)
+{
+    filt_chain_t c;
+    filt_chain_t a;
+    filt_chain_t b;
+    int type;
+    int i;
+    int fails=0;
+    int dc;
+    unsigned int sink=0;
+    double t;
+    double pass;
+    double stop;
+
+    printf("stage     dc out  gain 0.01  gain 0.4  ns/sample\n");
+    for (type=1; type<=FILT_TYPE_MAX; type++) {
+        one_stage(&c, type);
+        for (i=0; i<200; i++) {
+            dc=filter_run(&c, 1000);
+        }
+        pass=gain(type, 0.01);
+        stop=gain(type, 0.4);
+        one_stage(&c, type);
+        t=now_usec();
+        for (i=0; i<TEST_SAMPLES; i++) {
+            sink+=filter_run(&c, (uint16_t)((i*37) & 0xfff));
+        }
+        t=now_usec()-t;
+        printf("%-8s  %6d  %9.3f  %8.3f  %9.1f\n", filter_name(type), dc, pass, stop, t*1000.0/TEST_SAMPLES);
+        if (dc!=((type==FILT_HIGHPASS) ? 2048 : 1000)) {
+            printf("FAIL: %s settles to %d\n", filter_name(type), dc);
+            fails++;
+        }
+        if ((type==FILT_HIGHPASS) ? (pass>0.1) || (stop<0.9) : (pass<0.9) || (stop>0.2)) {
+            printf("FAIL: %s passes %.3f at 0.01 and %.3f at 0.4\n", filter_name(type), pass, stop);
+            fails++;
+        }
+    }
+
+    // two readers of a channel run copies of its chain, and mustn't disturb each other
+    one_stage(&a, FILT_LOWPASS);
+    b=a;
+    for (i=0; i<500; i++) {
+        filter_run(&a, (i & 1) ? 4000 : 0);
+        dc=filter_run(&b, 3000);
+    }
+    if (dc!=3000) {
+        printf("FAIL: a second copy of a chain reads %d, not 3000\n", dc);
+        fails++;
+    }
+
+    printf("filter_test: %s (%u)\n", fails ? "FAILED" : "passed", sink & 1);
+    return(fails ? 1 : 0);
+}
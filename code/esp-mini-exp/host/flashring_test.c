@@ -0,0 +1,245 @@
+// checks the flash ring (fringcore.c) against a file standing in for the telemlog partition:
+// finding the head and tail again after a reset, wrapping, a record cut short by a reset,
+// a damaged record, marking records as sent, and how many messages the backlog takes
+// build and run with: make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flashring.h"
+
+#define TEST_SECTS 4
+
+static int fails=0;
+
+// ********** the flash, as a file. Like NOR flash, a write can only clear bits **********
+
+static int file_read(void* ctx, uint32_t addr, void* buf, uint32_t len)
+{
+    FILE* f=(FILE*)ctx;
+    if ((addr+len) > TEST_SECTS*FRING_SECT_SIZE)
+        return(-1);
+    if ((fseek(f, addr, SEEK_SET)!=0) || (fread(buf, 1, len, f)!=len))
+        return(-1);
+    return(0);
+}
+
+static int file_write(void* ctx, uint32_t addr, const void* buf, uint32_t len)
+{
+    FILE* f=(FILE*)ctx;
+    uint8_t old[FRING_SECT_SIZE];
+    uint32_t i;
+    if ((len>sizeof(old)) || (file_read(ctx, addr, old, len)!=0))
+        return(-1);
+    for (i=0; i<len; i++) {
+        old[i]&=((const uint8_t*)buf)[i];
+    }
+    if ((fseek(f, addr, SEEK_SET)!=0) || (fwrite(old, 1, len, f)!=len))
+        return(-1);
+    return(0);
+}
+
+static int file_erase(void* ctx, uint32_t addr, uint32_t len)
+{
+    FILE* f=(FILE*)ctx;
+    uint8_t ff[FRING_SECT_SIZE];
+    memset(ff, 0xff, sizeof(ff));
+    while (len>0) {
+        if ((fseek(f, addr, SEEK_SET)!=0) || (fwrite(ff, 1, FRING_SECT_SIZE, f)!=FRING_SECT_SIZE))
+            return(-1);
+        addr+=FRING_SECT_SIZE;
+        len-=FRING_SECT_SIZE;
+    }
+    return(0);
+}
+
+// a ring on the file, as fring_init sets it up after a reset
+static void ring_open(fring_t* r, FILE* f)
+{
+    memset(r, 0, sizeof(fring_t));
+    r->flash.read=file_read;
+    r->flash.write=file_write;
+    r->flash.erase=file_erase;
+    r->flash.ctx=f;
+    r->nsect=TEST_SECTS;
+    fring_scan(r);
+}
+
+static FILE* flash_new(void)
+{
+    FILE* f=tmpfile();
+    if ((f==NULL) || (file_erase(f, 0, TEST_SECTS*FRING_SECT_SIZE)!=0)) {
+        printf("FAIL: can't make the flash file\n");
+        exit(1);
+    }
+    return(f);
+}
+
+static void store(fring_t* r, uint32_t n)
+{
+    char msg[64];
+    int len=snprintf(msg, sizeof(msg), "{\"ch1\":[%u.125,%u.250],\"ch2\":0.500}", n, n);
+    fring_write(r, msg, len);
+}
+
+static void check(const char* what, uint32_t got, uint32_t want)
+{
+    if (got!=want) {
+        printf("FAIL: %s is %u, not %u\n", what, got, want);
+        fails++;
+    }
+}
+
+// sends the whole backlog, checking every message. Returns the number of messages, and
+// the first and last seq sent. Each seq must be one more than the last, unless skip is set
+static uint32_t drain(fring_t* r, uint32_t* first, uint32_t* last, uint32_t skip)
+{
+    char out[TELEM_MSG_LEN];
+    char* p;
+    uint32_t msgs=0;
+    uint32_t seq;
+    uint32_t recs;
+    int n;
+    *first=0;
+    *last=0;
+    while ((n=fring_batch(r, out, TELEM_MSG_LEN))>0) {
+        msgs++;
+        if ((n>=TELEM_MSG_LEN) || ((int)strlen(out)!=n)) {
+            printf("FAIL: a backlog message is %d bytes\n", n);
+            fails++;
+        }
+        recs=0;
+        for (p=strstr(out, "\"seq\":"); p!=NULL; p=strstr(p+1, "\"seq\":")) {
+            seq=strtoul(p+6, NULL, 10);
+            if ((*last!=0) && (seq!=*last+1) && (seq!=skip)) {
+                printf("FAIL: seq %u follows %u\n", seq, *last);
+                fails++;
+            }
+            if (*first==0) *first=seq;
+            *last=seq;
+            recs++;
+        }
+        if ((recs>1) && ((strncmp(out, FRING_BATCH_OPEN, strlen(FRING_BATCH_OPEN))!=0) || (strcmp(&out[n-FRING_BATCH_CLOSE_LEN], FRING_BATCH_CLOSE)!=0))) {
+            printf("FAIL: badly formed batch %s\n", out);
+            fails++;
+        }
+        check("records marked sent", fring_batch_sent(r), recs);
+    }
+    return(msgs);
+}
+
+int main(void)
+{
+    FILE* f;
+    fring_t r;
+    uint32_t i;
+    uint32_t first;
+    uint32_t last;
+    uint32_t msgs;
+    uint32_t stored;
+    char out[TELEM_MSG_LEN];
+
+    // a blank partition is formatted, and the records are found again after a reset
+    f=flash_new();
+    ring_open(&r, f);
+    check("pending on a blank ring", r.stats.pending, 0);
+    for (i=1; i<=100; i++) {
+        store(&r, i);
+    }
+    ring_open(&r, f);
+    check("pending after a reset", r.stats.pending, 100);
+    check("next seq after a reset", r.stats.next_seq, 101);
+
+    // marking sent survives a reset
+    fring_batch(&r, out, TELEM_MSG_LEN);
+    stored=fring_batch_sent(&r);
+    fring_batch(&r, out, TELEM_MSG_LEN);
+    stored+=fring_batch_sent(&r);
+    ring_open(&r, f);
+    check("pending after sending two messages and a reset", r.stats.pending, 100-stored);
+
+    // the backlog goes several records to a message
+    msgs=drain(&r, &first, &last, 0);
+    check("first seq after a reset", first, stored+1);
+    check("last seq", last, 100);
+    check("pending once drained", r.stats.pending, 0);
+    printf("backlog of 100 records: %u records in the first two messages, %u messages for the rest (was one each)\n", stored, msgs);
+    if (msgs*3 > 100-stored) {
+        printf("FAIL: %u messages for %u records\n", msgs, 100-stored);
+        fails++;
+    }
+    ring_open(&r, f);
+    check("pending after draining and a reset", r.stats.pending, 0);
+    check("nothing to send", fring_batch(&r, out, TELEM_MSG_LEN), 0);
+    fclose(f);
+
+    // when full, the oldest sector is overwritten, and the newest records are still found in order
+    f=flash_new();
+    ring_open(&r, f);
+    for (i=1; i<=1000; i++) {
+        store(&r, i);
+    }
+    check("stored", r.stats.stored, 1000);
+    check("pending and lost", r.stats.pending+r.stats.lost, 1000);
+    stored=r.stats.pending;
+    ring_open(&r, f);
+    check("pending after wrapping and a reset", r.stats.pending, stored);
+    msgs=drain(&r, &first, &last, 0);
+    check("first seq after wrapping", first, 1001-stored);
+    check("last seq after wrapping", last, 1000);
+    printf("ring of %d sectors: %u of 1000 records kept, sent in %u messages\n", TEST_SECTS, stored, msgs);
+    for (i=1001; i<=1200; i++) {
+        store(&r, i);
+    }
+    ring_open(&r, f);
+    check("pending after wrapping again", r.stats.pending, 200);
+    drain(&r, &first, &last, 0);
+    check("first seq after wrapping again", first, 1001);
+    fclose(f);
+
+    // a reset between writing a message and its header leaves the message without one. It isn't a
+    // record, and nothing is written over it: the next record starts a new sector
+    f=flash_new();
+    ring_open(&r, f);
+    for (i=1; i<=10; i++) {
+        store(&r, i);
+    }
+    file_write(f, r.head_sect*FRING_SECT_SIZE + r.head_off + sizeof(fring_rec_hdr_t), "{\"ch1\":9.9}", 12);
+    stored=r.head_sect;
+    ring_open(&r, f);
+    check("pending after a torn record", r.stats.pending, 10);
+    store(&r, 11);
+    check("sector after a torn record", r.head_sect, stored+1);
+    ring_open(&r, f);
+    check("pending after a torn record and a reset", r.stats.pending, 11);
+    drain(&r, &first, &last, 0);
+    check("first seq after a torn record", first, 1);
+    check("last seq after a torn record", last, 11);
+
+    // a damaged record is skipped, and counted
+    for (i=12; i<=20; i++) {
+        store(&r, i);
+    }
+    ring_open(&r, f);
+    // the 14th record, the fourth in the sector started by 11
+    file_write(f, r.head_sect*FRING_SECT_SIZE + sizeof(fring_sect_hdr_t) + 3*(sizeof(fring_rec_hdr_t)+36) + sizeof(fring_rec_hdr_t) + 8, "\x00", 1);
+    drain(&r, &first, &last, 15);
+    check("corrupt", r.stats.corrupt, 1);
+    check("first seq around a damaged record", first, 12);
+    check("last seq around a damaged record", last, 20);
+    check("pending around a damaged record", r.stats.pending, 0);
+
+    // a record that isn't JSON goes on its own, as it was stored
+    fring_write(&r, "not json", 8);
+    store(&r, 22);
+    fring_batch(&r, out, TELEM_MSG_LEN);
+    if (strcmp(out, "not json")!=0) {
+        printf("FAIL: a record that isn't JSON is sent as %s\n", out);
+        fails++;
+    }
+    check("records sent with a non-JSON one", fring_batch_sent(&r), 1);
+    fclose(f);
+
+    printf("flashring_test: %s\n", fails ? "FAILED" : "passed");
+    return(fails ? 1 : 0);
+}
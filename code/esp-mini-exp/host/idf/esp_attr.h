@@ -0,0 +1,4 @@
+#ifndef _HOST_ESP_ATTR_H
+#define _HOST_ESP_ATTR_H
+#define IRAM_ATTR
+#endif
@@ -0,0 +1,3 @@
+#ifndef _HOST_ESP_LOG_H
+#define _HOST_ESP_LOG_H
+#endif
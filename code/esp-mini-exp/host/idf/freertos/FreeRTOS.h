@@ -0,0 +1,31 @@
+// just enough of FreeRTOS and ESP-IDF for telem_sim to build telemetry.c on a PC
+#ifndef _HOST_FREERTOS_H
+#define _HOST_FREERTOS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+typedef TickType_t portTickType;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef void* QueueHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef void* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+typedef uint32_t StackType_t;
+typedef struct { uint8_t d[80]; } StaticQueue_t;
+typedef struct { uint8_t d[80]; } StaticSemaphore_t;
+typedef struct { uint8_t d[400]; } StaticTask_t;
+typedef struct { uint32_t owner; } portMUX_TYPE;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define portMAX_DELAY 0xffffffff
+#define portTICK_PERIOD_MS 1
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(m) (void)(m)
+#define portEXIT_CRITICAL(m) (void)(m)
+
+#endif
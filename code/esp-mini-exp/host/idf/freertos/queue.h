@@ -0,0 +1,9 @@
+#ifndef _HOST_QUEUE_H
+#define _HOST_QUEUE_H
+#include "freertos/FreeRTOS.h"
+QueueHandle_t xQueueCreateStatic(UBaseType_t len, UBaseType_t item_size, uint8_t* store, StaticQueue_t* buf);
+BaseType_t xQueueSend(QueueHandle_t q, const void* item, TickType_t wait);
+BaseType_t xQueueReceive(QueueHandle_t q, void* item, TickType_t wait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q);
+#endif
@@ -0,0 +1,6 @@
+#ifndef _HOST_TASK_H
+#define _HOST_TASK_H
+#include "freertos/FreeRTOS.h"
+TickType_t xTaskGetTickCount(void);
+void vTaskDelay(TickType_t ticks);
+#endif
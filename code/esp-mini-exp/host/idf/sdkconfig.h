@@ -0,0 +1,4 @@
+#ifndef _HOST_SDKCONFIG_H
+#define _HOST_SDKCONFIG_H
+#define CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ 240
+#endif
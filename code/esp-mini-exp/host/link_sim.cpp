@@ -0,0 +1,340 @@
+// Casio link simulator: runs the protocol core (common/casio_core.h) on a PC for one
+// calculator, and then for two at once, each on its own thread and its own simulated
+// 38400 baud wire. Both links read their samples through one acquisition stand-in,
+// with a latest-value cache and a lock held only for the cache update, as acq.c does
+// on the ESP32. Each session is a run of {2001,1,1} Send38K then Receive38K exchanges,
+// and the test fails if a link is slower with the other one busy.
+// It then traces a calculator program loop taking samples, first with a Send38K before
+// each Receive38K, and then with sticky streaming ({2001,5,1} once), and counts the
+// procedures, bytes and time each sample takes.
+// build and run with: make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "casio_core.h"
+
+#define SIM_LINKS 2
+#define SIM_EXCHANGES 100           // per calculator
+#define SIM_BAUD 38400              // 10 bits per byte on the wire
+#define SIM_CONVERT_USEC 40         // one ADC conversion, made outside the lock
+#define SIM_CACHE_USEC 1000         // ACQ_CACHE_USEC
+#define SIM_SLOWDOWN_MAX 1.10       // the median exchange with two links, over the one with one
+#define SIM_POINTS 50               // samples taken by the program loop
+#define SIM_TRACE_POINTS 2          // traced
+#define SIM_STREAM_MAX 0.75         // time per sample with streaming, over the time without
+
+typedef struct sim_link_s {
+    int id;
+    // what casio_core needs
+    casio_cmd_t casio_cmd;
+    char procedure;
+    char comm_state;
+    char sys_state;
+    char hl_state;
+    struct { char operation; } chan_setup[3];
+    struct { uint32_t period_usec; unsigned int numsamp; char mode; } samp_trig_setup;
+    uint8_t casio_rx_buf[256 + 1];
+    uint8_t casio_tx_buf[1024];
+    uint16_t sampnum;
+    int8_t stream_chan;
+    double batch_res[BATCH_MAX];
+    int batch_len;
+    unsigned int list_len;
+    // what the board sent back for the last thing the calculator sent
+    uint8_t reply[1024];
+    int reply_len;
+    double lat_usec[SIM_EXCHANGES];
+    int wrong;                      // samples that didn't come back as sent
+    int procs;                      // Send38K and Receive38K procedures
+    int wire_bytes;                 // both ways
+    char trace;
+} sim_link_t;
+
+static int64_t sim_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000);
+}
+
+// ********** the shared acquisition stand-in **********
+
+static pthread_mutex_t sim_acq_lock=PTHREAD_MUTEX_INITIALIZER;
+static double sim_cache[3];
+static int64_t sim_cache_time[3];
+static uint32_t sim_conversions=0;
+
+static double sim_read_sample(int chan)
+{
+    double v;
+    int64_t now=sim_usec();
+    int64_t end;
+    pthread_mutex_lock(&sim_acq_lock);
+    if ((sim_cache_time[chan]!=0) && ((now-sim_cache_time[chan])<=SIM_CACHE_USEC)) {
+        v=sim_cache[chan];
+        pthread_mutex_unlock(&sim_acq_lock);
+        return(v);
+    }
+    pthread_mutex_unlock(&sim_acq_lock);
+    end=now+SIM_CONVERT_USEC;
+    while (sim_usec()<end)
+        ; // the conversion keeps the CPU busy
+    v=1.25 + chan;
+    pthread_mutex_lock(&sim_acq_lock);
+    sim_cache[chan]=v;
+    sim_cache_time[chan]=now;
+    sim_conversions++;
+    pthread_mutex_unlock(&sim_acq_lock);
+    return(v);
+}
+
+// ********** the board, as casio_core sees it **********
+
+struct sim_platform {
+    typedef sim_link_t link_t;
+    enum { chan_total=3, rx_len=256, verbose=0, pingpong=0, developer=0, hlpp=0 };
+    static void send(link_t* lk, const uint8_t* buf, uint16_t len)
+    {
+        if (lk->reply_len+len<=(int)sizeof(lk->reply)) {
+            memcpy(&lk->reply[lk->reply_len], buf, len);
+            lk->reply_len+=len;
+        }
+    }
+    static void receive(link_t* lk, int len, int match) {}
+    static void print(const char* fmt, ...)
+    {
+        va_list args;
+        va_start(args, fmt);
+        vprintf(fmt, args);
+        va_end(args);
+    }
+    static double read_sample(int chan) { return(sim_read_sample(chan)); }
+    static int64_t usec(void) { return(sim_usec()); }
+    static char status(void) { return('1'); }
+    static int active_chans(link_t* lk)
+    {
+        int i;
+        int n=0;
+        for (i=0; i<chan_total; i++) {
+            if (lk->chan_setup[i].operation!=0) n++;
+        }
+        return(n);
+    }
+    static int read_row(link_t* lk, double* vals, char type)
+    {
+        int i;
+        int n=0;
+        for (i=0; i<chan_total; i++) {
+            if (lk->chan_setup[i].operation!=0) vals[n++]=read_sample(i);
+        }
+        return(n);
+    }
+    static void chan_setup(link_t* lk, int chan, int type) {}
+    static void clear_channels(link_t* lk) {}
+    static void trigger(link_t* lk) {}
+    static void sampling_done(link_t* lk) {}
+    static int op_nargs(int op) { return(1); }
+    static double op_2001(link_t* lk, cmd_tok_t* op, int nargs, char in_batch) { return(0.0); }
+    static unsigned int list_begin(link_t* lk) { return(0); }
+    static double list_value(void* lk, unsigned int idx) { return(-1.0); }
+    static void list_end(link_t* lk, int state) {}
+};
+
+typedef casio_core<sim_platform> sim_core;
+
+// ********** the calculator **********
+
+static void sim_wire(int nbytes)
+{
+    struct timespec ts;
+    int64_t usec=((int64_t)nbytes*10*1000000)/SIM_BAUD;
+    ts.tv_sec=usec/1000000;
+    ts.tv_nsec=(usec%1000000)*1000;
+    nanosleep(&ts, NULL);
+}
+
+// n bytes from the calculator, and whatever the board sends back, each taking their time on the wire
+static void sim_rx(sim_link_t* lk, const uint8_t* buf, int n)
+{
+    sim_wire(n);
+    memset(lk->casio_rx_buf, 0, sizeof(lk->casio_rx_buf));
+    memcpy(lk->casio_rx_buf, buf, n);
+    lk->reply_len=0;
+    sim_core::process(lk);
+    sim_wire(lk->reply_len);
+    lk->wire_bytes+=n + lk->reply_len;
+}
+
+static void sim_rx1(sim_link_t* lk, uint8_t c)
+{
+    sim_rx(lk, &c, 1);
+}
+
+static void sim_send38k(sim_link_t* lk, const char* s)
+{
+    uint8_t hdr[CASIO_HEADER_LEN];
+    uint8_t data[64];
+    int n=(int)strlen(s);
+    lk->procs++;
+    if (lk->trace) printf("  Send38K {%s}\n", s);
+    sim_rx1(lk, CASIO_START_INDICATOR);
+    sim_core::build_header(hdr, 'A', 'V', 1, (uint16_t)n);
+    sim_rx(lk, hdr, CASIO_HEADER_LEN);
+    data[0]=':';
+    memcpy(&data[1], s, n);
+    n+=2;
+    sim_core::checksum(data, n, (char*)&data[n-1]);
+    sim_rx(lk, data, n);
+}
+
+// returns the value the board sent
+static double sim_recv38k(sim_link_t* lk, char form)
+{
+    uint8_t hdr[CASIO_HEADER_LEN];
+    char value[CASIO_ASCII_VALUE_LEN+1];
+    lk->procs++;
+    sim_rx1(lk, CASIO_START_INDICATOR);
+    sim_core::build_header(hdr, 'A', form, 1, 1);
+    hdr[1]='R';
+    sim_core::checksum(hdr, CASIO_HEADER_LEN, (char*)&hdr[14]);
+    sim_rx(lk, hdr, CASIO_HEADER_LEN);      // the board answers with its header
+    sim_rx1(lk, CODEB_OK);                  // and then the packet
+    memset(value, 0, sizeof(value));
+    if (lk->reply_len==CASIO_ASCII_VALUE_LEN+2)
+        memcpy(value, &lk->reply[1], CASIO_ASCII_VALUE_LEN);
+    sim_rx1(lk, CODEB_OK);
+    if (lk->trace) printf("  Receive38K %c = %s\n", form, value);
+    return(atof(value));
+}
+
+static void* sim_session(void* arg)
+{
+    sim_link_t* lk=(sim_link_t*)arg;
+    int i;
+    int64_t t;
+    for (i=0; i<SIM_EXCHANGES; i++) {
+        t=sim_usec();
+        sim_send38k(lk, "2001,1,1");
+        if (sim_recv38k(lk, 'V')!=1.25)
+            lk->wrong++;
+        lk->lat_usec[i]=(double)(sim_usec()-t);
+    }
+    return(NULL);
+}
+
+// a program loop taking SIM_POINTS samples from channel 1, with or without sticky streaming.
+// Returns the ms per sample
+static double sim_points(sim_link_t* lk, char streaming)
+{
+    int i;
+    int64_t t=sim_usec();
+    if (streaming) {
+        lk->trace=1;
+        printf(" once, to arm streaming\n");
+        sim_send38k(lk, "2001,5,1");
+    }
+    for (i=0; i<SIM_POINTS; i++) {
+        lk->trace=(i<SIM_TRACE_POINTS);
+        if (lk->trace) printf(" sample %d\n", i+1);
+        if (!streaming)
+            sim_send38k(lk, "2001,1,1");
+        if (sim_recv38k(lk, 'V')!=1.25)
+            lk->wrong++;
+    }
+    lk->trace=0;
+    if (streaming)
+        sim_send38k(lk, "2001,5,0");
+    return((sim_usec()-t)/1000.0/SIM_POINTS);
+}
+
+static int sim_cmp(const void* a, const void* b)
+{
+    double x=*(const double*)a;
+    double y=*(const double*)b;
+    return((x<y) ? -1 : (x>y) ? 1 : 0);
+}
+
+// median and worst exchange of a session, in ms
+static void sim_summary(sim_link_t* lk, double* med, double* worst)
+{
+    qsort(lk->lat_usec, SIM_EXCHANGES, sizeof(double), sim_cmp);
+    *med=lk->lat_usec[SIM_EXCHANGES/2]/1000.0;
+    *worst=lk->lat_usec[SIM_EXCHANGES-1]/1000.0;
+}
+
+static void sim_link_init(sim_link_t* lk, int id)
+{
+    memset(lk, 0, sizeof(sim_link_t));
+    lk->id=id;
+    lk->stream_chan=-1;
+}
+
+int main(void)
+{
+    sim_link_t links[SIM_LINKS];
+    pthread_t th[SIM_LINKS];
+    double med1, worst1;
+    double med[SIM_LINKS], worst[SIM_LINKS];
+    double ms[2];
+    int procs[2];
+    int bytes[2];
+    int i;
+    int fails=0;
+
+    sim_link_init(&links[0], 0);
+    sim_session(&links[0]);
+    sim_summary(&links[0], &med1, &worst1);
+
+    for (i=0; i<SIM_LINKS; i++) {
+        sim_link_init(&links[i], i);
+        pthread_create(&th[i], NULL, sim_session, &links[i]);
+    }
+    for (i=0; i<SIM_LINKS; i++) {
+        pthread_join(th[i], NULL);
+        sim_summary(&links[i], &med[i], &worst[i]);
+    }
+
+    printf("%d exchanges of {2001,1,1} and Receive38K per calculator, %d baud\n", SIM_EXCHANGES, SIM_BAUD);
+    printf("                 median ms  worst ms\n");
+    printf("one link          %8.2f  %8.2f\n", med1, worst1);
+    if (links[0].wrong>0) fails++;
+    for (i=0; i<SIM_LINKS; i++) {
+        printf("two links, %d      %8.2f  %8.2f\n", i+1, med[i], worst[i]);
+        if (links[i].wrong>0) {
+            printf("FAIL: link %d got %d wrong samples\n", i+1, links[i].wrong);
+            fails++;
+        }
+        if (med[i]>med1*SIM_SLOWDOWN_MAX) {
+            printf("FAIL: link %d takes %.2f ms with the other link busy, %.2f ms on its own\n", i+1, med[i], med1);
+            fails++;
+        }
+    }
+    printf("%u conversions for %d samples\n", sim_conversions, SIM_EXCHANGES*(SIM_LINKS+1));
+
+    // the same loop, with and without sticky streaming
+    for (i=0; i<2; i++) {
+        printf("%s\n", i ? "with streaming:" : "without streaming:");
+        sim_link_init(&links[0], 0);
+        ms[i]=sim_points(&links[0], (char)i);
+        procs[i]=links[0].procs;
+        bytes[i]=links[0].wire_bytes;
+        if (links[0].wrong>0) {
+            printf("FAIL: %d wrong samples %s streaming\n", links[0].wrong, i ? "with" : "without");
+            fails++;
+        }
+    }
+    printf("%d samples        procedures  bytes  ms/sample\n", SIM_POINTS);
+    for (i=0; i<2; i++) {
+        printf("%-17s %10d  %5d  %9.2f\n", i ? "streaming" : "Send38K each", procs[i], bytes[i], ms[i]);
+    }
+    if ((procs[1]*2 > procs[0]+4) || (ms[1] > ms[0]*SIM_STREAM_MAX)) {
+        printf("FAIL: streaming takes %d procedures and %.2f ms per sample, against %d and %.2f\n", procs[1], ms[1], procs[0], ms[0]);
+        fails++;
+    }
+    printf("link_sim: %s\n", fails ? "FAILED" : "passed");
+    return(fails ? 1 : 0);
+}
@@ -0,0 +1,263 @@
+// decodes and benchmarks the CBOR telemetry format (telemcbor.c) on a PC
+//   ./tcbor_tool                     checks that windows round-trip, and compares the size and
+//                                    speed of the JSON and CBOR messages
+//   ./tcbor_tool '{"cbor":"..."}'    decodes messages, as copied from IoT Central or the console,
+//                                    and prints each as the JSON message it stands for
+// build and run with: make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "telemcbor.h"
+
+#define TOOL_MSG_LEN 256        // TELEM_MSG_LEN
+#define TOOL_WRAP_LEN 11        // {"cbor":""}
+#define TOOL_DECIMALS 3         // TELEM_DECIMALS
+#define TOOL_LOOPS 20000        // encodes and decodes timed for each window
+#define TOOL_RANDOM 2000        // random windows checked
+
+static int fails=0;
+
+static double now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec*1e6 + ts.tv_nsec/1e3);
+}
+
+// a value in the window's fixed point, as the JSON format would send it
+static int put_value(char* out, int32_t v, int exp)
+{
+    int64_t u=v;
+    int64_t scale=1;
+    int i;
+    int n=0;
+    for (i=0; i<-exp; i++) {
+        scale*=10;
+    }
+    if (u<0) {
+        out[n++]='-';
+        u=-u;
+    }
+    if (scale==1)
+        return(n + sprintf(&out[n], "%lld", (long long)u));
+    return(n + sprintf(&out[n], "%lld.%0*lld", (long long)(u/scale), -exp, (long long)(u%scale)));
+}
+
+// the JSON message the window would be sent as with telem format json, returns its length
+static int put_json(char* out, const tcbor_window_t* w)
+{
+    int i, j;
+    int pos=0;
+    out[pos++]='{';
+    for (i=0; i<TCBOR_CHAN_MAX; i++) {
+        if (w->nvals[i]==0) continue;
+        if (pos>1) out[pos++]=',';
+        pos+=sprintf(&out[pos], "\"ch%d\":", i+1);
+        if (w->nvals[i]>1) out[pos++]='[';
+        for (j=0; j<w->nvals[i]; j++) {
+            if (j>0) out[pos++]=',';
+            pos+=put_value(&out[pos], w->vals[i][j], w->exp);
+        }
+        if (w->nvals[i]>1) out[pos++]=']';
+    }
+    out[pos++]='}';
+    out[pos]='\0';
+    return(pos);
+}
+
+// ********** decoding messages given on the command line **********
+
+static int decode_arg(const char* arg)
+{
+    static char json[TCBOR_CHAN_MAX*TCBOR_VALS_MAX*16];
+    uint8_t cbor[TOOL_MSG_LEN];
+    tcbor_window_t w;
+    const char* p=strstr(arg, "\"cbor\":\"");
+    int len;
+    int n;
+    if (p!=NULL) p+=8;
+    else p=arg;
+    len=strcspn(p, "\"");
+    n=tcbor_base64_decode(p, len, cbor, sizeof(cbor));
+    if ((n<0) || (tcbor_decode(cbor, n, &w)!=0)) {
+        printf("can't decode %s\n", arg);
+        return(1);
+    }
+    put_json(json, &w);
+    printf("t %llu ms, window %u ms, %d bytes of CBOR, %d values\n%s\n", (unsigned long long)w.t_ms, w.window_ms, n,
+        w.nvals[0] + w.nvals[1] + w.nvals[2], json);
+    return(0);
+}
+
+// ********** checks **********
+
+static char same(const tcbor_window_t* a, const tcbor_window_t* b)
+{
+    int i;
+    if ((a->t_ms!=b->t_ms) || (a->window_ms!=b->window_ms) || (a->exp!=b->exp))
+        return(0);
+    for (i=0; i<TCBOR_CHAN_MAX; i++) {
+        if ((a->nvals[i]!=b->nvals[i]) || (memcmp(a->vals[i], b->vals[i], a->nvals[i]*sizeof(int32_t))!=0))
+            return(0);
+    }
+    return(1);
+}
+
+// encode, base64, decode, and check the window comes back as it was
+static void round_trip(const tcbor_window_t* w, const char* what)
+{
+    static uint8_t cbor[TCBOR_CHAN_MAX*TCBOR_VALS_MAX*5 + TCBOR_HDR_LEN + 16];
+    static uint8_t back[sizeof(cbor)];
+    static char b64[sizeof(cbor)*2];
+    tcbor_window_t d;
+    int n;
+    int m;
+    n=tcbor_encode(w, cbor, sizeof(cbor));
+    if ((n<0) || (n!=tcbor_size(w))) {
+        printf("FAIL: %s encodes to %d bytes, tcbor_size says %d\n", what, n, tcbor_size(w));
+        fails++;
+        return;
+    }
+    m=tcbor_base64_encode(cbor, n, b64, sizeof(b64));
+    if ((m!=tcbor_base64_len(n)) || (tcbor_base64_decode(b64, m, back, sizeof(back))!=n) || (memcmp(cbor, back, n)!=0)) {
+        printf("FAIL: %s doesn't come back from base64\n", what);
+        fails++;
+        return;
+    }
+    if ((tcbor_decode(cbor, n, &d)!=0) || (!same(w, &d))) {
+        printf("FAIL: %s doesn't decode to the window it came from\n", what);
+        fails++;
+    }
+    if ((n>1) && (tcbor_decode(cbor, n-1, &d)==0) && (same(w, &d))) {
+        printf("FAIL: %s decodes without its last byte\n", what);
+        fails++;
+    }
+}
+
+static void check_windows(void)
+{
+    tcbor_window_t w;
+    int i, j, k;
+    static const int32_t edge[]={0, 1, -1, 63, 64, -64, -65, 8191, 8192, 2147483647, -2147483647-1, 2147483647};
+
+    memset(&w, 0, sizeof(w));
+    w.exp=-TOOL_DECIMALS;
+    round_trip(&w, "an empty window");
+
+    // every varint length, and the differences between the extremes, which wrap around
+    for (i=0; i<TCBOR_CHAN_MAX; i++) {
+        for (j=0; j<(int)(sizeof(edge)/sizeof(edge[0])); j++) {
+            w.vals[i][j]=edge[j] * ((i==1) ? -1 : 1);
+        }
+        w.nvals[i]=j;
+    }
+    w.t_ms=0xffffffffffffull;
+    w.window_ms=0xffffffff;
+    round_trip(&w, "a window of edge values");
+
+    srand(1);
+    for (k=0; k<TOOL_RANDOM; k++) {
+        memset(&w, 0, sizeof(w));
+        w.t_ms=((uint64_t)rand()<<20) ^ rand();
+        w.window_ms=rand() % 60000;
+        w.exp=-(rand() % 7);
+        for (i=0; i<TCBOR_CHAN_MAX; i++) {
+            w.nvals[i]=rand() % (TCBOR_VALS_MAX+1);
+            for (j=0; j<w.nvals[i]; j++) {
+                w.vals[i][j]=(k & 1) ? (int32_t)((uint32_t)rand()<<16 ^ rand()) : (j>0 ? w.vals[i][j-1] : 1650) + (rand() % 9) - 4;
+            }
+        }
+        round_trip(&w, "a random window");
+    }
+}
+
+// ********** size and speed **********
+
+// a 12-bit reading in volts, in thousandths, drifting with a little noise, as telem bench makes them
+static void make_window(tcbor_window_t* w, int nvals, char noisy)
+{
+    int i, j;
+    memset(w, 0, sizeof(tcbor_window_t));
+    w->exp=-TOOL_DECIMALS;
+    w->t_ms=1760000000000ull;
+    w->window_ms=1000;
+    for (i=0; i<TCBOR_CHAN_MAX; i++) {
+        for (j=0; j<nvals; j++) {
+            if (noisy)
+                w->vals[i][j]=(int32_t)((rand() % 4096) * 3300 / 4096);
+            else
+                w->vals[i][j]=(int32_t)(((2048 + (i*300) + (j*3) + ((j*7919) % 5) - 2) * 1000 + 620) / 1241);
+        }
+        w->nvals[i]=nvals;
+    }
+}
+
+static void bench(void)
+{
+    static char json[TCBOR_CHAN_MAX*TCBOR_VALS_MAX*16];
+    static uint8_t cbor[TCBOR_CHAN_MAX*TCBOR_VALS_MAX*5 + TCBOR_HDR_LEN + 16];
+    static const int sizes[]={1, 4, 10, 32};
+    tcbor_window_t w;
+    tcbor_window_t d;
+    int s, k;
+    int nv;
+    int jlen=0;
+    int clen=0;
+    int msg;
+    char noisy;
+    double tj, te, td;
+
+    make_window(&w, TCBOR_VALS_MAX, 0);
+    for (k=0; k<TOOL_LOOPS; k++) {
+        put_json(json, &w); // warm up, so the first row isn't timed with the CPU still slow
+    }
+    printf("values  kind     json  cbor  {\"cbor\"}  json/val  cbor/val  json ns/val  enc ns/val  dec ns/val\n");
+    for (noisy=0; noisy<2; noisy++) {
+        for (s=0; s<(int)(sizeof(sizes)/sizeof(sizes[0])); s++) {
+            make_window(&w, sizes[s], noisy);
+            nv=sizes[s]*TCBOR_CHAN_MAX;
+            tj=now_usec();
+            for (k=0; k<TOOL_LOOPS; k++) {
+                jlen=put_json(json, &w);
+            }
+            tj=now_usec()-tj;
+            te=now_usec();
+            for (k=0; k<TOOL_LOOPS; k++) {
+                clen=tcbor_encode(&w, cbor, sizeof(cbor));
+            }
+            te=now_usec()-te;
+            td=now_usec();
+            for (k=0; k<TOOL_LOOPS; k++) {
+                tcbor_decode(cbor, clen, &d);
+            }
+            td=now_usec()-td;
+            msg=TOOL_WRAP_LEN + tcbor_base64_len(clen);
+            printf("%6d  %-6s  %5d  %4d  %8d%s  %8.2f  %8.2f  %11.1f  %10.1f  %10.1f\n", nv, noisy ? "noisy" : "drift",
+                jlen, clen, msg, (msg>=TOOL_MSG_LEN) ? "*" : " ", (double)jlen/nv, (double)msg/nv,
+                tj*1000.0/(TOOL_LOOPS*nv), te*1000.0/(TOOL_LOOPS*nv), td*1000.0/(TOOL_LOOPS*nv));
+            if ((!noisy) && (sizes[s]>=10) && (msg>=jlen)) {
+                printf("FAIL: %d drifting values take %d bytes as CBOR, %d as JSON\n", nv, msg, jlen);
+                fails++;
+            }
+        }
+    }
+    printf("* too long for one %d byte telemetry message, telemetry_add sends it sooner\n", TOOL_MSG_LEN);
+}
+
+int main(int argc, char* argv[])
+{
+    int i;
+    int bad=0;
+    if (argc>1) {
+        for (i=1; i<argc; i++) {
+            bad+=decode_arg(argv[i]);
+        }
+        return(bad ? 1 : 0);
+    }
+    check_windows();
+    bench();
+    printf("tcbor_tool: %s\n", fails ? "FAILED" : "passed");
+    return(fails ? 1 : 0);
+}
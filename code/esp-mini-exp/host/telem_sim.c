@@ -0,0 +1,262 @@
+// telemetry harness: runs telemetry.c on a PC, with a simulated clock, and an MQTT stand-in
+// taking the messages off iotq as IoT Central would. Cloud streaming is played in at a few
+// rates, and the messages and bytes each sample costs are compared with sending one message
+// per sample. Every value is read back out of the messages, so none may go missing.
+// build and run with: make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "telemetry.h"
+#include "telemcbor.h"
+#include "flashring.h"
+#include "memstat.h"
+
+#define SIM_SECONDS 60
+#define SIM_TOPIC_LEN 37            // devices/<12 character id>/messages/events/
+#define SIM_TLS_LEN 29              // TLS record header, explicit nonce and GCM tag around each packet
+#define SIM_PUBACK_LEN 4
+
+static int fails=0;
+
+// ********** the clock, and esp_timer on it **********
+
+static int64_t sim_now=0;
+static esp_timer_cb_t sim_timer_cb;
+static uint64_t sim_timer_period=0;
+static int64_t sim_timer_due=0;
+
+int64_t esp_timer_get_time(void)
+{
+    return(sim_now);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle)
+{
+    sim_timer_cb=args->callback;
+    *handle=(esp_timer_handle_t)&sim_timer_cb;
+    return(ESP_OK);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_usec)
+{
+    sim_timer_period=period_usec;
+    sim_timer_due=sim_now+period_usec;
+    return(ESP_OK);
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_usec)
+{
+    return(ESP_FAIL);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    sim_timer_period=0;
+    return(ESP_OK);
+}
+
+// move the clock on, firing the flush timer on the way
+static void sim_advance(int64_t usec)
+{
+    int64_t end=sim_now+usec;
+    while ((sim_timer_period>0) && (sim_timer_due<=end)) {
+        sim_now=sim_timer_due;
+        sim_timer_due+=sim_timer_period;
+        sim_timer_cb(NULL);
+    }
+    sim_now=end;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return((TickType_t)(sim_now/1000));
+}
+
+// ********** iotq, and the MQTT stand-in that empties it **********
+
+typedef struct sim_broker_s {
+    uint32_t msgs;
+    uint32_t payload;               // bytes of telemetry
+    uint32_t wire;                  // bytes on the network, both ways
+    uint32_t values;                // read back out of the messages
+    uint32_t longest;
+} sim_broker_t;
+
+static sim_broker_t sim_broker;
+
+// the values in a message, from its JSON, or by decoding its CBOR
+static int sim_count_values(const char* msg)
+{
+    tcbor_window_t w;
+    uint8_t cbor[TELEM_MSG_LEN];
+    const char* p;
+    int n=0;
+    if (strncmp(msg, "{\"cbor\":\"", 9)==0) {
+        n=tcbor_base64_decode(&msg[9], strcspn(&msg[9], "\""), cbor, sizeof(cbor));
+        if ((n<0) || (tcbor_decode(cbor, n, &w)!=0)) {
+            printf("FAIL: can't decode %s\n", msg);
+            fails++;
+            return(0);
+        }
+        return(w.nvals[0] + w.nvals[1] + w.nvals[2]);
+    }
+    // {"ch1":[1.234,1.250],"ch3":0.500} has a colon per channel and a comma between values
+    for (p=msg; *p!='\0'; p++) {
+        if ((*p==':') || ((*p==',') && (p[-1]!=']') && (p[1]!='"'))) n++;
+    }
+    return(n);
+}
+
+// an MQTT PUBLISH at QoS 1 to the device's events topic, and its PUBACK, each in a TLS record
+static void sim_publish(const char* msg)
+{
+    int len=strlen(msg);
+    int rest=2 + SIM_TOPIC_LEN + 2 + len;
+    sim_broker.msgs++;
+    sim_broker.payload+=len;
+    sim_broker.wire+=SIM_TLS_LEN + 1 + ((rest<128) ? 1 : 2) + rest + SIM_TLS_LEN + SIM_PUBACK_LEN;
+    sim_broker.values+=sim_count_values(msg);
+    if (len>sim_broker.longest) sim_broker.longest=len;
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t len, UBaseType_t item_size, uint8_t* store, StaticQueue_t* buf)
+{
+    return((QueueHandle_t)buf);
+}
+
+// the network is fast enough here, so each message is published as soon as it's queued
+BaseType_t xQueueSend(QueueHandle_t q, const void* item, TickType_t wait)
+{
+    sim_publish((const char*)item);
+    return(pdTRUE);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+    return(0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t* buf)
+{
+    return((SemaphoreHandle_t)buf);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait)
+{
+    return(pdTRUE);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+    return(pdTRUE);
+}
+
+// ********** the rest of the board **********
+
+static char sim_online=1;
+static uint32_t sim_fring_stored=0;
+
+char fring_online(void)
+{
+    return(sim_online);
+}
+
+int fring_store(const char* msg, int len)
+{
+    sim_fring_stored++;
+    return(0);
+}
+
+void mem_static_add(const char* part, uint32_t bytes)
+{
+}
+
+uint16_t get_year(void)
+{
+    return(0); // no NTP, so windows are timed from boot
+}
+
+// ********** the runs **********
+
+// cloud streaming of nchans channels every period_ms, for SIM_SECONDS. With per_value set,
+// each value is flushed as it's added, which is what sending one message per sample costs
+static void sim_run(const char* name, int nchans, int period_ms, char format, char per_value, uint16_t size)
+{
+    telem_stats_t st;
+    uint32_t values;
+    int t, i;
+    memset(&sim_broker, 0, sizeof(sim_broker));
+    telemetry_set_format(format);
+    telemetry_set_size(size);
+    telemetry_clear_stats();
+    for (t=0; t<SIM_SECONDS*1000; t+=period_ms) {
+        for (i=0; i<nchans; i++) {
+            // a 12-bit reading in volts, drifting
+            telemetry_add(i, (double)(2048 + i*300 + ((t/period_ms)*3 % 200) + (t % 3)) / 1241.0);
+            if (per_value) telemetry_flush();
+        }
+        sim_advance((int64_t)period_ms*1000);
+    }
+    telemetry_flush();
+    telemetry_get_stats(&st);
+    values=(uint32_t)(SIM_SECONDS*1000/period_ms)*nchans;
+    printf("%-22s %6u %6u  %8.3f  %9.1f  %9.1f  %7u\n", name, values, sim_broker.msgs, (double)sim_broker.msgs/values,
+        (double)sim_broker.payload/values, (double)sim_broker.wire/values, sim_broker.longest);
+    if ((st.values!=values) || (sim_broker.values!=values)) {
+        printf("FAIL: %s added %u values, telemetry took %u and the broker got %u\n", name, values, st.values, sim_broker.values);
+        fails++;
+    }
+    if ((st.msgs!=sim_broker.msgs) || (st.bytes!=sim_broker.payload)) {
+        printf("FAIL: %s counts %u messages and %u bytes, the broker %u and %u\n", name, st.msgs, st.bytes, sim_broker.msgs, sim_broker.payload);
+        fails++;
+    }
+    if (sim_broker.longest>=size) {
+        printf("FAIL: %s sent a %u byte message, the limit is %u\n", name, sim_broker.longest, size);
+        fails++;
+    }
+}
+
+int main(void)
+{
+    uint32_t msgs1;
+    uint32_t wire1;
+
+    telemetry_init();
+    printf("%d seconds of cloud streaming, %d byte topic, QoS 1 over TLS\n", SIM_SECONDS, SIM_TOPIC_LEN);
+    printf("                       values   msgs  msgs/val  bytes/val  wire/val  longest\n");
+
+    sim_run("1 chan 10Hz, each", 1, 100, TELEM_FMT_JSON, 1, TELEM_MSG_LEN);
+    msgs1=sim_broker.msgs;
+    wire1=sim_broker.wire;
+    sim_run("1 chan 10Hz, json", 1, 100, TELEM_FMT_JSON, 0, TELEM_MSG_LEN);
+    if ((sim_broker.msgs*8>msgs1) || (sim_broker.wire*3>wire1)) {
+        printf("FAIL: windows take %u messages and %u bytes, one per value %u and %u\n", sim_broker.msgs, sim_broker.wire, msgs1, wire1);
+        fails++;
+    }
+    sim_run("1 chan 10Hz, cbor", 1, 100, TELEM_FMT_CBOR, 0, TELEM_MSG_LEN);
+    sim_run("3 chans 10Hz, each", 3, 100, TELEM_FMT_JSON, 1, TELEM_MSG_LEN);
+    sim_run("3 chans 10Hz, json", 3, 100, TELEM_FMT_JSON, 0, TELEM_MSG_LEN);
+    sim_run("3 chans 10Hz, cbor", 3, 100, TELEM_FMT_CBOR, 0, TELEM_MSG_LEN);
+    sim_run("3 chans 100Hz, json", 3, 10, TELEM_FMT_JSON, 0, TELEM_MSG_LEN);
+    sim_run("3 chans 100Hz, cbor", 3, 10, TELEM_FMT_CBOR, 0, TELEM_MSG_LEN);
+    sim_run("3 chans 10Hz, 96 byte", 3, 100, TELEM_FMT_JSON, 0, 96);
+
+    // offline, every window goes to the flash ring instead
+    sim_online=0;
+    telemetry_set_size(TELEM_MSG_LEN);
+    telemetry_clear_stats();
+    telemetry_add(0, 1.0);
+    sim_advance(TELEM_FLUSH_MS_DEFAULT*1000);
+    if (sim_fring_stored!=1) {
+        printf("FAIL: an offline window was stored %u times\n", sim_fring_stored);
+        fails++;
+    }
+
+    printf("telem_sim: %s\n", fails ? "FAILED" : "passed");
+    return(fails ? 1 : 0);
+}
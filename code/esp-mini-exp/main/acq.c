@@ -0,0 +1,292 @@
+// acquisition engine
+// rev 1 - ADC setup and conversions for all three channels, with a latest-value cache
+// rev 2 - running statistics per channel
+// rev 3 - filter chain per channel
+// rev 4 - pins can be handed over to the pulse counter and logic capture
+// rev 5 - filters and statistics run per reader, at the rate of the thing sampling
+// rev 6 - a spinlock instead of a mutex, as the readers include esp_timer callbacks
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include <driver/adc.h>
+#include "driver/gpio.h"
+#include "driver/rtc_io.h"
+#include "esp_timer.h"
+#include "miniexp.h"
+#include "acq.h"
+#include "memstat.h"
+
+static portMUX_TYPE acq_mux = portMUX_INITIALIZER_UNLOCKED; // the cache, the filters and the statistics
+static uint16_t acq_cache[CHAN_MAX];
+static int64_t acq_cache_time[CHAN_MAX];
+static char acq_hist_ena=0;
+static filt_chain_t acq_filt[CHAN_MAX];    // as configured, the readers run copies
+static uint32_t acq_filt_gen[CHAN_MAX];
+static volatile char acq_digital[CHAN_MAX];  // the pin belongs to a digital peripheral
+static volatile uint8_t acq_converting[CHAN_MAX]; // conversions in progress
+static const adc1_channel_t ME_HOT_DATA acq_adc_chan[CHAN_MAX] = {ADC1_CHANNEL_6, ADC1_CHANNEL_7, ADC1_CHANNEL_5};
+static const gpio_num_t acq_gpio[CHAN_MAX] = {GPIO_NUM_34, GPIO_NUM_35, GPIO_NUM_33};
+
+
+void acq_init(void)
+{
+    int i;
+    mem_static_add("acquisition", sizeof(acq_cache) + sizeof(acq_cache_time) + sizeof(acq_filt) + sizeof(acq_filt_gen));
+    for (i=0; i<CHAN_MAX; i++) {
+        acq_cache[i]=0;
+        acq_cache_time[i]=0;
+    }
+    acq_filter_clear(-1);
+    adc1_config_width(ADC_WIDTH_BIT_12);
+    adc1_config_channel_atten(ADC1_CHANNEL_6,ADC_ATTEN_DB_11);
+    adc1_config_channel_atten(ADC1_CHANNEL_7,ADC_ATTEN_DB_11);
+    adc1_config_channel_atten(ADC1_CHANNEL_5,ADC_ATTEN_DB_11);
+}
+
+// called with acq_mux held
+static ME_HOT void acq_stats_add(acq_stats_t* st, uint16_t raw)
+{
+    double delta;
+    st->count++;
+    if (raw<st->min) st->min=raw;
+    if (raw>st->max) st->max=raw;
+    delta=raw - st->mean;
+    st->mean+=delta/st->count;
+    st->m2+=delta*(raw - st->mean);
+    if (acq_hist_ena)
+        st->hist[(raw>>8) & (ACQ_HIST_BINS-1)]++;
+}
+
+// not under acq_mux, the ADC driver has locks of its own. A conversion would take a
+// digital pin back for the ADC, so acq_pin_digital waits for those in progress
+static ME_HOT uint16_t acq_convert(int chan)
+{
+    int raw;
+    portENTER_CRITICAL(&acq_mux);
+    if (acq_digital[chan]) {
+        portEXIT_CRITICAL(&acq_mux);
+        return(0);
+    }
+    acq_converting[chan]++;
+    portEXIT_CRITICAL(&acq_mux);
+    // for ESP32, channel numbering:
+    // chan 0 (Casio CHAN1) is ESP32 ADC1_CHANNEL_6 (IO34)
+    // chan 1 (Casio CHAN2) is ESP32 ADC1_CHANNEL_7 (IO35)
+    // chan 2 (Casio CHAN3) is ESP32 ADC1_CHANNEL_5 (IO33)
+    raw = adc1_get_raw(acq_adc_chan[chan]);
+    portENTER_CRITICAL(&acq_mux);
+    acq_converting[chan]--;
+    portEXIT_CRITICAL(&acq_mux);
+    if (raw<0) raw=0;
+    return((uint16_t)raw);
+}
+
+// raw 12-bit ADC reading, unfiltered. Two readers that miss the cache together both convert
+ME_HOT uint16_t acq_read_raw(int chan, uint32_t max_age_usec)
+{
+    uint16_t raw;
+    int64_t now;
+    if ((chan<0) || (chan>=CHAN_MAX)) {
+        printf("ERROR - unexpected channel in acq_read_raw!\r\n");
+        return(0);
+    }
+    now=esp_timer_get_time();
+    portENTER_CRITICAL(&acq_mux);
+    if (acq_digital[chan] ||
+        ((max_age_usec>0) && (acq_cache_time[chan]!=0) && ((now-acq_cache_time[chan])<=(int64_t)max_age_usec))) {
+        raw=acq_digital[chan] ? 0 : acq_cache[chan];
+        portEXIT_CRITICAL(&acq_mux);
+        return(raw);
+    }
+    portEXIT_CRITICAL(&acq_mux);
+    raw=acq_convert(chan);
+    portENTER_CRITICAL(&acq_mux);
+    acq_cache[chan]=raw;
+    acq_cache_time[chan]=now;
+    portEXIT_CRITICAL(&acq_mux);
+    return(raw);
+}
+
+void acq_reader_init(acq_reader_t* rd)
+{
+    memset(rd, 0, sizeof(acq_reader_t)); // generation 0 is never current, so the filters are copied on the first reading
+    acq_stats_reset(rd, -1);
+}
+
+void acq_reader_restart(acq_reader_t* rd)
+{
+    int i;
+    portENTER_CRITICAL(&acq_mux);
+    for (i=0; i<CHAN_MAX; i++) {
+        filter_restart(&rd->filt[i]);
+    }
+    portEXIT_CRITICAL(&acq_mux);
+}
+
+// a conversion (shared through the cache) run through rd's copy of the channel's filters
+ME_HOT uint16_t acq_read(acq_reader_t* rd, int chan, uint32_t max_age_usec)
+{
+    uint16_t raw=0;
+    if ((chan<0) || (chan>=CHAN_MAX))
+        return(acq_read_raw(chan, max_age_usec));
+    if (acq_digital[chan])
+        return(0); // not a reading, so it isn't filtered or counted
+    if (rd->uncached)
+        raw=acq_convert(chan);
+    else
+        raw=acq_read_raw(chan, max_age_usec);
+    portENTER_CRITICAL(&acq_mux);
+    if (rd->filt_gen[chan]!=acq_filt_gen[chan]) {
+        // the filters were changed, they start again from this reading
+        memcpy(&rd->filt[chan], &acq_filt[chan], sizeof(filt_chain_t));
+        filter_restart(&rd->filt[chan]);
+        rd->filt_gen[chan]=acq_filt_gen[chan];
+    }
+    if (rd->filt[chan].nstages>0)
+        raw=filter_run(&rd->filt[chan], raw);
+    acq_stats_add(&rd->stats[chan], raw);
+    portEXIT_CRITICAL(&acq_mux);
+    return(raw);
+}
+
+ME_HOT double raw_to_volts(uint16_t raw)
+{
+    return(((double)raw)/ACQ_COUNTS_PER_VOLT);
+}
+
+uint16_t volts_to_raw(double v)
+{
+    if (v<=0.0) return(0);
+    if (v*ACQ_COUNTS_PER_VOLT>=4095.0) return(4095);
+    return((uint16_t)(v*ACQ_COUNTS_PER_VOLT + 0.5));
+}
+
+void acq_stats_reset(acq_reader_t* rd, int chan)
+{
+    int i;
+    for (i=0; i<CHAN_MAX; i++) {
+        if ((chan>=0) && (chan!=i)) continue;
+        portENTER_CRITICAL(&acq_mux);
+        memset(&rd->stats[i], 0, sizeof(acq_stats_t));
+        rd->stats[i].min=0xffff;
+        portEXIT_CRITICAL(&acq_mux);
+    }
+}
+
+void acq_stats_hist(char enable)
+{
+    acq_hist_ena=enable;
+}
+
+void acq_get_stats(acq_reader_t* rd, int chan, acq_stats_t* st)
+{
+    if ((chan<0) || (chan>=CHAN_MAX)) {
+        memset(st, 0, sizeof(acq_stats_t));
+        return;
+    }
+    portENTER_CRITICAL(&acq_mux);
+    memcpy(st, &rd->stats[chan], sizeof(acq_stats_t));
+    portEXIT_CRITICAL(&acq_mux);
+}
+
+// sample standard deviation
+double acq_stats_stddev(const acq_stats_t* st)
+{
+    if (st->count<2)
+        return(0.0);
+    return(sqrt(st->m2/(st->count-1)));
+}
+
+// the mean square is the population variance plus the square of the mean
+double acq_stats_rms(const acq_stats_t* st)
+{
+    if (st->count==0)
+        return(0.0);
+    return(sqrt((st->m2/st->count) + (st->mean*st->mean)));
+}
+
+int acq_filter_add(int chan, int type, double p1, double p2)
+{
+    int res;
+    filt_chain_t c;
+    if ((chan<0) || (chan>=CHAN_MAX))
+        return(-1);
+    // the coefficients are worked out in double precision, outside the lock
+    acq_filter_get(chan, &c);
+    res=filter_add(&c, type, p1, p2);
+    if (res!=0)
+        return(res);
+    portENTER_CRITICAL(&acq_mux);
+    memcpy(&acq_filt[chan], &c, sizeof(filt_chain_t));
+    acq_filt_gen[chan]++;
+    portEXIT_CRITICAL(&acq_mux);
+    return(0);
+}
+
+void acq_filter_clear(int chan)
+{
+    int i;
+    for (i=0; i<CHAN_MAX; i++) {
+        if ((chan>=0) && (chan!=i)) continue;
+        portENTER_CRITICAL(&acq_mux);
+        filter_clear(&acq_filt[i]);
+        acq_filt_gen[i]++;
+        portEXIT_CRITICAL(&acq_mux);
+    }
+}
+
+void acq_filter_get(int chan, filt_chain_t* c)
+{
+    if ((chan<0) || (chan>=CHAN_MAX)) {
+        filter_clear(c);
+        return;
+    }
+    portENTER_CRITICAL(&acq_mux);
+    memcpy(c, &acq_filt[chan], sizeof(filt_chain_t));
+    portEXIT_CRITICAL(&acq_mux);
+}
+
+int acq_chan_gpio(int chan)
+{
+    if ((chan<0) || (chan>=CHAN_MAX))
+        return(-1);
+    return(acq_gpio[chan]);
+}
+
+// the ADC takes the pin over through the RTC multiplexer, which has to be released for the GPIO matrix
+void acq_pin_digital(int chan, char digital)
+{
+    if ((chan<0) || (chan>=CHAN_MAX))
+        return;
+    if (digital) {
+        // no conversions from here on, and none cached from before
+        portENTER_CRITICAL(&acq_mux);
+        acq_digital[chan]=1;
+        acq_cache_time[chan]=0;
+        portEXIT_CRITICAL(&acq_mux);
+        while (acq_converting[chan]>0) {
+            vTaskDelay(1);
+        }
+        rtc_gpio_deinit(acq_gpio[chan]);
+        gpio_set_direction(acq_gpio[chan], GPIO_MODE_INPUT);
+    } else {
+        gpio_set_pull_mode(acq_gpio[chan], GPIO_FLOATING);
+        adc1_config_channel_atten(acq_adc_chan[chan], ADC_ATTEN_DB_11);
+        portENTER_CRITICAL(&acq_mux);
+        acq_digital[chan]=0;
+        acq_cache_time[chan]=0;
+        portEXIT_CRITICAL(&acq_mux);
+    }
+}
+
+char acq_pin_is_digital(int chan)
+{
+    if ((chan<0) || (chan>=CHAN_MAX))
+        return(0);
+    return(acq_digital[chan]);
+}
@@ -0,0 +1,76 @@
+
+#ifndef _ACQ_HEADER_FILE_H
+#define _ACQ_HEADER_FILE_H
+
+#include "filter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// acquisition engine, shared by all Casio links and by the capture code.
+// Recent readings are cached so that two calculators polling the same channel
+// don't cost two conversions. esp_timer callbacks read channels, so the cache,
+// filters and statistics are updated under a spinlock rather than a mutex, and
+// the conversion itself runs outside it, serialized by the ADC driver.
+// The filter chains (see filter.h) are set up per channel, but each thing that
+// samples at a rate of its own (a link's sample timer, capture, the data logger,
+// cloud streaming) runs them in its own acq_reader_t, so a filter only ever sees
+// the samples of one rate, and each reader keeps its own statistics.
+// acq_read_raw gives the unfiltered conversion, for single readings.
+// While a pin is handed to the pulse counter or logic capture (acq_pin_digital)
+// it isn't converted, and reads 0.
+
+#define ACQ_CACHE_USEC 1000     // readings younger than this are shared
+#define ACQ_COUNTS_PER_VOLT 1241.0
+#define ACQ_HIST_BINS 16        // histogram of raw readings, 256 counts per bin
+#define ACQ_CHAN_MAX 3          // CHAN_MAX
+
+// running statistics for a channel of a reader, updated on every reading it
+// takes. Mean and variance use Welford's method, so each sample costs the same
+// however many there have been
+typedef struct acq_stats_s {
+    uint32_t count;
+    uint16_t min;
+    uint16_t max;
+    double mean;            // raw units
+    double m2;              // sum of squared differences from the mean
+    uint32_t hist[ACQ_HIST_BINS];
+} acq_stats_t;
+
+// filter state and statistics of one sampler. It should only be read from one
+// task or timer, and filter changes reach it on its next reading of the channel
+typedef struct acq_reader_s {
+    uint32_t filt_gen[ACQ_CHAN_MAX]; // acq_filter_add/acq_filter_clear generation copied
+    filt_chain_t filt[ACQ_CHAN_MAX];
+    acq_stats_t stats[ACQ_CHAN_MAX];
+    char uncached;                  // 1 to convert on every reading, leaving the shared cache alone
+} acq_reader_t;
+
+void acq_init(void);
+uint16_t acq_read_raw(int chan, uint32_t max_age_usec); // max_age_usec 0 forces a new conversion
+void acq_reader_init(acq_reader_t* rd);
+void acq_reader_restart(acq_reader_t* rd); // the filters forget their history, for a new run
+uint16_t acq_read(acq_reader_t* rd, int chan, uint32_t max_age_usec); // filtered, and counted in rd's statistics
+double raw_to_volts(uint16_t raw);
+uint16_t volts_to_raw(double v);
+void acq_stats_reset(acq_reader_t* rd, int chan); // chan 0..2, or -1 for all channels
+void acq_stats_hist(char enable);       // the histogram is off by default
+void acq_get_stats(acq_reader_t* rd, int chan, acq_stats_t* st);
+double acq_stats_stddev(const acq_stats_t* st); // all in raw units
+double acq_stats_rms(const acq_stats_t* st);
+int acq_filter_add(int chan, int type, double p1, double p2); // returns 0 on success
+void acq_filter_clear(int chan);        // chan 0..2, or -1 for all channels
+void acq_filter_get(int chan, filt_chain_t* c);
+int acq_chan_gpio(int chan);            // the channel's input pin
+void acq_pin_digital(int chan, char digital); // hands the pin to a digital peripheral (1) or back to the ADC (0)
+char acq_pin_is_digital(int chan);
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ACQ_HEADER_FILE_H */
@@ -0,0 +1,299 @@
+// bulk capture functions
+// rev 1 - captures are sampled by their own esp_timer, and stored as raw
+// 12-bit ADC values, interleaved by channel
+// rev 2 - triggered captures, into the same buffer used as a circular buffer
+// rev 3 - the timer callback and arm/stop hand the state over under a lock
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "miniexp.h"
+#include "capture.h"
+#include "acq.h"
+#include "memstat.h"
+#include "esp_timer.h"
+
+static esp_timer_handle_t cap_timer;
+static uint16_t cap_buf[CAP_BUF_LEN];
+static volatile unsigned int cap_done=0;  // samples per channel captured so far
+static unsigned int cap_numsamp=0;
+static uint8_t cap_mask=0;
+static uint8_t cap_nchan=0;
+static uint32_t cap_period_usec=0;
+static volatile char cap_state=CAP_IDLE;
+// triggered captures
+static int8_t cap_trig_chan=-1;     // -1 if captures aren't triggered
+static uint16_t cap_trig_level=0;
+static char cap_trig_slope=CAP_TRIG_RISING;
+static unsigned int cap_pretrig_pct=50;
+static char cap_rearm=0;
+static unsigned int cap_pre=0;      // samples kept from before the trigger
+static unsigned int cap_wr=0;       // next sample written in the circular buffer
+static unsigned int cap_filled=0;   // samples written since arming, up to cap_numsamp
+static unsigned int cap_post_left=0;
+static unsigned int cap_start=0;    // first sample of the frozen window
+static uint16_t cap_prev=0;
+static char cap_prev_valid=0;
+static uint32_t cap_ntrig=0;
+static acq_reader_t cap_reader;     // filters run at the capture rate
+static uint32_t cap_gen=0;          // moves on each time a capture is stopped or armed
+static portMUX_TYPE cap_mux = portMUX_INITIALIZER_UNLOCKED; // the state handed between the timer and the links
+
+
+static char cap_crossed(uint16_t prev, uint16_t v)
+{
+    char rising=(prev<cap_trig_level) && (v>=cap_trig_level);
+    char falling=(prev>cap_trig_level) && (v<=cap_trig_level);
+    switch(cap_trig_slope) {
+        case CAP_TRIG_RISING:
+            return(rising);
+        case CAP_TRIG_FALLING:
+            return(falling);
+        default:
+            return(rising || falling);
+    }
+}
+
+// one sample into the circular buffer, checking for the trigger. Called with cap_mux held,
+// returns 1 once the window is frozen
+static char cap_triggered_sample(const uint16_t* v)
+{
+    int i;
+    int n=0;
+    unsigned int row=cap_wr;
+    unsigned int pos=row*cap_nchan;
+    uint16_t tv=0;
+    for (i=0; i<CHAN_MAX; i++) {
+        if (cap_mask & (0x01<<i)) {
+            cap_buf[pos]=v[n];
+            if (i==cap_trig_chan) tv=v[n];
+            n++;
+            pos++;
+        }
+    }
+    cap_wr=(cap_wr+1) % cap_numsamp;
+    if (cap_filled<cap_numsamp) cap_filled++;
+    if (cap_state==CAP_WAITING) {
+        // there must already be enough history for the pre-trigger part of the window
+        if ((cap_filled>cap_pre) && cap_prev_valid && cap_crossed(cap_prev, tv)) {
+            cap_start=(row + cap_numsamp - cap_pre) % cap_numsamp;
+            cap_post_left=cap_numsamp - cap_pre - 1;
+            cap_state=CAP_TRIGGERED;
+        }
+        cap_prev=tv;
+        cap_prev_valid=1;
+    } else {
+        cap_post_left--;
+    }
+    if ((cap_state==CAP_TRIGGERED) && (cap_post_left==0)) {
+        cap_ntrig++;
+        cap_done=cap_numsamp;
+        cap_state=CAP_DONE;
+        return(1);
+    }
+    return(0);
+}
+
+
+// esp_timer_stop doesn't wait for a callback that has already started, so the conversions
+// are made outside cap_mux, and only stored if the capture hasn't been stopped or armed
+// again meanwhile (cap_gen moves on each time)
+void capture_callback(void* arg)
+{
+    int i;
+    int n=0;
+    uint32_t gen;
+    uint8_t mask;
+    char state;
+    uint16_t v[CHAN_MAX];
+    portENTER_CRITICAL(&cap_mux);
+    gen=cap_gen;
+    state=cap_state;
+    mask=cap_mask;
+    portEXIT_CRITICAL(&cap_mux);
+    if ((state!=CAP_RUNNING) && (state!=CAP_WAITING) && (state!=CAP_TRIGGERED))
+        return;
+    for (i=0; i<CHAN_MAX; i++) {
+        if (mask & (0x01<<i))
+            v[n++]=acq_read(&cap_reader, i, 0); // always a new conversion
+    }
+    portENTER_CRITICAL(&cap_mux);
+    if (cap_gen!=gen) {
+        portEXIT_CRITICAL(&cap_mux);
+        return;
+    }
+    if (cap_state==CAP_RUNNING) {
+        memcpy(&cap_buf[cap_done*cap_nchan], v, n*sizeof(uint16_t));
+        cap_done++;
+        if (cap_done>=cap_numsamp) {
+            cap_state=CAP_DONE;
+            esp_timer_stop(cap_timer); // inside the lock, so a capture armed just now keeps its timer
+        }
+    } else if (cap_triggered_sample(v)) {
+        esp_timer_stop(cap_timer);
+    }
+    portEXIT_CRITICAL(&cap_mux);
+}
+
+void capture_init(void)
+{
+    const esp_timer_create_args_t cap_timer_args = {
+        .callback = &capture_callback,
+        .name = "capture"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&cap_timer_args, &cap_timer));
+    acq_reader_init(&cap_reader);
+    mem_static_add("capture", sizeof(cap_buf) + sizeof(cap_reader));
+}
+
+int capture_arm(unsigned int numsamp, uint32_t period_usec, uint8_t chanmask)
+{
+    int i;
+    uint8_t nchan=0;
+    for (i=0; i<CHAN_MAX; i++) {
+        if (chanmask & (0x01<<i))
+            nchan++;
+    }
+    if ((nchan==0) || (numsamp==0) || (numsamp>CAP_LIST_MAX) || ((numsamp*nchan)>CAP_BUF_LEN)) {
+        printf("capture: can't capture %u samples from channel mask 0x%02x\r\n", numsamp, chanmask);
+        return(-1);
+    }
+    if (period_usec<CAP_MIN_PERIOD_USEC) {
+        printf("capture: period %u usec is too short\r\n", period_usec);
+        return(-1);
+    }
+    for (i=0; i<CHAN_MAX; i++) {
+        if ((chanmask & (0x01<<i)) && acq_pin_is_digital(i)) {
+            printf("capture: channel %d is a pulse counter or logic input\r\n", i+1);
+            return(-1);
+        }
+    }
+    if ((cap_trig_chan>=0) && !(chanmask & (0x01<<cap_trig_chan))) {
+        printf("capture: trigger channel %d isn't captured\r\n", cap_trig_chan+1);
+        return(-1);
+    }
+    capture_stop();
+    acq_reader_restart(&cap_reader);
+    portENTER_CRITICAL(&cap_mux);
+    cap_mask=chanmask;
+    cap_nchan=nchan;
+    cap_numsamp=numsamp;
+    cap_period_usec=period_usec;
+    cap_done=0;
+    cap_start=0;
+    portEXIT_CRITICAL(&cap_mux);
+    if (cap_trig_chan>=0) {
+        cap_ntrig=0;
+        return(capture_rearm());
+    }
+    portENTER_CRITICAL(&cap_mux);
+    cap_gen++;
+    cap_state=CAP_RUNNING;
+    portEXIT_CRITICAL(&cap_mux);
+    capture_callback(NULL); // first sample immediately
+    portENTER_CRITICAL(&cap_mux);
+    if (cap_state==CAP_RUNNING) {
+        ESP_ERROR_CHECK(esp_timer_start_periodic(cap_timer, period_usec));
+    }
+    portEXIT_CRITICAL(&cap_mux);
+    return(0);
+}
+
+void capture_stop(void)
+{
+    portENTER_CRITICAL(&cap_mux);
+    if ((cap_state==CAP_RUNNING) || (cap_state==CAP_WAITING) || (cap_state==CAP_TRIGGERED)) {
+        esp_timer_stop(cap_timer);
+        cap_state=CAP_DONE;
+    }
+    cap_gen++; // a callback already running drops its sample
+    portEXIT_CRITICAL(&cap_mux);
+}
+
+int capture_rearm(void)
+{
+    if ((cap_trig_chan<0) || (cap_numsamp==0) || !(cap_mask & (0x01<<cap_trig_chan)))
+        return(-1);
+    capture_stop();
+    acq_reader_restart(&cap_reader);
+    portENTER_CRITICAL(&cap_mux);
+    cap_pre=(cap_numsamp*cap_pretrig_pct)/100;
+    if (cap_pre>cap_numsamp-1) cap_pre=cap_numsamp-1;
+    cap_wr=0;
+    cap_filled=0;
+    cap_prev_valid=0;
+    cap_start=0;
+    cap_done=0;
+    cap_gen++;
+    cap_state=CAP_WAITING;
+    ESP_ERROR_CHECK(esp_timer_start_periodic(cap_timer, cap_period_usec));
+    portEXIT_CRITICAL(&cap_mux);
+    return(0);
+}
+
+int capture_set_trigger(int chan, uint16_t level, char slope)
+{
+    if (chan>=CHAN_MAX)
+        return(-1);
+    capture_stop();
+    cap_trig_chan=(chan<0) ? -1 : chan;
+    cap_trig_level=level;
+    cap_trig_slope=slope;
+    return(0);
+}
+
+void capture_set_pretrigger(unsigned int pct, char auto_rearm)
+{
+    if (pct>100) pct=100;
+    cap_pretrig_pct=pct;
+    cap_rearm=auto_rearm;
+}
+
+char capture_auto_rearm(void)
+{
+    return(cap_rearm && (cap_trig_chan>=0));
+}
+
+uint32_t capture_triggers(void)
+{
+    return(cap_ntrig);
+}
+
+char capture_state(void)
+{
+    return(cap_state);
+}
+
+// a triggered capture has nothing to fetch until its window is frozen
+unsigned int capture_count(void)
+{
+    return(cap_done);
+}
+
+uint8_t capture_chanmask(void)
+{
+    return(cap_mask);
+}
+
+uint32_t capture_period(void)
+{
+    return(cap_period_usec);
+}
+
+// chan is 0..2, and must be one of the captured channels
+uint16_t capture_get(int chan, unsigned int idx)
+{
+    int i;
+    unsigned int pos;
+    if ((idx>=cap_done) || !(cap_mask & (0x01<<chan)))
+        return(0);
+    pos=((cap_start+idx) % cap_numsamp)*cap_nchan;
+    for (i=0; i<chan; i++) {
+        if (cap_mask & (0x01<<i))
+            pos++;
+    }
+    return(cap_buf[pos]);
+}
@@ -0,0 +1,52 @@
+
+#ifndef _CAPTURE_HEADER_FILE_H
+#define _CAPTURE_HEADER_FILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// bulk capture: N samples at a fixed period across a set of channels,
+// held on the device until the calculator fetches them as whole lists.
+// With a trigger set, the capture works like an oscilloscope: sampling runs
+// continuously into a circular buffer, each sample of the trigger channel is
+// checked for a level crossing, and the window is frozen once enough samples
+// have been taken after the trigger. Part of the window (the pre-trigger
+// percentage) is taken from before the trigger.
+
+#define CAP_BUF_LEN 4096            // total samples, shared by all captured channels
+#define CAP_LIST_MAX 999            // the calculator can't hold a longer list
+#define CAP_MIN_PERIOD_USEC 100
+
+#define CAP_IDLE 0
+#define CAP_RUNNING 1
+#define CAP_DONE 2
+#define CAP_WAITING 3               // triggered capture, waiting for the trigger
+#define CAP_TRIGGERED 4             // triggered, taking the samples after the trigger
+
+#define CAP_TRIG_RISING 0
+#define CAP_TRIG_FALLING 1
+#define CAP_TRIG_EITHER 2
+
+void capture_init(void);
+int capture_arm(unsigned int numsamp, uint32_t period_usec, uint8_t chanmask); // returns 0 if ok
+void capture_stop(void);
+char capture_state(void);
+unsigned int capture_count(void);       // samples per channel captured so far
+uint8_t capture_chanmask(void);
+uint32_t capture_period(void);
+uint16_t capture_get(int chan, unsigned int idx); // raw ADC value
+int capture_set_trigger(int chan, uint16_t level, char slope); // chan 0..2, or -1 for no trigger. Returns 0 if ok
+void capture_set_pretrigger(unsigned int pct, char auto_rearm);
+char capture_auto_rearm(void);
+int capture_rearm(void);                // wait for the next trigger, with the same settings. Returns 0 if ok
+uint32_t capture_triggers(void);        // windows captured since the trigger was set
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CAPTURE_HEADER_FILE_H */
@@ -0,0 +1,158 @@
+// cloud streaming
+// rev 1 - samples are taken by an esp_timer, and forwarded by a low priority task
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "miniexp.h"
+#include "acq.h"
+#include "telemetry.h"
+#include "flashring.h"
+#include "cloudstream.h"
+#include "memstat.h"
+
+typedef struct cstream_sample_s {
+    uint8_t mask;
+    uint16_t raw[CHAN_MAX];
+} cstream_sample_t;
+
+extern QueueHandle_t iotq;
+
+static esp_timer_handle_t cstream_timer;
+static QueueHandle_t cstream_buf;
+static StaticQueue_t cstream_buf_q;
+static uint8_t cstream_buf_store[CSTREAM_BUF_LEN*sizeof(cstream_sample_t)];
+static TaskHandle_t cstream_task_handle;
+static StackType_t cstream_stack[CSTREAM_TASK_STACK];
+static StaticTask_t cstream_tcb;
+static volatile char cstream_state=0;
+static uint32_t cstream_period_ms=0;
+static uint8_t cstream_mask=0;
+static cstream_stats_t cstream_stats;
+static acq_reader_t cstream_reader;     // filters run at the streaming rate
+
+
+void cstream_callback(void* arg)
+{
+    int i;
+    cstream_sample_t samp;
+    cstream_sample_t old;
+    if (cstream_state==0)
+        return;
+    samp.mask=cstream_mask;
+    for (i=0; i<CHAN_MAX; i++) {
+        if (samp.mask & (0x01<<i))
+            samp.raw[i]=acq_read(&cstream_reader, i, ACQ_CACHE_USEC); // shares conversions with the Casio links
+        else
+            samp.raw[i]=0;
+    }
+    cstream_stats.samples++;
+    if (xQueueSend(cstream_buf, &samp, 0)!=pdTRUE) {
+        // full, so discard the oldest sample to make room
+        if (xQueueReceive(cstream_buf, &old, 0)==pdTRUE)
+            cstream_stats.dropped++;
+        xQueueSend(cstream_buf, &samp, 0);
+    }
+    xTaskNotifyGive(cstream_task_handle);
+}
+
+// moves samples from the buffer to the telemetry aggregator, whenever iotq has room
+static void cstream_task(void *pvParameters)
+{
+    int i;
+    cstream_sample_t samp;
+    for(;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (uxQueueMessagesWaiting(cstream_buf)>0) {
+            if ((fring_online()) && (uxQueueSpacesAvailable(iotq)==0)) {
+                // network is behind. Leave the samples buffered, the oldest are dropped if it stays that way
+                cstream_stats.stalls++;
+                vTaskDelay(100 / portTICK_PERIOD_MS);
+                continue;
+            }
+            if (xQueueReceive(cstream_buf, &samp, 0)!=pdTRUE)
+                break;
+            for (i=0; i<CHAN_MAX; i++) {
+                if (samp.mask & (0x01<<i))
+                    telemetry_add(i, raw_to_volts(samp.raw[i]));
+            }
+            cstream_stats.forwarded++;
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+void cloudstream_init(void)
+{
+    const esp_timer_create_args_t cstream_timer_args = {
+        .callback = &cstream_callback,
+        .name = "cloudstream"
+    };
+    memset(&cstream_stats, 0, sizeof(cstream_stats_t));
+    acq_reader_init(&cstream_reader);
+    cstream_buf = xQueueCreateStatic(CSTREAM_BUF_LEN, sizeof(cstream_sample_t), cstream_buf_store, &cstream_buf_q);
+    ESP_ERROR_CHECK(esp_timer_create(&cstream_timer_args, &cstream_timer));
+    cstream_task_handle = mem_task_create(cstream_task, "cloudstream", CSTREAM_TASK_STACK, NULL, CSTREAM_TASK_PRIORITY, cstream_stack, &cstream_tcb);
+    mem_static_add("telemetry", sizeof(cstream_buf_q) + sizeof(cstream_buf_store) + sizeof(cstream_stack) + sizeof(cstream_tcb) + sizeof(cstream_reader));
+}
+
+int cloudstream_start(uint32_t period_ms, uint8_t chanmask)
+{
+    int i;
+    chanmask=chanmask & ((0x01<<CHAN_MAX)-1);
+    if (chanmask==0) {
+        printf("cloudstream: no channels selected\r\n");
+        return(-1);
+    }
+    for (i=0; i<CHAN_MAX; i++) {
+        if ((chanmask & (0x01<<i)) && acq_pin_is_digital(i)) {
+            printf("cloudstream: channel %d is a pulse counter or logic input\r\n", i+1);
+            return(-1);
+        }
+    }
+    if (period_ms<CSTREAM_MIN_PERIOD_MS) {
+        printf("cloudstream: period %u msec is too short\r\n", period_ms);
+        return(-1);
+    }
+    cloudstream_stop();
+    memset(&cstream_stats, 0, sizeof(cstream_stats_t));
+    cstream_period_ms=period_ms;
+    cstream_mask=chanmask;
+    acq_reader_restart(&cstream_reader);
+    cstream_state=1;
+    ESP_ERROR_CHECK(esp_timer_start_periodic(cstream_timer, (uint64_t)period_ms * 1000));
+    return(0);
+}
+
+void cloudstream_stop(void)
+{
+    if (cstream_state) {
+        esp_timer_stop(cstream_timer);
+        cstream_state=0;
+    }
+}
+
+char cloudstream_active(void)
+{
+    return(cstream_state);
+}
+
+uint32_t cloudstream_period(void)
+{
+    return(cstream_period_ms);
+}
+
+uint8_t cloudstream_chanmask(void)
+{
+    return(cstream_mask);
+}
+
+void cloudstream_get_stats(cstream_stats_t* stats)
+{
+    memcpy(stats, &cstream_stats, sizeof(cstream_stats_t));
+}
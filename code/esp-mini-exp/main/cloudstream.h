@@ -0,0 +1,43 @@
+
+#ifndef _CLOUDSTREAM_HEADER_FILE_H
+#define _CLOUDSTREAM_HEADER_FILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// cloud streaming
+// Samples channels at a set rate, independently of the calculator, and
+// forwards them to IoT Central through the telemetry aggregator (or to the
+// flash ring, while WiFi is down). Samples wait in a drop-oldest buffer for
+// a low priority task, so a stalled network never delays the Casio links.
+
+#define CSTREAM_BUF_LEN 64          // samples held while the network is slow
+#define CSTREAM_MIN_PERIOD_MS 10
+#define CSTREAM_TASK_PRIORITY 2     // below the Casio UART tasks (12) and azure_task (5)
+#define CSTREAM_TASK_STACK (1024*4)
+
+typedef struct cstream_stats_s {
+    uint32_t samples;       // samples taken
+    uint32_t forwarded;     // samples passed on to the telemetry aggregator
+    uint32_t dropped;       // oldest samples discarded because the buffer was full
+    uint32_t stalls;        // times the task waited for iotq to have space
+} cstream_stats_t;
+
+void cloudstream_init(void);
+int cloudstream_start(uint32_t period_ms, uint8_t chanmask); // returns 0 on success
+void cloudstream_stop(void);
+char cloudstream_active(void);
+uint32_t cloudstream_period(void);
+uint8_t cloudstream_chanmask(void);
+void cloudstream_get_stats(cstream_stats_t* stats);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLOUDSTREAM_HEADER_FILE_H */
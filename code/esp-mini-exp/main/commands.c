@@ -25,6 +25,20 @@
 
 #include "nvs_flash.h"
 #include "timerfunc.h"
+#include "miniexp.h"
+#include "telemetry.h"
+#include "cloudstream.h"
+#include "flashring.h"
+#include "acq.h"
+#include "datalog.h"
+#include "fft.h"
+#include "filter.h"
+#include "logic.h"
+#include "wavegen.h"
+#include "prof.h"
+#include "memstat.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
 
 #define STORAGE_NAMESPACE "storage"
 
@@ -174,6 +188,226 @@ void register_iot_cmd(void)
     ESP_ERROR_CHECK( esp_console_cmd_register(&iot_cmd) );
 }
 
+// ***** pll *****
+// example: pll stats
+
+static struct {
+    struct arg_str *action;
+    struct arg_end *end;
+} pll_args;
+
+static int pll_cmd(int argc, char **argv)
+{
+    int n;
+    sample_pll_stats_t st;
+    int nerrors = arg_parse(argc, argv, (void **) &pll_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, pll_args.end, argv[0]);
+        return 1;
+    }
+    if (strcmp(pll_args.action->sval[0], "on")==0) {
+        sample_pll_enabled=1;
+        printf("Phase-locked sampling enabled for real-time mode\r\n");
+    } else if (strcmp(pll_args.action->sval[0], "off")==0) {
+        sample_pll_enabled=0;
+        printf("Phase-locked sampling disabled\r\n");
+    } else {
+        printf("pll %s\r\n", sample_pll_enabled ? "enabled" : "disabled");
+        for (n=0; n<LINK_MAX; n++) {
+            sample_pll_get_stats(&casio_links[n].samp, &st);
+            printf("link %d: %s\r\n", n, sample_pll_active(&casio_links[n].samp) ? "running" : "stopped");
+            printf("  polls %u, late %u, relocks %u\r\n", st.polls, st.late, st.relocks);
+            printf("  period %u usec, drift %d ppm\r\n", st.period_usec, st.drift_ppm);
+            printf("  phase error last %d, avg %u, max %u usec\r\n", st.phase_err_usec, st.phase_err_avg_usec, st.phase_err_max_usec);
+            printf("  sample age avg %u, max %u usec\r\n", st.age_avg_usec, st.age_max_usec);
+        }
+    }
+    return 0;
+}
+
+void register_pll_cmd(void)
+{
+    pll_args.action = arg_str1(NULL, NULL, "<on|off|stats>", "enable, disable or show statistics");
+    pll_args.end = arg_end(1);
+
+    const esp_console_cmd_t pll_cmd_def = {
+        .command = "pll",
+        .help = "Phase-locked real-time sampling",
+        .hint = NULL,
+        .func = &pll_cmd,
+        .argtable = &pll_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&pll_cmd_def) );
+}
+
+// ***** telem *****
+// example: telem flush 2000, telem size 128, telem format cbor, telem bench, telem stats, telem clear
+
+static struct {
+    struct arg_str *action;
+    struct arg_str *value;
+    struct arg_end *end;
+} telem_args;
+
+static int telem_cmd(int argc, char **argv)
+{
+    telem_stats_t st;
+    telem_bench_t b;
+    int nerrors = arg_parse(argc, argv, (void **) &telem_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, telem_args.end, argv[0]);
+        return 1;
+    }
+    if ((strcmp(telem_args.action->sval[0], "flush")==0) && (telem_args.value->count>0)) {
+        telemetry_set_flush_ms((uint32_t)atoi(telem_args.value->sval[0]));
+        printf("Telemetry flush interval %u msec\r\n", telemetry_get_flush_ms());
+    } else if ((strcmp(telem_args.action->sval[0], "size")==0) && (telem_args.value->count>0)) {
+        telemetry_set_size((uint16_t)atoi(telem_args.value->sval[0]));
+        printf("Telemetry message size limit %u bytes\r\n", telemetry_get_size());
+    } else if ((strcmp(telem_args.action->sval[0], "format")==0) && (telem_args.value->count>0)) {
+        telemetry_set_format((strcmp(telem_args.value->sval[0], "cbor")==0) ? TELEM_FMT_CBOR : TELEM_FMT_JSON);
+        printf("Telemetry format %s\r\n", (telemetry_get_format()==TELEM_FMT_CBOR) ? "cbor" : "json");
+    } else if (strcmp(telem_args.action->sval[0], "bench")==0) {
+        telemetry_bench(&b);
+        printf("%u values, 3 channels\r\n", b.samples);
+        printf("json: %u bytes (%u.%02u per value), %u cycles per value\r\n", b.json_bytes,
+            b.json_bytes/b.samples, ((b.json_bytes*100)/b.samples)%100, b.json_cycles_per_sample);
+        printf("cbor: %u bytes as sent (%u.%02u per value), %u bytes binary (%u.%02u per value), %u cycles per value\r\n", b.cbor_bytes,
+            b.cbor_bytes/b.samples, ((b.cbor_bytes*100)/b.samples)%100, b.cbor_raw_bytes,
+            b.cbor_raw_bytes/b.samples, ((b.cbor_raw_bytes*100)/b.samples)%100, b.cbor_cycles_per_sample);
+    } else if (strcmp(telem_args.action->sval[0], "clear")==0) {
+        telemetry_clear_stats();
+    } else {
+        telemetry_get_stats(&st);
+        printf("%s, flush every %u msec, up to %u bytes\r\n", (telemetry_get_format()==TELEM_FMT_CBOR) ? "cbor" : "json", telemetry_get_flush_ms(), telemetry_get_size());
+        printf("values %u, messages %u, bytes %u\r\n", st.values, st.msgs, st.bytes);
+        if (st.values>0) {
+            printf("messages per 100 values %u, bytes per value %u\r\n", (st.msgs*100)/st.values, st.bytes/st.values);
+        }
+        printf("size limit reached %u times\r\n", st.size_flushes);
+        printf("stored in flash while offline %u\r\n", st.stored);
+        printf("queue full: dropped %u messages, %u values; max queued %u of %d\r\n", st.dropped_msgs, st.dropped_values, st.queue_max, TELEM_QUEUE_LEN);
+    }
+    return 0;
+}
+
+void register_telem_cmd(void)
+{
+    telem_args.action = arg_str1(NULL, NULL, "<flush|size|format|bench|stats|clear>", "set flush interval (msec), size limit (bytes) or format (json or cbor), or compare formats, or show statistics");
+    telem_args.value = arg_str0(NULL, NULL, "<value>", "value");
+    telem_args.end = arg_end(2);
+
+    const esp_console_cmd_t telem_cmd_def = {
+        .command = "telem",
+        .help = "Batched telemetry to IoT Central",
+        .hint = NULL,
+        .func = &telem_cmd,
+        .argtable = &telem_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&telem_cmd_def) );
+}
+
+// ***** cloud *****
+// example: cloud 100 7 streams channels 1, 2 and 3 every 100 msec. cloud stop, cloud stats
+
+static struct {
+    struct arg_str *action;
+    struct arg_int *mask;
+    struct arg_end *end;
+} cloud_args;
+
+static int cloud_cmd(int argc, char **argv)
+{
+    cstream_stats_t st;
+    int period;
+    int nerrors = arg_parse(argc, argv, (void **) &cloud_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, cloud_args.end, argv[0]);
+        return 1;
+    }
+    if (strcmp(cloud_args.action->sval[0], "stop")==0) {
+        cloudstream_stop();
+        printf("Cloud streaming stopped\r\n");
+    } else if (strcmp(cloud_args.action->sval[0], "stats")==0) {
+        cloudstream_get_stats(&st);
+        if (cloudstream_active()) {
+            printf("streaming every %u msec, channel mask 0x%02x\r\n", cloudstream_period(), cloudstream_chanmask());
+        } else {
+            printf("stopped\r\n");
+        }
+        printf("samples %u, forwarded %u, dropped %u, stalls %u\r\n", st.samples, st.forwarded, st.dropped, st.stalls);
+    } else {
+        period=atoi(cloud_args.action->sval[0]);
+        if (cloudstream_start((uint32_t)period, (cloud_args.mask->count>0) ? (uint8_t)cloud_args.mask->ival[0] : 1)==0) {
+            printf("Streaming to IoT Central every %d msec\r\n", period);
+        }
+    }
+    return 0;
+}
+
+void register_cloud_cmd(void)
+{
+    cloud_args.action = arg_str1(NULL, NULL, "<msec|stop|stats>", "sample period in msec, or stop, or show statistics");
+    cloud_args.mask = arg_int0(NULL, NULL, "<mask>", "channel mask, 1 = channel 1, 2 = channel 2, 4 = channel 3");
+    cloud_args.end = arg_end(2);
+
+    const esp_console_cmd_t cloud_cmd_def = {
+        .command = "cloud",
+        .help = "Stream samples to IoT Central",
+        .hint = NULL,
+        .func = &cloud_cmd,
+        .argtable = &cloud_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cloud_cmd_def) );
+}
+
+// ***** backlog *****
+// example: backlog stats, backlog erase
+
+static struct {
+    struct arg_str *action;
+    struct arg_end *end;
+} backlog_args;
+
+static int backlog_cmd(int argc, char **argv)
+{
+    fring_stats_t st;
+    int nerrors = arg_parse(argc, argv, (void **) &backlog_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, backlog_args.end, argv[0]);
+        return 1;
+    }
+    if (strcmp(backlog_args.action->sval[0], "erase")==0) {
+        fring_erase();
+        printf("Telemetry backlog erased\r\n");
+    } else {
+        fring_get_stats(&st);
+        printf("%s, %u sectors\r\n", fring_online() ? "online" : "offline", st.sectors);
+        printf("pending %u, stored %u, sent %u\r\n", st.pending, st.stored, st.sent);
+        printf("lost %u, corrupt %u, next sequence number %u\r\n", st.lost, st.corrupt, st.next_seq);
+    }
+    return 0;
+}
+
+void register_backlog_cmd(void)
+{
+    backlog_args.action = arg_str1(NULL, NULL, "<stats|erase>", "show the flash backlog, or discard it");
+    backlog_args.end = arg_end(1);
+
+    const esp_console_cmd_t backlog_cmd_def = {
+        .command = "backlog",
+        .help = "Telemetry stored in flash while offline",
+        .hint = NULL,
+        .func = &backlog_cmd,
+        .argtable = &backlog_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&backlog_cmd_def) );
+}
+
 // ************ initialize console ********************
 void initialize_console(void)
 {
@@ -257,3 +491,523 @@ esp_err_t save_nvs_str(const char* name, char* buf, size_t maxsize)
     return ESP_OK;
 }
 
+
+// ***** log *****
+// example: log start 1000 3 logs channels 1 and 2 every second. log stop, log status, log dump 0 20
+
+static struct {
+    struct arg_str *action;
+    struct arg_int *arg1;
+    struct arg_int *arg2;
+    struct arg_end *end;
+} log_args;
+
+static int log_cmd(int argc, char **argv)
+{
+    dlog_status_t st;
+    uint32_t row, last;
+    uint16_t raw;
+    int i;
+    int nerrors = arg_parse(argc, argv, (void **) &log_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, log_args.end, argv[0]);
+        return 1;
+    }
+    datalog_get_status(&st);
+    if (strcmp(log_args.action->sval[0], "start")==0) {
+        if (log_args.arg1->count==0) {
+            printf("log start <msec> [mask]\r\n");
+            return 1;
+        }
+        if (datalog_start((uint32_t)log_args.arg1->ival[0], (log_args.arg2->count>0) ? (uint8_t)log_args.arg2->ival[0] : 1)==0) {
+            printf("Logging every %d msec\r\n", log_args.arg1->ival[0]);
+        }
+    } else if (strcmp(log_args.action->sval[0], "stop")==0) {
+        datalog_stop();
+        printf("Logging stopped\r\n");
+    } else if (strcmp(log_args.action->sval[0], "dump")==0) {
+        // CSV, the time is in seconds from the start of the log
+        row=(log_args.arg1->count>0) ? (uint32_t)log_args.arg1->ival[0] : 0;
+        last=st.rows;
+        if ((log_args.arg2->count>0) && (row+(uint32_t)log_args.arg2->ival[0]<last))
+            last=row+(uint32_t)log_args.arg2->ival[0];
+        printf("row,time");
+        for (i=0; i<DLOG_CHAN_MAX; i++) {
+            if (st.chanmask & (0x01<<i)) printf(",ch%d", i+1);
+        }
+        printf("\r\n");
+        for (; row<last; row++) {
+            printf("%u,%.3f", row, datalog_row_time(row));
+            for (i=0; i<DLOG_CHAN_MAX; i++) {
+                if ((st.chanmask & (0x01<<i))==0) continue;
+                if (datalog_get_raw(row, i, &raw)==0)
+                    printf(",%.3f", raw_to_volts(raw));
+                else
+                    printf(",");
+            }
+            printf("\r\n");
+        }
+    } else {
+        printf("%s\r\n", (st.state==DLOG_LOGGING) ? "logging" : ((st.state==DLOG_FULL) ? "stopped, filesystem full" : "idle"));
+        printf("rows %u, blocks %u, every %u msec, channel mask 0x%02x\r\n", st.rows, st.blocks, st.period_ms, st.chanmask);
+        printf("dropped %u, started at %llu msec (Unix time, 0 if the clock wasn't set)\r\n", st.dropped, st.start_ms);
+    }
+    return 0;
+}
+
+void register_log_cmd(void)
+{
+    log_args.action = arg_str1(NULL, NULL, "<start|stop|status|dump>", "start logging, stop, show the log status, or print it as CSV");
+    log_args.arg1 = arg_int0(NULL, NULL, "<msec|from>", "period in msec for start, first row for dump");
+    log_args.arg2 = arg_int0(NULL, NULL, "<mask|count>", "channel mask for start, number of rows for dump");
+    log_args.end = arg_end(3);
+
+    const esp_console_cmd_t log_cmd_def = {
+        .command = "log",
+        .help = "Log samples to flash",
+        .hint = NULL,
+        .func = &log_cmd,
+        .argtable = &log_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&log_cmd_def) );
+}
+
+// ***** fft *****
+// example: fft 1 4 shows the 4 strongest frequencies in the channel 1 capture. fft bench
+
+static struct {
+    struct arg_str *action;
+    struct arg_int *peaks;
+    struct arg_end *end;
+} fft_args;
+
+static int fft_cmd(int argc, char **argv)
+{
+    fft_bench_t b;
+    fft_peak_t pk[FFT_PEAKS_MAX];
+    int i, n;
+    int nerrors = arg_parse(argc, argv, (void **) &fft_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, fft_args.end, argv[0]);
+        return 1;
+    }
+    if (strcmp(fft_args.action->sval[0], "bench")==0) {
+        fft_bench(&b);
+        printf("%u point Q15 FFT: %u cycles\r\n", b.n, b.cycles);
+        if (b.dsp_cycles>0) printf("%u point esp-dsp FFT: %u cycles\r\n", b.n, b.dsp_cycles);
+        printf("%d point accuracy against double precision: SNR %.1f dB\r\n", FFT_BENCH_N, b.snr_db);
+        return 0;
+    }
+    if (fft_capture(atoi(fft_args.action->sval[0])-1, NULL, NULL)<0) {
+        printf("No capture for that channel\r\n");
+        return 1;
+    }
+    n=fft_peaks((fft_args.peaks->count>0) ? fft_args.peaks->ival[0] : 1, pk);
+    printf("%d bins, %.3f Hz each\r\n", fft_bins(), fft_bin_freq(1));
+    for (i=0; i<n; i++) {
+        printf("%.3f Hz, %.4f V\r\n", pk[i].freq, pk[i].amp);
+    }
+    return 0;
+}
+
+void register_fft_cmd(void)
+{
+    fft_args.action = arg_str1(NULL, NULL, "<chan|bench>", "captured channel to analyse, or time the FFT");
+    fft_args.peaks = arg_int0(NULL, NULL, "<peaks>", "number of peaks to show");
+    fft_args.end = arg_end(2);
+
+    const esp_console_cmd_t fft_cmd_def = {
+        .command = "fft",
+        .help = "Spectrum of the last capture",
+        .hint = NULL,
+        .func = &fft_cmd,
+        .argtable = &fft_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&fft_cmd_def) );
+}
+
+// ***** filter *****
+// example: filter 1 lowpass 0.05 adds a low-pass stage to channel 1, with a cutoff of 1/20 of the sample rate.
+// filter 1 list, filter 1 clear, filter 0 bench
+
+static struct {
+    struct arg_int *chan;
+    struct arg_str *action;
+    struct arg_dbl *p1;
+    struct arg_dbl *p2;
+    struct arg_end *end;
+} filter_args;
+
+#define FILT_BENCH_SAMPLES 1000
+
+static int filter_cmd(int argc, char **argv)
+{
+    filt_chain_t c;
+    int i;
+    int type;
+    int chan;
+    int64_t t;
+    int nerrors = arg_parse(argc, argv, (void **) &filter_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, filter_args.end, argv[0]);
+        return 1;
+    }
+    chan=filter_args.chan->ival[0]-1;
+    if (strcmp(filter_args.action->sval[0], "bench")==0) {
+        // cycles per sample for one stage of each type, on a made up signal
+        for (type=1; type<=FILT_TYPE_MAX; type++) {
+            filter_clear(&c);
+            filter_add(&c, type, (type==FILT_MAVG) ? FILT_TAPS_MAX : 0.05, (type==FILT_FIR) ? FILT_TAPS_MAX : 0.0);
+            t=esp_timer_get_time();
+            for (i=0; i<FILT_BENCH_SAMPLES; i++) {
+                filter_run(&c, (uint16_t)((i*37) & 0xfff));
+            }
+            t=esp_timer_get_time()-t;
+            printf("%-8s %u cycles per sample\r\n", filter_name(type), (uint32_t)((t * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ) / FILT_BENCH_SAMPLES));
+        }
+        return 0;
+    }
+    if ((chan<0) || (chan>=CHAN_MAX)) {
+        printf("Channel should be 1 to %d\r\n", CHAN_MAX);
+        return 1;
+    }
+    if (strcmp(filter_args.action->sval[0], "clear")==0) {
+        acq_filter_clear(chan);
+        printf("Channel %d filters removed\r\n", chan+1);
+        return 0;
+    }
+    if (strcmp(filter_args.action->sval[0], "list")!=0) {
+        for (type=1; type<=FILT_TYPE_MAX; type++) {
+            if (strcmp(filter_args.action->sval[0], filter_name(type))==0) break;
+        }
+        if ((type>FILT_TYPE_MAX) || (filter_args.p1->count==0) ||
+            (acq_filter_add(chan, type, filter_args.p1->dval[0], (filter_args.p2->count>0) ? filter_args.p2->dval[0] : 0.0)!=0)) {
+            printf("Can't add that filter\r\n");
+            return 1;
+        }
+    }
+    acq_filter_get(chan, &c);
+    printf("Channel %d, %d stages\r\n", chan+1, c.nstages);
+    for (i=0; i<c.nstages; i++) {
+        printf("%d: %s %g %g\r\n", i+1, filter_name(c.stage[i].type), c.stage[i].p1, c.stage[i].p2);
+    }
+    return 0;
+}
+
+void register_filter_cmd(void)
+{
+    filter_args.chan = arg_int1(NULL, NULL, "<chan>", "channel 1 to 3");
+    filter_args.action = arg_str1(NULL, NULL, "<mavg|iir|lowpass|highpass|fir|list|clear|bench>", "stage to add, or list, clear or time the stages");
+    filter_args.p1 = arg_dbl0(NULL, NULL, "<p1>", "samples for mavg, otherwise the cutoff as a fraction of the sample rate");
+    filter_args.p2 = arg_dbl0(NULL, NULL, "<p2>", "Q for lowpass and highpass, taps for fir");
+    filter_args.end = arg_end(4);
+
+    const esp_console_cmd_t filter_cmd_def = {
+        .command = "filter",
+        .help = "Filter chain for a channel",
+        .hint = NULL,
+        .func = &filter_cmd,
+        .argtable = &filter_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&filter_cmd_def) );
+}
+
+// virtual channels
+// vchan 4 "ch1-ch2", vchan 5 "(ch1+ch2)*0.5", vchan 6 "d(ch1)", vchan 7 "i(ch2)",
+// vchan 4 clear, vchan 0 list
+
+static struct {
+    struct arg_int *chan;
+    struct arg_str *expr;
+    struct arg_end *end;
+} vchan_args;
+
+static int vchan_cmd(int argc, char **argv)
+{
+    int i;
+    int v;
+    int nerrors = arg_parse(argc, argv, (void **) &vchan_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, vchan_args.end, argv[0]);
+        return 1;
+    }
+    v=vchan_args.chan->ival[0]-VCHAN_FIRST;
+    if (strcmp(vchan_args.expr->sval[0], "list")==0) {
+        for (i=0; i<VCHAN_MAX; i++) {
+            printf("CH%d: %s\r\n", i+VCHAN_FIRST, vchan_defined(i) ? vchan_expr(i) : "-");
+        }
+        return 0;
+    }
+    if ((v<0) || (v>=VCHAN_MAX)) {
+        printf("Channel should be %d to %d\r\n", VCHAN_FIRST, VCHAN_FIRST+VCHAN_MAX-1);
+        return 1;
+    }
+    if (strcmp(vchan_args.expr->sval[0], "clear")==0) {
+        vchan_clear(v);
+        printf("CH%d removed\r\n", v+VCHAN_FIRST);
+        return 0;
+    }
+    if (vchan_define(v, vchan_args.expr->sval[0])!=0) {
+        printf("Can't use that expression\r\n");
+        return 1;
+    }
+    printf("CH%d: %s\r\n", v+VCHAN_FIRST, vchan_expr(v));
+    return 0;
+}
+
+void register_vchan_cmd(void)
+{
+    vchan_args.chan = arg_int1(NULL, NULL, "<chan>", "virtual channel 4 to 7");
+    vchan_args.expr = arg_str1(NULL, NULL, "<expr|clear|list>", "expression using ch1 to ch3, numbers, + - * / ( ), d() and i()");
+    vchan_args.end = arg_end(2);
+
+    const esp_console_cmd_t vchan_cmd_def = {
+        .command = "vchan",
+        .help = "Virtual channel computed from the other channels",
+        .hint = NULL,
+        .func = &vchan_cmd,
+        .argtable = &vchan_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&vchan_cmd_def) );
+}
+
+// ***** logic *****
+// example: logic start 7 100 25 records the edges on lines 1 to 3 for 100 msec, at a 25ns resolution.
+// logic stop, logic status, logic dump 1
+
+static struct {
+    struct arg_str *action;
+    struct arg_int *arg1;
+    struct arg_int *arg2;
+    struct arg_int *arg3;
+    struct arg_end *end;
+} logic_args;
+
+static int logic_cmd(int argc, char **argv)
+{
+    logic_status_t st;
+    int i, line;
+    int nerrors = arg_parse(argc, argv, (void **) &logic_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, logic_args.end, argv[0]);
+        return 1;
+    }
+    if (strcmp(logic_args.action->sval[0], "start")==0) {
+        if ((logic_args.arg1->count==0) || (logic_args.arg2->count==0)) {
+            printf("logic start <mask> <msec> [ns]\r\n");
+            return 1;
+        }
+        if (logic_start((uint8_t)logic_args.arg1->ival[0], (uint32_t)logic_args.arg2->ival[0],
+                (logic_args.arg3->count>0) ? logic_args.arg3->ival[0] : LOGIC_TICK_NS_DEFAULT)!=0) {
+            printf("Can't start the logic capture\r\n");
+            return 1;
+        }
+        logic_get_status(&st);
+        printf("Capturing lines 0x%02x for %u msec, resolution %.1f ns\r\n", st.linemask, st.window_ms, st.tick_ns);
+    } else if (strcmp(logic_args.action->sval[0], "stop")==0) {
+        logic_stop();
+    } else if (strcmp(logic_args.action->sval[0], "dump")==0) {
+        // CSV, the time is in usec from the start of the capture
+        printf("line,time,level\r\n");
+        for (line=0; line<LOGIC_LINES; line++) {
+            if ((logic_args.arg1->count>0) && (logic_args.arg1->ival[0]!=line+1)) continue;
+            for (i=0; i<logic_edges(line); i++) {
+                printf("%d,%.3f,%u\r\n", line+1, logic_edge_usec(line, i), logic_edge_level(line, i));
+            }
+        }
+    } else {
+        logic_get_status(&st);
+        printf("%s, lines 0x%02x, %u msec, resolution %.1f ns\r\n", (st.state==LOGIC_RUNNING) ? "capturing" : ((st.state==LOGIC_DONE) ? "done" : "idle"),
+            st.linemask, st.window_ms, st.tick_ns);
+        for (line=0; line<LOGIC_LINES; line++) {
+            if ((st.linemask & (0x01<<line))==0) continue;
+            printf("line %d: starts at %u, %u edges in %u bursts, %u lost\r\n", line+1, logic_initial_level(line), st.nedges[line], st.bursts[line], st.lost[line]);
+        }
+    }
+    return 0;
+}
+
+void register_logic_cmd(void)
+{
+    logic_args.action = arg_str1(NULL, NULL, "<start|stop|status|dump>", "start a capture, stop it, show the status, or print the edges as CSV");
+    logic_args.arg1 = arg_int0(NULL, NULL, "<mask|line>", "line mask for start (1 = line 1, 2 = line 2, 4 = line 3), line for dump (all if left out)");
+    logic_args.arg2 = arg_int0(NULL, NULL, "<msec>", "capture window for start");
+    logic_args.arg3 = arg_int0(NULL, NULL, "<ns>", "resolution for start, 13 to 3200 ns");
+    logic_args.end = arg_end(4);
+
+    const esp_console_cmd_t logic_cmd_def = {
+        .command = "logic",
+        .help = "Logic capture of the channel pins",
+        .hint = NULL,
+        .func = &logic_cmd,
+        .argtable = &logic_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&logic_cmd_def) );
+}
+
+// ***** wave *****
+// example: wave sine 100 1.0 1.65 plays a 100Hz sine wave of 1V peak around 1.65V on GPIO25 and GPIO26.
+// wave square 1000, wave play 500 3 plays the uploaded table at 500 values per second three times, wave stop, wave status
+
+static struct {
+    struct arg_str *action;
+    struct arg_dbl *p1;
+    struct arg_dbl *p2;
+    struct arg_dbl *p3;
+    struct arg_end *end;
+} wave_args;
+
+static int wave_cmd(int argc, char **argv)
+{
+    wave_status_t st;
+    int shape;
+    int nerrors = arg_parse(argc, argv, (void **) &wave_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, wave_args.end, argv[0]);
+        return 1;
+    }
+    if (strcmp(wave_args.action->sval[0], "stop")==0) {
+        wavegen_stop();
+        return 0;
+    }
+    if (strcmp(wave_args.action->sval[0], "play")==0) {
+        if ((wave_args.p1->count==0) ||
+            (wavegen_play(wave_args.p1->dval[0], (wave_args.p2->count>0) ? (uint32_t)wave_args.p2->dval[0] : 0)!=0)) {
+            printf("Can't play the waveform table\r\n");
+            return 1;
+        }
+    } else if (strcmp(wave_args.action->sval[0], "status")!=0) {
+        for (shape=WAVE_SINE; shape<=WAVE_SAW; shape++) {
+            if (strcmp(wave_args.action->sval[0], wavegen_shape_name(shape))==0) break;
+        }
+        if ((shape>WAVE_SAW) || (wave_args.p1->count==0) ||
+            (wavegen_shape(shape, wave_args.p1->dval[0], (wave_args.p2->count>0) ? wave_args.p2->dval[0] : 1.0,
+                (wave_args.p3->count>0) ? wave_args.p3->dval[0] : 1.65)!=0)) {
+            printf("Can't play that waveform\r\n");
+            return 1;
+        }
+    }
+    wavegen_get_status(&st);
+    printf("%s, %d values in the table, %.3f Hz, %u of %u cycles\r\n", st.playing ? "playing" : "stopped", st.len, st.freq, st.cycles, st.count);
+    return 0;
+}
+
+void register_wave_cmd(void)
+{
+    wave_args.action = arg_str1(NULL, NULL, "<sine|square|triangle|saw|play|stop|status>", "shape to play, play the uploaded table, stop or show the status");
+    wave_args.p1 = arg_dbl0(NULL, NULL, "<freq|rate>", "frequency in Hz for a shape, values per second for play");
+    wave_args.p2 = arg_dbl0(NULL, NULL, "<amp|count>", "peak in volts for a shape (1 if left out), times to play the table (0 is continuously)");
+    wave_args.p3 = arg_dbl0(NULL, NULL, "<offset>", "middle in volts for a shape (1.65 if left out)");
+    wave_args.end = arg_end(4);
+
+    const esp_console_cmd_t wave_cmd_def = {
+        .command = "wave",
+        .help = "Waveform generator on the DAC pins",
+        .hint = NULL,
+        .func = &wave_cmd,
+        .argtable = &wave_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&wave_cmd_def) );
+}
+
+// ***** prof *****
+// example: prof 1000 times each hot path 1000 times, with the flash cache warm and then evicted
+
+static struct {
+    struct arg_int *iterations;
+    struct arg_end *end;
+} prof_args;
+
+static int prof_cmd(int argc, char **argv)
+{
+    me_prof_t res[ME_PROF_PATHS];
+    char wifi_load;
+    int i, n;
+    int nerrors = arg_parse(argc, argv, (void **) &prof_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, prof_args.end, argv[0]);
+        return 1;
+    }
+    n = (prof_args.iterations->count>0) ? prof_args.iterations->ival[0] : 1000;
+    if ((n<1) || (n>PROF_ITER_MAX)) {
+        printf("Iterations must be 1 to %d\r\n", PROF_ITER_MAX);
+        return 1;
+    }
+#ifdef CONFIG_MINIEXP_HOT_IRAM
+    printf("Hot paths in IRAM, %d calls each\r\n", n);
+#else
+    printf("Hot paths in flash, %d calls each\r\n", n);
+#endif
+    n=me_profile(n, res, &wifi_load);
+    if (!wifi_load) printf("WiFi isn't running, the cold runs only evict the flash cache\r\n");
+    printf("path      warm min/avg/max cycles     cold min/avg/max cycles\r\n");
+    for (i=0; i<n; i++) {
+        printf("%-9s %7u %7u %7u     %7u %7u %7u\r\n", res[i].name,
+            res[i].warm.min, (uint32_t)(res[i].warm.total/res[i].warm.n), res[i].warm.max,
+            res[i].cold.min, (uint32_t)(res[i].cold.total/res[i].cold.n), res[i].cold.max);
+    }
+    return 0;
+}
+
+void register_prof_cmd(void)
+{
+    prof_args.iterations = arg_int0(NULL, NULL, "<iterations>", "calls of each path (1000 if left out)");
+    prof_args.end = arg_end(1);
+
+    const esp_console_cmd_t prof_cmd_def = {
+        .command = "prof",
+        .help = "Cycle counts of the sampling and protocol hot paths",
+        .hint = NULL,
+        .func = &prof_cmd,
+        .argtable = &prof_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&prof_cmd_def) );
+}
+
+// ***** mem *****
+// example: mem shows the heap, the stack each task has never used, and the static RAM of each subsystem
+
+static int mem_cmd(int argc, char **argv)
+{
+    const mem_task_t* tasks;
+    const mem_part_t* parts;
+    int i, n;
+    uint32_t total=0;
+    printf("heap: %u free, %u minimum free, %u largest block\r\n", heap_caps_get_free_size(MALLOC_CAP_8BIT),
+        heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT), heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    printf("internal RAM: %u free, %u minimum free\r\n", heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+        heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+    n=mem_get_tasks(&tasks);
+    printf("task             stack  never used\r\n");
+    for (i=0; i<n; i++) {
+        printf("%-16s %5u  %5u\r\n", pcTaskGetTaskName(tasks[i].handle), tasks[i].stack,
+            (uint32_t)uxTaskGetStackHighWaterMark(tasks[i].handle));
+    }
+    n=mem_get_parts(&parts);
+    printf("subsystem        static bytes\r\n");
+    for (i=0; i<n; i++) {
+        printf("%-16s %7u\r\n", parts[i].name, parts[i].bytes);
+        total+=parts[i].bytes;
+    }
+    printf("%-16s %7u\r\n", "total", total);
+    return 0;
+}
+
+void register_mem_cmd(void)
+{
+    const esp_console_cmd_t mem_cmd_def = {
+        .command = "mem",
+        .help = "Heap, task stack and static memory use",
+        .hint = NULL,
+        .func = &mem_cmd,
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&mem_cmd_def) );
+}
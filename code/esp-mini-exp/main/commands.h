@@ -19,6 +19,22 @@ void register_wifi(void);       // example: wifi myssid mypassword
 int get_iot_details(char* iotdev, char* iotscope, char* iotkey);
 void register_iot_cmd(void);    // example: iot mydeviceid myidscope mysaskey
 
+// sampling
+void register_pll_cmd(void);    // example: pll on, pll off, pll stats
+
+// telemetry
+void register_telem_cmd(void);  // example: telem flush 2000, telem size 128, telem format cbor, telem stats
+void register_cloud_cmd(void);  // example: cloud 100 7, cloud stop, cloud stats
+void register_backlog_cmd(void); // example: backlog stats, backlog erase
+void register_log_cmd(void);     // example: log start 1000 3, log stop, log status, log dump 0 20
+void register_fft_cmd(void);     // example: fft 1 4, fft bench
+void register_filter_cmd(void);  // example: filter 1 lowpass 0.05, filter 1 list, filter 1 clear, filter 0 bench
+void register_vchan_cmd(void);   // example: vchan 4 "ch1-ch2", vchan 5 "d(ch1)", vchan 4 clear, vchan 0 list
+void register_logic_cmd(void);   // example: logic start 7 100 25, logic stop, logic status, logic dump 1
+void register_wave_cmd(void);    // example: wave sine 100 1.0 1.65, wave play 500 3, wave stop, wave status
+void register_prof_cmd(void);    // example: prof 1000
+void register_mem_cmd(void);     // example: mem
+
 
 
 
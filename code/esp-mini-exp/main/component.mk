@@ -16,6 +16,24 @@ iotc/parson.o \
 maincode.o \
 commands.o \
 timerfunc.o \
+capture.o \
+acq.o \
+telemetry.o \
+telemcbor.o \
+cloudstream.o \
+flashring.o \
+fringcore.o \
+datalog.o \
+decimate.o \
+fft.o \
+fftq15.o \
+filter.o \
+vchan.o \
+counter.o \
+logic.o \
+wavegen.o \
+prof.o \
+memstat.o \
 miniexp.o \
 azure-iot-central.o
 
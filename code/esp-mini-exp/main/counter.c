@@ -0,0 +1,166 @@
+// pulse counting channels
+// rev 1 - frequency and edge count with the PCNT peripheral
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/pcnt.h"
+#include "driver/gpio.h"
+#include "miniexp.h"
+#include "acq.h"
+#include "counter.h"
+
+typedef struct counter_chan_s {
+    pcnt_unit_t unit;
+    int mode;
+    int owner;                      // link that set the channel up, -1 if it's off
+    volatile int64_t overflow;      // edges counted by the interrupt
+    int64_t last_total;             // for the frequency
+    int64_t last_time;
+    double freq;
+} counter_chan_t;
+
+static counter_chan_t counters[CHAN_MAX] = {
+    {PCNT_UNIT_0, COUNTER_OFF, -1, 0, 0, 0, 0.0},
+    {PCNT_UNIT_1, COUNTER_OFF, -1, 0, 0, 0, 0.0},
+    {PCNT_UNIT_2, COUNTER_OFF, -1, 0, 0, 0, 0.0}
+};
+static portMUX_TYPE counter_mux = portMUX_INITIALIZER_UNLOCKED;
+static portMUX_TYPE counter_freq_mux = portMUX_INITIALIZER_UNLOCKED; // the frequency gate, updated by every link that reads
+
+
+// the hardware count has reached COUNTER_HLIM and gone back to zero
+static void IRAM_ATTR counter_isr(void* arg)
+{
+    counter_chan_t* c=(counter_chan_t*)arg;
+    portENTER_CRITICAL_ISR(&counter_mux);
+    c->overflow+=COUNTER_HLIM;
+    portEXIT_CRITICAL_ISR(&counter_mux);
+}
+
+void counter_init(void)
+{
+    pcnt_isr_service_install(0);
+}
+
+int counter_enable(int chan, int mode, int owner)
+{
+    counter_chan_t* c;
+    pcnt_config_t cfg;
+    if ((chan<0) || (chan>=CHAN_MAX) || (mode<COUNTER_OFF) || (mode>COUNTER_COUNT))
+        return(-1);
+    c=&counters[chan];
+    if ((c->mode!=COUNTER_OFF) && (c->owner!=owner))
+        return((mode==COUNTER_OFF) ? 0 : -1); // in use by the other link, so leave it alone
+    if (c->mode!=COUNTER_OFF) {
+        pcnt_counter_pause(c->unit);
+        pcnt_isr_handler_remove(c->unit);
+    }
+    if (mode==COUNTER_OFF) {
+        if (c->mode!=COUNTER_OFF)
+            acq_pin_digital(chan, 0);
+        c->mode=COUNTER_OFF;
+        c->owner=-1;
+        return(0);
+    }
+    acq_pin_digital(chan, 1);
+    memset(&cfg, 0, sizeof(pcnt_config_t));
+    cfg.pulse_gpio_num=acq_chan_gpio(chan);
+    cfg.ctrl_gpio_num=PCNT_PIN_NOT_USED;
+    cfg.channel=PCNT_CHANNEL_0;
+    cfg.unit=c->unit;
+    cfg.pos_mode=PCNT_COUNT_INC;
+    cfg.neg_mode=PCNT_COUNT_DIS;
+    cfg.lctrl_mode=PCNT_MODE_KEEP;
+    cfg.hctrl_mode=PCNT_MODE_KEEP;
+    cfg.counter_h_lim=COUNTER_HLIM;
+    cfg.counter_l_lim=0;
+    if (pcnt_unit_config(&cfg)!=ESP_OK) {
+        printf("counter: can't set up channel %d\r\n", chan+1);
+        c->mode=COUNTER_OFF;
+        c->owner=-1;
+        return(-1);
+    }
+    gpio_set_pull_mode(acq_chan_gpio(chan), GPIO_FLOATING);
+    if (COUNTER_GLITCH_FILTER>0) {
+        pcnt_set_filter_value(c->unit, COUNTER_GLITCH_FILTER);
+        pcnt_filter_enable(c->unit);
+    } else {
+        pcnt_filter_disable(c->unit);
+    }
+    pcnt_event_enable(c->unit, PCNT_EVT_H_LIM);
+    pcnt_counter_pause(c->unit);
+    pcnt_counter_clear(c->unit);
+    c->overflow=0;
+    c->last_total=0;
+    c->last_time=esp_timer_get_time();
+    c->freq=0.0;
+    c->mode=mode;
+    c->owner=owner;
+    pcnt_isr_handler_add(c->unit, counter_isr, c);
+    pcnt_counter_resume(c->unit);
+    return(0);
+}
+
+ME_HOT int counter_mode(int chan)
+{
+    if ((chan<0) || (chan>=CHAN_MAX))
+        return(COUNTER_OFF);
+    return(counters[chan].mode);
+}
+
+ME_HOT int64_t counter_total(int chan)
+{
+    counter_chan_t* c;
+    int64_t ov1, ov2;
+    int16_t count=0;
+    if (counter_mode(chan)==COUNTER_OFF)
+        return(0);
+    c=&counters[chan];
+    // read again if the overflow interrupt happened in between
+    do {
+        portENTER_CRITICAL(&counter_mux);
+        ov1=c->overflow;
+        portEXIT_CRITICAL(&counter_mux);
+        pcnt_get_counter_value(c->unit, &count);
+        portENTER_CRITICAL(&counter_mux);
+        ov2=c->overflow;
+        portEXIT_CRITICAL(&counter_mux);
+    } while (ov1!=ov2);
+    return(ov1 + count);
+}
+
+ME_HOT double counter_read(int chan)
+{
+    counter_chan_t* c;
+    int64_t total;
+    int64_t now;
+    double freq;
+    switch(counter_mode(chan)) {
+        case COUNTER_COUNT:
+            total=counter_total(chan);
+            return((double)((total>COUNTER_COUNT_MAX) ? COUNTER_COUNT_MAX : total));
+        case COUNTER_HZ:
+        case COUNTER_KHZ:
+            c=&counters[chan];
+            total=counter_total(chan);
+            now=esp_timer_get_time();
+            // both links can read the channel, so the gate is updated by one at a time.
+            // A very short gate would give a coarse result, so keep the last one
+            portENTER_CRITICAL(&counter_freq_mux);
+            if (((now - c->last_time)>=COUNTER_GATE_MIN_USEC) && (total>=c->last_total)) {
+                c->freq=((double)(total - c->last_total)*1000000.0)/(now - c->last_time);
+                c->last_total=total;
+                c->last_time=now;
+            }
+            freq=c->freq;
+            portEXIT_CRITICAL(&counter_freq_mux);
+            return((c->mode==COUNTER_KHZ) ? freq/1000.0 : freq);
+        default:
+            return(0.0);
+    }
+}
@@ -0,0 +1,44 @@
+
+#ifndef _COUNTER_HEADER_FILE_H
+#define _COUNTER_HEADER_FILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// pulse counting channels
+// Any of the three channels can count rising edges on its input pin with the
+// ESP32 PCNT (pulse counter) peripheral, instead of measuring a voltage. Edges
+// are counted in hardware, and the CPU is only interrupted once every
+// COUNTER_HLIM edges to extend the 16-bit hardware count, so signals up to
+// several MHz can be counted at no cost per edge.
+// Pins are the same as for the ADC: channel 1 is IO34, channel 2 is IO35, channel 3 is IO33.
+// The input should be a 0 to 3.3V logic signal.
+
+#define COUNTER_HLIM 30000                // hardware count at which the overflow interrupt fires
+#define COUNTER_GATE_MIN_USEC 10000       // frequency is kept if read again sooner than this
+#define COUNTER_GLITCH_FILTER 0           // ignore pulses shorter than this many 80MHz cycles, 0 is off (max 1023)
+#define COUNTER_COUNT_MAX 999999          // counts are sent with six digits, so counter_read stops here
+
+#define COUNTER_OFF 0
+#define COUNTER_HZ 1                      // frequency since the previous reading
+#define COUNTER_KHZ 2                     // the same in kHz, for signals that need more than six digits in Hz
+#define COUNTER_COUNT 3                   // edges since the channel was set up
+
+void counter_init(void);
+// chan 0..2, COUNTER_OFF gives the pin back to the ADC. owner is the link id. A channel set up by one
+// link can't be changed or turned off by another. Returns 0 on success
+int counter_enable(int chan, int mode, int owner);
+int counter_mode(int chan);
+int64_t counter_total(int chan);          // edges since the channel was set up
+double counter_read(int chan);            // value for the mode, COUNTER_COUNT stops at COUNTER_COUNT_MAX
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _COUNTER_HEADER_FILE_H */
@@ -0,0 +1,441 @@
+// long-duration data logging
+// rev 1 - fixed-size blocks on a FAT filesystem, with a per-block index
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_vfs.h"
+#include "esp_vfs_fat.h"
+#include "miniexp.h"
+#include "acq.h"
+#include "datalog.h"
+#include "memstat.h"
+
+typedef struct dlog_qitem_s {
+    uint8_t block[DLOG_BLOCK_LEN];
+    dlog_index_t idx;
+} dlog_qitem_t;
+
+static wl_handle_t dlog_wl=WL_INVALID_HANDLE;
+static char dlog_mounted=0;
+static SemaphoreHandle_t dlog_lock;     // the block being filled
+static SemaphoreHandle_t dlog_flock;    // the files and the read cache
+static StaticSemaphore_t dlog_lock_buf;
+static StaticSemaphore_t dlog_flock_buf;
+static FILE* dlog_f=NULL;
+static FILE* dlog_fi=NULL;
+static esp_timer_handle_t dlog_timer;
+static QueueHandle_t dlog_q;
+static StaticQueue_t dlog_q_buf;
+static uint8_t dlog_q_store[DLOG_QUEUE_LEN*sizeof(dlog_qitem_t)];
+static StackType_t dlog_stack[DLOG_TASK_STACK];
+static StaticTask_t dlog_tcb;
+static volatile char dlog_state=DLOG_IDLE;
+static dlog_header_t dlog_hdr;          // magic is 0 if there is no log
+static int8_t dlog_chan_pos[DLOG_CHAN_MAX]; // position of each channel in a row, -1 if not logged
+static dlog_qitem_t dlog_cur;           // block being filled
+static uint32_t dlog_rows_total=0;      // rows logged, including those in dlog_cur
+static volatile uint32_t dlog_blocks_written=0;
+static int64_t dlog_t0_usec;
+static uint32_t dlog_dropped=0;
+static uint8_t dlog_rcache[DLOG_BLOCK_LEN];
+static int32_t dlog_rcache_block=-1;
+static dlog_qitem_t dlog_witem;         // only used by the writer task
+static acq_reader_t dlog_reader;        // filters run at the logging rate
+
+
+// samples are 12 bits, packed two into three bytes
+static void dlog_put(uint8_t* data, int k, uint16_t s)
+{
+    uint8_t* p=&data[(k/2)*3];
+    if ((k & 1)==0) {
+        p[0]=s & 0xff;
+        p[1]=(p[1] & 0xf0) | ((s>>8) & 0x0f);
+    } else {
+        p[1]=(p[1] & 0x0f) | ((s & 0x0f)<<4);
+        p[2]=(s>>4) & 0xff;
+    }
+}
+
+static uint16_t dlog_get(const uint8_t* data, int k)
+{
+    const uint8_t* p=&data[(k/2)*3];
+    if ((k & 1)==0)
+        return(p[0] | ((p[1] & 0x0f)<<8));
+    return((p[1]>>4) | (p[2]<<4));
+}
+
+static void dlog_set_chans(uint8_t chanmask)
+{
+    int i;
+    int n=0;
+    for (i=0; i<DLOG_CHAN_MAX; i++) {
+        if (chanmask & (0x01<<i)) {
+            dlog_chan_pos[i]=n;
+            n++;
+        } else {
+            dlog_chan_pos[i]=-1;
+        }
+    }
+}
+
+static void dlog_callback(void* arg)
+{
+    int i;
+    uint16_t raw[DLOG_CHAN_MAX];
+    dlog_block_hdr_t* bh=(dlog_block_hdr_t*)dlog_cur.block;
+    uint8_t* data=&dlog_cur.block[sizeof(dlog_block_hdr_t)];
+    int k;
+    if (dlog_state!=DLOG_LOGGING)
+        return;
+    for (i=0; i<DLOG_CHAN_MAX; i++) {
+        if (dlog_chan_pos[i]>=0)
+            raw[i]=acq_read(&dlog_reader, i, ACQ_CACHE_USEC);
+    }
+    xSemaphoreTake(dlog_lock, portMAX_DELAY);
+    if (bh->nrows==0) {
+        memset(&dlog_cur, 0, sizeof(dlog_qitem_t));
+        bh->magic=DLOG_BLOCK_MAGIC;
+        bh->first_row=dlog_rows_total;
+        bh->t_ms=(uint32_t)((esp_timer_get_time()-dlog_t0_usec)/1000);
+        dlog_cur.idx.first_row=bh->first_row;
+        dlog_cur.idx.t_ms=bh->t_ms;
+        for (i=0; i<DLOG_CHAN_MAX; i++) {
+            dlog_cur.idx.min[i]=0xffff;
+        }
+    }
+    k=bh->nrows * dlog_hdr.nchan;
+    for (i=0; i<DLOG_CHAN_MAX; i++) {
+        if (dlog_chan_pos[i]<0) continue;
+        dlog_put(data, k+dlog_chan_pos[i], raw[i]);
+        if (raw[i]<dlog_cur.idx.min[i]) dlog_cur.idx.min[i]=raw[i];
+        if (raw[i]>dlog_cur.idx.max[i]) dlog_cur.idx.max[i]=raw[i];
+    }
+    bh->nrows++;
+    dlog_cur.idx.nrows=bh->nrows;
+    dlog_rows_total++;
+    if (bh->nrows>=dlog_hdr.rows_per_block) {
+        if (xQueueSend(dlog_q, &dlog_cur, 0)!=pdTRUE) {
+            // the writer is behind, so this block is lost. Rows are renumbered, the block times show the gap
+            dlog_dropped+=bh->nrows;
+            dlog_rows_total-=bh->nrows;
+        }
+        bh->nrows=0;
+    }
+    xSemaphoreGive(dlog_lock);
+}
+
+// writes full blocks and their index entries
+static void dlog_task(void *pvParameters)
+{
+    size_t n1, n2;
+    for(;;) {
+        xQueueReceive(dlog_q, &dlog_witem, portMAX_DELAY);
+        xSemaphoreTake(dlog_flock, portMAX_DELAY);
+        n1=0;
+        n2=0;
+        if ((dlog_f!=NULL) && (dlog_fi!=NULL)) {
+            fseek(dlog_f, (long)(dlog_blocks_written+1) * DLOG_BLOCK_LEN, SEEK_SET);
+            n1=fwrite(dlog_witem.block, DLOG_BLOCK_LEN, 1, dlog_f);
+            fseek(dlog_fi, (long)dlog_blocks_written * sizeof(dlog_index_t), SEEK_SET);
+            n2=fwrite(&dlog_witem.idx, sizeof(dlog_index_t), 1, dlog_fi);
+            fflush(dlog_f);
+            fflush(dlog_fi);
+            fsync(fileno(dlog_f));
+            fsync(fileno(dlog_fi));
+        }
+        if ((n1==1) && (n2==1)) {
+            dlog_blocks_written++;
+        } else {
+            printf("datalog: write failed, filesystem full? Logging stopped\r\n");
+            esp_timer_stop(dlog_timer);
+            dlog_state=DLOG_FULL;
+            xSemaphoreTake(dlog_lock, portMAX_DELAY);
+            dlog_rows_total=dlog_blocks_written * dlog_hdr.rows_per_block;
+            ((dlog_block_hdr_t*)dlog_cur.block)->nrows=0;
+            xSemaphoreGive(dlog_lock);
+            xQueueReset(dlog_q);
+        }
+        xSemaphoreGive(dlog_flock);
+    }
+    vTaskDelete(NULL);
+}
+
+// open the log left from before a reset, so it can still be read
+static void dlog_open_existing(void)
+{
+    long size;
+    dlog_index_t idx;
+    memset(&dlog_hdr, 0, sizeof(dlog_header_t));
+    dlog_f=fopen(DLOG_FILE, "r+b");
+    dlog_fi=fopen(DLOG_INDEX_FILE, "r+b");
+    if ((dlog_f==NULL) || (dlog_fi==NULL) ||
+        (fread(&dlog_hdr, sizeof(dlog_header_t), 1, dlog_f)!=1) ||
+        (dlog_hdr.magic!=DLOG_MAGIC) || (dlog_hdr.version!=DLOG_VERSION) || (dlog_hdr.rows_per_block==0)) {
+        memset(&dlog_hdr, 0, sizeof(dlog_header_t));
+        return;
+    }
+    dlog_set_chans(dlog_hdr.chanmask);
+    fseek(dlog_fi, 0, SEEK_END);
+    size=ftell(dlog_fi);
+    dlog_blocks_written=size / sizeof(dlog_index_t);
+    fseek(dlog_f, 0, SEEK_END);
+    size=ftell(dlog_f);
+    if ((size / DLOG_BLOCK_LEN) < (long)(dlog_blocks_written+1))
+        dlog_blocks_written=(size / DLOG_BLOCK_LEN) - 1; // the index was written, but not its block
+    dlog_rows_total=0;
+    if (dlog_blocks_written>0) {
+        fseek(dlog_fi, (long)(dlog_blocks_written-1) * sizeof(dlog_index_t), SEEK_SET);
+        if (fread(&idx, sizeof(dlog_index_t), 1, dlog_fi)==1)
+            dlog_rows_total=idx.first_row + idx.nrows;
+    }
+    printf("datalog: found a log of %u rows\r\n", dlog_rows_total);
+}
+
+void datalog_init(void)
+{
+    esp_err_t err;
+    const esp_vfs_fat_mount_config_t mount_config = {
+        .format_if_mount_failed = true,
+        .max_files = 4,
+        .allocation_unit_size = CONFIG_WL_SECTOR_SIZE
+    };
+    const esp_timer_create_args_t dlog_timer_args = {
+        .callback = &dlog_callback,
+        .name = "datalog"
+    };
+    memset(&dlog_hdr, 0, sizeof(dlog_header_t));
+    memset(&dlog_cur, 0, sizeof(dlog_qitem_t));
+    acq_reader_init(&dlog_reader);
+    dlog_lock=xSemaphoreCreateMutexStatic(&dlog_lock_buf);
+    dlog_flock=xSemaphoreCreateMutexStatic(&dlog_flock_buf);
+    dlog_q=xQueueCreateStatic(DLOG_QUEUE_LEN, sizeof(dlog_qitem_t), dlog_q_store, &dlog_q_buf);
+    mem_static_add("datalog", sizeof(dlog_lock_buf) + sizeof(dlog_flock_buf) + sizeof(dlog_q_buf) + sizeof(dlog_q_store)
+        + sizeof(dlog_cur) + sizeof(dlog_witem) + sizeof(dlog_rcache) + sizeof(dlog_stack) + sizeof(dlog_tcb) + sizeof(dlog_reader));
+    ESP_ERROR_CHECK(esp_timer_create(&dlog_timer_args, &dlog_timer));
+    err=esp_vfs_fat_spiflash_mount(DLOG_MOUNT, DLOG_PART_LABEL, &mount_config, &dlog_wl);
+    if (err!=ESP_OK) {
+        printf("datalog: can't mount the %s partition (%s), logging is disabled\r\n", DLOG_PART_LABEL, esp_err_to_name(err));
+        return;
+    }
+    dlog_mounted=1;
+    dlog_open_existing();
+    mem_task_create(dlog_task, "datalog", DLOG_TASK_STACK, NULL, DLOG_TASK_PRIORITY, dlog_stack, &dlog_tcb);
+}
+
+int datalog_start(uint32_t period_ms, uint8_t chanmask)
+{
+    int i;
+    int nchan=0;
+    struct timeval tv;
+    uint8_t block[DLOG_BLOCK_LEN];
+    if (!dlog_mounted) {
+        printf("datalog: no filesystem\r\n");
+        return(-1);
+    }
+    chanmask=chanmask & ((0x01<<DLOG_CHAN_MAX)-1);
+    for (i=0; i<DLOG_CHAN_MAX; i++) {
+        if (chanmask & (0x01<<i)) nchan++;
+        if ((chanmask & (0x01<<i)) && acq_pin_is_digital(i)) {
+            printf("datalog: channel %d is a pulse counter or logic input\r\n", i+1);
+            return(-1);
+        }
+    }
+    if (nchan==0) {
+        printf("datalog: no channels selected\r\n");
+        return(-1);
+    }
+    if (period_ms<DLOG_MIN_PERIOD_MS) {
+        printf("datalog: period %u msec is too short\r\n", period_ms);
+        return(-1);
+    }
+    datalog_stop();
+    xSemaphoreTake(dlog_flock, portMAX_DELAY);
+    if (dlog_f!=NULL) fclose(dlog_f);
+    if (dlog_fi!=NULL) fclose(dlog_fi);
+    dlog_f=fopen(DLOG_FILE, "w+b");
+    dlog_fi=fopen(DLOG_INDEX_FILE, "w+b");
+    if ((dlog_f==NULL) || (dlog_fi==NULL)) {
+        printf("datalog: can't create the log files\r\n");
+        memset(&dlog_hdr, 0, sizeof(dlog_header_t));
+        xSemaphoreGive(dlog_flock);
+        return(-1);
+    }
+    memset(&dlog_hdr, 0, sizeof(dlog_header_t));
+    dlog_hdr.magic=DLOG_MAGIC;
+    dlog_hdr.version=DLOG_VERSION;
+    dlog_hdr.period_ms=period_ms;
+    dlog_hdr.chanmask=chanmask;
+    dlog_hdr.nchan=nchan;
+    dlog_hdr.rows_per_block=DLOG_BLOCK_SAMPLES / nchan;
+    if (get_year()!=0) {
+        gettimeofday(&tv, NULL);
+        dlog_hdr.start_ms=(uint64_t)tv.tv_sec*1000 + tv.tv_usec/1000;
+    }
+    memset(block, 0xff, sizeof(block));
+    memcpy(block, &dlog_hdr, sizeof(dlog_header_t));
+    fwrite(block, DLOG_BLOCK_LEN, 1, dlog_f);
+    fflush(dlog_f);
+    dlog_set_chans(chanmask);
+    dlog_blocks_written=0;
+    dlog_rcache_block=-1;
+    xSemaphoreGive(dlog_flock);
+
+    xSemaphoreTake(dlog_lock, portMAX_DELAY);
+    memset(&dlog_cur, 0, sizeof(dlog_qitem_t));
+    dlog_rows_total=0;
+    dlog_dropped=0;
+    dlog_t0_usec=esp_timer_get_time();
+    acq_reader_restart(&dlog_reader);
+    dlog_state=DLOG_LOGGING;
+    xSemaphoreGive(dlog_lock);
+    dlog_callback(NULL); // first row now
+    ESP_ERROR_CHECK(esp_timer_start_periodic(dlog_timer, (uint64_t)period_ms * 1000));
+    return(0);
+}
+
+void datalog_stop(void)
+{
+    int i;
+    dlog_block_hdr_t* bh=(dlog_block_hdr_t*)dlog_cur.block;
+    if (dlog_state!=DLOG_LOGGING)
+        return;
+    esp_timer_stop(dlog_timer);
+    xSemaphoreTake(dlog_lock, portMAX_DELAY);
+    dlog_state=DLOG_IDLE;
+    if (bh->nrows>0) {
+        // the last block is written part full
+        if (xQueueSend(dlog_q, &dlog_cur, 1000 / portTICK_PERIOD_MS)!=pdTRUE) {
+            dlog_dropped+=bh->nrows;
+            dlog_rows_total-=bh->nrows;
+        }
+        bh->nrows=0;
+    }
+    xSemaphoreGive(dlog_lock);
+    // wait for the writer, so the whole log can be read back straight away
+    for (i=0; (i<50) && (uxQueueMessagesWaiting(dlog_q)>0); i++) {
+        vTaskDelay(20 / portTICK_PERIOD_MS);
+    }
+    xSemaphoreTake(dlog_flock, portMAX_DELAY); // and for the write in progress
+    xSemaphoreGive(dlog_flock);
+}
+
+void datalog_get_status(dlog_status_t* st)
+{
+    st->state=dlog_state;
+    st->rows=dlog_rows_total;
+    st->blocks=dlog_blocks_written;
+    st->period_ms=dlog_hdr.period_ms;
+    st->chanmask=dlog_hdr.chanmask;
+    st->start_ms=dlog_hdr.start_ms;
+    st->dropped=dlog_dropped;
+}
+
+uint32_t datalog_rows(void)
+{
+    return(dlog_rows_total);
+}
+
+// find a row, in the block being filled or on flash. chan can be -1 for just the time
+static int dlog_lookup(uint32_t row, int chan, uint16_t* raw, uint32_t* t_ms)
+{
+    uint32_t block;
+    uint32_t r;
+    int k;
+    dlog_block_hdr_t* bh;
+    if ((dlog_hdr.magic!=DLOG_MAGIC) || (row>=dlog_rows_total))
+        return(-1);
+    if ((chan>=0) && ((chan>=DLOG_CHAN_MAX) || (dlog_chan_pos[chan]<0)))
+        return(-1);
+    block=row / dlog_hdr.rows_per_block;
+    r=row % dlog_hdr.rows_per_block;
+    k=(r * dlog_hdr.nchan) + ((chan>=0) ? dlog_chan_pos[chan] : 0);
+
+    xSemaphoreTake(dlog_lock, portMAX_DELAY);
+    bh=(dlog_block_hdr_t*)dlog_cur.block;
+    if ((bh->nrows>0) && (block==(bh->first_row / dlog_hdr.rows_per_block)) && (r<bh->nrows)) {
+        if (raw!=NULL) *raw=dlog_get(&dlog_cur.block[sizeof(dlog_block_hdr_t)], k);
+        if (t_ms!=NULL) *t_ms=bh->t_ms + (r * dlog_hdr.period_ms);
+        xSemaphoreGive(dlog_lock);
+        return(0);
+    }
+    xSemaphoreGive(dlog_lock);
+
+    if (block>=dlog_blocks_written)
+        return(-1); // waiting to be written
+    xSemaphoreTake(dlog_flock, portMAX_DELAY);
+    if (dlog_rcache_block!=(int32_t)block) {
+        dlog_rcache_block=-1;
+        if ((dlog_f==NULL) ||
+            (fseek(dlog_f, (long)(block+1) * DLOG_BLOCK_LEN, SEEK_SET)!=0) ||
+            (fread(dlog_rcache, DLOG_BLOCK_LEN, 1, dlog_f)!=1) ||
+            (((dlog_block_hdr_t*)dlog_rcache)->magic!=DLOG_BLOCK_MAGIC)) {
+            xSemaphoreGive(dlog_flock);
+            return(-1);
+        }
+        dlog_rcache_block=block;
+    }
+    bh=(dlog_block_hdr_t*)dlog_rcache;
+    if (r>=bh->nrows) {
+        xSemaphoreGive(dlog_flock);
+        return(-1);
+    }
+    if (raw!=NULL) *raw=dlog_get(&dlog_rcache[sizeof(dlog_block_hdr_t)], k);
+    if (t_ms!=NULL) *t_ms=bh->t_ms + (r * dlog_hdr.period_ms);
+    xSemaphoreGive(dlog_flock);
+    return(0);
+}
+
+uint32_t datalog_rows_per_block(void)
+{
+    if (dlog_hdr.magic!=DLOG_MAGIC)
+        return(0);
+    return(dlog_hdr.rows_per_block);
+}
+
+int datalog_get_raw(uint32_t row, int chan, uint16_t* raw)
+{
+    return(dlog_lookup(row, chan, raw, NULL));
+}
+
+double datalog_row_time(uint32_t row)
+{
+    uint32_t t_ms;
+    if (dlog_lookup(row, -1, NULL, &t_ms)!=0)
+        return(-1.0);
+    return(((double)t_ms)/1000.0);
+}
+
+int datalog_get_index(uint32_t block, dlog_index_t* idx)
+{
+    dlog_block_hdr_t* bh;
+    if (dlog_hdr.magic!=DLOG_MAGIC)
+        return(-1);
+    xSemaphoreTake(dlog_lock, portMAX_DELAY);
+    bh=(dlog_block_hdr_t*)dlog_cur.block;
+    if ((bh->nrows>0) && (block==(bh->first_row / dlog_hdr.rows_per_block))) {
+        memcpy(idx, &dlog_cur.idx, sizeof(dlog_index_t));
+        xSemaphoreGive(dlog_lock);
+        return(0);
+    }
+    xSemaphoreGive(dlog_lock);
+    if (block>=dlog_blocks_written)
+        return(-1);
+    xSemaphoreTake(dlog_flock, portMAX_DELAY);
+    if ((dlog_fi==NULL) ||
+        (fseek(dlog_fi, (long)block * sizeof(dlog_index_t), SEEK_SET)!=0) ||
+        (fread(idx, sizeof(dlog_index_t), 1, dlog_fi)!=1)) {
+        xSemaphoreGive(dlog_flock);
+        return(-1);
+    }
+    xSemaphoreGive(dlog_flock);
+    return(0);
+}
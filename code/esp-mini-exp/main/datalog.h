@@ -0,0 +1,98 @@
+
+#ifndef _DATALOG_HEADER_FILE_H
+#define _DATALOG_HEADER_FILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// long-duration data logging
+// Samples are logged to a FAT filesystem on the "storage" flash partition,
+// so experiments can run unattended, without a calculator attached.
+// The log is made of fixed-size blocks, so any row can be found with one
+// seek, however long the log is:
+//   log.bin  a dlog_header_t block, then data blocks. Each data block is a
+//            dlog_block_hdr_t, then the raw 12-bit readings packed two per
+//            three bytes, one row (all logged channels) at a time
+//   log.idx  one dlog_index_t per data block, with the block's first row,
+//            time, and the min and max reading of each channel
+// Sampling is periodic, so the time of a row is the block time plus the
+// row's position times the period.
+
+#define DLOG_MOUNT "/log"
+#define DLOG_PART_LABEL "storage"
+#define DLOG_FILE DLOG_MOUNT "/log.bin"
+#define DLOG_INDEX_FILE DLOG_MOUNT "/log.idx"
+#define DLOG_MAGIC 0x474f4c44       // "DLOG"
+#define DLOG_BLOCK_MAGIC 0x4b4c4244 // "DBLK"
+#define DLOG_VERSION 1
+#define DLOG_BLOCK_LEN 512
+#define DLOG_BLOCK_DATA (DLOG_BLOCK_LEN - sizeof(dlog_block_hdr_t))
+#define DLOG_BLOCK_SAMPLES ((DLOG_BLOCK_DATA / 3) * 2)
+#define DLOG_CHAN_MAX 3
+#define DLOG_MIN_PERIOD_MS 10
+#define DLOG_QUEUE_LEN 4            // full blocks waiting to be written
+#define DLOG_PAGE_LEN 100           // rows in each page fetched by the calculator
+#define DLOG_TASK_PRIORITY 3
+#define DLOG_TASK_STACK (1024*4)
+
+#define DLOG_IDLE 0
+#define DLOG_LOGGING 1
+#define DLOG_FULL 2                 // stopped because the filesystem is full
+
+typedef struct dlog_header_s {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t period_ms;
+    uint8_t chanmask;
+    uint8_t nchan;
+    uint16_t rows_per_block;
+    uint64_t start_ms;              // Unix time of the first row, 0 if the clock wasn't set
+} dlog_header_t;
+
+typedef struct dlog_block_hdr_s {
+    uint32_t magic;
+    uint32_t first_row;
+    uint32_t t_ms;                  // time of the first row, from the start of the log
+    uint16_t nrows;
+    uint16_t reserved;
+} dlog_block_hdr_t;
+
+typedef struct dlog_index_s {
+    uint32_t first_row;
+    uint32_t t_ms;
+    uint16_t nrows;
+    uint16_t reserved;
+    uint16_t min[DLOG_CHAN_MAX];    // raw readings, only the logged channels are valid
+    uint16_t max[DLOG_CHAN_MAX];
+} dlog_index_t;
+
+typedef struct dlog_status_s {
+    char state;
+    uint32_t rows;
+    uint32_t blocks;
+    uint32_t period_ms;
+    uint8_t chanmask;
+    uint64_t start_ms;
+    uint32_t dropped;               // rows lost because blocks couldn't be written in time
+} dlog_status_t;
+
+void datalog_init(void);
+int datalog_start(uint32_t period_ms, uint8_t chanmask); // returns 0 on success
+void datalog_stop(void);
+void datalog_get_status(dlog_status_t* st);
+uint32_t datalog_rows(void);
+uint32_t datalog_rows_per_block(void);                       // 0 if there is no log
+int datalog_get_raw(uint32_t row, int chan, uint16_t* raw);  // chan 0..2, returns 0 on success
+double datalog_row_time(uint32_t row);                       // seconds from the start of the log
+int datalog_get_index(uint32_t block, dlog_index_t* idx);    // returns 0 on success
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DATALOG_HEADER_FILE_H */
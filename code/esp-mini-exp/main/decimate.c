@@ -0,0 +1,149 @@
+// decimation of stored samples
+// rev 1 - min/max envelope using a block index where there is one, and LTTB
+
+#include <stdio.h>
+#include <string.h>
+#include "decimate.h"
+
+
+static int decim_copy(const decim_src_t* src, uint32_t first, uint32_t last, uint16_t* out, uint32_t* x)
+{
+    uint32_t i;
+    int n=0;
+    for (i=first; i<last; i++) {
+        if (src->get(src->ctx, i, &out[n])!=0)
+            return(-1);
+        x[n]=i;
+        n++;
+    }
+    return(n);
+}
+
+// limits the range to the source, returns the number of samples in it
+static uint32_t decim_range(const decim_src_t* src, uint32_t first, uint32_t* last)
+{
+    if (*last>src->len) *last=src->len;
+    if (first>=*last) return(0);
+    return(*last-first);
+}
+
+int decim_minmax(const decim_src_t* src, uint32_t first, uint32_t last, int npoints, uint16_t* out, uint32_t* x)
+{
+    uint32_t n;
+    uint32_t i, b0, b1;
+    uint16_t v, bmin, bmax;
+    uint16_t min, max;
+    int j;
+    int nb;
+    n=decim_range(src, first, &last);
+    if (npoints>DECIM_POINTS_MAX) npoints=DECIM_POINTS_MAX;
+    if (n<=(uint32_t)npoints)
+        return(decim_copy(src, first, last, out, x));
+    nb=npoints/2;
+    if (nb<1) return(0);
+    for (j=0; j<nb; j++) {
+        b0=first + (uint32_t)(((uint64_t)n*j)/nb);
+        b1=first + (uint32_t)(((uint64_t)n*(j+1))/nb);
+        if ((src->block_len>0) && (n/nb>=2*src->block_len)) {
+            // buckets of two or more blocks are moved to the nearest block boundaries, so that
+            // only the index is read, apart from at the ends of the range
+            if (j>0) b0=((b0+src->block_len/2)/src->block_len)*src->block_len;
+            if (j<nb-1) b1=((b1+src->block_len/2)/src->block_len)*src->block_len;
+        }
+        min=0xffff;
+        max=0;
+        i=b0;
+        while (i<b1) {
+            // whole blocks come from the index
+            if ((src->block_len>0) && ((i % src->block_len)==0) && (i+src->block_len<=b1) &&
+                (src->block_minmax(src->ctx, i/src->block_len, &bmin, &bmax)==0)) {
+                if (bmin<min) min=bmin;
+                if (bmax>max) max=bmax;
+                i+=src->block_len;
+                continue;
+            }
+            if (src->get(src->ctx, i, &v)!=0)
+                return(-1);
+            if (v<min) min=v;
+            if (v>max) max=v;
+            i++;
+        }
+        out[j*2]=min;
+        out[j*2+1]=max;
+        x[j*2]=b0;
+        x[j*2+1]=b0;
+    }
+    return(nb*2);
+}
+
+int decim_lttb(const decim_src_t* src, uint32_t first, uint32_t last, int npoints, uint16_t* out, uint32_t* x)
+{
+    uint32_t n;
+    uint32_t i;
+    uint32_t a;         // point picked from the previous bucket
+    uint32_t r0, r1;    // current bucket
+    uint32_t s0, s1;    // next bucket
+    uint32_t pick;
+    uint16_t v, av, pickv, lastv;
+    double every;
+    double avgx, avgy;
+    double area, maxarea;
+    int j;
+    n=decim_range(src, first, &last);
+    if (npoints>DECIM_POINTS_MAX) npoints=DECIM_POINTS_MAX;
+    if ((n<=(uint32_t)npoints) || (npoints<3))
+        return(decim_copy(src, first, last, out, x));
+    // the first and last samples are always kept, the rest are split into npoints-2 buckets
+    every=((double)(n-2))/(npoints-2);
+    a=0;
+    if (src->get(src->ctx, first, &av)!=0)
+        return(-1);
+    if (src->get(src->ctx, last-1, &lastv)!=0)
+        return(-1);
+    out[0]=av;
+    x[0]=first;
+    for (j=0; j<npoints-2; j++) {
+        s0=(uint32_t)((j+1)*every)+1;
+        s1=(uint32_t)((j+2)*every)+1;
+        if (s1>n) s1=n;
+        avgx=0.0;
+        avgy=0.0;
+        for (i=s0; i<s1; i++) {
+            if (src->get(src->ctx, first+i, &v)!=0)
+                return(-1);
+            avgx+=i;
+            avgy+=v;
+        }
+        if (s1>s0) {
+            avgx=avgx/(s1-s0);
+            avgy=avgy/(s1-s0);
+        } else {
+            avgx=n-1;
+            avgy=lastv;
+        }
+        r0=(uint32_t)(j*every)+1;
+        r1=(uint32_t)((j+1)*every)+1;
+        maxarea=-1.0;
+        pick=r0;
+        pickv=av;
+        for (i=r0; i<r1; i++) {
+            if (src->get(src->ctx, first+i, &v)!=0)
+                return(-1);
+            // twice the area of the triangle, which is enough for comparing
+            area=((double)a-avgx)*((double)v-av) - ((double)a-i)*(avgy-av);
+            if (area<0) area=-area;
+            if (area>maxarea) {
+                maxarea=area;
+                pick=i;
+                pickv=v;
+            }
+        }
+        out[j+1]=pickv;
+        x[j+1]=first+pick;
+        a=pick;
+        av=pickv;
+    }
+    out[npoints-1]=lastv;
+    x[npoints-1]=last-1;
+    return(npoints);
+}
@@ -0,0 +1,48 @@
+
+#ifndef _DECIMATE_HEADER_FILE_H
+#define _DECIMATE_HEADER_FILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// decimation of stored samples down to a screen-sized list
+// The calculator screen is a few hundred pixels wide, so a long capture or
+// log is reduced to about that many points before it is sent:
+//   min/max  each bucket of samples becomes its min and max, so spikes are
+//            never lost. If the source has an index of block min/max values,
+//            buckets are lined up with its blocks and taken from the index
+//            without reading the samples, so the cost depends on the number
+//            of points rather than the length of the range
+//   LTTB     Largest-Triangle-Three-Buckets keeps the one sample from each
+//            bucket that best preserves the shape of the line. Every sample
+//            in the range is read
+// Samples are raw 12-bit readings. This file doesn't use any ESP-IDF functions.
+
+#define DECIM_POINTS_MAX 384        // fx-CG50 screen width
+#define DECIM_MINMAX 0
+#define DECIM_LTTB 1
+
+typedef struct decim_src_s {
+    uint32_t len;                   // number of samples
+    uint32_t block_len;             // samples per index block, 0 if there is no index
+    int (*get)(void* ctx, uint32_t idx, uint16_t* raw); // returns 0 on success
+    int (*block_minmax)(void* ctx, uint32_t block, uint16_t* min, uint16_t* max); // returns 0 on success
+    void* ctx;
+} decim_src_t;
+
+// reduces samples first..last-1 to at most npoints values, with the sample number of
+// each one in x. Returns the number of points, or -1 on a read error.
+// If the range has no more than npoints samples, they are all returned unchanged.
+int decim_minmax(const decim_src_t* src, uint32_t first, uint32_t last, int npoints, uint16_t* out, uint32_t* x);
+int decim_lttb(const decim_src_t* src, uint32_t first, uint32_t last, int npoints, uint16_t* out, uint32_t* x);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DECIMATE_HEADER_FILE_H */
@@ -0,0 +1,234 @@
+// spectrum analysis
+// rev 1 - Q15 radix-2 FFT of a windowed capture, with an optional esp-dsp path
+// rev 2 - the transform itself moved to fftq15.c, so it can be tested on a PC
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "miniexp.h"
+#include "capture.h"
+#include "acq.h"
+#include "fft.h"
+#include "memstat.h"
+#ifdef WITH_ESP_DSP
+#include "esp_dsp.h"
+#endif
+
+#define FFT_HEADROOM 16383          // largest input to the transform, half of full scale
+
+static SemaphoreHandle_t fft_lock;
+static StaticSemaphore_t fft_lock_buf;
+static int16_t fft_buf[FFT_N_MAX*2];
+static float fft_amp[FFT_N_MAX/2];
+static int fft_nbins=0;
+static double fft_binhz=0.0;
+
+
+// the transform used for captures
+static int fft_run(int16_t* data, int n)
+{
+#ifdef WITH_ESP_DSP
+    // esp-dsp also scales by 1/n, but leaves the result in bit reversed order
+    if (dsps_fft2r_sc16(data, n, dsps_fft_w_table_sc16)!=ESP_OK)
+        return(-1);
+    dsps_bit_rev_sc16_ansi(data, n);
+    return(0);
+#else
+    return(fft_q15(data, n));
+#endif
+}
+
+void fft_init(void)
+{
+    fft_lock=xSemaphoreCreateMutexStatic(&fft_lock_buf);
+    fft_q15_init();
+    mem_static_add("fft", sizeof(fft_lock_buf) + FFT_N_MAX*sizeof(int16_t) + sizeof(fft_buf) + sizeof(fft_amp));
+#ifdef WITH_ESP_DSP
+    ESP_ERROR_CHECK(dsps_fft2r_init_sc16(NULL, FFT_N_MAX));
+#endif
+}
+
+int fft_capture(int chan, float* amp, double* binhz)
+{
+    unsigned int n;
+    unsigned int i;
+    int nfft;
+    double mean=0.0;
+    double maxdev=0.0;
+    double dev;
+    double gain;
+    double w;
+    double wsum=0.0;
+    double scale;
+    double re, im;
+    n=capture_count();
+    if ((chan<0) || (chan>=CHAN_MAX) || !(capture_chanmask() & (0x01<<chan)) || (n<4) || (capture_period()==0)) {
+        xSemaphoreTake(fft_lock, portMAX_DELAY);
+        fft_nbins=0; // so the last spectrum isn't taken for this one
+        xSemaphoreGive(fft_lock);
+        return(-1);
+    }
+    nfft=2;
+    while ((nfft<(int)n) && (nfft<FFT_N_MAX)) nfft<<=1;
+    if (n>(unsigned int)nfft) n=nfft;
+    xSemaphoreTake(fft_lock, portMAX_DELAY);
+    // the mean is removed, and the rest scaled up to use the whole Q15 range
+    for (i=0; i<n; i++) {
+        mean+=capture_get(chan, i);
+    }
+    mean=mean/n;
+    for (i=0; i<n; i++) {
+        dev=fabs(capture_get(chan, i)-mean);
+        if (dev>maxdev) maxdev=dev;
+    }
+    gain=(maxdev>0.0) ? FFT_HEADROOM/maxdev : 1.0;
+    memset(fft_buf, 0, sizeof(fft_buf));
+    for (i=0; i<n; i++) {
+        w=0.5 - 0.5*cos(2.0*FFT_PI*i/(n-1));
+        wsum+=w;
+        fft_buf[i*2]=fft_sat16((int32_t)lround((capture_get(chan, i)-mean)*gain*w));
+    }
+    if (fft_run(fft_buf, nfft)!=0) {
+        fft_nbins=0;
+        xSemaphoreGive(fft_lock);
+        return(-1);
+    }
+    // undo the 1/nfft scaling and the gain, and correct for the window, so a sine reads as its amplitude
+    scale=(2.0*nfft)/(gain*wsum*ACQ_COUNTS_PER_VOLT);
+    fft_nbins=nfft/2;
+    for (i=0; i<(unsigned int)fft_nbins; i++) {
+        re=fft_buf[i*2];
+        im=fft_buf[i*2+1];
+        fft_amp[i]=(float)(sqrt(re*re + im*im)*scale);
+    }
+    fft_binhz=(1000000.0/capture_period())/nfft;
+    if (amp!=NULL)
+        memcpy(amp, fft_amp, fft_nbins*sizeof(float));
+    if (binhz!=NULL)
+        *binhz=fft_binhz;
+    n=fft_nbins;
+    xSemaphoreGive(fft_lock);
+    return((int)n);
+}
+
+int fft_bins(void)
+{
+    return(fft_nbins);
+}
+
+double fft_bin_freq(int bin)
+{
+    return(bin*fft_binhz);
+}
+
+double fft_bin_amp(int bin)
+{
+    if ((bin<0) || (bin>=fft_nbins))
+        return(0.0);
+    return(fft_amp[bin]);
+}
+
+int fft_peaks(int npeaks, fft_peak_t* peaks)
+{
+    int found;
+    xSemaphoreTake(fft_lock, portMAX_DELAY);
+    found=fft_find_peaks(fft_amp, fft_nbins, fft_binhz, npeaks, peaks);
+    xSemaphoreGive(fft_lock);
+    return(found);
+}
+
+// local maxima, with the frequency and amplitude refined by fitting a parabola through the peak and its neighbours
+int fft_find_peaks(const float* amp, int nbins, double binhz, int npeaks, fft_peak_t* peaks)
+{
+    int i, j;
+    int found=0;
+    double a, b, c, p;
+    fft_peak_t pk;
+    if (npeaks>FFT_PEAKS_MAX) npeaks=FFT_PEAKS_MAX;
+    if (npeaks<1)
+        return(0);
+    for (i=1; i<nbins-1; i++) {
+        a=amp[i-1];
+        b=amp[i];
+        c=amp[i+1];
+        if ((b<=a) || (b<c) || (b<=0.0))
+            continue;
+        p=0.5*(a-c)/(a - 2.0*b + c);
+        pk.freq=(i+p)*binhz;
+        pk.amp=b - 0.25*(a-c)*p;
+        // insert in order, strongest first
+        if ((found==npeaks) && (peaks[npeaks-1].amp>=pk.amp))
+            continue;
+        j=(found<npeaks) ? found : npeaks-1;
+        while ((j>0) && (peaks[j-1].amp<pk.amp)) {
+            peaks[j]=peaks[j-1];
+            j--;
+        }
+        peaks[j]=pk;
+        if (found<npeaks) found++;
+    }
+    return(found);
+}
+
+// times a full size transform, and compares a smaller one against the double precision reference
+void fft_bench(fft_bench_t* res)
+{
+    int i;
+    int64_t t;
+    double* re;
+    double* im;
+    double sig=0.0;
+    double err=0.0;
+    double dr, di;
+    memset(res, 0, sizeof(fft_bench_t));
+    xSemaphoreTake(fft_lock, portMAX_DELAY);
+    // two tones, one of them between bins
+    for (i=0; i<FFT_BENCH_N; i++) {
+        fft_buf[i*2]=(int16_t)lround(12000.0*sin(2.0*FFT_PI*13.0*i/FFT_BENCH_N) + 6000.0*sin(2.0*FFT_PI*40.5*i/FFT_BENCH_N));
+        fft_buf[i*2+1]=0;
+    }
+    re=malloc(FFT_BENCH_N*sizeof(double));
+    im=malloc(FFT_BENCH_N*sizeof(double));
+    if ((re!=NULL) && (im!=NULL)) {
+        for (i=0; i<FFT_BENCH_N; i++) {
+            re[i]=fft_buf[i*2];
+            im[i]=0.0;
+        }
+        fft_ref(re, im, FFT_BENCH_N);
+        fft_q15(fft_buf, FFT_BENCH_N);
+        for (i=0; i<FFT_BENCH_N; i++) {
+            dr=re[i]/FFT_BENCH_N;
+            di=im[i]/FFT_BENCH_N;
+            sig+=dr*dr + di*di;
+            dr-=fft_buf[i*2];
+            di-=fft_buf[i*2+1];
+            err+=dr*dr + di*di;
+        }
+        res->snr_db=(err>0.0) ? 10.0*log10(sig/err) : 999.0;
+    }
+    free(re);
+    free(im);
+
+    res->n=FFT_N_MAX;
+    for (i=0; i<FFT_N_MAX*2; i++) {
+        fft_buf[i]=(int16_t)((i*7919) & 0x3fff) - 0x2000;
+    }
+    t=esp_timer_get_time();
+    fft_q15(fft_buf, FFT_N_MAX);
+    t=esp_timer_get_time()-t;
+    res->cycles=(uint32_t)(t * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ);
+#ifdef WITH_ESP_DSP
+    t=esp_timer_get_time();
+    fft_run(fft_buf, FFT_N_MAX);
+    t=esp_timer_get_time()-t;
+    res->dsp_cycles=(uint32_t)(t * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ);
+#endif
+    xSemaphoreGive(fft_lock);
+}
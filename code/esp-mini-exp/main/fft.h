@@ -0,0 +1,62 @@
+
+#ifndef _FFT_HEADER_FILE_H
+#define _FFT_HEADER_FILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// spectrum analysis of a captured channel
+// The capture is windowed (Hann), zero padded to a power of two and transformed
+// with a fixed-point Q15 radix-2 FFT, which halves the values at each stage so
+// that nothing overflows. The result is kept until the next analysis, as the
+// amplitude of each frequency bin in volts (the amplitude of a sine wave at the
+// bin frequency reads as its peak voltage). The console and both calculator links
+// can analyse, so a link takes its own copy of the result to send from.
+// fftq15.c holds the transform, and doesn't use any ESP-IDF functions, so it
+// can be tested against the double precision reference on a PC.
+
+// uncomment to use the esp-dsp component's FFT, which has an assembler version for the ESP32
+// (esp-dsp must be cloned into the project's components folder):
+//#define WITH_ESP_DSP
+
+#define FFT_N_MAX 1024              // enough for the longest capture list
+#define FFT_PEAKS_MAX 8             // each peak is two values, and a list result holds 16
+#define FFT_BENCH_N 256             // points in the accuracy test
+#define FFT_PI 3.14159265358979323846
+
+typedef struct fft_peak_s {
+    double freq;                    // Hz, interpolated between bins
+    double amp;                     // volts
+} fft_peak_t;
+
+typedef struct fft_bench_s {
+    uint32_t n;                     // points in the timed transform
+    uint32_t cycles;                // CPU cycles for the Q15 transform
+    uint32_t dsp_cycles;            // the same with esp-dsp, 0 if it isn't used
+    double snr_db;                  // Q15 output against a double precision reference, FFT_BENCH_N points
+} fft_bench_t;
+
+void fft_init(void);
+void fft_q15_init(void);            // makes the twiddle table, or the first fft_q15 does
+int fft_q15(int16_t* data, int n);  // in place, data is n complex values (re, im), the result is scaled by 1/n
+void fft_ref(double* re, double* im, int n); // the same in double precision, without the scaling
+int16_t fft_sat16(int32_t v);
+int fft_capture(int chan, float* amp, double* binhz); // analyses capture channel 0..2, returns the number of bins or -1.
+                                    // amp (FFT_N_MAX/2 values) and binhz get a copy of the result, if they aren't NULL
+int fft_bins(void);
+double fft_bin_freq(int bin);
+double fft_bin_amp(int bin);
+int fft_peaks(int npeaks, fft_peak_t* peaks); // strongest first, returns the number found
+int fft_find_peaks(const float* amp, int nbins, double binhz, int npeaks, fft_peak_t* peaks); // the same in a copy
+void fft_bench(fft_bench_t* res);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FFT_HEADER_FILE_H */
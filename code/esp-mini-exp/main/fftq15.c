@@ -0,0 +1,111 @@
+// fixed-point FFT
+// rev 1 - Q15 radix-2 transform and its double precision reference, moved out of fft.c
+
+#include <stdint.h>
+#include <math.h>
+#include "fft.h"
+
+static int16_t fft_tw[FFT_N_MAX];   // cos and sin pairs for e^(-j.2.pi.k/FFT_N_MAX), k < FFT_N_MAX/2
+static char fft_tw_ready=0;
+
+
+int16_t fft_sat16(int32_t v)
+{
+    if (v>32767) return(32767);
+    if (v<-32768) return(-32768);
+    return((int16_t)v);
+}
+
+void fft_q15_init(void)
+{
+    int k;
+    for (k=0; k<FFT_N_MAX/2; k++) {
+        fft_tw[k*2]=fft_sat16((int32_t)lround(cos(2.0*FFT_PI*k/FFT_N_MAX)*32768.0));
+        fft_tw[k*2+1]=fft_sat16((int32_t)lround(sin(2.0*FFT_PI*k/FFT_N_MAX)*32768.0));
+    }
+    fft_tw_ready=1;
+}
+
+int fft_q15(int16_t* data, int n)
+{
+    int i, j, k;
+    int len, half, step;
+    int a, b;
+    int16_t t;
+    int32_t wr, wi, tr, ti, ar, ai;
+    if (!fft_tw_ready)
+        fft_q15_init();
+    if ((n<2) || (n>FFT_N_MAX) || ((n & (n-1))!=0))
+        return(-1);
+    // bit reversed order
+    j=0;
+    for (i=0; i<n-1; i++) {
+        if (i<j) {
+            t=data[i*2]; data[i*2]=data[j*2]; data[j*2]=t;
+            t=data[i*2+1]; data[i*2+1]=data[j*2+1]; data[j*2+1]=t;
+        }
+        k=n>>1;
+        while (k<=j) {
+            j-=k;
+            k>>=1;
+        }
+        j+=k;
+    }
+    // butterflies, halving at every stage
+    for (len=2; len<=n; len<<=1) {
+        half=len>>1;
+        step=FFT_N_MAX/len;
+        for (i=0; i<n; i+=len) {
+            for (j=0; j<half; j++) {
+                wr=fft_tw[j*step*2];
+                wi=-fft_tw[j*step*2+1];
+                a=(i+j)*2;
+                b=(i+j+half)*2;
+                tr=(data[b]*wr - data[b+1]*wi + 0x4000)>>15;
+                ti=(data[b]*wi + data[b+1]*wr + 0x4000)>>15;
+                ar=data[a];
+                ai=data[a+1];
+                data[a]=fft_sat16((ar+tr)>>1);
+                data[a+1]=fft_sat16((ai+ti)>>1);
+                data[b]=fft_sat16((ar-tr)>>1);
+                data[b+1]=fft_sat16((ai-ti)>>1);
+            }
+        }
+    }
+    return(0);
+}
+
+// double precision reference, for the accuracy test
+void fft_ref(double* re, double* im, int n)
+{
+    int i, j, k, len;
+    double t, wr, wi, tr, ti;
+    j=0;
+    for (i=0; i<n-1; i++) {
+        if (i<j) {
+            t=re[i]; re[i]=re[j]; re[j]=t;
+            t=im[i]; im[i]=im[j]; im[j]=t;
+        }
+        k=n>>1;
+        while (k<=j) {
+            j-=k;
+            k>>=1;
+        }
+        j+=k;
+    }
+    for (len=2; len<=n; len<<=1) {
+        for (i=0; i<n; i+=len) {
+            for (j=0; j<len/2; j++) {
+                wr=cos(2.0*FFT_PI*j/len);
+                wi=-sin(2.0*FFT_PI*j/len);
+                k=i+j+len/2;
+                tr=re[k]*wr - im[k]*wi;
+                ti=re[k]*wi + im[k]*wr;
+                re[k]=re[i+j]-tr;
+                im[k]=im[i+j]-ti;
+                re[i+j]+=tr;
+                im[i+j]+=ti;
+            }
+        }
+    }
+}
@@ -0,0 +1,212 @@
+// per-channel filter chains
+// rev 1 - moving average, single-pole IIR, biquad and FIR stages in fixed point
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "filter.h"
+
+#define FILT_PI 3.14159265358979323846
+#define FILT_FRAC 4                 // fraction bits between stages
+#define FILT_Q28 268435456.0
+#define FILT_Q15 32768.0
+#define FILT_MID (2048<<FILT_FRAC) // high-pass output is centred here
+
+
+void filter_clear(filt_chain_t* c)
+{
+    memset(c, 0, sizeof(filt_chain_t));
+}
+
+void filter_restart(filt_chain_t* c)
+{
+    int i;
+    for (i=0; i<c->nstages; i++) {
+        c->stage[i].primed=0;
+    }
+}
+
+const char* filter_name(int type)
+{
+    switch(type) {
+        case FILT_MAVG:
+            return("mavg");
+        case FILT_IIR1:
+            return("iir");
+        case FILT_LOWPASS:
+            return("lowpass");
+        case FILT_HIGHPASS:
+            return("highpass");
+        case FILT_FIR:
+            return("fir");
+        default:
+            return("none");
+    }
+}
+
+// biquad coefficients from the RBJ audio EQ cookbook, as b0, b1, b2, a1, a2
+static void filt_design_biquad(filt_stage_t* s, double fc, double q)
+{
+    double w0=2.0*FILT_PI*fc;
+    double cw=cos(w0);
+    double alpha=sin(w0)/(2.0*q);
+    double a0=1.0+alpha;
+    double b[3];
+    if (s->type==FILT_LOWPASS) {
+        b[0]=(1.0-cw)/2.0;
+        b[1]=1.0-cw;
+    } else {
+        b[0]=(1.0+cw)/2.0;
+        b[1]=-(1.0+cw);
+    }
+    b[2]=b[0];
+    s->coef[0]=(int32_t)lround(b[0]/a0*FILT_Q28);
+    s->coef[1]=(int32_t)lround(b[1]/a0*FILT_Q28);
+    s->coef[2]=(int32_t)lround(b[2]/a0*FILT_Q28);
+    s->coef[3]=(int32_t)lround((-2.0*cw)/a0*FILT_Q28);
+    s->coef[4]=(int32_t)lround((1.0-alpha)/a0*FILT_Q28);
+}
+
+// windowed-sinc low-pass (Hamming window), with a gain of exactly 1
+static void filt_design_fir(filt_stage_t* s, double fc)
+{
+    int i;
+    int32_t tot=0;
+    double m=(s->len-1)/2.0;
+    double h[FILT_TAPS_MAX];
+    double sum=0.0;
+    double t;
+    for (i=0; i<s->len; i++) {
+        t=i-m;
+        h[i]=(t==0.0) ? 2.0*fc : sin(2.0*FILT_PI*fc*t)/(FILT_PI*t);
+        if (s->len>1) h[i]*=0.54 - 0.46*cos(2.0*FILT_PI*i/(s->len-1));
+        sum+=h[i];
+    }
+    for (i=0; i<s->len; i++) {
+        s->coef[i]=(int32_t)lround(h[i]/sum*FILT_Q15);
+        tot+=s->coef[i];
+    }
+    s->coef[s->len/2]+=(int32_t)FILT_Q15 - tot; // rounding left over goes in the middle tap
+}
+
+int filter_add(filt_chain_t* c, int type, double p1, double p2)
+{
+    filt_stage_t* s;
+    if (c->nstages>=FILT_STAGES_MAX)
+        return(-1);
+    s=&c->stage[c->nstages];
+    memset(s, 0, sizeof(filt_stage_t));
+    s->type=type;
+    s->p1=p1;
+    s->p2=p2;
+    switch(type) {
+        case FILT_MAVG:
+            if ((p1<1) || (p1>FILT_TAPS_MAX))
+                return(-1);
+            s->len=(uint8_t)p1;
+            break;
+        case FILT_IIR1:
+            if ((p1<=0.0) || (p1>=0.5))
+                return(-1);
+            s->coef[0]=(int32_t)lround((1.0 - exp(-2.0*FILT_PI*p1))*FILT_Q15);
+            break;
+        case FILT_LOWPASS:
+        case FILT_HIGHPASS:
+            if ((p1<=0.0) || (p1>=0.5) || (p2<0.0))
+                return(-1);
+            if (p2==0.0) s->p2=0.707;
+            filt_design_biquad(s, p1, s->p2);
+            break;
+        case FILT_FIR:
+            if ((p1<=0.0) || (p1>=0.5) || (p2<1) || (p2>FILT_TAPS_MAX))
+                return(-1);
+            s->len=(uint8_t)p2;
+            filt_design_fir(s, p1);
+            break;
+        default:
+            return(-1);
+    }
+    c->nstages++;
+    return(0);
+}
+
+// x has FILT_FRAC fraction bits
+static int32_t filt_stage_run(filt_stage_t* s, int32_t x)
+{
+    int i, k;
+    int64_t acc;
+    int32_t y;
+    switch(s->type) {
+        case FILT_MAVG:
+            if (!s->primed) {
+                for (i=0; i<s->len; i++) s->hist[i]=x;
+                s->acc=x*s->len;
+                s->pos=0;
+                s->primed=1;
+            }
+            s->acc+=x - s->hist[s->pos];
+            s->hist[s->pos]=x;
+            s->pos=(s->pos+1) % s->len;
+            return(s->acc / s->len);
+        case FILT_IIR1:
+            // the output is kept with 12 more fraction bits, so slow filters don't stall
+            if (!s->primed) {
+                s->acc=x<<12;
+                s->primed=1;
+            }
+            s->acc+=(int32_t)(((int64_t)((x<<12) - s->acc) * s->coef[0]) >> 15);
+            return(s->acc>>12);
+        case FILT_LOWPASS:
+        case FILT_HIGHPASS:
+            // direct form 1, hist holds x[n-1], x[n-2], y[n-1], y[n-2]
+            if (!s->primed) {
+                acc=(int64_t)s->coef[0] + s->coef[1] + s->coef[2];
+                y=(int32_t)(((int64_t)x * acc) / ((int64_t)FILT_Q28 + s->coef[3] + s->coef[4])); // the steady state output
+                s->hist[0]=x;
+                s->hist[1]=x;
+                s->hist[2]=y;
+                s->hist[3]=y;
+                s->primed=1;
+            }
+            acc=(int64_t)s->coef[0]*x + (int64_t)s->coef[1]*s->hist[0] + (int64_t)s->coef[2]*s->hist[1]
+                - (int64_t)s->coef[3]*s->hist[2] - (int64_t)s->coef[4]*s->hist[3];
+            y=(int32_t)((acc + (1<<27)) >> 28);
+            s->hist[1]=s->hist[0];
+            s->hist[0]=x;
+            s->hist[3]=s->hist[2];
+            s->hist[2]=y;
+            if (s->type==FILT_HIGHPASS)
+                return(y + FILT_MID);
+            return(y);
+        case FILT_FIR:
+            if (!s->primed) {
+                for (i=0; i<s->len; i++) s->hist[i]=x;
+                s->pos=0;
+                s->primed=1;
+            }
+            s->hist[s->pos]=x;
+            acc=0;
+            k=s->pos;
+            for (i=0; i<s->len; i++) {
+                acc+=(int64_t)s->coef[i]*s->hist[k];
+                k=(k==0) ? s->len-1 : k-1;
+            }
+            s->pos=(s->pos+1) % s->len;
+            return((int32_t)((acc + (1<<14)) >> 15));
+        default:
+            return(x);
+    }
+}
+
+uint16_t filter_run(filt_chain_t* c, uint16_t raw)
+{
+    int i;
+    int32_t x=((int32_t)raw)<<FILT_FRAC;
+    for (i=0; i<c->nstages; i++) {
+        x=filt_stage_run(&c->stage[i], x);
+    }
+    x=(x + (1<<(FILT_FRAC-1))) >> FILT_FRAC;
+    if (x<0) x=0;
+    if (x>4095) x=4095;
+    return((uint16_t)x);
+}
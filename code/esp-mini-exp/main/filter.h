@@ -0,0 +1,84 @@
+
+#ifndef _FILTER_HEADER_FILE_H
+#define _FILTER_HEADER_FILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// per-channel filter chains, in fixed point
+// Each channel can have up to FILT_STAGES_MAX stages, run in order on every new
+// conversion. Between stages, samples are kept with 4 extra fraction bits.
+// Cutoffs are given as a fraction of the sample rate (0.1 is a tenth of it).
+// Each sampler runs its own copy of a channel's chain (acq_reader_t in acq.h),
+// so the history of a filter only ever holds samples taken at one rate.
+// Work per sample for each stage:
+//   FILT_MAVG      moving average of up to 16 samples, one add, one subtract and a divide
+//   FILT_IIR1      single-pole low-pass, one 32x32 bit multiply
+//   FILT_LOWPASS   biquad (RBJ cookbook, Q28 coefficients), five 32x32 bit multiplies
+//   FILT_HIGHPASS  as FILT_LOWPASS, the output is centred on mid-scale (2048, about 1.65V)
+//   FILT_FIR       windowed-sinc low-pass of up to 16 taps (Q15), one multiply per tap
+// Cost per sample of one stage, set up as the console "filter bench" sets it up.
+// The PC column is measured by host/filter_test (x86-64, -O2), which also checks
+// the gain of each stage. The ESP32 column is counted from the instructions each
+// stage needs (a 32x32 bit product added into 64 bits is about six), and
+// "filter bench" measures it on the board:
+//   stage              ESP32 cycles   PC ns
+//   FILT_MAVG (16)          ~40        10.7
+//   FILT_IIR1               ~30         8.2
+//   FILT_LOWPASS            ~70        10.9
+//   FILT_HIGHPASS           ~75        11.8
+//   FILT_FIR (16 taps)     ~160        33.7
+// acq_read adds about 800 cycles for the lock and the reader's statistics, which
+// are in double precision and so done in software, whatever the filters.
+// CPU load on one 160MHz core for one channel with four 16-tap FIR stages (~650
+// cycles), and in brackets with acq_read (~1450 cycles):
+//   capture at 10kHz (CAP_MIN_PERIOD_USEC)              4.1% (9.1%)
+//   link sample timer at 1kHz (SAMPLE_TICK_MIN_USEC)    0.4% (0.9%)
+//   data logger and cloud streaming at 100Hz            0.04% (0.09%)
+// Each channel sampled, and each sampler, adds as much again.
+// This file doesn't use any ESP-IDF functions.
+
+#define FILT_STAGES_MAX 4
+#define FILT_TAPS_MAX 16
+
+#define FILT_NONE 0
+#define FILT_MAVG 1                 // p1 is the number of samples
+#define FILT_IIR1 2                 // p1 is the cutoff
+#define FILT_LOWPASS 3              // p1 is the cutoff, p2 is Q (0.707 if 0)
+#define FILT_HIGHPASS 4
+#define FILT_FIR 5                  // p1 is the cutoff, p2 is the number of taps
+#define FILT_TYPE_MAX 5
+
+typedef struct filt_stage_s {
+    uint8_t type;
+    uint8_t len;                    // samples held for FILT_MAVG and FILT_FIR
+    uint8_t pos;
+    uint8_t primed;                 // 0 until the first sample sets up the history
+    double p1;                      // as configured, for listing
+    double p2;
+    int32_t coef[FILT_TAPS_MAX];
+    int32_t hist[FILT_TAPS_MAX];
+    int32_t acc;
+} filt_stage_t;
+
+typedef struct filt_chain_s {
+    int nstages;
+    filt_stage_t stage[FILT_STAGES_MAX];
+} filt_chain_t;
+
+void filter_clear(filt_chain_t* c);
+int filter_add(filt_chain_t* c, int type, double p1, double p2); // returns 0 on success
+void filter_restart(filt_chain_t* c);                          // forgets the history
+uint16_t filter_run(filt_chain_t* c, uint16_t raw);
+const char* filter_name(int type);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FILTER_HEADER_FILE_H */
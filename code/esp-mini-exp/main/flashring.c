@@ -0,0 +1,151 @@
+// store-and-forward flash ring
+// rev 1 - log-structured ring of telemetry messages on the telemlog partition
+// rev 2 - the ring itself moved to fringcore.c, and the backlog is sent several records to a message
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "miniexp.h"
+#include "telemetry.h"
+#include "flashring.h"
+#include "memstat.h"
+
+extern QueueHandle_t iotq;
+
+static const esp_partition_t* fring_part=NULL;
+static fring_t fring;
+static SemaphoreHandle_t fring_lock;
+static StaticSemaphore_t fring_lock_buf;
+static QueueHandle_t fring_q;          // messages waiting to be written, so callers never wait for flash
+static StaticQueue_t fring_q_buf;
+static uint8_t fring_q_store[FRING_PENDING_LEN*TELEM_MSG_LEN];
+static StackType_t fring_stack[FRING_TASK_STACK];
+static StaticTask_t fring_tcb;
+static volatile char fring_is_online=0;
+static char fring_msg[TELEM_MSG_LEN];  // only used by the fring task
+static char fring_out[TELEM_MSG_LEN];
+
+
+static int fring_part_read(void* ctx, uint32_t addr, void* buf, uint32_t len)
+{
+    return((esp_partition_read(fring_part, addr, buf, len)==ESP_OK) ? 0 : -1);
+}
+
+static int fring_part_write(void* ctx, uint32_t addr, const void* buf, uint32_t len)
+{
+    return((esp_partition_write(fring_part, addr, buf, len)==ESP_OK) ? 0 : -1);
+}
+
+static int fring_part_erase(void* ctx, uint32_t addr, uint32_t len)
+{
+    return((esp_partition_erase_range(fring_part, addr, len)==ESP_OK) ? 0 : -1);
+}
+
+// send up to FRING_DRAIN_BATCH backlog messages, each holding as many records as fit
+static void fring_drain(void)
+{
+    int i;
+    int n;
+    for (i=0; i<FRING_DRAIN_BATCH; i++) {
+        if (!fring_is_online)
+            break;
+        xSemaphoreTake(fring_lock, portMAX_DELAY);
+        n=fring_batch(&fring, fring_out, TELEM_MSG_LEN);
+        xSemaphoreGive(fring_lock);
+        if (n==0)
+            break;
+        if (xQueueSend(iotq, fring_out, 100 / portTICK_PERIOD_MS)!=pdTRUE)
+            break; // try again next period
+
+        xSemaphoreTake(fring_lock, portMAX_DELAY);
+        fring_batch_sent(&fring);
+        xSemaphoreGive(fring_lock);
+    }
+}
+
+// writes stored messages to flash, and sends the backlog when online
+static void fring_task(void *pvParameters)
+{
+    TickType_t last_drain=xTaskGetTickCount();
+    for(;;) {
+        if (xQueueReceive(fring_q, fring_msg, FRING_DRAIN_PERIOD_MS / portTICK_PERIOD_MS)==pdTRUE) {
+            fring_msg[TELEM_MSG_LEN-1]='\0';
+            xSemaphoreTake(fring_lock, portMAX_DELAY);
+            if (fring_write(&fring, fring_msg, strlen(fring_msg))!=0)
+                fring.stats.lost++;
+            xSemaphoreGive(fring_lock);
+        }
+        if ((xTaskGetTickCount()-last_drain) >= (FRING_DRAIN_PERIOD_MS / portTICK_PERIOD_MS)) {
+            last_drain=xTaskGetTickCount();
+            if ((fring_is_online) && (fring.stats.pending>0))
+                fring_drain();
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+void fring_init(void)
+{
+    memset(&fring, 0, sizeof(fring_t));
+    fring_part=esp_partition_find_first(ESP_PARTITION_TYPE_DATA, FRING_PART_SUBTYPE, FRING_PART_LABEL);
+    if (fring_part==NULL) {
+        printf("flash ring: no %s partition, telemetry won't be stored while offline\r\n", FRING_PART_LABEL);
+        return;
+    }
+    fring.nsect=fring_part->size / FRING_SECT_SIZE;
+    if (fring.nsect<2) {
+        printf("flash ring: %s partition is too small\r\n", FRING_PART_LABEL);
+        fring_part=NULL;
+        return;
+    }
+    fring.flash.read=fring_part_read;
+    fring.flash.write=fring_part_write;
+    fring.flash.erase=fring_part_erase;
+    fring_lock=xSemaphoreCreateMutexStatic(&fring_lock_buf);
+    fring_scan(&fring);
+    printf("flash ring: %u sectors, %u messages waiting to be sent\r\n", fring.nsect, fring.stats.pending);
+    fring_q=xQueueCreateStatic(FRING_PENDING_LEN, TELEM_MSG_LEN, fring_q_store, &fring_q_buf);
+    mem_task_create(fring_task, "flashring", FRING_TASK_STACK, NULL, FRING_TASK_PRIORITY, fring_stack, &fring_tcb);
+    mem_static_add("telemetry", sizeof(fring) + sizeof(fring_lock_buf) + sizeof(fring_q_buf) + sizeof(fring_q_store) + sizeof(fring_stack) + sizeof(fring_tcb) + sizeof(fring_msg) + sizeof(fring_out));
+}
+
+int fring_store(const char* msg, int len)
+{
+    if (fring_part==NULL)
+        return(-1);
+    if (xQueueSend(fring_q, msg, 0)!=pdTRUE) {
+        fring.stats.lost++;
+        return(-1);
+    }
+    return(0);
+}
+
+void fring_set_online(char online)
+{
+    fring_is_online=online;
+}
+
+char fring_online(void)
+{
+    return(fring_is_online);
+}
+
+void fring_get_stats(fring_stats_t* stats)
+{
+    memcpy(stats, &fring.stats, sizeof(fring_stats_t));
+}
+
+void fring_erase(void)
+{
+    if (fring_part==NULL)
+        return;
+    xSemaphoreTake(fring_lock, portMAX_DELAY);
+    fring_format(&fring);
+    xSemaphoreGive(fring_lock);
+}
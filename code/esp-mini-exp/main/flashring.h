@@ -0,0 +1,113 @@
+
+#ifndef _FLASHRING_HEADER_FILE_H
+#define _FLASHRING_HEADER_FILE_H
+
+#include <stdint.h>
+#include "telemetry.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// store-and-forward flash ring
+// Telemetry messages that can't be sent (WiFi down, or iotq full) are
+// appended to a log on the "telemlog" flash partition, each with a sequence
+// number and CRC. Once connected again, the backlog is sent oldest first, with
+// {"seq":n, ...} added to each message so the receiver can put it in order. As
+// many records as fit go in each iotq message, {"backlog":[{"seq":n, ...},
+// {"seq":n+1, ...}]}, so the backlog takes a few full messages, not one each.
+// A record is marked as sent by clearing its state word, so the backlog
+// survives a reset. When the ring is full, the oldest sector is erased.
+//
+// Flash layout, each 4096 byte sector:
+//   sector header: magic "FRNG", sector sequence number
+//   records, 4-byte aligned: fring_rec_hdr_t followed by the message
+//   unwritten flash (0xff) marks the end of the records in a sector
+//
+// The ring itself (fringcore.c) reaches the flash through fring_flash_t, so it
+// runs on a PC against a file, see host/flashring_test.c.
+
+#define FRING_PART_LABEL "telemlog"
+#define FRING_PART_SUBTYPE 0x40         // custom data partition subtype, see partitions.csv
+#define FRING_SECT_SIZE 4096
+#define FRING_SECT_MAGIC 0x474e5246     // "FRNG"
+#define FRING_REC_MAGIC 0xa55a
+#define FRING_REC_PENDING 0xffffffff
+#define FRING_REC_SENT 0x00000000
+#define FRING_PENDING_LEN 4             // messages waiting to be written to flash
+#define FRING_DRAIN_BATCH 8             // messages sent per drain period, each holding as many records as fit
+#define FRING_DRAIN_PERIOD_MS 1000      // limits the backlog to FRING_DRAIN_BATCH messages per second
+#define FRING_TASK_PRIORITY 3
+#define FRING_TASK_STACK (1024*4)
+#define FRING_REC_LEN_MAX TELEM_MSG_LEN
+#define FRING_BATCH_OPEN "{\"backlog\":["
+#define FRING_BATCH_CLOSE "]}"
+#define FRING_BATCH_CLOSE_LEN 2
+
+typedef struct fring_sect_hdr_s {
+    uint32_t magic;
+    uint32_t sect_seq;      // increases every time a sector is started, so the newest can be found
+} fring_sect_hdr_t;
+
+typedef struct fring_rec_hdr_s {
+    uint16_t magic;
+    uint16_t len;           // message length, the record is padded to a multiple of 4
+    uint32_t seq;           // record sequence number
+    uint16_t crc;           // CRC-16/CCITT of seq and the message
+    uint16_t reserved;
+    uint32_t state;         // FRING_REC_PENDING, cleared to FRING_REC_SENT once sent
+} fring_rec_hdr_t;
+
+typedef struct fring_stats_s {
+    uint32_t stored;        // messages written to flash
+    uint32_t sent;          // backlog messages sent
+    uint32_t pending;       // messages in flash waiting to be sent
+    uint32_t lost;          // messages that couldn't be stored, or were erased before being sent
+    uint32_t corrupt;       // records skipped due to a bad CRC
+    uint32_t sectors;
+    uint32_t next_seq;
+} fring_stats_t;
+
+// flash access for the ring, each returns 0 on success. Writes can only clear bits
+typedef struct fring_flash_s {
+    int (*read)(void* ctx, uint32_t addr, void* buf, uint32_t len);
+    int (*write)(void* ctx, uint32_t addr, const void* buf, uint32_t len);
+    int (*erase)(void* ctx, uint32_t addr, uint32_t len);
+    void* ctx;
+} fring_flash_t;
+
+typedef struct fring_s {
+    fring_flash_t flash;
+    uint32_t nsect;
+    uint32_t head_sect;     // where the next record is written
+    uint32_t head_off;
+    uint32_t tail_sect;     // oldest record that may still be pending
+    uint32_t tail_off;
+    uint32_t sect_seq;      // sequence number of the head sector
+    uint32_t batch_sect;    // where the last fring_batch started
+    uint32_t batch_off;
+    uint32_t batch_recs;    // records in it
+    fring_stats_t stats;
+} fring_t;
+
+// the ring itself, fringcore.c. The caller holds a lock around each call
+void fring_scan(fring_t* r);                // find the head, the oldest pending record and the next sequence number
+int fring_write(fring_t* r, const char* msg, int len);  // append a record, returns 0 if it was written
+int fring_batch(fring_t* r, char* out, int size);       // the oldest pending records as one message, returns its length, 0 if none
+uint32_t fring_batch_sent(fring_t* r);      // mark the records of the last fring_batch as sent, returns how many
+void fring_format(fring_t* r);              // erase every sector
+
+void fring_init(void);
+int fring_store(const char* msg, int len);  // queue a message for flash, returns 0 if accepted
+void fring_set_online(char online);
+char fring_online(void);
+void fring_get_stats(fring_stats_t* stats);
+void fring_erase(void);                     // discard the whole backlog
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FLASHRING_HEADER_FILE_H */
@@ -0,0 +1,364 @@
+// store-and-forward flash ring, the log itself
+// rev 1 - moved out of flashring.c with the flash reached through fring_flash_t, so it can be
+//         tested on a PC, and backlog records are sent several to a message
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "flashring.h"
+
+#define FRING_ALIGN(x) (((x)+3) & ~3)
+
+
+static uint16_t fring_crc16(uint16_t crc, const uint8_t* p, int len)
+{
+    int i;
+    while (len>0) {
+        crc=crc ^ (((uint16_t)*p)<<8);
+        for (i=0; i<8; i++) {
+            if (crc & 0x8000)
+                crc=(crc<<1) ^ 0x1021;
+            else
+                crc=crc<<1;
+        }
+        p++;
+        len--;
+    }
+    return(crc);
+}
+
+static uint16_t fring_rec_crc(uint32_t seq, const char* msg, int len)
+{
+    uint16_t crc=0xffff;
+    crc=fring_crc16(crc, (const uint8_t*)&seq, sizeof(seq));
+    return(fring_crc16(crc, (const uint8_t*)msg, len));
+}
+
+static uint32_t fring_sect_addr(uint32_t sect)
+{
+    return(sect * FRING_SECT_SIZE);
+}
+
+// returns 1 if a record header was read, 0 at the end of the sector's records, -1 if it's not a record
+static int fring_read_hdr(fring_t* r, uint32_t sect, uint32_t off, fring_rec_hdr_t* h)
+{
+    if ((off + sizeof(fring_rec_hdr_t)) > FRING_SECT_SIZE)
+        return(0);
+    if (r->flash.read(r->flash.ctx, fring_sect_addr(sect)+off, h, sizeof(fring_rec_hdr_t))!=0)
+        return(-1);
+    if (h->magic==0xffff)
+        return(0);
+    if ((h->magic!=FRING_REC_MAGIC) || ((off + sizeof(fring_rec_hdr_t) + FRING_ALIGN(h->len)) > FRING_SECT_SIZE))
+        return(-1);
+    return(1);
+}
+
+static char fring_sect_valid(fring_t* r, uint32_t sect, uint32_t* sect_seq)
+{
+    fring_sect_hdr_t sh;
+    if (r->flash.read(r->flash.ctx, fring_sect_addr(sect), &sh, sizeof(sh))!=0)
+        return(0);
+    if (sh.magic!=FRING_SECT_MAGIC)
+        return(0);
+    *sect_seq=sh.sect_seq;
+    return(1);
+}
+
+// returns 1 if the sector is erased (all 0xff) from off to its end
+static char fring_erased(fring_t* r, uint32_t sect, uint32_t off)
+{
+    uint32_t buf[16];
+    uint32_t n;
+    uint32_t i;
+    while (off<FRING_SECT_SIZE) {
+        n=FRING_SECT_SIZE-off;
+        if (n>sizeof(buf)) n=sizeof(buf);
+        if (r->flash.read(r->flash.ctx, fring_sect_addr(sect)+off, buf, n)!=0)
+            return(0);
+        for (i=0; i<n/4; i++) {
+            if (buf[i]!=0xffffffff)
+                return(0);
+        }
+        off+=n;
+    }
+    return(1);
+}
+
+// erase a sector and make it the head
+static void fring_start_sect(fring_t* r, uint32_t sect)
+{
+    fring_sect_hdr_t sh;
+    r->flash.erase(r->flash.ctx, fring_sect_addr(sect), FRING_SECT_SIZE);
+    r->sect_seq++;
+    sh.magic=FRING_SECT_MAGIC;
+    sh.sect_seq=r->sect_seq;
+    r->flash.write(r->flash.ctx, fring_sect_addr(sect), &sh, sizeof(sh));
+    r->head_sect=sect;
+    r->head_off=sizeof(fring_sect_hdr_t);
+}
+
+// number of pending records in a sector
+static uint32_t fring_sect_pending(fring_t* r, uint32_t sect)
+{
+    fring_rec_hdr_t h;
+    uint32_t off=sizeof(fring_sect_hdr_t);
+    uint32_t n=0;
+    while (fring_read_hdr(r, sect, off, &h)==1) {
+        if (h.state==FRING_REC_PENDING) n++;
+        off+=sizeof(fring_rec_hdr_t) + FRING_ALIGN(h.len);
+    }
+    return(n);
+}
+
+void fring_scan(fring_t* r)
+{
+    uint32_t s;
+    uint32_t n;
+    uint32_t seq;
+    uint32_t off;
+    uint32_t oldest=0;
+    uint32_t oldest_seq=0xffffffff;
+    char found=0;
+    char tail_found=0;
+    int rd;
+    fring_rec_hdr_t h;
+
+    r->stats.pending=0;
+    r->stats.next_seq=1;
+    r->stats.sectors=r->nsect;
+    r->sect_seq=0;
+    for (s=0; s<r->nsect; s++) {
+        if (fring_sect_valid(r, s, &seq)) {
+            if ((!found) || (seq>r->sect_seq)) {
+                r->sect_seq=seq;
+                r->head_sect=s;
+            }
+            if (seq<oldest_seq) {
+                oldest_seq=seq;
+                oldest=s;
+            }
+            found=1;
+        }
+    }
+    if (!found) {
+        printf("flash ring: formatting\r\n");
+        fring_start_sect(r, 0);
+        r->tail_sect=r->head_sect;
+        r->tail_off=r->head_off;
+        return;
+    }
+    // sectors are used in order, so walk from the oldest to the head
+    s=oldest;
+    for (n=0; n<r->nsect; n++) {
+        if (fring_sect_valid(r, s, &seq)) {
+            off=sizeof(fring_sect_hdr_t);
+            while ((rd=fring_read_hdr(r, s, off, &h))==1) {
+                if (h.seq>=r->stats.next_seq) r->stats.next_seq=h.seq+1;
+                if (h.state==FRING_REC_PENDING) {
+                    r->stats.pending++;
+                    if (!tail_found) {
+                        r->tail_sect=s;
+                        r->tail_off=off;
+                        tail_found=1;
+                    }
+                }
+                off+=sizeof(fring_rec_hdr_t) + FRING_ALIGN(h.len);
+            }
+            if (s==r->head_sect) {
+                // a damaged record means the rest of the sector can't be written. So does a message
+                // written without its header, by a reset between the two writes: the end of the records
+                // is only trusted if the flash after it is erased, otherwise the next record goes in a new sector
+                r->head_off=((rd<0) || (!fring_erased(r, s, off))) ? FRING_SECT_SIZE : off;
+                if ((r->head_off==FRING_SECT_SIZE) && (rd==0))
+                    printf("flash ring: unfinished record at the head, starting a new sector\r\n");
+                break;
+            }
+        }
+        s=(s+1) % r->nsect;
+    }
+    if (!tail_found) {
+        r->tail_sect=r->head_sect;
+        r->tail_off=r->head_off;
+    }
+}
+
+int fring_write(fring_t* r, const char* msg, int len)
+{
+    fring_rec_hdr_t h;
+    uint32_t need=sizeof(fring_rec_hdr_t) + FRING_ALIGN(len);
+    uint32_t next;
+    uint32_t addr;
+    uint32_t lost;
+    if (need > (FRING_SECT_SIZE - sizeof(fring_sect_hdr_t)))
+        return(-1);
+    if ((r->head_off + need) > FRING_SECT_SIZE) {
+        next=(r->head_sect+1) % r->nsect;
+        if (next==r->tail_sect) {
+            // full, so the oldest sector is overwritten
+            lost=fring_sect_pending(r, next);
+            r->stats.lost+=lost;
+            r->stats.pending-=lost;
+            r->tail_sect=(next+1) % r->nsect;
+            r->tail_off=sizeof(fring_sect_hdr_t);
+        }
+        fring_start_sect(r, next);
+        if (r->stats.pending==0) {
+            r->tail_sect=r->head_sect;
+            r->tail_off=r->head_off;
+        }
+    }
+    addr=fring_sect_addr(r->head_sect) + r->head_off;
+    h.magic=FRING_REC_MAGIC;
+    h.len=(uint16_t)len;
+    h.seq=r->stats.next_seq;
+    h.crc=fring_rec_crc(h.seq, msg, len);
+    h.reserved=0xffff;
+    h.state=FRING_REC_PENDING;
+    // message first, then the header, so a record cut short by a reset is never seen as valid
+    r->flash.write(r->flash.ctx, addr+sizeof(fring_rec_hdr_t), msg, FRING_ALIGN(len));
+    r->flash.write(r->flash.ctx, addr, &h, sizeof(fring_rec_hdr_t));
+    r->head_off+=need;
+    r->stats.next_seq++;
+    r->stats.pending++;
+    r->stats.stored++;
+    return(0);
+}
+
+// move a cursor to the next record, from the tail towards the head. Returns 1 if there is one
+static int fring_next(fring_t* r, uint32_t* sect, uint32_t* off, fring_rec_hdr_t* h)
+{
+    int rd;
+    for(;;) {
+        if ((*sect==r->head_sect) && (*off>=r->head_off))
+            return(0);
+        rd=fring_read_hdr(r, *sect, *off, h);
+        if (rd>0)
+            return(1);
+        if (*sect==r->head_sect) {
+            *off=r->head_off;
+            return(0);
+        }
+        *sect=(*sect+1) % r->nsect;
+        *off=sizeof(fring_sect_hdr_t);
+    }
+}
+
+// mark the record at the tail as sent, and move the tail past it
+static void fring_mark_sent(fring_t* r, fring_rec_hdr_t* h)
+{
+    uint32_t sent=FRING_REC_SENT;
+    uint32_t addr=fring_sect_addr(r->tail_sect) + r->tail_off + offsetof(fring_rec_hdr_t, state);
+    r->flash.write(r->flash.ctx, addr, &sent, sizeof(sent)); // only clears bits, so no erase is needed
+    r->tail_off+=sizeof(fring_rec_hdr_t) + FRING_ALIGN(h->len);
+    if (r->stats.pending>0) r->stats.pending--;
+}
+
+// move the tail to the oldest pending record, marking damaged ones as sent. Returns 1 if there is one
+static int fring_tail(fring_t* r, fring_rec_hdr_t* h, char* msg)
+{
+    while (fring_next(r, &r->tail_sect, &r->tail_off, h)) {
+        if (h->state!=FRING_REC_PENDING) {
+            r->tail_off+=sizeof(fring_rec_hdr_t) + FRING_ALIGN(h->len);
+            continue;
+        }
+        if ((h->len>=FRING_REC_LEN_MAX) ||
+            (r->flash.read(r->flash.ctx, fring_sect_addr(r->tail_sect)+r->tail_off+sizeof(fring_rec_hdr_t), msg, h->len)!=0) ||
+            (fring_rec_crc(h->seq, msg, h->len)!=h->crc)) {
+            r->stats.corrupt++;
+            fring_mark_sent(r, h);
+            continue;
+        }
+        msg[h->len]='\0';
+        return(1);
+    }
+    return(0);
+}
+
+// a record as one backlog item, {"seq":n, ...} from {...}. Returns its length, or 0 if it doesn't fit in size
+static int fring_item(char* out, int size, const fring_rec_hdr_t* h, const char* msg)
+{
+    int n;
+    n=snprintf(out, size, "{\"seq\":%u,", (unsigned int)h->seq);
+    if ((n>=size) || (msg[0]!='{') || ((n + h->len) >= size))
+        return(0);
+    memcpy(&out[n], &msg[1], h->len-1);
+    out[n + h->len - 1]='\0';
+    return(n + h->len - 1);
+}
+
+int fring_batch(fring_t* r, char* out, int size)
+{
+    fring_rec_hdr_t h;
+    char msg[FRING_REC_LEN_MAX];
+    uint32_t sect;
+    uint32_t off;
+    int pos;
+    int n;
+
+    r->batch_recs=0;
+    if (!fring_tail(r, &h, msg))
+        return(0);
+    r->batch_sect=r->tail_sect;
+    r->batch_off=r->tail_off;
+    pos=snprintf(out, size, "%s", FRING_BATCH_OPEN);
+    n=fring_item(&out[pos], size-pos-FRING_BATCH_CLOSE_LEN, &h, msg);
+    if (n==0) {
+        // not JSON, or too long to go with anything else, so it goes on its own as it was stored
+        snprintf(out, size, "%s", msg);
+        r->batch_recs=1;
+        return(strlen(out));
+    }
+    pos+=n;
+    r->batch_recs=1;
+    sect=r->tail_sect;
+    off=r->tail_off + sizeof(fring_rec_hdr_t) + FRING_ALIGN(h.len);
+    // the records after the tail are pending, as they are only ever marked in order. A damaged one ends
+    // the batch, and is dealt with once it is at the tail
+    while (fring_next(r, &sect, &off, &h)) {
+        if ((h.state!=FRING_REC_PENDING) || (h.len>=FRING_REC_LEN_MAX) ||
+            (r->flash.read(r->flash.ctx, fring_sect_addr(sect)+off+sizeof(fring_rec_hdr_t), msg, h.len)!=0) ||
+            (fring_rec_crc(h.seq, msg, h.len)!=h.crc))
+            break;
+        msg[h.len]='\0';
+        n=fring_item(&out[pos+1], size-pos-1-FRING_BATCH_CLOSE_LEN, &h, msg);
+        if (n==0)
+            break;
+        out[pos]=',';
+        pos+=n+1;
+        r->batch_recs++;
+        off+=sizeof(fring_rec_hdr_t) + FRING_ALIGN(h.len);
+    }
+    pos+=snprintf(&out[pos], size-pos, "%s", FRING_BATCH_CLOSE);
+    return(pos);
+}
+
+uint32_t fring_batch_sent(fring_t* r)
+{
+    fring_rec_hdr_t h;
+    char msg[FRING_REC_LEN_MAX];
+    uint32_t n=0;
+    if ((r->batch_recs==0) || (r->tail_sect!=r->batch_sect) || (r->tail_off!=r->batch_off)) {
+        r->batch_recs=0;
+        return(0); // the ring was erased, or its oldest sector overwritten, meanwhile
+    }
+    while ((n<r->batch_recs) && (fring_tail(r, &h, msg))) {
+        fring_mark_sent(r, &h);
+        n++;
+    }
+    r->stats.sent+=n;
+    r->batch_recs=0;
+    return(n);
+}
+
+void fring_format(fring_t* r)
+{
+    uint32_t s;
+    for (s=0; s<r->nsect; s++) {
+        r->flash.erase(r->flash.ctx, fring_sect_addr(s), FRING_SECT_SIZE);
+    }
+    r->stats.pending=0;
+    r->batch_recs=0;
+    fring_start_sect(r, 0);
+    r->tail_sect=r->head_sect;
+    r->tail_off=r->head_off;
+}
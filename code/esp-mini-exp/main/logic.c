@@ -0,0 +1,237 @@
+// logic capture
+// rev 1 - edge lists from the RMT receiver, one task per line
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/ringbuf.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/rmt.h"
+#include "driver/gpio.h"
+#include "miniexp.h"
+#include "acq.h"
+#include "counter.h"
+#include "logic.h"
+
+#define LOGIC_TASK_PRIORITY 10
+
+typedef struct logic_line_s {
+    rmt_channel_t rmt;
+    RingbufHandle_t rb;
+    uint8_t level0;                 // level when the capture started
+    uint16_t nedges;
+    uint32_t bursts;
+    uint32_t lost;
+    uint32_t last_tick;             // time of the last edge
+} logic_line_t;
+
+static uint32_t logic_buf[LOGIC_LINES][LOGIC_EDGES_MAX];
+static logic_line_t logic_lines[LOGIC_LINES];
+static volatile int logic_state=LOGIC_IDLE;
+static uint8_t logic_mask=0;
+static double logic_tick_ns=LOGIC_TICK_NS_DEFAULT;
+static uint32_t logic_window_ms=0;
+static uint32_t logic_window_ticks=0;
+static int64_t logic_t0=0;
+static volatile char logic_stop_req=0;
+static volatile int logic_nrunning=0;
+static portMUX_TYPE logic_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+static void logic_add_edge(logic_line_t* l, int line, uint32_t t, uint8_t level)
+{
+    if (t>logic_window_ticks)
+        return;
+    if (l->nedges>=LOGIC_EDGES_MAX) {
+        l->lost++;
+        return;
+    }
+    logic_buf[line][l->nedges]=(t & LOGIC_EDGE_TICKS) | (level ? LOGIC_EDGE_LEVEL : 0);
+    l->nedges++;
+    l->last_tick=t;
+}
+
+// a burst of high and low periods, handed over at time now, LOGIC_IDLE_TICKS after its last edge
+static void logic_add_burst(logic_line_t* l, int line, rmt_item32_t* it, int n, int64_t now)
+{
+    int i, k;
+    int64_t total=0;
+    int64_t t;
+    uint32_t d;
+    uint8_t lvl;
+    uint8_t prev;
+    for (i=0; i<n; i++) {
+        total+=it[i].duration0;
+        if (it[i].duration0==0) break;
+        total+=it[i].duration1;
+        if (it[i].duration1==0) break;
+    }
+    // the start of the burst, from when it arrived
+    t=(int64_t)(((now - logic_t0) * 1000.0) / logic_tick_ns) - total - LOGIC_IDLE_TICKS;
+    if ((l->nedges>0) && (t<=(int64_t)l->last_tick)) t=l->last_tick+1;
+    if (t<0) t=0;
+    prev=(l->nedges>0) ? ((logic_buf[line][l->nedges-1] & LOGIC_EDGE_LEVEL)!=0) : l->level0;
+    l->bursts++;
+    for (i=0; i<n; i++) {
+        for (k=0; k<2; k++) {
+            d=(k==0) ? it[i].duration0 : it[i].duration1;
+            lvl=(k==0) ? it[i].level0 : it[i].level1;
+            if (d==0) return;
+            if (lvl!=prev) {
+                logic_add_edge(l, line, (uint32_t)t, lvl);
+                prev=lvl;
+            }
+            t+=d;
+        }
+    }
+}
+
+static void logic_task(void* arg)
+{
+    logic_line_t* l=(logic_line_t*)arg;
+    int line=l - logic_lines;
+    rmt_item32_t* items;
+    size_t len=0;
+    int64_t now;
+    int64_t end=logic_t0 + ((int64_t)logic_window_ms*1000);
+    for (;;) {
+        items=(rmt_item32_t*)xRingbufferReceive(l->rb, &len, pdMS_TO_TICKS(10));
+        now=esp_timer_get_time();
+        if (items!=NULL) {
+            logic_add_burst(l, line, items, len/sizeof(rmt_item32_t), now);
+            vRingbufferReturnItem(l->rb, items);
+        }
+        if (logic_stop_req || (now>end) || (l->nedges>=LOGIC_EDGES_MAX)) break;
+    }
+    rmt_rx_stop(l->rmt);
+    rmt_driver_uninstall(l->rmt);
+    acq_pin_digital(line, 0);
+    portENTER_CRITICAL(&logic_mux);
+    logic_nrunning--;
+    if (logic_nrunning==0) logic_state=LOGIC_DONE;
+    portEXIT_CRITICAL(&logic_mux);
+    vTaskDelete(NULL);
+}
+
+int logic_start(uint8_t linemask, uint32_t window_ms, double tick_ns)
+{
+    int i;
+    int nlines=0;
+    int blocks;
+    int div;
+    int ch=0;
+    rmt_config_t cfg;
+    logic_line_t* l;
+    linemask&=(0x01<<LOGIC_LINES)-1;
+    if ((logic_state==LOGIC_RUNNING) || (linemask==0) || (window_ms==0))
+        return(-1);
+    for (i=0; i<LOGIC_LINES; i++) {
+        if ((linemask & (0x01<<i)) == 0) continue;
+        if (counter_mode(i)!=COUNTER_OFF) {
+            printf("logic: channel %d is counting pulses\r\n", i+1);
+            return(-1);
+        }
+        nlines++;
+    }
+    div=(int)(tick_ns/12.5 + 0.5); // the RMT runs from the 80MHz APB clock
+    if (div<1) div=1;
+    if (div>255) div=255;
+    logic_tick_ns=div*12.5;
+    if (((double)window_ms*1000000.0/logic_tick_ns) > LOGIC_EDGE_TICKS)
+        window_ms=(uint32_t)(LOGIC_EDGE_TICKS*logic_tick_ns/1000000.0);
+    logic_window_ms=window_ms;
+    logic_window_ticks=(uint32_t)((double)window_ms*1000000.0/logic_tick_ns);
+    logic_mask=linemask;
+    logic_stop_req=0;
+    blocks=LOGIC_RMT_BLOCKS/((nlines==3) ? 4 : nlines); // each line's blocks start at its own RMT channel
+    for (i=0; i<LOGIC_LINES; i++) {
+        l=&logic_lines[i];
+        memset(l, 0, sizeof(logic_line_t));
+        if ((linemask & (0x01<<i)) == 0) continue;
+        l->rmt=(rmt_channel_t)ch;
+        ch+=blocks;
+        acq_pin_digital(i, 1);
+        l->level0=gpio_get_level(acq_chan_gpio(i));
+        memset(&cfg, 0, sizeof(rmt_config_t));
+        cfg.rmt_mode=RMT_MODE_RX;
+        cfg.channel=l->rmt;
+        cfg.gpio_num=acq_chan_gpio(i);
+        cfg.clk_div=(uint8_t)div;
+        cfg.mem_block_num=(uint8_t)blocks;
+        cfg.rx_config.filter_en=false;
+        cfg.rx_config.idle_threshold=LOGIC_IDLE_TICKS;
+        if ((rmt_config(&cfg)!=ESP_OK) || (rmt_driver_install(l->rmt, LOGIC_RINGBUF_LEN, 0)!=ESP_OK)) {
+            printf("logic: can't set up line %d\r\n", i+1);
+            acq_pin_digital(i, 0);
+            logic_mask&=~(0x01<<i);
+            continue;
+        }
+        rmt_get_ringbuf_handle(l->rmt, &l->rb);
+    }
+    if (logic_mask==0)
+        return(-1);
+    logic_nrunning=0;
+    for (i=0; i<LOGIC_LINES; i++) {
+        if (logic_mask & (0x01<<i)) logic_nrunning++;
+    }
+    logic_state=LOGIC_RUNNING;
+    logic_t0=esp_timer_get_time();
+    for (i=0; i<LOGIC_LINES; i++) {
+        if ((logic_mask & (0x01<<i)) == 0) continue;
+        rmt_rx_start(logic_lines[i].rmt, true);
+        xTaskCreate(logic_task, "logic", LOGIC_TASK_STACK, &logic_lines[i], LOGIC_TASK_PRIORITY, NULL);
+    }
+    return(0);
+}
+
+void logic_stop(void)
+{
+    if (logic_state==LOGIC_RUNNING)
+        logic_stop_req=1;
+}
+
+void logic_get_status(logic_status_t* st)
+{
+    int i;
+    memset(st, 0, sizeof(logic_status_t));
+    st->state=logic_state;
+    st->linemask=logic_mask;
+    st->tick_ns=logic_tick_ns;
+    st->window_ms=logic_window_ms;
+    for (i=0; i<LOGIC_LINES; i++) {
+        st->nedges[i]=logic_lines[i].nedges;
+        st->bursts[i]=logic_lines[i].bursts;
+        st->lost[i]=logic_lines[i].lost;
+    }
+}
+
+int logic_edges(int line)
+{
+    if ((line<0) || (line>=LOGIC_LINES) || ((logic_mask & (0x01<<line)) == 0))
+        return(0);
+    return(logic_lines[line].nedges);
+}
+
+uint8_t logic_initial_level(int line)
+{
+    if ((line<0) || (line>=LOGIC_LINES))
+        return(0);
+    return(logic_lines[line].level0);
+}
+
+double logic_edge_usec(int line, int idx)
+{
+    if ((idx<0) || (idx>=logic_edges(line)))
+        return(0.0);
+    return((logic_buf[line][idx] & LOGIC_EDGE_TICKS) * logic_tick_ns / 1000.0);
+}
+
+uint8_t logic_edge_level(int line, int idx)
+{
+    if ((idx<0) || (idx>=logic_edges(line)))
+        return(0);
+    return((logic_buf[line][idx] & LOGIC_EDGE_LEVEL)!=0);
+}
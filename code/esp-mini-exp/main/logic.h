@@ -0,0 +1,64 @@
+
+#ifndef _LOGIC_HEADER_FILE_H
+#define _LOGIC_HEADER_FILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// logic capture
+// Records the edges of 0 to 3.3V logic signals on the channel pins (line 1 is
+// IO34, line 2 is IO35, line 3 is IO33) with the RMT peripheral in receive
+// mode. The RMT times each high and low period in hardware, to a resolution of
+// down to 12.5ns, so only the transitions are stored and a line that doesn't
+// change costs nothing. Edges within a burst are timed exactly. After
+// LOGIC_IDLE_TICKS without an edge the burst is handed over, and the gap to
+// the next burst is timed with esp_timer instead, to within a few microseconds.
+// The RMT memory (LOGIC_RMT_BLOCKS blocks of 128 periods) is shared between the
+// lines captured, so a burst can be 1024 periods long on one line, or 256 with
+// all three. The ESP32 RMT can't empty its memory while receiving, so a longer
+// burst (a continuous clock, say) is lost: use a pulse counter channel for those.
+// Each line keeps up to LOGIC_EDGES_MAX edges, the longest list a calculator can take.
+
+#define LOGIC_LINES 3
+#define LOGIC_EDGES_MAX 999
+#define LOGIC_TICK_NS_DEFAULT 100
+#define LOGIC_RMT_BLOCKS 8                  // RMT memory blocks, each of 64 entries of two periods
+#define LOGIC_IDLE_TICKS 32000              // a burst ends after this long without an edge
+#define LOGIC_RINGBUF_LEN 4096
+#define LOGIC_TASK_STACK 3072
+
+#define LOGIC_IDLE 0
+#define LOGIC_RUNNING 1
+#define LOGIC_DONE 2
+
+#define LOGIC_EDGE_LEVEL 0x80000000         // edge word: level after the edge, and ticks from the start
+#define LOGIC_EDGE_TICKS 0x7fffffff
+
+typedef struct logic_status_s {
+    int state;
+    uint8_t linemask;
+    double tick_ns;                         // actual resolution
+    uint32_t window_ms;
+    uint16_t nedges[LOGIC_LINES];
+    uint32_t bursts[LOGIC_LINES];
+    uint32_t lost[LOGIC_LINES];             // edges that didn't fit
+} logic_status_t;
+
+int logic_start(uint8_t linemask, uint32_t window_ms, double tick_ns); // returns 0 on success
+void logic_stop(void);
+void logic_get_status(logic_status_t* st);
+int logic_edges(int line);                  // line 0..2
+uint8_t logic_initial_level(int line);
+double logic_edge_usec(int line, int idx);  // from the start of the capture
+uint8_t logic_edge_level(int line, int idx);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LOGIC_HEADER_FILE_H */
@@ -42,6 +42,17 @@
 #endif
 
 #include "timerfunc.h"
+#include "capture.h"
+#include "acq.h"
+#include "telemetry.h"
+#include "cloudstream.h"
+#include "flashring.h"
+#include "datalog.h"
+#include "fft.h"
+#include "counter.h"
+#include "wavegen.h"
+#include "prof.h"
+#include "memstat.h"
 #include "esp_timer.h"
 
 
@@ -58,27 +69,29 @@
 #define MIN_PRE_IDLE (0)
 // might need to increase RX_TIMEOUT in future
 #define RX_TIMEOUT 2
+#define UART_TASK_STACK (1024*10)
+#define AZURE_TASK_STACK (1024*10)
 
 #ifdef CONFIG_ESP_CONSOLE_USB_CDC
 #error This example is incompatible with USB CDC console. Please try "console_usb" example instead.
 #endif // CONFIG_ESP_CONSOLE_USB_CDC
 
 const char* prompt = "> ";
-static QueueHandle_t uart0_queue;
-
-esp_timer_handle_t sample_timer;
-xQueueHandle timer_queue;
-
-extern uint8_t casio_rx_buf[];
-
-static char do_append=0;
-static uint8_t appendbuf[64];
-static int appendpos=0;
-
-QueueHandle_t iotq;
 
 /* FreeRTOS event group to signal when we are connected & ready to make a request */
 static EventGroupHandle_t wifi_event_group;
+static StaticEventGroup_t wifi_event_group_buf;
+
+// the Casio link tasks and their buffers, allocated here rather than on the heap
+static StackType_t uart_task_stack[LINK_MAX][UART_TASK_STACK];
+static StaticTask_t uart_task_tcb[LINK_MAX];
+static uint8_t uart_rd_buf[LINK_MAX][RD_BUF_SIZE];
+#ifdef WITH_IOT
+static StackType_t azure_task_stack[AZURE_TASK_STACK];
+static StaticTask_t azure_task_tcb;
+#endif
+static char wifi_ssid[32];
+static char wifi_pw[64];
 
 #ifndef BIT0
 #define BIT0 (0x1 << 0)
@@ -98,12 +111,14 @@ static esp_err_t event_handler(void *ctx, system_event_t *event)
         break;
     case SYSTEM_EVENT_STA_GOT_IP:
         xEventGroupSetBits(wifi_event_group, CONNECTED_BIT);
+        fring_set_online(1); // start sending any telemetry stored while offline
         break;
     case SYSTEM_EVENT_STA_DISCONNECTED:
         /* This is a workaround as ESP platform WiFi libs don't currently
            auto-reassociate. */
         esp_wifi_connect();
         xEventGroupClearBits(wifi_event_group, CONNECTED_BIT);
+        fring_set_online(0); // store telemetry in flash until reconnected
         break;
     default:
         break;
@@ -115,7 +130,7 @@ int esp_platform_init(void);
 static void initialise_wifi(char* ssid, char* wifipw)
 {
     tcpip_adapter_init();
-    wifi_event_group = xEventGroupCreate();
+    wifi_event_group = xEventGroupCreateStatic(&wifi_event_group_buf);
     ESP_ERROR_CHECK( esp_event_loop_init(event_handler, NULL) );
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK( esp_wifi_init(&cfg) );
@@ -141,18 +156,20 @@ static void initialise_wifi(char* ssid, char* wifipw)
     ESP_ERROR_CHECK( esp_wifi_start() );
 }
 
-// task to handle UART events for Casio connection
+// task to handle UART events for a Casio connection. There is one task per link
 static void uart_event_task(void *pvParameters)
 {
+    casio_link_t* lk = (casio_link_t*) pvParameters;
     int i,j;
+    int expect;
     uart_event_t event;
     size_t buffered_size;
-    uint8_t* dtmp = (uint8_t*) malloc(RD_BUF_SIZE);
+    uint8_t* dtmp = uart_rd_buf[lk->id];
     for(;;) {
         //Waiting for UART event.
-        if(xQueueReceive(uart0_queue, (void * )&event, (portTickType)portMAX_DELAY)) {
+        if(xQueueReceive(lk->uart_queue, (void * )&event, (portTickType)portMAX_DELAY)) {
             bzero(dtmp, RD_BUF_SIZE);
-            if (VERBOSE) {ESP_LOGI(TAG, "uart[%d] event:", CASIO_UART_NUM);}
+            if (VERBOSE) {ESP_LOGI(TAG, "uart[%d] event:", lk->uart_num);}
             switch(event.type) {
                 //Event of UART receving data
                 /*We'd better handler data event fast, there would be much more data events than
@@ -160,30 +177,46 @@ static void uart_event_task(void *pvParameters)
                 be full.*/
                 case UART_DATA:
                     if (VERBOSE) {ESP_LOGI(TAG, "[UART DATA]: %d", event.size);}
-                    uart_read_bytes(CASIO_UART_NUM, dtmp, event.size, portMAX_DELAY);
+                    uart_read_bytes(lk->uart_num, dtmp, event.size, portMAX_DELAY);
                     if (VERBOSE) {ESP_LOGI(TAG, "size %d, first bytes are 0x%02x, %02x, %02x, %02x", event.size, dtmp[0], dtmp[1], dtmp[2], dtmp[3]);}
                     if (VERBOSE) {ESP_LOGI(TAG, "[DATA EVT]:");}
-                    if ((do_append==0) && (event.size<15) && (event.size>2)) {
+                    expect=casio_rx_data_len(lk);
+                    if ((expect>0) && ((lk->datapos>0) || (event.size<expect))) {
+                        // data packet spread over more than one UART event, so assemble it
+                        for (i=0; i<event.size; i++) {
+                            if (lk->datapos>=COMM_BUFF_LENGTH)
+                                break;
+                            lk->casio_rx_buf[lk->datapos]=dtmp[i];
+                            lk->datapos++;
+                        }
+                        if (lk->datapos>=expect) {
+                            lk->datapos=0;
+                            casio_uart_processor(lk, 1);
+                        }
+                        break;
+                    }
+                    lk->datapos=0;
+                    if ((lk->do_append==0) && (event.size<15) && (event.size>2)) {
                         if ((dtmp[0]==':') && ((dtmp[1]=='N') || (dtmp[1]=='R'))) {
-                            do_append=1;
-                            appendpos=event.size;
+                            lk->do_append=1;
+                            lk->appendpos=event.size;
                             for (i=0; i<event.size; i++) {
-                                appendbuf[i]=dtmp[i];
+                                lk->appendbuf[i]=dtmp[i];
                             }
                         } else {
                             for (j=0; j<event.size; j++) {
-                                casio_rx_buf[j]=dtmp[j];
+                                lk->casio_rx_buf[j]=dtmp[j];
                             }
                         }
-                    } else if (do_append==1) {
+                    } else if (lk->do_append==1) {
                         for (i=0; i<event.size; i++) {
-                            appendbuf[appendpos]=dtmp[i];
-                            appendpos++;
-                            if (appendpos>=15) {
-                                do_append=0;
-                                appendpos=0;
+                            lk->appendbuf[lk->appendpos]=dtmp[i];
+                            lk->appendpos++;
+                            if (lk->appendpos>=15) {
+                                lk->do_append=0;
+                                lk->appendpos=0;
                                 for (j=0; j<15; j++) {
-                                    casio_rx_buf[j]=appendbuf[j];
+                                    lk->casio_rx_buf[j]=lk->appendbuf[j];
                                 }
                                 break;
                             }
@@ -193,12 +226,12 @@ static void uart_event_task(void *pvParameters)
                             if (i>=COMM_BUFF_LENGTH)
                                 break;
                             else
-                                casio_rx_buf[i]=dtmp[i];
+                                lk->casio_rx_buf[i]=dtmp[i];
                         }
                     }
 
-                    if (do_append==0) {
-                        casio_uart_processor(1);
+                    if (lk->do_append==0) {
+                        casio_uart_processor(lk, 1);
                     }
                     break;
                 //Event of HW FIFO overflow detected
@@ -207,16 +240,16 @@ static void uart_event_task(void *pvParameters)
                     // If fifo overflow happened, you should consider adding flow control for your application.
                     // The ISR has already reset the rx FIFO,
                     // As an example, we directly flush the rx buffer here in order to read more data.
-                    uart_flush_input(CASIO_UART_NUM);
-                    xQueueReset(uart0_queue);
+                    uart_flush_input(lk->uart_num);
+                    xQueueReset(lk->uart_queue);
                     break;
                 //Event of UART ring buffer full
                 case UART_BUFFER_FULL:
                     ESP_LOGI(TAG, "ring buffer full");
                     // If buffer full happened, you should consider encreasing your buffer size
                     // As an example, we directly flush the rx buffer here in order to read more data.
-                    uart_flush_input(CASIO_UART_NUM);
-                    xQueueReset(uart0_queue);
+                    uart_flush_input(lk->uart_num);
+                    xQueueReset(lk->uart_queue);
                     break;
                 //Event of UART RX break detected
                 case UART_BREAK:
@@ -232,19 +265,19 @@ static void uart_event_task(void *pvParameters)
                     break;
                 //UART_PATTERN_DET
                 case UART_PATTERN_DET:
-                    uart_get_buffered_data_len(CASIO_UART_NUM, &buffered_size);
-                    int pos = uart_pattern_pop_pos(CASIO_UART_NUM);
+                    uart_get_buffered_data_len(lk->uart_num, &buffered_size);
+                    int pos = uart_pattern_pop_pos(lk->uart_num);
                     ESP_LOGI(TAG, "[UART PATTERN DETECTED] pos: %d, buffered size: %d", pos, buffered_size);
                     if (pos == -1) {
                         // There used to be a UART_PATTERN_DET event, but the pattern position queue is full so that it can not
                         // record the position. We should set a larger queue size.
                         // As an example, we directly flush the rx buffer here.
-                        uart_flush_input(CASIO_UART_NUM);
+                        uart_flush_input(lk->uart_num);
                     } else {
-                        uart_read_bytes(CASIO_UART_NUM, dtmp, pos, 100 / portTICK_PERIOD_MS);
+                        uart_read_bytes(lk->uart_num, dtmp, pos, 100 / portTICK_PERIOD_MS);
                         uint8_t pat[PATTERN_CHR_NUM + 1];
                         memset(pat, 0, sizeof(pat));
-                        uart_read_bytes(CASIO_UART_NUM, pat, PATTERN_CHR_NUM, 100 / portTICK_PERIOD_MS);
+                        uart_read_bytes(lk->uart_num, pat, PATTERN_CHR_NUM, 100 / portTICK_PERIOD_MS);
                         ESP_LOGI(TAG, "read data: %s", dtmp);
                         ESP_LOGI(TAG, "read pat : %s", pat);
                     }
@@ -256,11 +289,36 @@ static void uart_event_task(void *pvParameters)
             }
         }
     }
-    free(dtmp);
-    dtmp = NULL;
     vTaskDelete(NULL);
 }
 
+// set up the UART and event task for a Casio link
+static void casio_uart_init(casio_link_t* lk, int txpin, int rxpin)
+{
+    esp_err_t ret;
+    char taskname[20];
+    uart_config_t uart_config = {
+        .baud_rate = 38400,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_2,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE
+    };
+    uart_param_config(lk->uart_num, &uart_config);
+    ret=uart_set_pin(lk->uart_num, txpin /*Tx*/, rxpin /*Rx*/, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    if (ret==ESP_OK) {
+        printf("uart_set_pin OK\r\n");
+    }
+    gpio_set_pull_mode(rxpin, GPIO_PULLUP_ONLY); // idle high, in case no calculator is plugged in
+    uart_driver_install(lk->uart_num, BUF_SIZE * 2, BUF_SIZE * 2, 20, &lk->uart_queue, 0);
+    //uart_enable_pattern_det_intr(lk->uart_num, 0x15, PATTERN_CHR_NUM, 10000, 10, 10)
+    uart_set_rx_timeout(lk->uart_num, RX_TIMEOUT);
+    //uart_enable_pattern_det_baud_intr(lk->uart_num, 0x15, PATTERN_CHR_NUM, MIN_PATTERN_INTERVAL, MIN_POST_IDLE, MIN_PRE_IDLE);
+    uart_pattern_queue_reset(lk->uart_num, 20);
+    snprintf(taskname, sizeof(taskname), "uart_event_task%d", lk->id);
+    mem_task_create(uart_event_task, taskname, UART_TASK_STACK, lk, 12, uart_task_stack[lk->id], &uart_task_tcb[lk->id]);
+}
+
 // task to handle interaction with Azure IoT Central
 void azure_task(void *pvParameter)
 {
@@ -278,7 +336,6 @@ void azure_task(void *pvParameter)
 
 void app_main()
 {
-    esp_err_t ret;
     esp_err_t err = nvs_flash_init();
     if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
         ESP_ERROR_CHECK( nvs_flash_erase() );
@@ -287,61 +344,62 @@ void app_main()
     ESP_ERROR_CHECK(err);
     initialize_console();
 
+    acq_init();
+    vchan_init();
+    counter_init();
+    wavegen_init();
     init_miniexp();
-    timer_queue = xQueueCreate(10, sizeof(timer_event_t));
-    sample_timer_init();
+    capture_init();
+    fft_init();
+    prof_init();
 
     // register console commands
     register_wifi();
     register_iot_cmd();
+    register_pll_cmd();
+    register_telem_cmd();
+    register_cloud_cmd();
+    register_backlog_cmd();
+    register_log_cmd();
+    register_fft_cmd();
+    register_filter_cmd();
+    register_vchan_cmd();
+    register_logic_cmd();
+    register_wave_cmd();
+    register_prof_cmd();
+    register_mem_cmd();
 
     // get wifi credentials and initialize wifi
-    char* ssid = malloc(32);
-    char* wifipw = malloc(64);
-    get_wifi_details(ssid, wifipw);
+    get_wifi_details(wifi_ssid, wifi_pw);
 #ifdef WITH_WLAN
-    initialise_wifi(ssid, wifipw);
+    initialise_wifi(wifi_ssid, wifi_pw);
 #endif
-    bzero(ssid, 32);
-    bzero(wifipw, 64);
-    free(ssid);
-    free(wifipw);
+    bzero(wifi_ssid, sizeof(wifi_ssid));
+    bzero(wifi_pw, sizeof(wifi_pw));
 
     // test
     //casio_uart_processor(10);
 
-    adc1_config_width(ADC_WIDTH_BIT_12);
-    adc1_config_channel_atten(ADC1_CHANNEL_6,ADC_ATTEN_DB_11);
-    adc1_config_channel_atten(ADC1_CHANNEL_7,ADC_ATTEN_DB_11);
-    adc1_config_channel_atten(ADC1_CHANNEL_5,ADC_ATTEN_DB_11);
-
-    iotq = xQueueCreate( 5, 32); // a queue of up to 5 items, of 32 bytes each
+    telemetry_init(); // creates iotq, for batched messages to IoT Central
+    fring_init();
+    cloudstream_init();
+    datalog_init(); // mounts the storage partition, and reopens any log from before a reset
 
-    // UART for Casio
-    uart_config_t uart_config = {
-        .baud_rate = 38400,
-        .data_bits = UART_DATA_8_BITS,
-        .parity = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_2,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE
-    };
-    uart_param_config(CASIO_UART_NUM, &uart_config);
-    ret=uart_set_pin(CASIO_UART_NUM, GPIO_NUM_17 /*Tx*/, GPIO_NUM_16 /*Rx*/, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-    if (ret==ESP_OK) {
-        printf("uart_set_pin OK\r\n");
-    }
-    uart_driver_install(CASIO_UART_NUM, BUF_SIZE * 2, BUF_SIZE * 2, 20, &uart0_queue, 0);
-    //uart_enable_pattern_det_intr(CASIO_UART_NUM, 0x15, PATTERN_CHR_NUM, 10000, 10, 10)
-    uart_set_rx_timeout(CASIO_UART_NUM, RX_TIMEOUT);
-    //uart_enable_pattern_det_baud_intr(CASIO_UART_NUM, 0x15, PATTERN_CHR_NUM, MIN_PATTERN_INTERVAL, MIN_POST_IDLE, MIN_PRE_IDLE);
-    uart_pattern_queue_reset(CASIO_UART_NUM, 20);
-    xTaskCreate(uart_event_task, "uart_event_task", 1024*10, NULL, 12, NULL);
+    // UARTs for Casio
+    casio_uart_init(&casio_links[0], CASIO_TX_PIN, CASIO_RX_PIN);
+#ifdef WITH_LINK2
+    casio_uart_init(&casio_links[1], CASIO2_TX_PIN, CASIO2_RX_PIN);
+#endif
 
 #ifdef WITH_IOT
-    if ( xTaskCreate(&azure_task, "azure_task", 1024 * 10, NULL, 5, NULL) != pdPASS ) {
+    // not registered with mem_task_create, since the task ends once the IoT connection is set up
+    if ( xTaskCreateStatic(&azure_task, "azure_task", AZURE_TASK_STACK, NULL, 5, azure_task_stack, &azure_task_tcb) == NULL ) {
         printf("create azure task failed\r\n");
     }
+    mem_static_add("iot", sizeof(azure_task_stack) + sizeof(azure_task_tcb));
 #endif
+    mem_static_add("protocol", sizeof(uart_task_stack) + sizeof(uart_task_tcb) + sizeof(uart_rd_buf));
+    mem_task_add(xTaskGetCurrentTaskHandle(), CONFIG_ESP_MAIN_TASK_STACK_SIZE); // the console runs here
 
     printf("Hello from Mini Explorer\r\n");
     while(1) {
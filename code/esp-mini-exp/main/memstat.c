@@ -0,0 +1,61 @@
+// memory budget
+// rev 1 - registry of static tasks and buffers, for the mem command
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "memstat.h"
+
+// only added to from app_main while the subsystems start, so there's no lock
+static mem_task_t mem_tasks[MEM_TASKS_MAX];
+static int mem_ntasks=0;
+static mem_part_t mem_parts[MEM_PARTS_MAX];
+static int mem_nparts=0;
+
+
+TaskHandle_t mem_task_create(TaskFunction_t fn, const char* name, uint32_t stack_size, void* arg, UBaseType_t prio, StackType_t* stack, StaticTask_t* tcb)
+{
+    TaskHandle_t h;
+    h=xTaskCreateStatic(fn, name, stack_size, arg, prio, stack, tcb);
+    mem_task_add(h, stack_size);
+    return(h);
+}
+
+void mem_task_add(TaskHandle_t handle, uint32_t stack_size)
+{
+    if ((handle==NULL) || (mem_ntasks>=MEM_TASKS_MAX))
+        return;
+    mem_tasks[mem_ntasks].handle=handle;
+    mem_tasks[mem_ntasks].stack=stack_size;
+    mem_ntasks++;
+}
+
+void mem_static_add(const char* part, uint32_t bytes)
+{
+    int i;
+    for (i=0; i<mem_nparts; i++) {
+        if (strcmp(mem_parts[i].name, part)==0) {
+            mem_parts[i].bytes+=bytes;
+            return;
+        }
+    }
+    if (mem_nparts>=MEM_PARTS_MAX)
+        return;
+    mem_parts[mem_nparts].name=part;
+    mem_parts[mem_nparts].bytes=bytes;
+    mem_nparts++;
+}
+
+int mem_get_tasks(const mem_task_t** tasks)
+{
+    *tasks=mem_tasks;
+    return(mem_ntasks);
+}
+
+int mem_get_parts(const mem_part_t** parts)
+{
+    *parts=mem_parts;
+    return(mem_nparts);
+}
@@ -0,0 +1,45 @@
+#ifndef _MEMSTAT_HEADER_FILE_H
+#define _MEMSTAT_HEADER_FILE_H
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// memory budget
+// The acquisition, protocol and telemetry subsystems create their tasks, queues
+// and buffers statically at init, so once the board is running they don't use
+// the heap, and heap free stays steady however long a capture or log runs. Each
+// subsystem registers its tasks and the RAM it holds here, for the console "mem"
+// command, which shows how much of each task's stack has never been used, and
+// helps when making buffers bigger for longer captures.
+// Needs CONFIG_FREERTOS_SUPPORT_STATIC_ALLOCATION (set in sdkconfig.defaults).
+
+#define MEM_TASKS_MAX 12
+#define MEM_PARTS_MAX 12
+
+typedef struct mem_task_s {
+    TaskHandle_t handle;
+    uint32_t stack;                 // bytes
+} mem_task_t;
+
+typedef struct mem_part_s {
+    const char* name;
+    uint32_t bytes;                 // statically allocated
+} mem_part_t;
+
+// creates a task on a static stack of stack_size bytes, and registers it
+TaskHandle_t mem_task_create(TaskFunction_t fn, const char* name, uint32_t stack_size, void* arg, UBaseType_t prio, StackType_t* stack, StaticTask_t* tcb);
+void mem_task_add(TaskHandle_t handle, uint32_t stack_size); // registers a task created elsewhere, such as the main task
+void mem_static_add(const char* part, uint32_t bytes);      // adds to the named subsystem's total
+int mem_get_tasks(const mem_task_t** tasks);                // returns the number of registered tasks
+int mem_get_parts(const mem_part_t** parts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MEMSTAT_HEADER_FILE_H */
@@ -10,6 +10,15 @@
 
 //#define MBED
 
+#ifndef MBED
+#include "sdkconfig.h"
+#ifdef CONFIG_MINIEXP_HOT_IRAM
+// the core's per-packet functions inline into the ME_HOT wrappers below, which are in IRAM
+#define CASIO_CORE_HOT __attribute__((always_inline))
+#endif
+#endif
+#include "../../common/casio_core.h"
+
 #ifndef MBED
 extern "C" {
 #endif
@@ -20,11 +29,22 @@ extern "C" {
 #else
 #include "miniexp.h"
 #include <string.h>
+#include <stdarg.h>
 #include "driver/uart.h"
 #include <driver/adc.h>
 #include "driver/timer.h"
 #include "esp_timer.h"
 #include "timerfunc.h"
+#include "capture.h"
+#include "acq.h"
+#include "telemetry.h"
+#include "cloudstream.h"
+#include "datalog.h"
+#include "fft.h"
+#include "counter.h"
+#include "logic.h"
+#include "wavegen.h"
+#include "memstat.h"
 #include "esp_wifi.h"
 #endif
 
@@ -33,41 +53,13 @@ extern "C" {
 #define LED_PIN         LED0
 #define TOGGLE_RATE     (0.5f)
 #define BUFF_LENGTH     5
-#define CASIO_START_INDICATOR 0x15
-#define CODEA_OK 0x13
-#define CODEB_OK 0x06
-#define CODEA_RETRY 0x05
-#define CODEB_RETRY 0x05
-#define CODEA_ERROR 0x22
-#define CODEB_ERROR 0x22
-#define DIR_CASIO_SEND 'N'
-#define DIR_CASIO_RECV 'R'
-#define TYPE_ASCII 'A'
-#define TYPE_HEX 'H'
-#define START_HEADER_ERROR -10
-#define COMM_IDLE 0
-#define COMM_WAITING_INSTRUCTION 1
-#define COMM_WAITING_DATA 2
-#define COMM_WAITING_RX_HEADER_ACK 3
-#define COMM_WAITING_RX_PACKET_ACK 4
-#define COMM_WAITING_PERFORM_ROLESWAP 5
-#define PROC_NULL 0
-#define PROC_SEND38K 1
-#define PROC_RECV38K 2
-#define BRIEF 1
-#define HL_IDLE 0
-#define HL_SENDING 1
-#define HL_ME_GETSAMPLE1 2
-#define HL_ME_GETSAMPLE2 3
-#define HL_ME_GETSAMPLE3 4
-#define HL_STATUS_CHECK 5
-#define HL_ME_STATUS 6
-#define TOK_MAX 6
-#define CHAN_MAX 3
-#define TRIG_MODE_NRT 0
-#define TRIG_MODE_RT 1
-#define TOK_TYPE_INT 0
-#define TOK_TYPE_FLOAT 1
+// the board's own lists, sent on Receive38K by the protocol core
+#define HL_ME_CAPTURE_LIST (HL_BOARD+0)
+#define HL_ME_LOG_PAGE (HL_BOARD+1)
+#define HL_ME_DECIM_LIST (HL_BOARD+2)
+#define HL_ME_FFT_LIST (HL_BOARD+3)
+#define HL_ME_LOGIC_LIST (HL_BOARD+4)
+#define LOGIC_USEC_SEND_MAX 999999.0 // ASCII values have 6 digits, so later edge times are sent in ms
 #define ENV_ENA_PIN PF9
 #define TIMER_SAMP_CHAN_NONE 0
 #define TIMER_MASK_CHAN0 0x01
@@ -85,61 +77,18 @@ extern "C" {
 
 
 
-#define SYS_IDLE 0
-#define SYS_INIT 1
-
-
-// typedef
-typedef struct casio_cmd_s {
-    char direction;
-    char type;
-    char form;
-    uint16_t line;
-    uint32_t offset;
-    uint16_t psize;
-    char area;
-    char csum;
-    uint16_t datapacksize; // packet size including start and checksum
-    char direction2;
-    char type2;
-    char form2;
-    char csum2;
-    char command;
-} casio_cmd_t;
-
-typedef struct cmd_tok_s {
-    int tokint;
-    double tokfloat;
-    char toktype;
-} cmd_tok_t;
-
-typedef struct chan_setup_s {
-    char operation;
-} chan_setup_t;
-
-typedef struct samp_trig_setup_s {
-    uint32_t period_usec;
-    unsigned int numsamp;
-    char mode;
-} samp_trig_setup_t;
-
 // globals
 #ifdef MBED
 Serial usb_serial(USBTX, USBRX);
 Serial casio_serial(PC11, PC10, NULL, 38400);
 Si1133* light_sensor;
 #endif
-casio_cmd_t casio_cmd;
-char procedure=PROC_NULL;
-chan_setup_t chan_setup[CHAN_MAX];
-samp_trig_setup_t samp_trig_setup;
+casio_link_t casio_links[LINK_MAX];
 #ifdef MBED
 DigitalOut env_en(ENV_ENA_PIN, 1);
 LowPowerTicker      blinker;
 DigitalOut          LED(LED_PIN);
 #else
-extern QueueHandle_t iotq;
-extern xQueueHandle timer_queue;
 char iot_connection_ok=0; // this gets set to 1 when the IoT connection is successful
 #endif
 
@@ -152,44 +101,147 @@ event_callback_t    casioEventCb;
 #endif
 
 uint8_t             rx_buf[BUFF_LENGTH + 1];
-uint8_t             casio_rx_buf[COMM_BUFF_LENGTH + 1];
-uint8_t             casio_tx_buf[1024];
-char comm_state = COMM_IDLE;
-char sys_state = SYS_IDLE;
-char hl_state = HL_IDLE;
-uint16_t sampnum = 0;
-int8_t sample_method = TIMER_SAMP_CHAN_NONE;
 
-double value=-10.0;
+#ifdef MBED
+// the Mbed serial API calls back without a context, and only has the one link
+void casio_uart_callback(int events) {
+    casio_uart_processor(&casio_links[0], events);
+}
+#endif
+
+// the board side of the protocol core
+struct me_platform {
+    typedef casio_link_t link_t;
+    enum { chan_total=CHAN_TOTAL, rx_len=COMM_BUFF_LENGTH, verbose=VERBOSE, pingpong=PINGPONG, developer=DEVELOPER, hlpp=HLPP };
+    static void send(casio_link_t* lk, const uint8_t* buf, uint16_t len)
+    {
+#ifdef MBED
+        casio_serial.write(buf, len, NULL);
+#else
+        uart_write_bytes(lk->uart_num, (const char*)buf, len);
+#endif
+    }
+    static void receive(casio_link_t* lk, int len, int match)
+    {
+#ifdef MBED
+        casio_serial.read(lk->casio_rx_buf, len, casio_uart_callback, SERIAL_EVENT_RX_ALL, (match<0) ? SERIAL_RESERVED_CHAR_MATCH : match);
+#endif
+        // on the ESP32, the UART task assembles the packets itself, using casio_rx_data_len
+    }
+    static void print(const char* fmt, ...)
+    {
+        va_list ap;
+        va_start(ap, fmt);
+#ifdef MBED
+        usb_serial.vprintf(fmt, ap);
+#else
+        vprintf(fmt, ap);
+#endif
+        va_end(ap);
+    }
+    static double read_sample(int chan);
+    static int64_t usec(void)
+    {
+#ifdef MBED
+        return((int64_t)us_ticker_read());
+#else
+        return(esp_timer_get_time());
+#endif
+    }
+    static char status(void);
+    static int active_chans(casio_link_t* lk);
+    static int read_row(casio_link_t* lk, double* vals, char type);
+    static void chan_setup(casio_link_t* lk, int chan, int type);
+    static void clear_channels(casio_link_t* lk);
+    static void trigger(casio_link_t* lk);
+    static void sampling_done(casio_link_t* lk);
+    static int op_nargs(int op);
+    static double op_2001(casio_link_t* lk, cmd_tok_t* op, int nargs, char in_batch);
+    static unsigned int list_begin(casio_link_t* lk);
+    static double list_value(void* ctx, unsigned int idx);
+    static void list_end(casio_link_t* lk, int state);
+};
+typedef casio_core<me_platform> me_core;
 
 // functions
 
 void
 init_miniexp(void)
 {
-    int i;
-    for (i=0; i<CHAN_MAX; i++) {
-        chan_setup[i].operation = 0; // clear all channels
+    int i, n;
+    casio_link_t* lk;
+    for (n=0; n<LINK_MAX; n++) {
+        lk=&casio_links[n];
+        memset(lk, 0, sizeof(casio_link_t));
+        lk->id=n;
+        lk->uart_num=(n==0) ? CASIO_UART_NUM : CASIO2_UART_NUM;
+        lk->procedure=PROC_NULL;
+        lk->comm_state=COMM_IDLE;
+        lk->sys_state=SYS_IDLE;
+        lk->hl_state=HL_IDLE;
+        lk->sample_method=TIMER_SAMP_CHAN_NONE;
+        lk->stream_chan=-1;
+        for (i=0; i<CHAN_TOTAL; i++) {
+            lk->chan_setup[i].operation = 0; // clear all channels
+        }
+        sample_timer_init(&lk->samp, &lk->sample_method);
     }
+    mem_static_add("protocol", sizeof(casio_links));
 }
 
 char
-count_active_chan(void) {
+count_active_chan(casio_link_t* lk) {
     char tot=0;
     int i;
-    for (i=0; i<CHAN_MAX; i++) {
-        if (chan_setup[i].operation != 0) {
+    uint8_t used=0;
+    for (i=0; i<CHAN_TOTAL; i++) {
+        if (lk->chan_setup[i].operation != 0) {
             tot++;
-            sample_method |= (0x01<<i);
+            if (i<CHAN_MAX) {
+                used |= (0x01<<i);
+            } else {
+                used |= vchan_chanmask(i-CHAN_MAX); // a virtual channel needs the channels it reads sampled too
+            }
+        }
+    }
+    for (i=0; i<CHAN_MAX; i++) {
+        if (used & (0x01<<i)) {
+            lk->sample_method |= (0x01<<i);
         } else {
-            sample_method &= ~(0x01<<i);
+            lk->sample_method &= ~(0x01<<i);
         }
     }
     return(tot);
 }
 
-double
-get_sample(int chan)
+// fills row with a value for every channel (CHAN_TOTAL of them). The physical channels come from meas,
+// or are sampled now if meas is NULL, and then the virtual channels are worked out from them.
+void
+get_chan_row(casio_link_t* lk, double* row, const double* meas, int64_t t_usec)
+{
+    int i;
+    uint8_t used=0;
+    for (i=0; i<CHAN_TOTAL; i++) {
+        if (lk->chan_setup[i].operation != 0) {
+            used |= (i<CHAN_MAX) ? (0x01<<i) : vchan_chanmask(i-CHAN_MAX);
+        }
+    }
+    for (i=0; i<CHAN_MAX; i++) {
+        row[i]=0.0;
+        if (used & (0x01<<i)) {
+            row[i] = (meas!=NULL) ? meas[i] : get_sample(NULL, i);
+        }
+    }
+    for (i=CHAN_MAX; i<CHAN_TOTAL; i++) {
+        row[i]=0.0;
+        if (lk->chan_setup[i].operation != 0) {
+            row[i]=vchan_eval(i-CHAN_MAX, row, t_usec, &lk->vchan_st[i-CHAN_MAX]);
+        }
+    }
+}
+
+ME_HOT double
+get_sample(acq_reader_t* rd, int chan)
 {
     double sampval=0.0;
 #ifdef MBED
@@ -198,483 +250,209 @@ get_sample(int chan)
     light=light/1000.0;
     sampval=(double)light;
 #else
-    // for ESP32, channel numbering:
-    // chan 0 (Casio CHAN1) is ESP32 ADC1_CHANNEL_6 (IO34)
-    // chan 1 (Casio CHAN2) is ESP32 ADC1_CHANNEL_7 (IO35)
-    // chan 1 (Casio CHAN3) is ESP32 ADC1_CHANNEL_5 (IO33)
-    switch(chan) {
-        case 0:
-            sampval = (double)adc1_get_raw(ADC1_CHANNEL_6);
-            break;
-        case 1:
-            sampval = (double)adc1_get_raw(ADC1_CHANNEL_7);
-            break;
-        case 2:
-            sampval = (double)adc1_get_raw(ADC1_CHANNEL_5);
-            break;
-        default:
-            printf("ERROR - unexpected channel in get_sample!\r\n");
-            break;
+    if (counter_mode(chan)!=COUNTER_OFF) {
+        sampval=counter_read(chan);
+    } else {
+        sampval=raw_to_volts((rd!=NULL) ? acq_read(rd, chan, ACQ_CACHE_USEC) : acq_read_raw(chan, ACQ_CACHE_USEC));
     }
-    sampval=sampval/1241.0;
 #endif
     return(sampval);
 }
 
+double
+me_platform::read_sample(int chan)
+{
+    return(get_sample(NULL, chan));
+}
 
-uint16_t rescale(double v) {
-    double value;
-    double scaled;
-    uint16_t scaled_u16;
-    value=v;
-    if (value>10.0) value=10.0;
-    if (value<-10.0) value = -10.0;
-    // convert value to a 12-bit number
-    scaled=10.92+value;
-    scaled=scaled*4096;
-    scaled=scaled/21.555;
-    scaled_u16=(uint16_t)scaled;
-    scaled_u16=scaled_u16&0x0fff;
-    return(scaled_u16);
+ME_HOT uint16_t rescale(double v) {
+    return(me_core::rescale(v));
 }
 
 
-// com_seek_char searches the casio comms rx buffer for a particular
-// character v. Returns the position of v. Returns -1 if it was not found.
-int
-comm_seek_char(char v)
+// convert a floating point value into ascii text 
+// this function always returns 6 characters such as "1.2345" but no end of string!!
+ME_HOT void float2ascii(double v, uint8_t* buf)
 {
-    int i;
-    char found=0;
-    for (i=0; i<COMM_BUFF_LENGTH; i++) {
-        if(casio_rx_buf[i] == v){
-            found=1;
-            break;
-        }
-    }
-    if (found)
-        return (i);
-    else
-        return(-1);
+    me_core::float2ascii(v, buf);
 }
 
-void
-casio_send_response(char r)
+ME_HOT int8_t
+calc_checksum(uint8_t* buf, int len, char* calc_result)
 {
-#ifdef MBED
-    casio_serial.write((const uint8_t *)&r, 1, NULL);
-#else
-    uart_write_bytes(CASIO_UART_NUM, (const char*) &r, 1);
-#endif
+    if (me_core::checksum(buf, len, calc_result)!=0) {
+        printf("error, buffer too small for calculating checksum!\r\n");
+        return(-1);
+    }
+    return(0);
 }
 
-void
-casio_send_buf(uint8_t* buf, uint16_t len)
+// builds a measurement packet of n values in buf, ASCII or (type 'H') hex. Returns its length
+ME_HOT int
+build_meas_packet(uint8_t* buf, char type, const double* vals, int n)
 {
-#ifdef MBED
-    casio_serial.write(buf, len, NULL);
-#else
-    uart_write_bytes(CASIO_UART_NUM, (const char*) buf, len);
-#endif
+    return(me_core::build_row(buf, type, vals, n));
 }
 
-// hex_print: used to print the entire passed buffer of length len
-// if brief is set to 1 then it will only print the hex values
-// otherwise it will also print the ascii text for the buffer too.
-// Output example: 3a,31,32,2c,31,40  text: ':12,1@'
-// where 0x3a is the start byte, and 0x40 is the checksum
-// 
-void
-hex_print(uint8_t* buf, char len, char brief=0)
+// 1 if another calculator has a capture list on its way, so the capture mustn't be armed again yet
+static char
+capture_fetching(casio_link_t* lk)
 {
     int i;
-    char printable=0;
-    if (len<1) return;
-    USB_PRINT("%02x", buf[0]);
-    for (i=1; i<len; i++) {
-        USB_PRINT(",%02x", buf[i]);
-    }
-    
-    if (brief) return;
-    
-    USB_PRINT("  text: '");
-    for (i=0; i<len; i++) {
-        printable=1;
-        if ((buf[i]<32) || (buf[i]>126))
-            printable=0;
-        if (printable)
-            USB_PRINT("%c", buf[i]);
-        else
-            USB_PRINT(".");
+    for (i=0; i<LINK_MAX; i++) {
+        if ((&casio_links[i]!=lk) && (casio_links[i].hl_state==HL_ME_CAPTURE_LIST))
+            return(1);
     }
+    return(0);
 }
 
-void
-asc_print(uint8_t* buf, char len)
+double
+capture_list_value(void* ctx, unsigned int idx)
 {
-    int i;
-    char printable=0;
-    if (len<1) return;
-
-    for (i=0; i<len; i++) {
-        printable=1;
-        if ((buf[i]<32) || (buf[i]>126))
-            printable=0;
-        if (printable)
-            USB_PRINT("%c", buf[i]);
-        else
-            USB_PRINT(".");
-    }
+    return(raw_to_volts(capture_get(*(char*)ctx, idx)));
 }
 
-void get_tokens(uint8_t* buf, uint16_t len, cmd_tok_t* tok_arr, char* total)
+double
+log_page_value(void* ctx, unsigned int idx)
 {
-    char* token;
-    const char s[2]=",";
-    char tot=0;
-    buf[len]='\0'; // bit naughty, writing outside the length specified. We don't need the checksum so it will get overwritten
-    
-    token=strtok((char*)buf, s);
-    
-    while(token != NULL) {
-        sscanf(token, "%d", &(tok_arr[(unsigned char)tot].tokint));
-        tok_arr[(unsigned char)tot].toktype=TOK_TYPE_INT;
-        if (strstr(token, ".")!=NULL) {
-            sscanf(token, "%lf", &(tok_arr[(unsigned char)tot].tokfloat));
-            tok_arr[(unsigned char)tot].toktype=TOK_TYPE_FLOAT;
-        }
-        tot++;
-        if (tot>=TOK_MAX) {
-            if(DEVELOPER) USB_PRINT("Reached TOK_MAX number of allowed tokens\r\n");
-            break;
-        }
-        token = strtok(NULL, s); // get next token
-    }
-    if(VERBOSE) USB_PRINT("num tokens found: %d\r\n", tot);
-    *total=tot;
+    casio_link_t* lk=(casio_link_t*)ctx;
+    uint16_t raw;
+    if (lk->log_fetch_chan<0)
+        return(datalog_row_time(lk->log_fetch_row+idx));
+    if (datalog_get_raw(lk->log_fetch_row+idx, lk->log_fetch_chan, &raw)!=0)
+        return(-1.0);
+    return(raw_to_volts(raw));
 }
 
-void
-instruction_print(char do_pingpong=0)
+// sources for decimation. ctx holds the channel
+int
+capture_decim_get(void* ctx, uint32_t idx, uint16_t* raw)
 {
-    char dirprint=0;
-    char typeprint=0;
-    char formprint=0;
-    if (casio_cmd.direction2!=0) {
-        dirprint = DIR_CASIO_RECV;
-    } else {
-        dirprint = DIR_CASIO_SEND;
-    }
-    if(!do_pingpong)
-        USB_PRINT("instruction: {\r\n");
-    switch(dirprint) {
-        case DIR_CASIO_SEND:
-            if (do_pingpong)
-                USB_PRINT("  |---N");
-            else
-                USB_PRINT("  direction : send,\r\n");
-            break;
-        case DIR_CASIO_RECV:
-            if (do_pingpong)
-                USB_PRINT("  |---------------R");
-            else
-                USB_PRINT("  direction : recv,\r\n");
-            break;
-        default:
-            if (do_pingpong)
-                USB_PRINT("  |?---X");
-            else
-                USB_PRINT("  direction : unknown '%c',\r\n", casio_cmd.direction);
-            break;
-    }
-    if (dirprint==DIR_CASIO_RECV)
-        typeprint=casio_cmd.type2;
-    else
-        typeprint=casio_cmd.type;
-    switch(typeprint) {
-        case 'A':
-            if (do_pingpong)
-                USB_PRINT("A");
-            else
-                USB_PRINT("  type : ascii,\r\n");
-            break;
-        case 'H':
-            if (do_pingpong)
-                USB_PRINT("H");
-            else
-                USB_PRINT("  type : hex,\r\n");
-            break;
-        default:
-            if (do_pingpong)
-                USB_PRINT("X");
-            else
-                USB_PRINT("  type : unknown '%c',\r\n", typeprint);
-            break;
-    }
-    if (dirprint==DIR_CASIO_RECV)
-        formprint=casio_cmd.form2;
-    else
-        formprint=casio_cmd.form;
-    switch(formprint) {
-        case 'V':
-            if (do_pingpong)
-                USB_PRINT("V");
-            else
-                USB_PRINT("  form : variable,\r\n");
-            break;
-        case 'L':
-            if (do_pingpong)
-                USB_PRINT("L");
-            else
-                USB_PRINT("  form : list,\r\n");
-            break;
-        default:
-            if (do_pingpong)
-                USB_PRINT("X");
-            else
-                USB_PRINT("  form : unknown '%c',\r\n", formprint);
-            break;
-    }
-    if (dirprint==DIR_CASIO_SEND) {
-        // these fields only make sense for send from casio
-        if (do_pingpong) {
-#ifdef MBED
-            USB_PRINT(",L=%u,O=%lu,P=%u,", casio_cmd.line, casio_cmd.offset, casio_cmd.psize);
-#else
-            USB_PRINT(",L=%u,O=%u,P=%u,", casio_cmd.line, casio_cmd.offset, casio_cmd.psize);
-#endif
-        } else {
-            USB_PRINT("  line : %u,\r\n", casio_cmd.line);
-#ifdef MBED
-            USB_PRINT("  offset : %lu,\r\n", casio_cmd.offset);
-#else
-            USB_PRINT("  offset : %u,\r\n", casio_cmd.offset);
-#endif
-            USB_PRINT("  packet_size : %u,\r\n", casio_cmd.psize);
-        }
-        if (do_pingpong) {
-            // tidy the length for pingpong properly later
-            if (casio_cmd.psize>9)
-                USB_PRINT("%c---------->|\r\n", casio_cmd.area);
-            else
-                USB_PRINT("%c----------->|\r\n", casio_cmd.area);
-        } else {
-            switch(casio_cmd.area) {
-                case 'A':
-                    USB_PRINT("  area : all,\r\n");
-                    break;
-                case 'S':
-                    USB_PRINT("  area : start,\r\n");
-                    break;
-                case 'M':
-                    USB_PRINT("  area : middle,\r\n");
-                    break;
-                case 'E':
-                    USB_PRINT("  area : end,\r\n");
-                    break;
-                default:
-                    USB_PRINT("  area : unknown '%c',\r\n", casio_cmd.form);
-                    break;
-            }
-        }
-    } else {
-        // DIR_CASIO_RECV
-        if (do_pingpong) USB_PRINT("------------->|\r\n");
-    }
-    if (!do_pingpong) {
-        USB_PRINT("  checksum : 0x%02x\r\n", casio_cmd.csum);
-        USB_PRINT("}\r\n");
-    }
+    *raw=capture_get(*(char*)ctx, idx);
+    return(0);
 }
 
-void
-print_hlpp_r38(uint8_t* buf, uint16_t len, char f)
+int
+log_decim_get(void* ctx, uint32_t idx, uint16_t* raw)
 {
-    int8_t plen;
-    int i;
-    char padding[24];
-    
-    USB_PRINT("  |<--R38K: ");
-    if (f=='A') { // ASCII
-        if (len<20) {
-            plen=(int8_t)len;
-            asc_print(buf, plen);
-        } else {
-            plen=20;
-            asc_print(buf, plen-3);
-            USB_PRINT("etc");
-        }     
-        for (i=0; i<(20-plen); i++) {
-            padding[i]='-';
-        }
-        padding[20-plen]='\0';
-        USB_PRINT(padding);
-        USB_PRINT("---|\r\n");
-    } else if (f=='H') { // Hex
-        USB_PRINT("0x");
-        if (len<6) {
-            plen=(int8_t)len;
-            hex_print(buf, plen, BRIEF);
-        } else {
-            plen=6;
-            hex_print(buf, plen-1, BRIEF);
-            USB_PRINT("..");
-        }     
-        for (i=0; i<(17-plen); i++) {
-            padding[i]='-';
-        }
-        padding[17-plen]='\0';
-        USB_PRINT(padding);
-        USB_PRINT("-|\r\n");    
-    } else {
-        // unknown format
-        USB_PRINT("unknown format!--------|\r\n");
-    }
+    return(datalog_get_raw(idx, *(char*)ctx, raw));
 }
 
-// convert a floating point value into ascii text 
-// this function always returns 6 characters such as "1.2345" but no end of string!!
-void float2ascii(double v, uint8_t* buf)
+int
+log_decim_block_minmax(void* ctx, uint32_t block, uint16_t* min, uint16_t* max)
 {
-    int idx=0;
-    int i;
-    int l;
-    char found=0;
-    uint8_t x;
-    uint8_t tbuf[10];
-    snprintf((char*)tbuf, 9, "%lf", v);
-    tbuf[6]='\0';
-    //printf("input is  '%s'\n", tbuf);
-    for (i=0; i<10;i++) {
-        found=0;
-        x=tbuf[i];
-        if (x=='-') {
-            found=1;
-        } else if (x=='.') {
-            found=1;
-        } else if ((x>='0') && (x<='9')) {
-            found=1;
-        } else if (x=='\0') {
-            found=2;
-        }
-        switch(found) {
-            case 0:
-                // perhaps space?
-                break;
-            case 1: // found valid char
-                buf[idx]=x;
-                idx++;
-                if (idx>=6) {
-                    //buf[6]='\0';
-                    i=10;
-                }
-                break;
-            case 2: // found end of string
-                l=strlen((char*)buf);
-                if (l<6) {
-                    // zero pad from the beginning
-                    for (i=5; i>=0; i--) {
-                        l--;
-                        if (l>=0) {
-                            if(buf[i-(5-l)]=='-') {
-                                found=3;
-                                buf[i]='0';
-                            } else {
-                                buf[i]=buf[i-(5-l)];
-                            }
-                        } else {
-                            buf[i]='0';
-                        }
-                    }
-                } else {
-                    //buf[6]='\0';
-                }
-                if (found==3) {
-                    buf[0]='-';
-                }
-                //buf[6]='\0';
-                break;
-            default:
-                // should not occur
-                break;
-        }
+    dlog_index_t idx;
+    if (datalog_get_index(block, &idx)!=0)
+        return(-1);
+    *min=idx.min[(int)*(char*)ctx];
+    *max=idx.max[(int)*(char*)ctx];
+    return(0);
+}
 
-    }
-    //printf("output is '%s'\n", buf);
+double
+decim_list_value(void* ctx, unsigned int idx)
+{
+    casio_link_t* lk=(casio_link_t*)ctx;
+    if (lk->dec_send_x)
+        return((double)lk->dec_x[idx]);
+    return(raw_to_volts(lk->dec_raw[idx]));
 }
 
-void clear_buf(uint8_t* buf, char len)
+double
+fft_list_value(void* ctx, unsigned int idx)
 {
-    int i;
-    for (i=0; i<len; i++) {
-        buf[i]=0;
+    casio_link_t* lk=(casio_link_t*)ctx;
+    if (lk->fft_send_freq)
+        return(idx*lk->fft_binhz);
+    return(lk->fft_amp[idx]);
+}
+
+double
+logic_list_value(void* ctx, unsigned int idx)
+{
+    casio_link_t* lk=(casio_link_t*)ctx;
+    switch(lk->logic_send) {
+        case 1:
+            return((double)logic_edge_level(lk->logic_line, idx));
+        case 2:
+            return(logic_edge_usec(lk->logic_line, idx)/1000.0);
+        default:
+            return(logic_edge_usec(lk->logic_line, idx));
     }
 }
 
-int8_t
-calc_checksum(uint8_t* buf, int len, char* calc_result)
+// decimates capture (from_log 0) or log channel chan to a list for the next Receive38K.
+// chan 0 instead sends the sample numbers of the last decimated list
+int
+me_decimate(casio_link_t* lk, char from_log, int chan, int npoints, int mode)
 {
-    int i;
-    char tot=0;
-    if(len<3) {
-        printf("error, buffer too small for calculating checksum!\r\n");
-        return(-1);
+    char c=chan-1;
+    decim_src_t src;
+    if ((chan<1) || (chan>CHAN_MAX)) {
+        lk->dec_send_x=1;
+        return(lk->dec_len);
     }
-    // loop through buffer except the start and end bytes
-    for (i=1; i<(len-1); i++) {
-        tot=tot+buf[i];
+    lk->dec_send_x=0;
+    memset(&src, 0, sizeof(decim_src_t));
+    src.ctx=&c;
+    if (from_log) {
+        src.len=datalog_rows();
+        src.block_len=datalog_rows_per_block();
+        src.get=log_decim_get;
+        src.block_minmax=log_decim_block_minmax;
+    } else {
+        src.len=((capture_chanmask() & (0x01<<c))!=0) ? capture_count() : 0;
+        src.get=capture_decim_get;
     }
-    *calc_result = (0xff - tot)+1;
-    return(0);
+    if (mode==DECIM_LTTB)
+        lk->dec_len=decim_lttb(&src, lk->dec_first, (lk->dec_last>0) ? lk->dec_last : src.len, npoints, lk->dec_raw, lk->dec_x);
+    else
+        lk->dec_len=decim_minmax(&src, lk->dec_first, (lk->dec_last>0) ? lk->dec_last : src.len, npoints, lk->dec_raw, lk->dec_x);
+    if (lk->dec_len<0) lk->dec_len=0;
+    return(lk->dec_len);
 }
 
+// converts a token to a value, whether it was sent as an integer or not
+double
+tok_value(cmd_tok_t* tok)
+{
+    if (tok->toktype==TOK_TYPE_FLOAT)
+        return(tok->tokfloat);
+    return((double)tok->tokint);
+}
 
-int8_t
-decode_instruction(uint8_t* buf)
+ME_HOT int8_t
+decode_instruction(casio_cmd_t* cmd, uint8_t* buf)
 {
-    char csum;
-    // sanity check
-    if (buf[0]!=':') {
-        USB_PRINT("error, start_header is not ':'!\r\n");
-        return(START_HEADER_ERROR);
-    }
-    if ((buf[1]!='N') && (buf[1]!='R')) {
-        USB_PRINT("error, direction is not 'N' or 'R'!\r\n");
-        return(-1);
-    }
-    calc_checksum(buf, 15, &csum);
-    if (csum!=buf[14]) {
-        USB_PRINT("error, I compute checksum should be %02x\r\n", csum);
-        return(-1);
-    }
-    
-    if (buf[1]==DIR_CASIO_SEND) {
-        casio_cmd.direction=buf[1];
-        casio_cmd.type=buf[2];
-        casio_cmd.form=buf[3];
-        casio_cmd.line=(uint16_t)buf[4];
-        casio_cmd.line=(casio_cmd.line<<8) | ((uint16_t)buf[5]);
-        casio_cmd.offset=((uint32_t)buf[6])<<24;
-        casio_cmd.offset=casio_cmd.offset | (((uint32_t)buf[7])<<16);
-        casio_cmd.offset=casio_cmd.offset | (((uint32_t)buf[8])<<8);
-        casio_cmd.offset=casio_cmd.offset | ((uint32_t)buf[9]);
-        casio_cmd.psize=(uint16_t)buf[10];
-        casio_cmd.psize=(casio_cmd.psize<<8) | ((uint16_t)buf[11]);
-        casio_cmd.area=buf[13];
-        casio_cmd.csum=buf[14];
-        casio_cmd.direction2=0;
-    } else { // DIR_CASIO_RECV
-        casio_cmd.direction2=buf[1];
-        casio_cmd.type2=buf[2];
-        casio_cmd.form2=buf[3];
-        casio_cmd.csum2=buf[14];
+    int8_t res=me_core::decode_instruction(cmd, buf);
+    switch(res) {
+        case CASIO_START_HEADER_ERROR:
+            USB_PRINT("error, start_header is not ':'!\r\n");
+            break;
+        case CASIO_DIRECTION_ERROR:
+            USB_PRINT("error, direction is not 'N' or 'R'!\r\n");
+            break;
+        case CASIO_CHECKSUM_ERROR:
+            USB_PRINT("error, instruction checksum is wrong\r\n");
+            return(-1);
+        default:
+            if(VERBOSE) USB_PRINT("instruction decoded\r\n");
+            break;
     }
-    
-    if(VERBOSE) USB_PRINT("instruction decoded\r\n");
-    return(0);
+    return(res);
 }
 
 
+// number of bytes expected for a Send38K data packet, or 0 if we aren't waiting for one.
+// Long packets arrive in several UART events and need to be assembled first.
+ME_HOT int
+casio_rx_data_len(casio_link_t* lk)
+{
+    if (lk->comm_state==COMM_WAITING_DATA)
+        return(lk->casio_cmd.datapacksize);
+    return(0);
+}
+
 // callbacks
 void blink(void) {
 #ifdef MBED
@@ -682,891 +460,794 @@ void blink(void) {
 #endif
 }
 
+// MiniExp status: 1 = running, 2 = WiFi connected, 3 = time set, 4 = IoT connection ok
+char
+me_status(void)
+{
+    char av='1';
+    wifi_ap_record_t apinfo;
+    if (esp_wifi_sta_get_ap_info(&apinfo)==ESP_OK) {
+        av ='2'; // WiFi is connected
+        if (get_year()>=2021) {
+            av ='3'; // NTP is working
+            if (iot_connection_ok==1) {
+                av ='4'; // IoT connection is ok
+            }
+        }
+    }
+    return(av);
+}
+
+// number of arguments each of the board's 2001 operations takes, so that a batch can be split up.
+// The protocol core knows the ones it handles itself
+int
+me_op_nargs(int op)
+{
+    switch(op) {
+        case 60:
+            return(TOK_MAX); // all the values that follow, so it has to come last in a batch
+        case 35:
+        case 37:
+        case 62:
+            return(4);
+        case 40:
+        case 42:
+        case 44:
+        case 46:
+        case 53:
+            return(3);
+        case 24:
+        case 50:
+        case 51:
+        case 43:
+        case 45:
+        case 32:
+        case 34:
+        case 38:
+        case 39:
+        case 47:
+        case 48:
+        case 61:
+            return(2);
+        default:
+            return(1);
+    }
+}
 
-void casio_uart_processor(int events) {
-    int8_t res;
-    int txbytes_total=0;
-    uint16_t scaled_u16;
-    int8_t plen;
+// performs one of the board's 2001 operations, for casio_core::op(). op[0] is the operation,
+// followed by nargs arguments. On its own, an operation may prepare a response for the next
+// Receive38K. In a batch, every operation instead returns a value for the combined result list.
+double
+me_2001_op(casio_link_t* lk, cmd_tok_t* op, int nargs, char in_batch)
+{
     int i;
-    char padding[24];
-    char doerror=0;
-    char numtok=0;
-    //int16_t tok_arr[TOK_MAX];
-    cmd_tok_t tok_arr[TOK_MAX];
-    double sample;
-    char iot_text[64]={0};
-    
-    
-    
-    switch(comm_state) {
-        case COMM_IDLE:
-            procedure=PROC_NULL;
-            if (comm_seek_char(CASIO_START_INDICATOR) >= 0) {
-                // casio has sent a start indicator. We should send CODEA_OK
-                // but first prepare for the 15 byte response
-                comm_state=COMM_WAITING_INSTRUCTION;
-                clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-                if(PINGPONG) USB_PRINT("  |                                |\r\n");
-                if(PINGPONG) USB_PRINT("  |                          **COMM_IDLE**\r\n");
-                if(PINGPONG) USB_PRINT("  |------0x15-CASIO-START-IND----->|\r\n");     
-                if(PINGPONG) USB_PRINT("  |<-----------CODEA_OK------------|\r\n");
-                if(DEVELOPER) USB_PRINT("wait instruct:\r\n");
+    int arg=0;
+    double res=1.0; // operations with nothing to report return 1
+    if (nargs>=1) arg=op[1].tokint;
+    switch (op[0].tokint)
+    {
+        case 24: // stream samples to the cloud: 2001,24,period,chanmask. A period of 0 stops streaming
+            res=0.0;
 #ifdef MBED
-                casio_serial.read(casio_rx_buf, 15, casio_uart_processor);
-#endif
-                // send CODEA_OK
-                casio_send_response(CODEA_OK);
+            // not supported currently
+#else
+#ifdef WITH_IOT
+            if ((nargs<1) || (tok_value(&op[1])<=0.0)) {
+                cloudstream_stop();
+                if(DEVELOPER) USB_PRINT("cloud streaming stopped\r\n");
+                res=1.0;
             } else {
-                // we didn't receive a start indication from casio.
-                if(DEVELOPER) USB_PRINT("received junk, ignoring:\r\n");
-                if(DEVELOPER) { hex_print(casio_rx_buf, 15); USB_PRINT("'\r\n"); }
-                if(DEVELOPER) USB_PRINT("waiting start indicator\r\n");
-                if(PINGPONG) {
-                    USB_PRINT("  |                                |\r\n");
-                    USB_PRINT("  |                          **COMM_IDLE**\r\n");
-                    USB_PRINT("  |-JUNK-");
-                    hex_print(casio_rx_buf, 3);
-                    USB_PRINT("etc-->|\r\n");
+                uint8_t cmask = TIMER_MASK_CHAN0;
+                if (nargs>=2) cmask=(uint8_t)op[2].tokint;
+                if (cloudstream_start((uint32_t)(tok_value(&op[1])*1000.0), cmask)==0) {
+                    if(DEVELOPER) USB_PRINT("cloud streaming started, mask 0x%02x\r\n", cmask);
+                    res=1.0;
                 }
-                clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-#ifdef MBED
-                casio_serial.read(casio_rx_buf, 15, casio_uart_processor, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
-#endif
             }
-            break;
-        case COMM_WAITING_INSTRUCTION:
-            if (DEVELOPER) USB_PRINT("recvd instruct:\r\n");
-            if (DEVELOPER) { hex_print(casio_rx_buf, 15); USB_PRINT("'\r\n"); }
-            if(PINGPONG) USB_PRINT("  |                    COMM_WAITING_INSTRUCTION\r\n");
-            res=decode_instruction(casio_rx_buf);
-            if (res==START_HEADER_ERROR) {
-                if(DEVELOPER) USB_PRINT("revert to waiting for start indicator\r\n");
-                if(PINGPONG) USB_PRINT("  |------[START HEADER ERROR]----->|\r\n");
-                comm_state=COMM_IDLE;
-                clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-#ifdef MBED
-                casio_serial.read(casio_rx_buf, 15, casio_uart_processor, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
-#endif
-            } else {
-                if (casio_rx_buf[1]==DIR_CASIO_SEND)
-                    procedure=PROC_SEND38K;
-                else
-                    procedure=PROC_RECV38K;
-                if (VERBOSE) instruction_print();
-                if(PINGPONG) instruction_print(1);
-                if (casio_rx_buf[1]==DIR_CASIO_SEND) {
-                    // casio will now send data, when we issue CODEB_OK
-                    if(PINGPONG) USB_PRINT("  |<-----------CODEB_OK------------|\r\n");
-                    clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-                    if (casio_cmd.type==TYPE_ASCII) {
-                        casio_cmd.datapacksize=casio_cmd.psize+2; 
-                    } else {
-                        USB_PRINT("error, cannot handle type '%c'\r\n", casio_cmd.type);
-                        casio_cmd.datapacksize=casio_cmd.psize+2; 
-                    }
-                    if (casio_cmd.datapacksize>COMM_BUFF_LENGTH) {
-                        USB_PRINT("error, length %u is larger than buffer size!\r\n", casio_cmd.datapacksize);
-                        casio_cmd.datapacksize=COMM_BUFF_LENGTH;
-                    }
-#ifdef MBED
-                    casio_serial.read(casio_rx_buf, casio_cmd.datapacksize, casio_uart_processor);
 #endif
-                    comm_state = COMM_WAITING_DATA;
-                    casio_send_response(CODEB_OK);
-                } else { // DIR_CASIO_RECV
-                    // we are now expected to receive CODEB after sending a header
-#ifdef MBED
-                    casio_serial.read(casio_rx_buf, 1, casio_uart_processor, SERIAL_EVENT_RX_ALL, CODEB_OK);
 #endif
-                    comm_state=COMM_WAITING_RX_HEADER_ACK;
-                    switch(hl_state) {
-                        case HL_ME_STATUS:
-                            if (VERBOSE) USB_PRINT("building header for MiniExp status response\r\n");
-                            casio_tx_buf[0]=':';
-                            casio_tx_buf[1]='N';
-                            casio_tx_buf[2]='A';
-                            casio_tx_buf[3]='V';
-                            casio_tx_buf[4]=0;
-                            casio_tx_buf[5]=1;
-                            casio_tx_buf[6]=0;
-                            casio_tx_buf[7]=0;
-                            casio_tx_buf[8]=0;
-                            casio_tx_buf[9]=1;
-                            casio_tx_buf[10]=0;
-                            casio_tx_buf[11]=1; // Lets use 1 character for the status
-                            casio_tx_buf[12]=0xff;
-                            casio_tx_buf[13]='A';
-                            calc_checksum(casio_tx_buf, 15, (char*)&casio_tx_buf[14]);
-                            if(DEVELOPER) USB_PRINT("sending MiniExp status header, waiting for CODEB_OK\r\n");
-                            casio_send_buf(casio_tx_buf, 15);
-                            break;
-                        case HL_ME_GETSAMPLE1:
-                        case HL_ME_GETSAMPLE2:
-                        case HL_ME_GETSAMPLE3:
-                            if (VERBOSE) USB_PRINT("building header for value response\r\n");
-                            casio_tx_buf[0]=':';
-                            casio_tx_buf[1]='N';
-                            casio_tx_buf[2]='A';
-                            casio_tx_buf[3]='V';
-                            casio_tx_buf[4]=0;
-                            casio_tx_buf[5]=1;
-                            casio_tx_buf[6]=0;
-                            casio_tx_buf[7]=0;
-                            casio_tx_buf[8]=0;
-                            casio_tx_buf[9]=1;
-                            casio_tx_buf[10]=0;
-                            casio_tx_buf[11]=6; // hard-coded for now, always 6 characters.
-                            casio_tx_buf[12]=0xff;
-                            casio_tx_buf[13]='A';
-                            calc_checksum(casio_tx_buf, 15, (char*)&casio_tx_buf[14]);
-                            if(DEVELOPER) USB_PRINT("sending value header, waiting for CODEB_OK\r\n");
-                            casio_send_buf(casio_tx_buf, 15);
-                            break;
-                        default:
-                            if (casio_cmd.form2=='L') { // think we can now send header for voltage packets?
-                                // a list is being requested. It could be a measurement request, or a status check request list
-                                switch(hl_state) {
-                                    case HL_STATUS_CHECK: // prepare to send header for status check "1,0,999,1" (9 bytes) to indicate status OK and channel 1 active
-                                        if (VERBOSE) USB_PRINT("building header for list response for status request\r\n");
-                                        casio_tx_buf[0]=':';
-                                        casio_tx_buf[1]='N';
-                                        casio_tx_buf[2]='A';
-                                        casio_tx_buf[3]='L';
-                                        casio_tx_buf[4]=0;
-                                        casio_tx_buf[5]=1;
-                                        casio_tx_buf[6]=0;
-                                        casio_tx_buf[7]=0;
-                                        casio_tx_buf[8]=0;
-                                        casio_tx_buf[9]=1;
-                                        casio_tx_buf[10]=0;
-                                        casio_tx_buf[11]=9; // 9 bytes hard coded for now
-                                        if(PINGPONG) USB_PRINT("  |<---NAL,L=1,O=1,P=9,A-----------|\r\n");
-                                        
-                                        casio_tx_buf[12]=0xff;
-                                        casio_tx_buf[13]='A';
-                                        break;
-                                    default: // send header for voltage packets
-                                        casio_cmd.command=99; // magic code for now for voltage measurement request
-                                        if (VERBOSE) USB_PRINT("building header for list response for measurement\r\n");
-                                        casio_tx_buf[0]=':';
-                                        casio_tx_buf[1]='N';
-                                        if (casio_cmd.type2=='A') {
-                                            casio_tx_buf[2]='A';
-                                        } else {
-                                            casio_tx_buf[2]='H'; //H
-                                        }
-                                        casio_tx_buf[3]='L';
-                                        casio_tx_buf[4]=0;
-                                        char totchan=count_active_chan();
-                                        if (casio_cmd.type2=='A') {
-                                            casio_tx_buf[5]=totchan; // Line field seems to be number of values in the list
-                                        }
-                                        casio_tx_buf[6]=0;
-                                        casio_tx_buf[7]=0;
-                                        casio_tx_buf[8]=0;
-                                        casio_tx_buf[9]=1;
-                                        casio_tx_buf[10]=0;
-                                        if (casio_cmd.type2=='A') {
-                                            //char totchan=count_active_chan();
-                                            char asc_len=totchan*6; // 6 characters per ascii voltage value for now.
-                                            asc_len=asc_len+(totchan-1); // add 1 byte for each comma between voltage values
-                                            casio_tx_buf[11]=asc_len;
-                                            if(DEVELOPER) USB_PRINT("asc_len set to %d\r\n", asc_len);
-                                            if(PINGPONG) USB_PRINT("  |<---NAL,L=1,O=1,P=N,A-----------|\r\n");
-                                        } else if (samp_trig_setup.mode==TRIG_MODE_NRT) { // non-real-time chunk, used for faster sampling. Doesn't work.
-                                            unsigned int nn;
-                                            nn = samp_trig_setup.numsamp;
-                                            if (nn>512) { // don't know yet how to extend beyond one packet : (
-                                                if(DEVELOPER) USB_PRINT("samples greater than 512 may not currently work..\r\n");
-                                            } 
-                                            casio_tx_buf[4] = (nn>>8) & 0x00ff;  // Line
-                                            casio_tx_buf[5] = nn & 0x00ff;       // Line
-                                            if(DEVELOPER) USB_PRINT("buf[4]=0x%02x, buf[5]=0x%02x\r\n", casio_tx_buf[4], casio_tx_buf[5]);
-                                            //casio_tx_buf[5]=100; // 100 lines?
-                                            nn=nn*2; // 2 bytes per sample
-                                            casio_tx_buf[10] = (nn>>8) & 0x00ff;   // Packet size
-                                            casio_tx_buf[11] = nn & 0x00ff;        // Packet size
-                                            if(DEVELOPER) USB_PRINT("buf[10]=0x%02x, buf[11]=0x%02x\r\n", casio_tx_buf[10], casio_tx_buf[11]);
-                                            if (sampnum>=512) { // this doesn't work currently
-                                                nn=samp_trig_setup.numsamp;
-                                                //nn=nn>>9; // divide by 512
-                                                casio_tx_buf[8]=(nn>>8) & 0x00ff; // Offset
-                                                casio_tx_buf[9]=nn & 0x00ff;      // Offset
-                                            }
-                                            if(PINGPONG) USB_PRINT("  |<---NHL,L=NN,O=1,P=NN,A---------|\r\n");
-                                        } else { // real-time mode (slower sampling, data sent one sample at a time)
-                                            char totchan=count_active_chan();
-                                            casio_tx_buf[11]=2*totchan; // 2 bytes for hex value
-                                            if(PINGPONG) USB_PRINT("  |<---NHL,L=1,O=1,P=2,A-----------|\r\n");
-                                        }
-                                        casio_tx_buf[12]=0xff;
-                                        if (sampnum==0) {
-                                            casio_tx_buf[13]='A';// A   // anything else seems to generate an error : (
-                                        } else if (sampnum>=512) { // don't know what to do here
-                                            casio_tx_buf[13]='M';//E
-                                        } else {
-                                            casio_tx_buf[13]='M';//M
-                                        }
-                                        break;
-                                }
-
-                                calc_checksum(casio_tx_buf, 15, (char*)&casio_tx_buf[14]);
-                                if(DEVELOPER) USB_PRINT("sending list header\r\n");
-                                casio_send_buf(casio_tx_buf, 15);
-                            }
-                            
-                            if ((casio_cmd.command=='7') && (casio_cmd.form2!='L')) {
-                                if(DEVELOPER) USB_PRINT("building header for status check (command 7) response\r\n");
-                                if (casio_cmd.line==1) {
-                                    if(DEVELOPER) USB_PRINT("building header for line 1\r\n");
-                                    casio_tx_buf[0]=':';
-                                    casio_tx_buf[1]='N';
-                                    casio_tx_buf[2]='A';
-                                    casio_tx_buf[3]='L';
-                                    casio_tx_buf[4]=0;
-                                    casio_tx_buf[5]=1;
-                                    casio_tx_buf[6]=0;
-                                    casio_tx_buf[7]=0;
-                                    casio_tx_buf[8]=0;
-                                    casio_tx_buf[9]=1;
-                                    casio_tx_buf[10]=0;
-                                    casio_tx_buf[11]=1;
-                                    casio_tx_buf[12]=0xff;
-                                    casio_tx_buf[13]='A';
-                                    calc_checksum(casio_tx_buf, 15, (char*)&casio_tx_buf[14]);
-                                    if(DEVELOPER) USB_PRINT("sending header, waiting for CODEB_OK\r\n");
-                                    if(PINGPONG) USB_PRINT("  |<---NAL,L=1,O=1,P=1,A-----------|\r\n");
-                                    casio_send_buf(casio_tx_buf, 15);
-                                }
-                            }
-
-                            break;
-                    }
-                    
-
-                    
-                    switch(sys_state) {
-                        case SYS_IDLE:
-                            sys_state = SYS_INIT;
-                            break;
-                        default:
-                            if(VERBOSE) USB_PRINT("unrecognized sys_state %d\r\n", sys_state);
-                            break;
-                    }   
-                    
+            break;
+        case 40: // arm a bulk capture: 2001,40,numsamp,period,chanmask
+            res=0.0;
+            if (nargs>=2) {
+                double period = tok_value(&op[2]);
+                uint8_t mask = TIMER_MASK_CHAN0;
+                if (nargs>=3) mask=(uint8_t)op[3].tokint;
+                if (capture_fetching(lk)) {
+                    if(DEVELOPER) USB_PRINT("capture is being fetched by the other calculator\r\n");
+                } else if (capture_arm((unsigned int)arg, (uint32_t)(period*1000000.0), mask)==0) {
+                    if(DEVELOPER) USB_PRINT("capture armed, %d samples, mask 0x%02x\r\n", arg, mask);
+                    res=1.0;
                 }
-                
             }
             break;
-        case COMM_WAITING_DATA:
-            if(DEVELOPER) USB_PRINT("recvd data pak:\r\n");
-            if(DEVELOPER) { hex_print(casio_rx_buf, casio_cmd.datapacksize); USB_PRINT("'\r\n"); }
-            if(PINGPONG) USB_PRINT("  |                       COMM_WAITING_DATA\r\n");
-            if(HLPP) {
-                if (procedure==PROC_SEND38K) {
-                    USB_PRINT("  |---S38K: ");
-                    if (casio_cmd.type==TYPE_ASCII) {
-                        plen=(int8_t)casio_cmd.datapacksize-2;
-                        if(plen<20) {
-                            asc_print(casio_rx_buf+1, plen);
-                        } else {
-                            plen=20;
-                            asc_print(casio_rx_buf+1, plen-3);
-                            USB_PRINT("etc");
-                        }
-                        for (i=0; i<(20-plen); i++) {
-                            padding[i]='-';
-                        }
-                        padding[20-plen]='\0';
-                        USB_PRINT(padding);
-                        USB_PRINT("-->|\r\n");
-                    } else if (casio_cmd.type==TYPE_HEX) {
-                        // not fully tested for now
-                        plen=(int8_t)casio_cmd.datapacksize-2;
-                        if(plen<6) {
-                            hex_print(casio_rx_buf+1, plen);
-                        } else {
-                            plen=5;
-                            hex_print(casio_rx_buf+1, plen);
-                            USB_PRINT("..");
-                        }
-                        for (i=0; i<(20-plen); i++) {
-                            padding[i]='-';
-                        }
-                        padding[20-plen]='\0';
-                        USB_PRINT(padding);
-                        USB_PRINT("-->|\r\n");
-                    } else {
-                        // unexpected format
-                        USB_PRINT("unknown format!------->|\r\n");
+        case 41: // fetch capture as a list on the next Receive38K: 2001,41,chan. chan 0 means all channels, one list each
+            if (in_batch) {
+                res=(double)capture_count(); // the list can't be part of a batch result, so report progress instead
+                break;
+            }
+            lk->cap_fetch_all=0;
+            if ((arg>=1) && (arg<=CHAN_MAX)) {
+                lk->cap_fetch_chan=arg-1;
+            } else {
+                lk->cap_fetch_all=1;
+                for (i=0; i<CHAN_MAX; i++) {
+                    if (capture_chanmask() & (0x01<<i)) {
+                        lk->cap_fetch_chan=i;
+                        break;
                     }
-                } else {
-                    // we don't expect any other procedure if we're in state COM_WAITING_DATA
                 }
             }
-            // is the first byte ':'? If not, then reject with a CODEB_ERROR for now
-            if (casio_rx_buf[0]!=':') {
-                if(DEVELOPER) USB_PRINT("error, invalid data, send CODEB_ERROR\r\n");
-                doerror=1;
+            lk->hl_state=HL_ME_CAPTURE_LIST;
+            if(DEVELOPER) USB_PRINT("will send capture list to casio on next Receive38K\r\n");
+            break;
+        case 50: // log to flash: 2001,50,period,chanmask. A period of 0 stops logging
+            res=0.0;
+            if ((nargs<1) || (tok_value(&op[1])<=0.0)) {
+                datalog_stop();
+                if(DEVELOPER) USB_PRINT("logging stopped\r\n");
+                res=1.0;
+            } else {
+                uint8_t lmask = TIMER_MASK_CHAN0;
+                if (nargs>=2) lmask=(uint8_t)op[2].tokint;
+                if (datalog_start((uint32_t)(tok_value(&op[1])*1000.0), lmask)==0) {
+                    if(DEVELOPER) USB_PRINT("logging started, mask 0x%02x\r\n", lmask);
+                    res=1.0;
+                }
             }
-            
-            get_tokens(&casio_rx_buf[1], casio_cmd.datapacksize-2, tok_arr, &numtok);
-            // handle the commands!
-            switch(tok_arr[0].tokint) {
-                case 2001: // MiniExperimenter command
-                    if (numtok>=3) {
-                        switch (tok_arr[1].tokint)
-                        {
-                            case 0: // provide a status
-                                hl_state=HL_ME_STATUS;
-                                if(DEVELOPER) USB_PRINT("will send MiniExp status to casio on next Receive38K\r\n");
-                                break;
-                            case 1: // get sample
-                            case 2:
-                            case 3:
-                                // on Receive38K, send the calculator a sample
-                                hl_state=HL_ME_GETSAMPLE1 + tok_arr[1].tokint - 1;
-                                if(DEVELOPER) USB_PRINT("will send sample to casio on next Receive38K\r\n");
-                                break;
-                            case 21: // send something to cloud
-                            case 22:
-                            case 23:
-                                int pos;
-                                // now we need to build a message in the format: {"chX": 1.2345} where X is 1,2 or 3. The value can be float or int. 
-                                // there seems to be a limit of 32 bytes for the IoT message somewhere. 
-                                if (tok_arr[2].toktype==TOK_TYPE_FLOAT) {
-                                    pos = snprintf(iot_text, sizeof(iot_text) - 1, "{\"ch%d\": %lf}", tok_arr[1].tokint-20, tok_arr[2].tokfloat);
-                                } else {
-                                    pos = snprintf(iot_text, sizeof(iot_text) - 1, "{\"ch%d\": %d}", tok_arr[1].tokint-20, tok_arr[2].tokint);
-                                }
-                                iot_text[pos] = 0; 
-#ifdef MBED
-                                // not supported currently
-#else
-#ifdef WITH_IOT
-                                if(DEVELOPER) USB_PRINT("adding to IOT queue\r\n");
-                                xQueueSend(iotq, iot_text, 50 / portTICK_PERIOD_MS);
-#endif
-#endif
-                            default:
-                                break;
-                        }
-                    }
+            break;
+        case 51: // fetch a page of the log as a list on the next Receive38K: 2001,51,chan,page. chan 0 gets the row times
+            {
+                uint32_t rows=datalog_rows();
+                uint32_t first=0;
+                if (nargs>=2) first=(uint32_t)op[2].tokint * DLOG_PAGE_LEN;
+                lk->log_fetch_chan=((arg>=1) && (arg<=CHAN_MAX)) ? arg-1 : -1;
+                lk->log_fetch_row=first;
+                lk->log_fetch_len=(first<rows) ? rows-first : 0;
+                if (lk->log_fetch_len>DLOG_PAGE_LEN) lk->log_fetch_len=DLOG_PAGE_LEN;
+                if (in_batch) {
+                    res=(double)lk->log_fetch_len; // the list can't be part of a batch result, so report the page size instead
                     break;
-                
-                case 0: // don't know what this is. Lets use it to clear the channel list.
-                    if(DEVELOPER)USB_PRINT("received command 0\r\n");
-                    for (i=0; i<CHAN_MAX; i++) {
-                        chan_setup[i].operation=0;
-                    }
-                    sampnum=0;
+                }
+                lk->hl_state=HL_ME_LOG_PAGE;
+                if(DEVELOPER) USB_PRINT("will send %u log rows from row %u to casio on next Receive38K\r\n", lk->log_fetch_len, first);
+            }
+            break;
+        case 52: // log status: state, rows, pages, period, chanmask
+            {
+                dlog_status_t lst;
+                datalog_get_status(&lst);
+                if (in_batch) {
+                    res=(double)lst.rows;
                     break;
-                case 1: // channel setup command
-                    if(DEVELOPER)USB_PRINT("received channel setup data\r\n");
-                    if(PINGPONG) USB_PRINT("  |--------1-CHAN_SETUP----------->|\r\n");
-                    if (numtok>=3) {
-                        samp_trig_setup.mode=TRIG_MODE_NRT; // we reset to this as a default if no command 12 arrives later
-                        if (tok_arr[1].tokint<=CHAN_MAX) {
-                            chan_setup[(tok_arr[1].tokint)-1].operation = tok_arr[2].tokint;
-                            if(DEVELOPER)USB_PRINT("CH%d set to type %d\r\n", tok_arr[1].tokint, tok_arr[2].tokint);
-                            if (tok_arr[2].tokint!=2) {
-                                if(DEVELOPER)USB_PRINT("error, unsupported chan type\r\n");
-                            }
-                        }
-                    } else {
-                        // wrong amount of tokens!
-                    }
+                }
+                lk->batch_res[0]=(double)lst.state;
+                lk->batch_res[1]=(double)lst.rows;
+                lk->batch_res[2]=(double)((lst.rows+DLOG_PAGE_LEN-1)/DLOG_PAGE_LEN);
+                lk->batch_res[3]=((double)lst.period_ms)/1000.0;
+                lk->batch_res[4]=(double)lst.chanmask;
+                lk->batch_len=5;
+                lk->hl_state=HL_ME_BATCH;
+                if(DEVELOPER) USB_PRINT("will send log status to casio on next Receive38K\r\n");
+            }
+            break;
+        case 46: // logic capture: 2001,46,linemask,window,resolution. The window is in ms, the resolution in ns (100 if left out).
+                 // linemask 0 stops a capture early
+            res=0.0;
+            if (arg==0) {
+                logic_stop();
+                res=1.0;
+            } else if (nargs>=2) {
+                if (logic_start((uint8_t)arg, (uint32_t)op[2].tokint, (nargs>=3) ? tok_value(&op[3]) : LOGIC_TICK_NS_DEFAULT)==0) {
+                    if(DEVELOPER) USB_PRINT("logic capture started, lines 0x%02x for %d ms\r\n", arg, op[2].tokint);
+                    res=1.0;
+                }
+            }
+            break;
+        case 47: // logic edges: 2001,47,line,what. what 0 sends the time of each edge on the line in us, 1 the level after it,
+                 // 2 the time in ms. line 0 sends the state (0 idle, 1 capturing, 2 done), edges on each line and resolution in ns
+            {
+                logic_status_t lst;
+                logic_get_status(&lst);
+                if (in_batch) {
+                    res=((arg>=1) && (arg<=LOGIC_LINES)) ? (double)logic_edges(arg-1) : (double)lst.state;
                     break;
-                case 3: // sample rate and num samples
-                    if(DEVELOPER)USB_PRINT("received sampling rate\r\n");
-                    if(PINGPONG) USB_PRINT("  |--------3-SAMPLERATE----------->|\r\n");
-                    if (numtok>=3) {
-                        if (tok_arr[1].toktype==TOK_TYPE_INT) {
-                            samp_trig_setup.period_usec=((uint32_t)(tok_arr[1].tokint))*1E6;
-                        } else {
-                            samp_trig_setup.period_usec=(uint32_t)(tok_arr[1].tokfloat*1000000.0);
-                        }
-                        if(DEVELOPER)USB_PRINT("sample rate: %u usec\r\n", samp_trig_setup.period_usec);
-                        if (tok_arr[2].tokint==-1) {
-                            samp_trig_setup.mode=TRIG_MODE_RT;
-                            samp_trig_setup.numsamp=0; // sampled with each data request
-                            if(DEVELOPER)USB_PRINT("num samples: per data request\r\n");
-                        } else {
-                            samp_trig_setup.numsamp=(unsigned int)tok_arr[2].tokint;
-                            if(DEVELOPER)USB_PRINT("num samples: %u\r\n", samp_trig_setup.numsamp);
-                        }
-                        
-                    } else {
-                        // wrong amount of tokens!   
+                }
+                if ((arg>=1) && (arg<=LOGIC_LINES)) {
+                    lk->logic_line=arg-1;
+                    lk->logic_send=(nargs>=2) ? (char)op[2].tokint : 0;
+                    lk->hl_state=HL_ME_LOGIC_LIST;
+                    if(DEVELOPER) USB_PRINT("will send %d logic edges to casio on next Receive38K\r\n", logic_edges(arg-1));
+                } else {
+                    lk->batch_res[0]=(double)lst.state;
+                    for (i=0; i<LOGIC_LINES; i++) {
+                        lk->batch_res[1+i]=(double)lst.nedges[i];
                     }
+                    lk->batch_res[1+LOGIC_LINES]=lst.tick_ns;
+                    lk->batch_len=2+LOGIC_LINES;
+                    lk->hl_state=HL_ME_BATCH;
+                }
+            }
+            break;
+        case 44: // capture trigger: 2001,44,chan,level,slope. Level is in volts, slope 0 rising, 1 falling, 2 either. chan 0 turns the trigger off
+            res=0.0;
+            {
+                double level = (nargs>=2) ? tok_value(&op[2]) : 0.0;
+                char slope = (nargs>=3) ? (char)op[3].tokint : CAP_TRIG_RISING;
+                if (capture_fetching(lk)) {
+                    if(DEVELOPER) USB_PRINT("capture is being fetched by the other calculator\r\n");
+                } else if (capture_set_trigger(((arg>=1) && (arg<=CHAN_MAX)) ? arg-1 : -1, volts_to_raw(level), slope)==0) {
+                    if(DEVELOPER) USB_PRINT("capture trigger set, channel %d\r\n", arg);
+                    res=1.0;
+                }
+            }
+            break;
+        case 45: // pre-trigger percentage and roll mode: 2001,45,pct,rearm. With rearm 1, fetching the last channel re-arms the capture
+            capture_set_pretrigger((arg>0) ? (unsigned int)arg : 0, (nargs>=2) ? (char)(op[2].tokint!=0) : 0);
+            break;
+        case 42: // decimated capture: 2001,42,chan,points,mode. Mode 0 is min/max pairs, 1 is LTTB. chan 0 gets the sample numbers
+        case 53: // decimated log, in the same way
+            {
+                int npoints = (nargs>=2) ? op[2].tokint : DECIM_POINTS_MAX;
+                int mode = (nargs>=3) ? op[3].tokint : DECIM_MINMAX;
+                res=(double)me_decimate(lk, op[0].tokint==53, arg, npoints, mode);
+                if (in_batch)
+                    break; // the list can't be part of a batch result, so report the number of points instead
+                res=1.0;
+                lk->hl_state=HL_ME_DECIM_LIST;
+                if(DEVELOPER) USB_PRINT("will send %d decimated values to casio on next Receive38K\r\n", lk->dec_len);
+            }
+            break;
+        case 43: // range of samples (or log rows) to decimate: 2001,43,first,last. 2001,43,0,0 is everything
+            lk->dec_first=(arg>0) ? (uint32_t)arg : 0;
+            lk->dec_last=((nargs>=2) && (op[2].tokint>0)) ? (uint32_t)op[2].tokint : 0;
+            break;
+        case 31: // channel statistics of this link's timed samples: 2001,31,chan returns count, min, max, mean, standard deviation and RMS
+            {
+                acq_stats_t st;
+                acq_get_stats(&lk->samp.reader, arg-1, &st);
+                if (in_batch) {
+                    res=st.mean/ACQ_COUNTS_PER_VOLT; // just the mean
                     break;
-                case 7: // status check command 7
-                    casio_cmd.command='7';
-                    if(DEVELOPER) USB_PRINT("received status check command '7'\r\n");
-                    if(PINGPONG) USB_PRINT("  |--------7-STATUS_CHECK--------->|\r\n");
-                    hl_state=HL_STATUS_CHECK;
+                }
+                lk->batch_res[0]=(double)st.count;
+                lk->batch_res[1]=(st.count>0) ? raw_to_volts(st.min) : 0.0;
+                lk->batch_res[2]=raw_to_volts(st.max);
+                lk->batch_res[3]=st.mean/ACQ_COUNTS_PER_VOLT;
+                lk->batch_res[4]=acq_stats_stddev(&st)/ACQ_COUNTS_PER_VOLT;
+                lk->batch_res[5]=acq_stats_rms(&st)/ACQ_COUNTS_PER_VOLT;
+                lk->batch_len=6;
+                lk->hl_state=HL_ME_BATCH;
+                if(DEVELOPER) USB_PRINT("will send channel %d statistics to casio on next Receive38K\r\n", arg);
+            }
+            break;
+        case 32: // reset statistics: 2001,32,chan,hist. chan 0 resets all channels, hist 1 turns the histogram on
+            acq_stats_reset(&lk->samp.reader, ((arg>=1) && (arg<=CHAN_MAX)) ? arg-1 : -1);
+            if (nargs>=2) acq_stats_hist((char)(op[2].tokint!=0));
+            break;
+        case 33: // channel histogram: 2001,33,chan returns the number of readings in each 1/16 of the ADC range
+            {
+                acq_stats_t st;
+                acq_get_stats(&lk->samp.reader, arg-1, &st);
+                if (in_batch) {
+                    res=(double)st.count;
                     break;
-                case 8: // trigger command to start sampling
-                    // enable the timer (it may be already enabled. But this resets it too)
-                    //setup_tg0_timer(TIMER_0, 1, 1000000);
-                    count_active_chan(); // this updates sample_method bitmask
-                    if(DEVELOPER) USB_PRINT("triggered, sample_method is 0x%02x\r\n", sample_method);
-                    if (samp_trig_setup.period_usec>=200000) { // >= 0.2 sec
-                        sample_timer_start(samp_trig_setup.period_usec);
-                    } else {
-                        // todo: figure out bulk (non-real-time) sampling
-                        //sample_timer_start(200000);
+                }
+                for (i=0; i<ACQ_HIST_BINS; i++) {
+                    lk->batch_res[i]=(double)st.hist[i];
+                }
+                lk->batch_len=ACQ_HIST_BINS;
+                lk->hl_state=HL_ME_BATCH;
+                if(DEVELOPER) USB_PRINT("will send channel %d histogram to casio on next Receive38K\r\n", arg);
+            }
+            break;
+        case 34: // spectrum of a captured channel: 2001,34,chan,peaks. peaks 0 returns the amplitude of every frequency bin,
+                 // otherwise the frequency and amplitude of that many of the strongest peaks. chan 0 returns the bin frequencies
+            {
+                fft_peak_t pk[FFT_PEAKS_MAX];
+                int npeaks = (nargs>=2) ? op[2].tokint : 0;
+                int n;
+                lk->fft_send_freq=0;
+                if ((arg>=1) && (arg<=CHAN_MAX)) {
+                    // the other link or the console may analyse another channel before this one is sent, so keep a copy
+                    lk->fft_nbins=fft_capture(arg-1, lk->fft_amp, &lk->fft_binhz);
+                    if (lk->fft_nbins<0) {
+                        lk->fft_nbins=0;
+                        if(DEVELOPER) USB_PRINT("no capture for the spectrum of channel %d\r\n", arg);
                     }
-                    sampnum=0;
-                    hl_state=HL_SENDING;
-                    if(DEVELOPER)USB_PRINT("entering state HL_SENDING\r\n");
-                    if(PINGPONG) USB_PRINT("  |--------8-TRIGGER-------------->|\r\n");
+                } else {
+                    lk->fft_send_freq=1;
+                    npeaks=0;
+                }
+                if (in_batch) {
+                    // just the frequency of the strongest peak
+                    res=(fft_find_peaks(lk->fft_amp, lk->fft_nbins, lk->fft_binhz, 1, pk)==1) ? pk[0].freq : 0.0;
                     break;
-                case 12: // real time mode
-                    if (numtok==2) {
-                        if (tok_arr[1].tokint==1) {
-                            samp_trig_setup.mode=TRIG_MODE_RT; // real-time mode, single result
-                            if(DEVELOPER)USB_PRINT("entering realtime mode\r\n");
-                            if(PINGPONG) USB_PRINT("  |--------12-REALTIME------------>|\r\n");
-                        } else {
-                            samp_trig_setup.mode=TRIG_MODE_NRT; // non-real-time, batched. can't get this to work..
-                            if(DEVELOPER)USB_PRINT("entering unusable non-realtime mode (batch)\r\n");
-                            if(PINGPONG) USB_PRINT("  |--------12-NONREALTIME--------->|\r\n");
-                        }
-                    } else {
-                        // wrong number of tokens! Should not occur.
+                }
+                if (npeaks>0) {
+                    n=fft_find_peaks(lk->fft_amp, lk->fft_nbins, lk->fft_binhz, npeaks, pk);
+                    for (i=0; i<n; i++) {
+                        lk->batch_res[i*2]=pk[i].freq;
+                        lk->batch_res[i*2+1]=pk[i].amp;
                     }
-                    break;
-                default:
-                    if(PINGPONG) {
-                        USB_PRINT("  |--[PAK ");
-                        plen=(int8_t)casio_cmd.datapacksize-2;
-                        if(plen<20) {
-                            asc_print(casio_rx_buf+1, plen);
-                        } else {
-                            plen=20;
-                            asc_print(casio_rx_buf+1, plen-3);
-                            USB_PRINT("etc");
-                        }
-                        USB_PRINT("]");
-                        for (i=0; i<(20-plen); i++) {
-                            padding[i]='-';
-                        }
-                        padding[20-plen]='\0';
-                        USB_PRINT(padding);
-                        USB_PRINT("--->|\r\n");
+                    lk->batch_len=n*2;
+                    if (n==0) {
+                        lk->batch_res[0]=-1.0; // no peaks
+                        lk->batch_len=1;
                     }
-                    break;
-            }
-            
-            // we can now send CODEB_OK and go back to idle state
-            if(PINGPONG) {
-                if (doerror) {
-                    USB_PRINT("  |<---------CODEB_ERROR-----------|\r\n");
+                    lk->hl_state=HL_ME_BATCH;
                 } else {
-                    USB_PRINT("  |<-----------CODEB_OK------------|\r\n");
+                    lk->hl_state=HL_ME_FFT_LIST;
                 }
+                if(DEVELOPER) USB_PRINT("will send spectrum to casio on next Receive38K\r\n");
             }
-            comm_state=COMM_IDLE;
-            clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-#ifdef MBED
-            casio_serial.read(casio_rx_buf, 15, casio_uart_processor, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
-#endif
-            if (doerror) {
-                casio_send_response(CODEB_ERROR);
-            } else {
-                casio_send_response(CODEB_OK);
+            break;
+        case 35: // add a filter stage: 2001,35,chan,type,p1,p2. Types are 1 moving average (p1 samples), 2 single-pole low-pass,
+                 // 3 biquad low-pass, 4 biquad high-pass (p1 cutoff as a fraction of the sample rate, p2 Q), 5 FIR low-pass (p2 taps)
+            res=0.0;
+            if (nargs>=3) {
+                if (acq_filter_add(arg-1, op[2].tokint, tok_value(&op[3]), (nargs>=4) ? tok_value(&op[4]) : 0.0)==0) {
+                    if(DEVELOPER) USB_PRINT("filter stage added to channel %d\r\n", arg);
+                    res=1.0;
+                }
             }
             break;
-        case COMM_WAITING_RX_HEADER_ACK:
-            if(PINGPONG) USB_PRINT("  |                  COMM_WAITING_RX_HEADER_ACK\r\n");
-            switch(casio_rx_buf[0]) {
-                case CODEB_OK:
-                    if(DEVELOPER) USB_PRINT("rcvd CODEB_OK\r\n");
-                    if(PINGPONG) USB_PRINT("  |------------CODEB_OK----------->|\r\n");
-                    // we are now expected to receive a CODEB after sending a packet
-#ifdef MBED
-                    casio_serial.read(casio_rx_buf, 1, casio_uart_processor, SERIAL_EVENT_RX_ALL, CODEB_OK);
-#endif
-                    char av;
-                    switch (hl_state) {
-                        case HL_ME_STATUS:
-                            if(DEVELOPER) USB_PRINT("HL_ME_STATUS: sending ME status to Casio\r\n");
-                            if(PINGPONG) USB_PRINT("  |<------[MINIEXP STATUS]---------|\r\n");
-                            av='1';
-                            wifi_ap_record_t apinfo;
-                            if (esp_wifi_sta_get_ap_info(&apinfo)==ESP_OK) {
-                                av ='2'; // WiFi is connected
-                                if (get_year()>=2021) {
-                                    av ='3'; // NTP is working
-                                    if (iot_connection_ok==1) {
-                                        av ='4'; // IoT connection is ok
-                                    }
-                                }
-                            }
-                            casio_tx_buf[0]=':';
-                            casio_tx_buf[1]=av;
-                            txbytes_total=3;
-                            calc_checksum(casio_tx_buf, txbytes_total, (char*)&casio_tx_buf[txbytes_total-1]);
-                            hl_state=HL_IDLE;
-                            comm_state=COMM_WAITING_RX_PACKET_ACK;
-                            casio_send_buf(casio_tx_buf, txbytes_total);
-                            break;
-                        case HL_ME_GETSAMPLE1:
-                        case HL_ME_GETSAMPLE2:
-                        case HL_ME_GETSAMPLE3:
-                            if(DEVELOPER) USB_PRINT("HL_ME_GETSAMPLE: sending sample to Casio\r\n");
-                            if(PINGPONG) USB_PRINT("  |<-----[MEASUREMENT ASCII]-------|\r\n");
-                            casio_tx_buf[0]=':';
-                            sample=get_sample(hl_state - HL_ME_GETSAMPLE1); // get measurement for channel 0, 1 or 2
-                            float2ascii(sample, &casio_tx_buf[1]); // populate 6 bytes with the ASCII representation
-                            txbytes_total=6+2; // 6 bytes from float2ascii, and two bytes for ':' and the checksum
-                            if (HLPP) print_hlpp_r38(&casio_tx_buf[1], txbytes_total-2, 'A');
-                            calc_checksum(casio_tx_buf, txbytes_total, (char*)&casio_tx_buf[txbytes_total-1]);
-                            hl_state=HL_IDLE;
-                            comm_state=COMM_WAITING_RX_PACKET_ACK;
-                            casio_send_buf(casio_tx_buf, txbytes_total);
-                            break;
-                        case HL_STATUS_CHECK:
-                            if(PINGPONG) USB_PRINT("  |<-------1-STATUS_READY----------|\r\n");
-                            if (HLPP) USB_PRINT("  |<--R38K: 1----------------------|\r\n");
-                            if (casio_cmd.form2=='L') { // list expected
-                                if(DEVELOPER) USB_PRINT("used list for status check (command 7) response\r\n");
-                                casio_tx_buf[0]=':';
-                                casio_tx_buf[1]='1';
-                                casio_tx_buf[2]=',';
-                                casio_tx_buf[3]='0';
-                                casio_tx_buf[4]=',';
-                                casio_tx_buf[5]='9';
-                                casio_tx_buf[6]='9';
-                                casio_tx_buf[7]='9';
-                                casio_tx_buf[8]=',';
-                                casio_tx_buf[9]='1';
-                                txbytes_total=11; // 9+2
-                            } else { //value expected
-                                if(DEVELOPER) USB_PRINT("used variable for status check (command 7) response\r\n");
-                                casio_tx_buf[0]=':';
-                                casio_tx_buf[1]='1';
-                                txbytes_total=3; // 1+2
-                            }
-                            calc_checksum(casio_tx_buf, txbytes_total, (char*)&casio_tx_buf[txbytes_total-1]);
-                            if(DEVELOPER) USB_PRINT("sending packet, waiting for CODEB_OK\r\n");
-                            hl_state=HL_IDLE;
-                            comm_state=COMM_WAITING_RX_PACKET_ACK;
-                            casio_send_buf(casio_tx_buf, txbytes_total);
-                            break;
-                        default:
-                            break;
-                    }
-                    if (casio_cmd.command=='7') {
-                        if(DEVELOPER) USB_PRINT("building packet for status check (command 7) response\r\n");
-                        if (casio_cmd.line==1) {
-                            if(DEVELOPER) USB_PRINT("building packet for line 1\r\n");
-                            if(PINGPONG) USB_PRINT("  |<-------1-STATUS_READY----------|\r\n");
-                            if (HLPP) USB_PRINT("  |<--R38K: 1----------------------|\r\n");
-                            casio_tx_buf[0]=':';
-                            casio_tx_buf[1]='1';
-                            txbytes_total=3;
-                            calc_checksum(casio_tx_buf, txbytes_total, (char*)&casio_tx_buf[txbytes_total-1]);
-                            if(DEVELOPER) USB_PRINT("sending packet, waiting for CODEB_OK\r\n");
-                            comm_state=COMM_WAITING_RX_PACKET_ACK;
-                            casio_send_buf(casio_tx_buf, txbytes_total);
-                        }
-                    }
-                    if (casio_cmd.command==99) {
-                        if (VERBOSE) USB_PRINT("building packet with voltage value response\r\n");
-                        //if (1/*casio_cmd.line==1*/) {
-                        if (casio_cmd.type2=='A') {
-                            if (DEVELOPER) USB_PRINT("sending meas pak\r\n");
-                            if(PINGPONG) USB_PRINT("  |<-----[MEASUREMENT ASCII]-------|\r\n");
-                            casio_tx_buf[0]=':';
-
-
-                            int bytenum=1;
-                            txbytes_total=2; // header and checksum
-                            for (i=0; i<CHAN_MAX; i++) {
-                                if (chan_setup[i].operation!=0) {
-                                    if (DEVELOPER) USB_PRINT("chan %d enabled\r\n", i);
-                                    if (bytenum!=1) {
-                                        // there is more than one channel result! add a comma
-                                        casio_tx_buf[bytenum]=',';
-                                        bytenum++;
-                                        txbytes_total++;
-                                    }
-                                    sample = get_sample(i);
-                                    float2ascii(sample, &casio_tx_buf[bytenum]); // populate 6 bytes with the ASCII representation
-                                    txbytes_total=txbytes_total+6;
-                                    bytenum=bytenum+6;
-                                }
-                            }
-
-                            casio_tx_buf[txbytes_total-1]='\0'; // just to print it out. It gets overwritten with checksum later
-                            if (DEVELOPER) USB_PRINT("sending values '%s'\r\n", &casio_tx_buf[1]);
-
-
-                            //sample=get_sample(0);
-                            //float2ascii(sample, &casio_tx_buf[1]); // populate 6 bytes with the ASCII representation
-                            //casio_tx_buf[1]='3';
-                            //casio_tx_buf[2]='.';
-                            //casio_tx_buf[3]='6';
-                            //txbytes_total=6+2; // 6 bytes from float2ascii, and two bytes for ':' and the checksum
-                            if (HLPP) print_hlpp_r38(&casio_tx_buf[1], txbytes_total-2, 'A');
-                            calc_checksum(casio_tx_buf, txbytes_total, (char*)&casio_tx_buf[txbytes_total-1]);
-                        } else if (casio_cmd.type2=='H') { // is this hex format?
-                            if (VERBOSE) USB_PRINT("building hex packet for line 1\r\n");
-                            if(PINGPONG) USB_PRINT("  |<------[MEASUREMENT HEX]--------|\r\n");
-                            casio_tx_buf[0]=':';
-
-                            timer_event_t evt;
-                            xQueueReceive(timer_queue, &evt, (samp_trig_setup.period_usec/512)/portTICK_PERIOD_MS /*portMAX_DELAY*/);
-                            if (evt.event==0) {
-                                //value = evt.meas[0];
-                            } else {
-                                if(DEVELOPER)USB_PRINT("***TIMER FAIL!***\r\n");
-                                //value=get_sample(0);
-                            }
-
-                            //scaled_u16=rescale(value);
-
-                            //if (value>10.0) value=10.0;
-                            //if (value<-10.0) value = -10.0;
-                            // convert value to a 12-bit number
-                            //scaled=10.92+value;
-                            //scaled=scaled*4096;
-                            //scaled=scaled/21.555;
-                            //scaled_u16=(uint16_t)scaled;
-                            //scaled_u16=scaled_u16&0x0fff;
-                            
-                            //value=value+0.1;
-                            //if (value>10.0) value=-10;
-                            
-                            int bytenum=1;
-                            txbytes_total=2; // header and checksum
-                            for (i=0; i<CHAN_MAX; i++) {
-                                if (chan_setup[i].operation!=0) {
-                                    value = evt.meas[i];
-                                    scaled_u16=rescale(value);
-                                    casio_tx_buf[bytenum]=(uint8_t)(scaled_u16 & 0x00ff);
-                                    bytenum++;
-                                    casio_tx_buf[bytenum]=(uint8_t)((scaled_u16 >> 8) & 0x00ff);
-                                    bytenum++;
-                                    txbytes_total=txbytes_total+2;
-                                }
-                            }
-                            //casio_tx_buf[1]=(uint8_t)(scaled_u16 & 0x00ff);
-                            //casio_tx_buf[2]=(uint8_t)((scaled_u16 >> 8) & 0x00ff);
-                            //txbytes_total=4;
-                            //if (count_active_chan()>1) {
-                            //    casio_tx_buf[3]=(uint8_t)(scaled_u16 & 0x00ff);
-                            //    casio_tx_buf[4]=(uint8_t)((scaled_u16 >> 8) & 0x00ff);
-                            //    txbytes_total=6;
-                            //}
-
-                            
-
-                            char fin=0;
-                            if ((hl_state==HL_SENDING) && (samp_trig_setup.mode==TRIG_MODE_NRT)){
-                                if (sampnum==samp_trig_setup.numsamp) {
-                                    // we have completed the bulk transfer of data.
-                                    fin=1;
-                                    casio_tx_buf[0]=':';
-                                    casio_tx_buf[1]='E';
-                                    casio_tx_buf[2]='N';
-                                    casio_tx_buf[3]='D';
-                                    unsigned int ns = samp_trig_setup.numsamp;
-                                    for (i=3; i<(ns*3); i++) {
-                                        casio_tx_buf[i]=0xff;
-                                    }
-                                    txbytes_total=(ns*3)+2;
-                                    if(DEVELOPER)USB_PRINT("Sending :END\r\n");
-                                }
-                            }
-
-                            sampnum=sampnum+1;
-                            
-                            // non-real-time mode is used for fast sample rates. Doesn't work : (
-                            if ((hl_state==HL_SENDING) && (samp_trig_setup.mode==TRIG_MODE_NRT) && (fin==0)){
-                                int padding=0;
-                                int mult=2+padding;
-                                unsigned int ns = samp_trig_setup.numsamp;
-                                for (i=0; i<ns; i++) {
-                                    value = get_sample(0);
-                                    scaled_u16=rescale(value);
-                                    casio_tx_buf[(i*mult)+1]=(uint8_t)(scaled_u16 & 0x00ff);
-                                    casio_tx_buf[(i*mult)+2]=(uint8_t)((scaled_u16 >> 8) & 0x00ff);
-                                    if(padding>0) {
-                                        casio_tx_buf[(i*mult)+3]=',';
-                                    }
-                                    if(padding>1) {
-                                        casio_tx_buf[(i*mult)+4]=0x00;
-                                    }
-                                    if(padding>2) {
-                                        casio_tx_buf[(i*mult)+5]=0x00;
-                                    }
-                                }
-                                txbytes_total=(ns*mult)+2;   //(200*2)+2;
-                                sampnum=sampnum+ns-1;
-                            }                           
-                            
-                            if (HLPP) print_hlpp_r38(&casio_tx_buf[1], txbytes_total-2, 'H');
-                            calc_checksum(casio_tx_buf, txbytes_total, (char*)&casio_tx_buf[txbytes_total-1]);
-                            //sampnum=sampnum+100;
-                        } else {
-                            USB_PRINT("error, unrecognizable type '%c'!\r\n", casio_cmd.type2);
-                        }
-                        //sampnum++;
-                        if(DEVELOPER)USB_PRINT("sending sample %u\r\n", sampnum);
-                        if(VERBOSE)USB_PRINT("sending voltage sample %u, txbytes_total %d waiting for CODEB_OK\r\n", sampnum, txbytes_total);
-                        if ((hl_state==HL_SENDING) && (samp_trig_setup.mode==TRIG_MODE_RT)){
-                            if (sampnum>=samp_trig_setup.numsamp) {
-                                sample_method=TIMER_SAMP_CHAN_NONE;
-                                sample_timer_stop();
-                            }
-                        }
-                        if ((hl_state==HL_SENDING) && (samp_trig_setup.mode==TRIG_MODE_NRT)){
-                            if (sampnum>=samp_trig_setup.numsamp) {
-                                hl_state=HL_IDLE;
-                                sample_method=TIMER_SAMP_CHAN_NONE;
-                                //comm_state=COMM_WAITING_RX_PACKET_ACK;
-                                comm_state=COMM_WAITING_PERFORM_ROLESWAP;
-                                if(DEVELOPER)USB_PRINT("Entering state HL_IDLE\r\n");
-                            } else {
-                                // we will stay in this state if we are sending multiple data packets
-                                if(DEVELOPER)USB_PRINT("then ready to send next data packet\r\n");
-                                
-                            }
-                            
-                        } else {
-                            comm_state=COMM_WAITING_RX_PACKET_ACK;
-                        }
-                        casio_send_buf(casio_tx_buf, txbytes_total /*15*/);
-                        //}
+        case 36: // remove the filters from a channel: 2001,36,chan. chan 0 clears all channels
+            acq_filter_clear(((arg>=1) && (arg<=CHAN_MAX)) ? arg-1 : -1);
+            break;
+        case 37: // define a virtual channel: 2001,37,vchan,kind,chA,chB. vchan is 4 to 7, kinds are 1 chA-chB, 2 chA/chB,
+                 // 3 chA+chB, 4 derivative of chA, 5 running integral of chA, 0 removes the definition
+            res=0.0;
+            if ((nargs>=2) && (arg>=VCHAN_FIRST) && (arg<VCHAN_FIRST+VCHAN_MAX)) {
+                int kind=op[2].tokint;
+                int cha=(nargs>=3) ? op[3].tokint : 1;
+                int chb=(nargs>=4) ? op[4].tokint : 2;
+                char expr[VCHAN_EXPR_LEN];
+                expr[0]='\0';
+                switch(kind) {
+                    case 1:
+                        snprintf(expr, VCHAN_EXPR_LEN, "ch%d-ch%d", cha, chb);
+                        break;
+                    case 2:
+                        snprintf(expr, VCHAN_EXPR_LEN, "ch%d/ch%d", cha, chb);
+                        break;
+                    case 3:
+                        snprintf(expr, VCHAN_EXPR_LEN, "ch%d+ch%d", cha, chb);
+                        break;
+                    case 4:
+                        snprintf(expr, VCHAN_EXPR_LEN, "d(ch%d)", cha);
+                        break;
+                    case 5:
+                        snprintf(expr, VCHAN_EXPR_LEN, "i(ch%d)", cha);
+                        break;
+                    default:
+                        break;
+                }
+                if (kind==0) {
+                    vchan_clear(arg-VCHAN_FIRST);
+                    res=1.0;
+                } else if ((expr[0]!='\0') && (vchan_define(arg-VCHAN_FIRST, expr)==0)) {
+                    if(DEVELOPER) USB_PRINT("CH%d is %s\r\n", arg, expr);
+                    res=1.0;
+                }
+            }
+            break;
+        case 38: // scale a virtual channel: 2001,38,vchan,factor
+            res=0.0;
+            if ((nargs>=2) && vchan_defined(arg-VCHAN_FIRST)) {
+                char expr[VCHAN_EXPR_LEN];
+                if (snprintf(expr, VCHAN_EXPR_LEN, "(%s)*%g", vchan_expr(arg-VCHAN_FIRST), tok_value(&op[2]))<VCHAN_EXPR_LEN) {
+                    if (vchan_define(arg-VCHAN_FIRST, expr)==0) {
+                        if(DEVELOPER) USB_PRINT("CH%d is %s\r\n", arg, expr);
+                        res=1.0;
                     }
-                    break;
-                case CODEB_RETRY:
-                    if(DEVELOPER) USB_PRINT("received CODEB_RETRY\r\n");
-                    if(PINGPONG) USB_PRINT("  |----------CODEB_RETRY---------->|\r\n");
-                    break;
-                case CODEB_ERROR:
-                    if(DEVELOPER) USB_PRINT("received CODEB_ERROR\r\n");
-                    if(PINGPONG) USB_PRINT("  |----------CODEB_ERROR---------->|\r\n");
-                    break;
-                case CASIO_START_INDICATOR:
-                    // we don't expect this, but it seems to occur occasionally. We should try to recover.
-                    // I think this occurs when status check variable request occurs
-                    // do whatever would occur if we'd been in state COMM_IDLE.
-                    if(DEVELOPER) USB_PRINT("COMM_WAITING_RX_HEADER_ACK received unexpected start indication\r\n");
-                    procedure=PROC_NULL;
-
-                    // casio has sent a start indicator. We should send CODEA_OK
-                    // but first prepare for the 15 byte response
-                    comm_state=COMM_WAITING_INSTRUCTION;
-                    clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-                    if(PINGPONG) USB_PRINT("  |                                |\r\n");
-                    if(PINGPONG) USB_PRINT("  |                          **COMM_IDLE**\r\n");
-                    if(PINGPONG) USB_PRINT("  |------0x15-CASIO-START-IND----->|\r\n");     
-                    if(PINGPONG) USB_PRINT("  |<-----------CODEA_OK------------|\r\n");
-                    if(DEVELOPER) USB_PRINT("wait instruct:\r\n");
-#ifdef MBED
-                    casio_serial.read(casio_rx_buf, 15, casio_uart_processor);
-#endif
-                    // send CODEA_OK
-                    casio_send_response(CODEA_OK);
-                    break;
-                default:
-                    if(DEVELOPER) USB_PRINT("COMM_WAITING_RX_HEADER_ACK received unexpected value '%u', expected CODEB\r\n", casio_rx_buf[0]);
-                    if(PINGPONG) USB_PRINT("  |---------CODEB_UNKNOWN!-------->|\r\n");
-                    break;
+                }
             }
             break;
-        case COMM_WAITING_RX_PACKET_ACK:
-            if(PINGPONG) USB_PRINT("  |                COMM_WAITING_RX_PACKET_ACK\r\n");
-            switch(casio_rx_buf[0]) {
-                case CODEB_OK:
-                    if(DEVELOPER) USB_PRINT("rcvd CODEB_OK. Fin\r\n");
-                    if(PINGPONG) USB_PRINT("  |------------CODEB_OK----------->|\r\n");
-                    casio_cmd.direction=0;
-                    casio_cmd.direction2=0;
-#ifdef MBED
-                    casio_serial.read(casio_rx_buf, 15, casio_uart_processor, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
-#endif
-                    clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-                    comm_state=COMM_IDLE;
-                    break;
-                case CODEB_RETRY:
-                    if(DEVELOPER) USB_PRINT("received CODEB_RETRY\r\n");
-                    if(PINGPONG) USB_PRINT("  |----------CODEB_RETRY---------->|\r\n");
-                    break;
-                case CODEB_ERROR:
-                    if(DEVELOPER) USB_PRINT("received CODEB_ERROR\r\n");
-                    if(PINGPONG) USB_PRINT("  |----------CODEB_ERROR---------->|\r\n");
-                    break;
-                case CASIO_START_INDICATOR:
-                    // we don't expect this, but it seems to occur occasionally. We should try to recover.
-                    // I think this occurs when status check variable request occurs
-                    // do whatever would occur if we'd been in state COMM_IDLE.
-                    if(DEVELOPER) USB_PRINT("COMM_WAITING_RX_PACKET_ACK received unexpected start indication\r\n");
-                    procedure=PROC_NULL;
-
-                    // casio has sent a start indicator. We should send CODEA_OK
-                    // but first prepare for the 15 byte response
-                    comm_state=COMM_WAITING_INSTRUCTION;
-                    clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-                    if(PINGPONG) USB_PRINT("  |                                |\r\n");
-                    if(PINGPONG) USB_PRINT("  |                          **COMM_IDLE**\r\n");
-                    if(PINGPONG) USB_PRINT("  |------0x15-CASIO-START-IND----->|\r\n");     
-                    if(PINGPONG) USB_PRINT("  |<-----------CODEA_OK------------|\r\n");
-                    if(DEVELOPER) USB_PRINT("wait instruct:\r\n");
-#ifdef MBED
-                    casio_serial.read(casio_rx_buf, 15, casio_uart_processor);
-#endif
-                    // send CODEA_OK
-                    casio_send_response(CODEA_OK);
-                    break;
-                default:
-                    if(DEVELOPER) USB_PRINT("COMM_WAITING_RX_PACKET_ACK received unexpected value '%u', expected CODEB\r\n", casio_rx_buf[0]);
-                    if(PINGPONG) USB_PRINT("  |---------CODEB_UNKNOWN!-------->|\r\n");
+        case 39: // channel sample period: 2001,39,chan,seconds. 0 seconds makes the channel follow the common period set with
+                 // command 3. chan 0 sends the period each channel is sampled at, in seconds
+            res=0.0;
+            if ((arg>=1) && (arg<=CHAN_MAX)) {
+                if (nargs>=2) {
+                    double p=tok_value(&op[2]);
+                    sample_timer_set_period(&lk->samp, arg-1, (p>0.0) ? (uint32_t)(p*1000000.0) : 0);
+                    if(DEVELOPER) USB_PRINT("CH%d sample period %u usec\r\n", arg, lk->samp.chan_period_usec[arg-1]);
+                }
+                res=((double)sample_timer_chan_period(&lk->samp, arg-1, lk->samp_trig_setup.period_usec))/1000000.0;
+            } else if (!in_batch) {
+                for (i=0; i<CHAN_MAX; i++) {
+                    lk->batch_res[i]=((double)sample_timer_chan_period(&lk->samp, i, lk->samp_trig_setup.period_usec))/1000000.0;
+                }
+                lk->batch_len=CHAN_MAX;
+                lk->hl_state=HL_ME_BATCH;
+            }
+            break;
+        case 48: // recent samples of a channel: 2001,48,chan,what sends the last SAMPLE_RING_LEN samples taken of the channel
+                 // while multi-rate sampling, oldest first. what 0 sends the values, 1 the time of each in seconds from
+                 // the oldest, so the calculator can see the rate the channel runs at. In a batch, the result is the number of samples
+            res=0.0;
+            if ((arg>=1) && (arg<=CHAN_MAX)) {
+                int n;
+                if (in_batch) {
+                    res=(double)sample_ring_read(&lk->samp, arg-1, NULL, NULL);
                     break;
+                }
+                if ((nargs>=2) && (op[2].tokint==1)) {
+                    uint64_t t[SAMPLE_RING_LEN];
+                    n=sample_ring_read(&lk->samp, arg-1, t, NULL);
+                    for (i=0; i<n; i++) {
+                        lk->batch_res[i]=((double)(t[i] - t[0]))/1000000.0;
+                    }
+                } else {
+                    n=sample_ring_read(&lk->samp, arg-1, NULL, lk->batch_res);
+                }
+                if (n==0) {
+                    lk->batch_res[0]=-1.0; // no samples
+                    n=1;
+                }
+                lk->batch_len=n;
+                lk->hl_state=HL_ME_BATCH;
+                res=1.0;
+            }
+            break;
+        case 60: // upload a waveform: 2001,60,first,v1,v2,... puts the values (in volts) into the waveform table from position first.
+                 // first 1 starts a new table. The result is the number of values in the table
+            res=0.0;
+            if ((nargs>=2) && (arg>=1)) {
+                double wv[TOK_MAX];
+                int n=nargs-1;
+                for (i=0; i<n; i++) {
+                    wv[i]=tok_value(&op[2+i]);
+                }
+                n=wavegen_load(arg-1, wv, n);
+                if (n>0) res=(double)n;
+                if(DEVELOPER) USB_PRINT("waveform table has %d values\r\n", n);
+            }
+            break;
+        case 61: // play the waveform table: 2001,61,rate,count. rate is values per second, count the number of times to play it
+                 // (0 for continuously). rate 0 stops the generator
+            res=0.0;
+            if ((nargs<1) || (tok_value(&op[1])<=0.0)) {
+                wavegen_stop();
+                res=1.0;
+            } else if (wavegen_play(tok_value(&op[1]), (nargs>=2) ? (uint32_t)op[2].tokint : 0)==0) {
+                if(DEVELOPER) USB_PRINT("playing the waveform table\r\n");
+                res=1.0;
+            }
+            break;
+        case 62: // built-in waveform: 2001,62,shape,freq,amplitude,offset. Shapes are 1 sine, 2 square, 3 triangle, 4 sawtooth.
+                 // amplitude is the peak in volts (1 if left out), offset the middle (1.65 if left out)
+            res=0.0;
+            if (nargs>=2) {
+                if (wavegen_shape(arg, tok_value(&op[2]), (nargs>=3) ? tok_value(&op[3]) : 1.0, (nargs>=4) ? tok_value(&op[4]) : 1.65)==0) {
+                    if(DEVELOPER) USB_PRINT("playing %s wave\r\n", wavegen_shape_name(arg));
+                    res=1.0;
+                }
             }
             break;
-        case COMM_WAITING_PERFORM_ROLESWAP:
-            casio_cmd.direction=0;
-            casio_cmd.direction2=0;
+        case 30: // phase-locked sampling in real-time mode, 1 to enable, 0 to disable
+            sample_pll_enabled = (arg!=0);
+            if(DEVELOPER) USB_PRINT("phase-locked sampling %s\r\n", sample_pll_enabled ? "enabled" : "disabled");
+            break;
+        case 21: // send something to cloud, 2001,21,value for channel 1 up to 2001,23,value for channel 3
+        case 22:
+        case 23:
+            res=0.0;
+            if (nargs<1) break;
+            // values are collected by the telemetry aggregator, and sent as one message per flush interval
 #ifdef MBED
-            casio_serial.read(casio_rx_buf, 15, casio_uart_processor, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
+            // not supported currently
+#else
+#ifdef WITH_IOT
+            if (telemetry_add(op[0].tokint-21, tok_value(&op[1]))==0) res=1.0;
+#endif
 #endif
-            clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-            comm_state=COMM_IDLE;
-            casio_tx_buf[0]=':';
-            casio_tx_buf[0]='R';
-            casio_tx_buf[0]='A';
-            casio_tx_buf[0]='L';
-            casio_tx_buf[4]=0xff;
-            casio_tx_buf[5]=0xff;
-            casio_tx_buf[6]=0xff;
-            casio_tx_buf[7]=0xff;
-            casio_tx_buf[8]=0xff;
-            casio_tx_buf[9]=0xff;
-            casio_tx_buf[10]=0xff;
-            casio_tx_buf[11]=0xff;
-            casio_tx_buf[12]=0xff;
-            casio_tx_buf[13]=0xff;
-            if(DEVELOPER)USB_PRINT("Sending Roleswap\r\n");
-            calc_checksum(casio_tx_buf, 15, (char*)&casio_tx_buf[14]);
-            casio_send_buf(casio_tx_buf, 15);   
             break;
         default:
-            if(DEVELOPER) USB_PRINT("unexpected comm state. Going to COMM_IDLE\r\n");
-            if(PINGPONG) USB_PRINT("  |                          COMM_UNKNOWN!\r\n");
-            comm_state=COMM_IDLE;
-            clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-#ifdef MBED
-            casio_serial.read(casio_rx_buf, 15, casio_uart_processor, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
-#endif
+            res=0.0;
             break;
     }
+    return(res);
+}
+
+// ********** board hooks of the protocol core **********
+
+char
+me_platform::status(void)
+{
+    return(me_status());
+}
+
+int
+me_platform::active_chans(casio_link_t* lk)
+{
+    return(count_active_chan(lk)); // this updates sample_method bitmask
+}
+
+// the active channels for a measurement packet. Hex packets are the timed ones, and wait for
+// the sample timer, ASCII ones are sampled now
+int
+me_platform::read_row(casio_link_t* lk, double* vals, char type)
+{
+    int i;
+    int n=0;
+    double row[CHAN_TOTAL];
+    if (type==TYPE_HEX) {
+        timer_event_t evt;
+        if (sample_pll_active(&lk->samp)) {
+            // phase-locked: sample was converted just ahead of this poll
+            sample_pll_poll(&lk->samp, &evt);
+        } else {
+            sample_timer_get(&lk->samp, &evt, lk->samp_trig_setup.period_usec/512 /*portMAX_DELAY*/);
+        }
+        if (evt.event!=0) {
+            if(DEVELOPER)USB_PRINT("***TIMER FAIL!***\r\n");
+        }
+        get_chan_row(lk, row, evt.meas, (int64_t)evt.countval);
+    } else {
+        get_chan_row(lk, row, NULL, usec());
+    }
+    for (i=0; i<CHAN_TOTAL; i++) {
+        if (lk->chan_setup[i].operation!=0) {
+            if (VERBOSE) USB_PRINT("chan %d enabled\r\n", i);
+            vals[n++]=row[i];
+        }
+    }
+    return(n);
+}
+
+void
+me_platform::chan_setup(casio_link_t* lk, int chan, int type)
+{
+    if ((type<CHAN_TYPE_VOLTS) || (type>CHAN_TYPE_KHZ) || ((chan>=CHAN_MAX) && (type!=CHAN_TYPE_VOLTS))) {
+        if(DEVELOPER)USB_PRINT("error, unsupported chan type\r\n");
+    }
+#ifndef MBED
+    if (chan<CHAN_MAX) {
+        // pulse counter types take the pin from the ADC, and start counting from zero
+        switch(type) {
+            case CHAN_TYPE_FREQ:
+                counter_enable(chan, COUNTER_HZ, lk->id);
+                break;
+            case CHAN_TYPE_COUNT:
+                counter_enable(chan, COUNTER_COUNT, lk->id);
+                break;
+            case CHAN_TYPE_KHZ:
+                counter_enable(chan, COUNTER_KHZ, lk->id);
+                break;
+            default:
+                counter_enable(chan, COUNTER_OFF, lk->id);
+                break;
+        }
+    }
+#endif
+    if (chan>=CHAN_MAX) {
+        // virtual channel, derivatives and integrals start again with the new run
+        vchan_restart(chan-CHAN_MAX, &lk->vchan_st[chan-CHAN_MAX]);
+        if (!vchan_defined(chan-CHAN_MAX)) {
+            if(DEVELOPER)USB_PRINT("error, CH%d has no expression, it will read 0\r\n", chan+1);
+        }
+    }
+}
+
+void
+me_platform::clear_channels(casio_link_t* lk)
+{
+#ifndef MBED
+    int i;
+    for (i=0; i<CHAN_MAX; i++) {
+        counter_enable(i, COUNTER_OFF, lk->id); // only the counters this link set up
+    }
+#endif
+}
+
+// enables the sample timer (it may be already enabled. But this resets it too)
+void
+me_platform::trigger(casio_link_t* lk)
+{
+    count_active_chan(lk); // this updates sample_method bitmask
+    if(DEVELOPER) USB_PRINT("triggered, sample_method is 0x%02x\r\n", lk->sample_method);
+    if (lk->samp_trig_setup.period_usec>=200000) { // >= 0.2 sec
+        if ((lk->samp_trig_setup.mode==TRIG_MODE_RT) && sample_pll_enabled && !sample_timer_multirate(&lk->samp)) {
+            if(DEVELOPER) USB_PRINT("using phase-locked sampling\r\n");
+            sample_pll_start(&lk->samp, lk->samp_trig_setup.period_usec);
+        } else {
+            sample_timer_start(&lk->samp, lk->samp_trig_setup.period_usec);
+        }
+    } else {
+        // todo: figure out bulk (non-real-time) sampling
+    }
+}
+
+void
+me_platform::sampling_done(casio_link_t* lk)
+{
+    lk->sample_method=TIMER_SAMP_CHAN_NONE;
+    sample_timer_stop(&lk->samp);
+    sample_pll_stop(&lk->samp);
+}
+
+int
+me_platform::op_nargs(int op)
+{
+    return(me_op_nargs(op));
+}
+
+double
+me_platform::op_2001(casio_link_t* lk, cmd_tok_t* op, int nargs, char in_batch)
+{
+    return(me_2001_op(lk, op, nargs, in_batch));
+}
+
+// values in the list hl_state has ready. A capture or logic capture that is still running keeps
+// growing, so the core keeps the count for the list itself
+unsigned int
+me_platform::list_begin(casio_link_t* lk)
+{
+    unsigned int n;
+    switch(lk->hl_state) {
+        case HL_ME_CAPTURE_LIST: // one list holding the whole capture for a channel
+            return(capture_count());
+        case HL_ME_LOGIC_LIST:
+            n=logic_edges(lk->logic_line);
+            if ((n>0) && (lk->logic_send==0) && (logic_edge_usec(lk->logic_line, n-1)>LOGIC_USEC_SEND_MAX)) {
+                // too many digits to send in microseconds, so -1 is sent, and the times have to be fetched in ms
+                if(DEVELOPER) USB_PRINT("logic edges are too late to send in us\r\n");
+                n=0;
+            }
+            return(n);
+        case HL_ME_FFT_LIST:
+            return((unsigned int)lk->fft_nbins);
+        case HL_ME_DECIM_LIST:
+            return((unsigned int)lk->dec_len);
+        case HL_ME_LOG_PAGE:
+            return(lk->log_fetch_len);
+        default:
+            return(0);
+    }
+}
+
+double
+me_platform::list_value(void* ctx, unsigned int idx)
+{
+    casio_link_t* lk=(casio_link_t*)ctx;
+    switch(lk->hl_state) {
+        case HL_ME_CAPTURE_LIST:
+            return(capture_list_value(&lk->cap_fetch_chan, idx));
+        case HL_ME_LOGIC_LIST:
+            return(logic_list_value(lk, idx));
+        case HL_ME_FFT_LIST:
+            return(fft_list_value(lk, idx));
+        case HL_ME_DECIM_LIST:
+            return(decim_list_value(lk, idx));
+        case HL_ME_LOG_PAGE:
+            return(log_page_value(lk, idx));
+        default:
+            return(-1.0);
+    }
+}
+
+void
+me_platform::list_end(casio_link_t* lk, int state)
+{
+    int i;
+    if (state!=HL_ME_CAPTURE_LIST)
+        return;
+    if(DEVELOPER) USB_PRINT("sent channel %d capture\r\n", lk->cap_fetch_chan+1);
+    // in roll mode, the next triggered window is captured once the last channel has been sent
+    if ((lk->list_len>0) && capture_auto_rearm() && ((capture_chanmask()>>(lk->cap_fetch_chan+1))==0) && !capture_fetching(lk)) {
+        capture_rearm();
+        if(DEVELOPER) USB_PRINT("capture re-armed\r\n");
+    }
+    if (lk->cap_fetch_all) {
+        // move on to the next captured channel, for the next Receive38K
+        for (i=lk->cap_fetch_chan+1; i<CHAN_MAX; i++) {
+            if (capture_chanmask() & (0x01<<i)) {
+                lk->cap_fetch_chan=i;
+                lk->hl_state=HL_ME_CAPTURE_LIST;
+                break;
+            }
+        }
+        if (lk->hl_state==HL_IDLE) lk->cap_fetch_all=0;
+    }
+}
+
+void casio_uart_processor(casio_link_t* lk, int events) {
+    me_core::process(lk);
+}
+
+// ********** hot path profiling **********
+
+typedef struct me_prof_ctx_s {
+    sample_timer_t* st;
+    timer_event_t evt;
+    casio_cmd_t cmd;
+    uint8_t hdr[CASIO_HEADER_LEN];
+    uint8_t buf[64];
+    int len;
+    double vals[CHAN_MAX];
+} me_prof_ctx_t;
+
+static int8_t me_prof_sample_method;
+static sample_timer_t me_prof_st;
+static me_prof_ctx_t me_prof_ctx;
+
+// the callers are always in IRAM, so that only the function being measured can miss the flash cache.
+// The sample path converts through its own uncached reader, so the links' statistics, filters
+// and cached readings are left as they were
+static IRAM_ATTR void
+me_prof_sample(void* ctx)
+{
+    me_prof_ctx_t* c=(me_prof_ctx_t*)ctx;
+    sample_fill_event(c->st, &c->evt);
+}
+
+static IRAM_ATTR void
+me_prof_decode(void* ctx)
+{
+    me_prof_ctx_t* c=(me_prof_ctx_t*)ctx;
+    decode_instruction(&c->cmd, c->hdr);
+}
+
+static IRAM_ATTR void
+me_prof_checksum(void* ctx)
+{
+    me_prof_ctx_t* c=(me_prof_ctx_t*)ctx;
+    calc_checksum(c->buf, c->len, (char*)&c->buf[c->len-1]);
+}
+
+static IRAM_ATTR void
+me_prof_ascii(void* ctx)
+{
+    me_prof_ctx_t* c=(me_prof_ctx_t*)ctx;
+    build_meas_packet(c->buf, TYPE_ASCII, c->vals, CHAN_MAX);
+}
+
+static IRAM_ATTR void
+me_prof_hex(void* ctx)
+{
+    me_prof_ctx_t* c=(me_prof_ctx_t*)ctx;
+    build_meas_packet(c->buf, TYPE_HEX, c->vals, CHAN_MAX);
+}
+
+// times n calls of each hot path, warm and then cold. wifi_load is set to 1 if WiFi
+// scans were running during the cold runs. Returns the number of results (ME_PROF_PATHS)
+int
+me_profile(int n, me_prof_t* res, char* wifi_load)
+{
+    int i, p;
+    me_prof_ctx_t* c=&me_prof_ctx;
+    static const char* names[ME_PROF_PATHS] = {"sample", "decode", "checksum", "packet A", "packet H"};
+    prof_fn_t fns[ME_PROF_PATHS] = {me_prof_sample, me_prof_decode, me_prof_checksum, me_prof_ascii, me_prof_hex};
 
+    memset(c, 0, sizeof(me_prof_ctx_t));
+    me_prof_sample_method=0;
+    for (i=0; i<CHAN_MAX; i++) {
+        // reading a pulse counter moves the frequency gate of the link that set it up
+        if (counter_mode(i)==COUNTER_OFF)
+            me_prof_sample_method|=(0x01<<i);
+    }
+    me_prof_st.sample_method=&me_prof_sample_method; // the ADC channels, without touching a link's timer
+    acq_reader_init(&me_prof_st.reader);
+    me_prof_st.reader.uncached=1;
+    c->st=&me_prof_st;
+    me_core::build_header(c->hdr, 'A', 'V', 1, 1); // a one character variable, as the status response sends
+    for (i=0; i<CHAN_MAX; i++) {
+        c->vals[i]=-1.234 + 2.5*i;
+    }
+    c->len=build_meas_packet(c->buf, TYPE_ASCII, c->vals, CHAN_MAX); // the checksum runs over a 3 channel ASCII packet
+
+    for (p=0; p<ME_PROF_PATHS; p++) {
+        res[p].name=names[p];
+        prof_measure(fns[p], c, n, 0, &res[p].warm);
+    }
+    *wifi_load=(prof_load_start()==0) ? 1 : 0;
+    for (p=0; p<ME_PROF_PATHS; p++) {
+        prof_measure(fns[p], c, n, 1, &res[p].cold);
+    }
+    if (*wifi_load)
+        prof_load_stop();
+    return(ME_PROF_PATHS);
 }
 
 #ifndef MBED
@@ -1,6 +1,15 @@
 #ifndef __MINIEXP_HEADER_FILE__
 #define __MINIEXP_HEADER_FILE__
 
+#include "timerfunc.h"
+#include "decimate.h"
+#include "vchan.h"
+#include "fft.h"
+#include "prof.h"
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "../../common/casio_core.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -15,16 +24,121 @@ extern "C" {
 #define DEVELOPER 1
 #define HLPP 0
 
+// ME_HOT marks the functions that run for every sample and every packet, and
+// ME_HOT_DATA the tables they read. With CONFIG_MINIEXP_HOT_IRAM (menuconfig,
+// Mini Experimenter) they are placed in IRAM and DRAM, so that flash cache misses
+// while WiFi or NVS is busy don't stall them. Otherwise they stay in flash.
+#ifdef CONFIG_MINIEXP_HOT_IRAM
+#define ME_HOT IRAM_ATTR
+#define ME_HOT_DATA DRAM_ATTR
+#else
+#define ME_HOT
+#define ME_HOT_DATA
+#endif
+
 
 
 // ESP32
+// Each calculator has its own link. Link 0 is on UART2 (Tx GPIO17, Rx GPIO16).
+// A second calculator can be connected to UART1 (Tx GPIO19, Rx GPIO18).
+#define WITH_LINK2
 #define CASIO_UART_NUM UART_NUM_2
+#define CASIO_TX_PIN GPIO_NUM_17
+#define CASIO_RX_PIN GPIO_NUM_16
+#define CASIO2_UART_NUM UART_NUM_1
+#define CASIO2_TX_PIN GPIO_NUM_19
+#define CASIO2_RX_PIN GPIO_NUM_18
+#ifdef WITH_LINK2
+#define LINK_MAX 2
+#else
+#define LINK_MAX 1
+#endif
+
+#define COMM_BUFF_LENGTH 256
+#define CHAN_MAX 3
+#define CHAN_TOTAL (CHAN_MAX+VCHAN_MAX) // physical channels, then the virtual channels
+#define ME_PROF_PATHS 5         // hot paths measured by me_profile
+
+// channel types (chan_setup operation), set with command 1
+#define CHAN_TYPE_OFF 0
+#define CHAN_TYPE_VOLTS 2
+#define CHAN_TYPE_FREQ 3        // pulse counter, frequency in Hz
+#define CHAN_TYPE_COUNT 4       // pulse counter, edges since the channel was set up
+#define CHAN_TYPE_KHZ 5         // pulse counter, frequency in kHz
+
+typedef struct chan_setup_s {
+    char operation;
+} chan_setup_t;
+
+typedef struct samp_trig_setup_s {
+    uint32_t period_usec;
+    unsigned int numsamp;
+    char mode;
+} samp_trig_setup_t;
+
+// all the protocol state for one calculator connection, the casio_core link
+typedef struct casio_link_s {
+    int id;
+    int uart_num;
+    QueueHandle_t uart_queue;
+    // protocol state
+    casio_cmd_t casio_cmd;
+    char procedure;
+    char comm_state;
+    char sys_state;
+    char hl_state;
+    chan_setup_t chan_setup[CHAN_TOTAL];
+    samp_trig_setup_t samp_trig_setup;
+    uint8_t casio_rx_buf[COMM_BUFF_LENGTH + 1];
+    uint8_t casio_tx_buf[1024];
+    uint16_t sampnum;
+    int8_t sample_method;
+    sample_timer_t samp;
+    // 2001 protocol state
+    char cap_fetch_chan;    // channel (0..2) sent on the next capture list fetch
+    char cap_fetch_all;     // set to 1 to send every captured channel, one list per Receive38K
+    int8_t stream_chan;     // when 0..2, every Receive38K of a variable gets a new sample from this channel
+    double batch_res[BATCH_MAX]; // results of a 2001 batch, sent as one list
+    int8_t log_fetch_chan;  // channel (0..2) sent on the next log page fetch, -1 for the row times
+    uint32_t log_fetch_row; // first row of the log page
+    unsigned int log_fetch_len; // rows in the log page, 0 if there are none
+    uint32_t dec_first;     // range decimated for the calculator, the whole capture or log if dec_last is 0
+    uint32_t dec_last;
+    uint16_t dec_raw[DECIM_POINTS_MAX]; // the last decimated list
+    uint32_t dec_x[DECIM_POINTS_MAX];   // sample number of each point in it
+    int dec_len;
+    char dec_send_x;        // set to 1 to send dec_x instead of the values
+    char fft_send_freq;     // set to 1 to send the bin frequencies instead of the spectrum
+    float fft_amp[FFT_N_MAX/2]; // copy of the spectrum from the last 2001,34 on this link
+    int fft_nbins;          // bins in it, 0 if there's no spectrum
+    double fft_binhz;
+    int8_t logic_line;      // logic capture line (0..2) sent on the next logic list fetch
+    char logic_send;        // 0 edge times in us, 1 levels after each edge, 2 edge times in ms
+    int batch_len;
+    unsigned int list_len;  // values promised in the last capture or logic list header, 0 if -1 is sent instead
+    vchan_state_t vchan_st[VCHAN_MAX]; // derivative and integral state of each virtual channel
+    // assembling UART events into packets
+    char do_append;
+    uint8_t appendbuf[64];
+    int appendpos;
+    int datapos;
+} casio_link_t;
+
+// cycle counts of one hot path, from me_profile
+typedef struct me_prof_s {
+    const char* name;
+    prof_stats_t warm;
+    prof_stats_t cold;              // flash cache evicted before each call, with WiFi scanning
+} me_prof_t;
 
-#define COMM_BUFF_LENGTH 30
+extern casio_link_t casio_links[LINK_MAX];
 
 void init_miniexp(void);
-void casio_uart_processor(int events);
-double get_sample(int chan);
+void casio_uart_processor(casio_link_t* lk, int events);
+int casio_rx_data_len(casio_link_t* lk);
+double get_sample(acq_reader_t* rd, int chan); // rd NULL for an unfiltered reading
+void get_chan_row(casio_link_t* lk, double* row, const double* meas, int64_t t_usec);
+int me_profile(int n, me_prof_t* res, char* wifi_load); // fills ME_PROF_PATHS results, n calls of each
 
 
 #ifdef __cplusplus
@@ -0,0 +1,104 @@
+// hot path profiling
+// rev 1 - cycle counts with the flash cache warm and evicted
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_partition.h"
+#include "esp_wifi.h"
+#include "xtensa/hal.h"
+#include "prof.h"
+
+#define PROF_LOAD_TASK_PRIORITY 4
+#define PROF_LOAD_CORE 0            // the WiFi stack runs on the PRO CPU
+#define PROF_CACHE_LINE 32
+
+static const volatile uint8_t* prof_evict_buf=NULL;
+static spi_flash_mmap_handle_t prof_evict_handle;
+static volatile char prof_load_run=0;
+static TaskHandle_t prof_load_handle=NULL;
+
+
+void prof_init(void)
+{
+    const esp_partition_t* part;
+    const void* p;
+    // any mapped flash will do, the running app is always there
+    part=esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
+    if ((part==NULL) || (part->size<PROF_EVICT_LEN))
+        return;
+    if (esp_partition_mmap(part, 0, PROF_EVICT_LEN, SPI_FLASH_MMAP_DATA, &p, &prof_evict_handle)!=ESP_OK) {
+        printf("prof: can't map flash, cold runs will be warm\r\n");
+        return;
+    }
+    prof_evict_buf=(const volatile uint8_t*)p;
+}
+
+// reads one byte of every cache line in the mapped flash, replacing whatever the cache held
+static void prof_evict(void)
+{
+    int i;
+    uint8_t x=0;
+    if (prof_evict_buf==NULL)
+        return;
+    for (i=0; i<PROF_EVICT_LEN; i+=PROF_CACHE_LINE) {
+        x+=prof_evict_buf[i];
+    }
+    (void)x;
+}
+
+// in IRAM whatever the build option, so that only the measured function can miss the cache
+void IRAM_ATTR prof_measure(prof_fn_t fn, void* ctx, int n, char cold, prof_stats_t* st)
+{
+    int i;
+    uint32_t c0, c;
+    memset(st, 0, sizeof(prof_stats_t));
+    st->min=0xffffffff;
+    if (n>PROF_ITER_MAX) n=PROF_ITER_MAX;
+    for (i=0; i<n; i++) {
+        if (cold)
+            prof_evict();
+        c0=xthal_get_ccount();
+        fn(ctx);
+        c=xthal_get_ccount()-c0;
+        if (c<st->min) st->min=c;
+        if (c>st->max) st->max=c;
+        st->total+=c;
+        st->n++;
+    }
+    if (st->n==0) st->min=0;
+}
+
+static void prof_load_task(void* arg)
+{
+    while (prof_load_run) {
+        if (esp_wifi_scan_start(NULL, true)!=ESP_OK) // blocks until the scan is done
+            vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    prof_load_handle=NULL;
+    vTaskDelete(NULL);
+}
+
+int prof_load_start(void)
+{
+    wifi_mode_t mode;
+    if ((esp_wifi_get_mode(&mode)!=ESP_OK) || (mode==WIFI_MODE_NULL))
+        return(-1);
+    if (prof_load_handle!=NULL)
+        return(0);
+    prof_load_run=1;
+    xTaskCreatePinnedToCore(prof_load_task, "profload", 1024*3, NULL, PROF_LOAD_TASK_PRIORITY, &prof_load_handle, PROF_LOAD_CORE);
+    return(0);
+}
+
+void prof_load_stop(void)
+{
+    prof_load_run=0;
+    while (prof_load_handle!=NULL) {
+        vTaskDelay(pdMS_TO_TICKS(50));
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef _PROF_HEADER_FILE_H
+#define _PROF_HEADER_FILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// cycle count profiling of the hot paths
+// Each call of the measured function is timed with the CPU cycle counter. A
+// warm run measures it with its code already in the flash cache. A cold run
+// first reads through more mapped flash than the cache holds, which is what
+// WiFi and NVS activity does to code running from flash, and WiFi scans are
+// kept going for the whole run, so the radio is busy too. Functions placed in IRAM
+// (CONFIG_MINIEXP_HOT_IRAM) should read about the same warm and cold.
+
+#define PROF_EVICT_LEN (64*1024)    // twice the flash cache
+#define PROF_ITER_MAX 10000
+
+typedef void (*prof_fn_t)(void* ctx);
+
+typedef struct prof_stats_s {
+    uint32_t n;
+    uint32_t min;                   // cycles
+    uint32_t max;
+    uint64_t total;
+} prof_stats_t;
+
+void prof_init(void);
+void prof_measure(prof_fn_t fn, void* ctx, int n, char cold, prof_stats_t* st);
+int prof_load_start(void);          // starts the WiFi scans, returns 0 if WiFi is running
+void prof_load_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PROF_HEADER_FILE_H */
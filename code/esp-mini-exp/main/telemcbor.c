@@ -0,0 +1,290 @@
+// compact binary telemetry encoding
+// rev 1 - CBOR window with delta, zig-zag, varint packed values
+
+#include <stdio.h>
+#include <string.h>
+#include "telemcbor.h"
+
+#define CBOR_UINT 0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_MAP 5
+
+static const char b64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+static uint32_t zigzag(int32_t v)
+{
+    return(((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+}
+
+static int32_t unzigzag(uint32_t u)
+{
+    return((int32_t)((u >> 1) ^ (~(u & 1) + 1)));
+}
+
+static int varint_len(uint32_t u)
+{
+    int n=1;
+    while (u>=0x80) {
+        u=u>>7;
+        n++;
+    }
+    return(n);
+}
+
+// the difference from the previous value wraps around, so every int32 value round-trips
+static uint32_t packed_item(const int32_t* vals, int i)
+{
+    if (i==0)
+        return(zigzag(vals[0]));
+    return(zigzag((int32_t)((uint32_t)vals[i] - (uint32_t)vals[i-1])));
+}
+
+static int packed_len(const tcbor_window_t* w, int chan)
+{
+    int i;
+    int n=0;
+    for (i=0; i<w->nvals[chan]; i++) {
+        n+=varint_len(packed_item(w->vals[chan], i));
+    }
+    return(n);
+}
+
+static int head_len(uint32_t val)
+{
+    if (val<24) return(1);
+    if (val<0x100) return(2);
+    if (val<0x10000) return(3);
+    return(5);
+}
+
+static int put_head(uint8_t* out, int major, uint32_t val)
+{
+    int n=head_len(val);
+    switch(n) {
+        case 1:
+            out[0]=(major<<5) | val;
+            break;
+        case 2:
+            out[0]=(major<<5) | 24;
+            out[1]=val;
+            break;
+        case 3:
+            out[0]=(major<<5) | 25;
+            out[1]=val>>8;
+            out[2]=val;
+            break;
+        default:
+            out[0]=(major<<5) | 26;
+            out[1]=val>>24;
+            out[2]=val>>16;
+            out[3]=val>>8;
+            out[4]=val;
+            break;
+    }
+    return(n);
+}
+
+int tcbor_size(const tcbor_window_t* w)
+{
+    int i;
+    int n;
+    int len=TCBOR_HDR_LEN;
+    for (i=0; i<TCBOR_CHAN_MAX; i++) {
+        if (w->nvals[i]==0) continue;
+        n=packed_len(w, i);
+        len+=4 + head_len(n) + n; // "chX", then the byte string
+    }
+    return(len);
+}
+
+int tcbor_encode(const tcbor_window_t* w, uint8_t* out, int outlen)
+{
+    int i, j;
+    int pos=0;
+    int nchan=0;
+    uint32_t u;
+    if (tcbor_size(w)>outlen)
+        return(-1);
+    for (i=0; i<TCBOR_CHAN_MAX; i++) {
+        if (w->nvals[i]>0) nchan++;
+    }
+    pos+=put_head(&out[pos], CBOR_MAP, 3+nchan);
+    // "t", always as an 8-byte unsigned int
+    out[pos++]=(CBOR_TEXT<<5) | 1;
+    out[pos++]='t';
+    out[pos++]=(CBOR_UINT<<5) | 27;
+    for (i=7; i>=0; i--) {
+        out[pos++]=(uint8_t)(w->t_ms >> (i*8));
+    }
+    // "ms", always as a 4-byte unsigned int
+    out[pos++]=(CBOR_TEXT<<5) | 2;
+    out[pos++]='m';
+    out[pos++]='s';
+    out[pos++]=(CBOR_UINT<<5) | 26;
+    for (i=3; i>=0; i--) {
+        out[pos++]=(uint8_t)(w->window_ms >> (i*8));
+    }
+    // "e", a small int
+    out[pos++]=(CBOR_TEXT<<5) | 1;
+    out[pos++]='e';
+    if (w->exp<0)
+        out[pos++]=(CBOR_NEGINT<<5) | (uint8_t)(-1 - w->exp);
+    else
+        out[pos++]=(CBOR_UINT<<5) | (uint8_t)w->exp;
+    for (i=0; i<TCBOR_CHAN_MAX; i++) {
+        if (w->nvals[i]==0) continue;
+        out[pos++]=(CBOR_TEXT<<5) | 3;
+        out[pos++]='c';
+        out[pos++]='h';
+        out[pos++]='1' + i;
+        pos+=put_head(&out[pos], CBOR_BYTES, packed_len(w, i));
+        for (j=0; j<w->nvals[i]; j++) {
+            u=packed_item(w->vals[i], j);
+            while (u>=0x80) {
+                out[pos++]=(uint8_t)(u | 0x80);
+                u=u>>7;
+            }
+            out[pos++]=(uint8_t)u;
+        }
+    }
+    return(pos);
+}
+
+// read a CBOR item head, returns its length or -1
+static int get_head(const uint8_t* in, int len, int* major, uint64_t* val)
+{
+    int i;
+    int n;
+    int info;
+    if (len<1) return(-1);
+    *major=in[0]>>5;
+    info=in[0] & 0x1f;
+    if (info<24) {
+        *val=info;
+        return(1);
+    }
+    if (info>27) return(-1);
+    n=1<<(info-24);
+    if (len<1+n) return(-1);
+    *val=0;
+    for (i=0; i<n; i++) {
+        *val=(*val<<8) | in[1+i];
+    }
+    return(1+n);
+}
+
+int tcbor_decode(const uint8_t* in, int len, tcbor_window_t* w)
+{
+    int pos=0;
+    int n;
+    int major;
+    int entries;
+    int chan;
+    int end;
+    int shift;
+    uint64_t val;
+    uint32_t u;
+    int32_t prev;
+    char key[4];
+    int keylen;
+
+    memset(w, 0, sizeof(tcbor_window_t));
+    n=get_head(in, len, &major, &val);
+    if ((n<0) || (major!=CBOR_MAP)) return(-1);
+    pos+=n;
+    entries=(int)val;
+    while (entries>0) {
+        entries--;
+        n=get_head(&in[pos], len-pos, &major, &val);
+        if ((n<0) || (major!=CBOR_TEXT) || (val>3) || (pos+n+(int)val>len)) return(-1);
+        pos+=n;
+        keylen=(int)val;
+        memcpy(key, &in[pos], keylen);
+        key[keylen]='\0';
+        pos+=keylen;
+        n=get_head(&in[pos], len-pos, &major, &val);
+        if (n<0) return(-1);
+        pos+=n;
+        if ((major==CBOR_BYTES) || (major==CBOR_TEXT)) {
+            if (pos+(int)val>len) return(-1);
+            end=pos+(int)val;
+            if ((keylen==3) && (key[0]=='c') && (key[1]=='h') && (key[2]>='1') && (key[2]<'1'+TCBOR_CHAN_MAX)) {
+                chan=key[2]-'1';
+                prev=0;
+                while (pos<end) {
+                    u=0;
+                    shift=0;
+                    do {
+                        if ((pos>=end) || (shift>28)) return(-1);
+                        u=u | ((uint32_t)(in[pos] & 0x7f) << shift);
+                        shift+=7;
+                    } while (in[pos++] & 0x80);
+                    if (w->nvals[chan]>=TCBOR_VALS_MAX) return(-1);
+                    prev=(int32_t)((uint32_t)prev + (uint32_t)unzigzag(u));
+                    w->vals[chan][w->nvals[chan]]=prev;
+                    w->nvals[chan]++;
+                }
+            }
+            pos=end;
+        } else if (strcmp(key, "t")==0) {
+            w->t_ms=val;
+        } else if (strcmp(key, "ms")==0) {
+            w->window_ms=(uint32_t)val;
+        } else if (strcmp(key, "e")==0) {
+            w->exp=(major==CBOR_NEGINT) ? (int8_t)(-1 - (int64_t)val) : (int8_t)val;
+        } else if ((major!=CBOR_UINT) && (major!=CBOR_NEGINT)) {
+            return(-1); // arrays, maps and the rest aren't used
+        }
+    }
+    return(0);
+}
+
+int tcbor_base64_len(int len)
+{
+    return(((len+2)/3)*4);
+}
+
+int tcbor_base64_encode(const uint8_t* in, int len, char* out, int outlen)
+{
+    int i;
+    int pos=0;
+    uint32_t v;
+    if (tcbor_base64_len(len)+1>outlen)
+        return(-1);
+    for (i=0; i<len; i+=3) {
+        v=(uint32_t)in[i]<<16;
+        if (i+1<len) v|=(uint32_t)in[i+1]<<8;
+        if (i+2<len) v|=in[i+2];
+        out[pos++]=b64_chars[(v>>18) & 0x3f];
+        out[pos++]=b64_chars[(v>>12) & 0x3f];
+        out[pos++]=(i+1<len) ? b64_chars[(v>>6) & 0x3f] : '=';
+        out[pos++]=(i+2<len) ? b64_chars[v & 0x3f] : '=';
+    }
+    out[pos]='\0';
+    return(pos);
+}
+
+int tcbor_base64_decode(const char* in, int len, uint8_t* out, int outlen)
+{
+    int i;
+    int pos=0;
+    int bits=0;
+    uint32_t v=0;
+    const char* p;
+    for (i=0; i<len; i++) {
+        if (in[i]=='=') break;
+        p=strchr(b64_chars, in[i]);
+        if ((p==NULL) || (in[i]=='\0')) return(-1);
+        v=(v<<6) | (uint32_t)(p-b64_chars);
+        bits+=6;
+        if (bits>=8) {
+            bits-=8;
+            if (pos>=outlen) return(-1);
+            out[pos++]=(uint8_t)(v>>bits);
+        }
+    }
+    return(pos);
+}
@@ -0,0 +1,49 @@
+
+#ifndef _TELEMCBOR_HEADER_FILE_H
+#define _TELEMCBOR_HEADER_FILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// compact binary telemetry encoding
+// A window of values is encoded as a CBOR map:
+//   "t"   time of the first value in msec (8-byte unsigned int)
+//   "ms"  length of the window in msec (4-byte unsigned int)
+//   "e"   decimal exponent of the values, -3 means they are in thousandths
+//   "ch1", "ch2", "ch3"  byte strings of packed values
+// Each packed byte string holds the first value, and then the difference from
+// the previous value, each zig-zag encoded and written as a varint (7 bits per
+// byte, least significant first, top bit set on all but the last byte).
+// So slowly changing 12-bit readings mostly take one or two bytes per value.
+// This file doesn't use any ESP-IDF functions, so the same code can decode
+// messages on a PC.
+
+#define TCBOR_CHAN_MAX 3
+#define TCBOR_VALS_MAX 32
+#define TCBOR_HDR_LEN 23    // map header, "t", "ms" and "e", which are always the same size
+
+typedef struct tcbor_window_s {
+    uint64_t t_ms;
+    uint32_t window_ms;
+    int8_t exp;
+    uint8_t nvals[TCBOR_CHAN_MAX];
+    int32_t vals[TCBOR_CHAN_MAX][TCBOR_VALS_MAX];
+} tcbor_window_t;
+
+int tcbor_encode(const tcbor_window_t* w, uint8_t* out, int outlen);  // returns the length, or -1 if it doesn't fit
+int tcbor_size(const tcbor_window_t* w);                              // length tcbor_encode would return
+int tcbor_decode(const uint8_t* in, int len, tcbor_window_t* w);     // returns 0 on success
+int tcbor_base64_encode(const uint8_t* in, int len, char* out, int outlen); // returns the length, with a NUL added
+int tcbor_base64_decode(const char* in, int len, uint8_t* out, int outlen);
+int tcbor_base64_len(int len);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TELEMCBOR_HEADER_FILE_H */
@@ -0,0 +1,355 @@
+// telemetry aggregator
+// rev 1 - time-windowed batches of values from all channels, in fixed-point JSON
+// rev 2 - optional CBOR encoding, see telemcbor.h
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "miniexp.h"
+#include "telemetry.h"
+#include "telemcbor.h"
+#include "flashring.h"
+#include "memstat.h"
+
+#define TELEM_SCALE 1000    // 10^TELEM_DECIMALS
+#define TELEM_VAL_LEN 13    // longest formatted value, "-2147483.647" plus a NUL
+
+QueueHandle_t iotq; // messages for IoT Central, TELEM_MSG_LEN bytes each
+
+static SemaphoreHandle_t telem_lock;
+static StaticSemaphore_t telem_lock_buf;
+static StaticQueue_t iotq_buf;
+static uint8_t iotq_store[TELEM_QUEUE_LEN*TELEM_MSG_LEN];
+static esp_timer_handle_t telem_timer;
+static tcbor_window_t telem_win = { .exp = -TELEM_DECIMALS }; // values held for the next message
+static uint16_t telem_chars[TELEM_CHAN_MAX];    // formatted length of the values held for each channel
+static int64_t telem_t0_usec;                   // esp_timer time of the first value in the window
+static uint32_t telem_flush_ms = TELEM_FLUSH_MS_DEFAULT;
+static uint16_t telem_size = TELEM_MSG_LEN;
+static char telem_format = TELEM_FMT_JSON;
+static telem_stats_t telem_stats;
+static char telem_msg[TELEM_MSG_LEN];
+static uint8_t telem_cbor[TELEM_MSG_LEN];
+
+
+// format a fixed-point value, returns the length
+static int telem_fixed(char* buf, int32_t v)
+{
+    char tmp[TELEM_VAL_LEN];
+    uint32_t u;
+    uint32_t frac;
+    int i=0;
+    int n=0;
+    int d;
+    if (v<0) {
+        buf[n++]='-';
+        u=(uint32_t)(-(int64_t)v);
+    } else {
+        u=(uint32_t)v;
+    }
+    frac=u % TELEM_SCALE;
+    u=u / TELEM_SCALE;
+    do {
+        tmp[i++]='0' + (u % 10);
+        u=u / 10;
+    } while (u>0);
+    while (i>0) {
+        buf[n++]=tmp[--i];
+    }
+    buf[n++]='.';
+    for (d=TELEM_SCALE/10; d>0; d=d/10) {
+        buf[n++]='0' + ((frac / d) % 10);
+    }
+    buf[n]='\0';
+    return(n);
+}
+
+static int32_t telem_to_fixed(double value)
+{
+    double s = value * TELEM_SCALE;
+    if (s>2147483647.0) return(2147483647);
+    if (s<-2147483647.0) return(-2147483647);
+    return((int32_t)(s<0 ? s-0.5 : s+0.5));
+}
+
+// length of the JSON message if extra_chars of value were added to channel chan
+static int telem_json_len(int chan, int extra_chars)
+{
+    int i;
+    int n;
+    int chars;
+    int len=2; // {}
+    int nchans=0;
+    for (i=0; i<TELEM_CHAN_MAX; i++) {
+        n=telem_win.nvals[i];
+        chars=telem_chars[i];
+        if (i==chan) {
+            n++;
+            chars+=extra_chars;
+        }
+        if (n==0) continue;
+        len+=6 + chars + (n-1); // "chX": and the values with commas
+        if (n>1) len+=2;        // []
+        nchans++;
+    }
+    if (nchans>1) len+=nchans-1;
+    return(len);
+}
+
+// JSON message, for example {"ch1":[1.234,1.250],"ch3":0.5}. Returns the length
+static int telem_build_json(const tcbor_window_t* w, char* out)
+{
+    int i, j;
+    int pos=0;
+    out[pos++]='{';
+    for (i=0; i<TELEM_CHAN_MAX; i++) {
+        if (w->nvals[i]==0) continue;
+        if (pos>1) out[pos++]=',';
+        pos+=snprintf(&out[pos], TELEM_MSG_LEN-pos, "\"ch%d\":", i+1);
+        if (w->nvals[i]>1) out[pos++]='[';
+        for (j=0; j<w->nvals[i]; j++) {
+            if (j>0) out[pos++]=',';
+            pos+=telem_fixed(&out[pos], w->vals[i][j]);
+        }
+        if (w->nvals[i]>1) out[pos++]=']';
+    }
+    out[pos++]='}';
+    out[pos]='\0';
+    return(pos);
+}
+
+// CBOR message, base64 encoded so it can travel as text: {"cbor":"..."}. Returns the length
+static int telem_build_cbor(const tcbor_window_t* w, char* out)
+{
+    int n;
+    int pos;
+    n=tcbor_encode(w, telem_cbor, sizeof(telem_cbor));
+    if (n<0) return(0);
+    pos=snprintf(out, TELEM_MSG_LEN, "{\"cbor\":\"");
+    n=tcbor_base64_encode(telem_cbor, n, &out[pos], TELEM_MSG_LEN-pos-2);
+    if (n<0) return(0);
+    pos+=n;
+    out[pos++]='"';
+    out[pos++]='}';
+    out[pos]='\0';
+    return(pos);
+}
+
+// length of the message if value v (formatted as extra_chars) was added to channel chan
+static int telem_msg_len(int chan, int32_t v, int extra_chars)
+{
+    int len;
+    if (telem_format==TELEM_FMT_JSON)
+        return(telem_json_len(chan, extra_chars));
+    telem_win.vals[chan][telem_win.nvals[chan]]=v;
+    telem_win.nvals[chan]++;
+    len=TELEM_CBOR_WRAP_LEN + tcbor_base64_len(tcbor_size(&telem_win));
+    telem_win.nvals[chan]--;
+    return(len);
+}
+
+// the window's start time in msec. Unix time once the clock is set by NTP, otherwise time since boot
+static uint64_t telem_window_time(int64_t t0_usec)
+{
+    struct timeval tv;
+    int64_t now=esp_timer_get_time();
+    if (get_year()==0)
+        return((uint64_t)(t0_usec/1000));
+    gettimeofday(&tv, NULL);
+    return((uint64_t)tv.tv_sec*1000 + tv.tv_usec/1000 - (uint64_t)((now-t0_usec)/1000));
+}
+
+// build the message and put it on iotq. Call with telem_lock held
+static void telem_send(void)
+{
+    int i;
+    int pos;
+    int nvals=0;
+    UBaseType_t waiting;
+    for (i=0; i<TELEM_CHAN_MAX; i++) {
+        nvals+=telem_win.nvals[i];
+    }
+    if (nvals==0) return;
+    if (telem_format==TELEM_FMT_CBOR) {
+        telem_win.t_ms=telem_window_time(telem_t0_usec);
+        telem_win.window_ms=(uint32_t)((esp_timer_get_time()-telem_t0_usec)/1000);
+        pos=telem_build_cbor(&telem_win, telem_msg);
+    } else {
+        pos=telem_build_json(&telem_win, telem_msg);
+    }
+    memset(telem_win.nvals, 0, sizeof(telem_win.nvals));
+    memset(telem_chars, 0, sizeof(telem_chars));
+    if (pos==0) {
+        telem_stats.dropped_msgs++;
+        telem_stats.dropped_values+=nvals;
+        return;
+    }
+
+    // never block the caller, the Casio link may be waiting on us.
+    // If the message can't be sent now, keep it in flash until the connection is back
+    if ((fring_online()) && (xQueueSend(iotq, telem_msg, 0)==pdTRUE)) {
+        telem_stats.msgs++;
+        telem_stats.bytes+=pos;
+    } else if (fring_store(telem_msg, pos)==0) {
+        telem_stats.stored++;
+    } else {
+        telem_stats.dropped_msgs++;
+        telem_stats.dropped_values+=nvals;
+    }
+    waiting=uxQueueMessagesWaiting(iotq);
+    if (waiting>telem_stats.queue_max) telem_stats.queue_max=waiting;
+    if(VERBOSE) printf("telemetry: %s\r\n", telem_msg);
+}
+
+static void telem_timer_callback(void* arg)
+{
+    telemetry_flush();
+}
+
+void telemetry_init(void)
+{
+    const esp_timer_create_args_t telem_timer_args = {
+        .callback = &telem_timer_callback,
+        .name = "telemetry"
+    };
+    iotq = xQueueCreateStatic(TELEM_QUEUE_LEN, TELEM_MSG_LEN, iotq_store, &iotq_buf);
+    telem_lock = xSemaphoreCreateMutexStatic(&telem_lock_buf);
+    mem_static_add("telemetry", sizeof(iotq_store) + sizeof(iotq_buf) + sizeof(telem_lock_buf) + sizeof(telem_win) + sizeof(telem_msg) + sizeof(telem_cbor));
+    memset(telem_win.nvals, 0, sizeof(telem_win.nvals));
+    memset(telem_chars, 0, sizeof(telem_chars));
+    memset(&telem_stats, 0, sizeof(telem_stats_t));
+    ESP_ERROR_CHECK(esp_timer_create(&telem_timer_args, &telem_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(telem_timer, (uint64_t)telem_flush_ms * 1000));
+}
+
+int telemetry_add(int chan, double value)
+{
+    char buf[TELEM_VAL_LEN];
+    int32_t v;
+    int vlen;
+    if ((chan<0) || (chan>=TELEM_CHAN_MAX)) return(-1);
+    v=telem_to_fixed(value);
+    vlen=telem_fixed(buf, v);
+    xSemaphoreTake(telem_lock, portMAX_DELAY);
+    if ((telem_win.nvals[chan]>=TELEM_VALS_MAX) || (telem_msg_len(chan, v, vlen)>=telem_size)) {
+        telem_stats.size_flushes++;
+        telem_send();
+    }
+    if ((telem_win.nvals[0]==0) && (telem_win.nvals[1]==0) && (telem_win.nvals[2]==0))
+        telem_t0_usec=esp_timer_get_time();
+    telem_win.vals[chan][telem_win.nvals[chan]]=v;
+    telem_win.nvals[chan]++;
+    telem_chars[chan]+=vlen;
+    telem_stats.values++;
+    xSemaphoreGive(telem_lock);
+    return(0);
+}
+
+void telemetry_flush(void)
+{
+    xSemaphoreTake(telem_lock, portMAX_DELAY);
+    telem_send();
+    xSemaphoreGive(telem_lock);
+}
+
+void telemetry_set_flush_ms(uint32_t ms)
+{
+    if (ms<TELEM_FLUSH_MS_MIN) ms=TELEM_FLUSH_MS_MIN;
+    telem_flush_ms=ms;
+    esp_timer_stop(telem_timer);
+    esp_timer_start_periodic(telem_timer, (uint64_t)telem_flush_ms * 1000);
+}
+
+uint32_t telemetry_get_flush_ms(void)
+{
+    return(telem_flush_ms);
+}
+
+void telemetry_set_size(uint16_t bytes)
+{
+    if (bytes>TELEM_MSG_LEN) bytes=TELEM_MSG_LEN;
+    if (bytes<TELEM_SIZE_MIN) bytes=TELEM_SIZE_MIN;
+    xSemaphoreTake(telem_lock, portMAX_DELAY);
+    telem_size=bytes;
+    telem_send(); // what's held may no longer fit
+    xSemaphoreGive(telem_lock);
+}
+
+uint16_t telemetry_get_size(void)
+{
+    return(telem_size);
+}
+
+void telemetry_get_stats(telem_stats_t* stats)
+{
+    xSemaphoreTake(telem_lock, portMAX_DELAY);
+    memcpy(stats, &telem_stats, sizeof(telem_stats_t));
+    xSemaphoreGive(telem_lock);
+}
+
+void telemetry_clear_stats(void)
+{
+    xSemaphoreTake(telem_lock, portMAX_DELAY);
+    memset(&telem_stats, 0, sizeof(telem_stats_t));
+    xSemaphoreGive(telem_lock);
+}
+
+void telemetry_set_format(char format)
+{
+    xSemaphoreTake(telem_lock, portMAX_DELAY);
+    telem_send(); // the held values were sized for the old format
+    telem_format=format;
+    xSemaphoreGive(telem_lock);
+}
+
+char telemetry_get_format(void)
+{
+    return(telem_format);
+}
+
+// encode a made-up window of slowly changing readings, in both formats
+void telemetry_bench(telem_bench_t* res)
+{
+    static tcbor_window_t w; // too big for the console task stack
+    int i, j;
+    int nvals=0;
+    int len=0;
+    int64_t t;
+    memset(&w, 0, sizeof(tcbor_window_t));
+    w.exp=-TELEM_DECIMALS;
+    w.t_ms=telem_window_time(esp_timer_get_time());
+    w.window_ms=telem_flush_ms;
+    for (i=0; i<TELEM_CHAN_MAX; i++) {
+        for (j=0; j<TELEM_BENCH_VALS; j++) {
+            // a 12-bit ADC reading in volts, drifting and with a little noise
+            w.vals[i][j]=telem_to_fixed(((double)(2048 + (i*300) + (j*3) + ((j*7919) % 5) - 2))/1241.0);
+        }
+        w.nvals[i]=TELEM_BENCH_VALS;
+        nvals+=TELEM_BENCH_VALS;
+    }
+    res->samples=nvals;
+    xSemaphoreTake(telem_lock, portMAX_DELAY); // telem_msg and telem_cbor are shared
+    t=esp_timer_get_time();
+    for (i=0; i<TELEM_BENCH_LOOPS; i++) {
+        len=telem_build_json(&w, telem_msg);
+    }
+    t=esp_timer_get_time()-t;
+    res->json_bytes=len;
+    res->json_cycles_per_sample=(uint32_t)((t * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ) / (TELEM_BENCH_LOOPS * nvals));
+    t=esp_timer_get_time();
+    for (i=0; i<TELEM_BENCH_LOOPS; i++) {
+        len=telem_build_cbor(&w, telem_msg);
+    }
+    t=esp_timer_get_time()-t;
+    res->cbor_bytes=len;
+    res->cbor_raw_bytes=tcbor_size(&w);
+    res->cbor_cycles_per_sample=(uint32_t)((t * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ) / (TELEM_BENCH_LOOPS * nvals));
+    xSemaphoreGive(telem_lock);
+}
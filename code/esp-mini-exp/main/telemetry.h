@@ -0,0 +1,73 @@
+
+#ifndef _TELEMETRY_HEADER_FILE_H
+#define _TELEMETRY_HEADER_FILE_H
+
+#include <stdint.h>
+#include "telemcbor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// telemetry aggregator
+// Values sent to the cloud are collected per channel, and sent as one
+// JSON message per time window, for example {"ch1":[1.234,1.250],"ch3":0.5}
+// A channel with a single value in the window is sent as a plain number,
+// so one value per window looks the same as the original {"chX": value} message.
+// With the CBOR format, the window is instead sent as {"cbor":"<base64>"},
+// see telemcbor.h. It stays text, so it can go through iotq and the flash ring.
+
+#define TELEM_MSG_LEN 256           // size of each iotq item
+#define TELEM_QUEUE_LEN 8           // number of iotq items
+#define TELEM_CHAN_MAX TCBOR_CHAN_MAX
+#define TELEM_VALS_MAX TCBOR_VALS_MAX   // values held per channel before a flush is forced
+#define TELEM_FLUSH_MS_DEFAULT 1000
+#define TELEM_FLUSH_MS_MIN 100
+#define TELEM_SIZE_MIN 32
+#define TELEM_DECIMALS 3            // values are sent in fixed-point, with this many decimal places
+#define TELEM_FMT_JSON 0
+#define TELEM_FMT_CBOR 1
+#define TELEM_CBOR_WRAP_LEN 11      // {"cbor":""}
+#define TELEM_BENCH_VALS 10         // values per channel in the benchmark window, small enough for a JSON message
+#define TELEM_BENCH_LOOPS 100
+
+typedef struct telem_stats_s {
+    uint32_t values;        // values accepted
+    uint32_t msgs;          // messages put on iotq
+    uint32_t bytes;         // total length of those messages
+    uint32_t stored;        // messages kept in the flash ring, because WiFi was down or iotq was full
+    uint32_t dropped_msgs;  // messages lost because iotq and the flash ring were both full
+    uint32_t dropped_values;
+    uint32_t size_flushes;  // messages sent early because they reached the size limit
+    uint32_t queue_max;     // highest number of waiting iotq items seen
+} telem_stats_t;
+
+typedef struct telem_bench_s {
+    uint32_t samples;               // values in the benchmark window
+    uint32_t json_bytes;
+    uint32_t json_cycles_per_sample;
+    uint32_t cbor_bytes;            // {"cbor":"<base64>"} message
+    uint32_t cbor_raw_bytes;        // the CBOR itself, as it would be sent over a binary transport
+    uint32_t cbor_cycles_per_sample;
+} telem_bench_t;
+
+void telemetry_init(void);
+int telemetry_add(int chan, double value);  // chan is 0..2, returns 0 if accepted
+void telemetry_flush(void);
+void telemetry_set_flush_ms(uint32_t ms);
+uint32_t telemetry_get_flush_ms(void);
+void telemetry_set_size(uint16_t bytes);     // largest message, up to TELEM_MSG_LEN
+uint16_t telemetry_get_size(void);
+void telemetry_get_stats(telem_stats_t* stats);
+void telemetry_clear_stats(void);
+void telemetry_set_format(char format);     // TELEM_FMT_JSON or TELEM_FMT_CBOR
+char telemetry_get_format(void);
+void telemetry_bench(telem_bench_t* res);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TELEMETRY_HEADER_FILE_H */
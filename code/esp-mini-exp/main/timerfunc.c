@@ -25,11 +25,8 @@
 #include "timerfunc.h"
 #include "esp_timer.h"
 
-esp_timer_handle_t sample_timer;
-extern int8_t sample_method;
-extern xQueueHandle timer_queue;
-
-static char sample_timer_active=0;
+char sample_pll_enabled = SAMPLE_PLL_DEFAULT;
+static portMUX_TYPE sample_ring_mux = portMUX_INITIALIZER_UNLOCKED;
 
 
 uint16_t get_year(void)
@@ -45,50 +42,347 @@ uint16_t get_year(void)
     return(timeinfo.tm_year + 1900);
 }
 
-void sample_timer_callback(void* arg)
+// sample all channels enabled in sample_method into evt
+ME_HOT void sample_fill_event(sample_timer_t* st, timer_event_t* evt)
 {
-
-    timer_event_t evt;
-    evt.event = 0;
-    evt.countval = 0;
+    int8_t sample_method = *(st->sample_method);
+    evt->event = 0;
+    evt->countval = (uint64_t)esp_timer_get_time(); // time the conversion was done
 
     if (sample_method & 0x01)
-        evt.meas[0] = get_sample(0);
+        evt->meas[0] = get_sample(&st->reader, 0);
     else
-        evt.meas[0] = 0;
+        evt->meas[0] = 0;
 
     if (sample_method & 0x02)
-        evt.meas[1] = get_sample(1);
+        evt->meas[1] = get_sample(&st->reader, 1);
     else
-        evt.meas[1] = 0;
+        evt->meas[1] = 0;
 
     if (sample_method & 0x04)
-        evt.meas[2] = get_sample(2);
+        evt->meas[2] = get_sample(&st->reader, 2);
     else
-        evt.meas[2] = 0;
+        evt->meas[2] = 0;
+}
+
+// ********** multi-rate sampling **********
+
+static ME_HOT void sample_wheel_add(sample_timer_t* st, int chan)
+{
+    uint32_t ticks = st->chan_ticks[chan];
+    st->wheel[(st->wheel_pos + ticks) % SAMPLE_WHEEL_SLOTS] |= (0x01<<chan);
+    st->chan_rounds[chan] = (uint16_t)((ticks - 1) / SAMPLE_WHEEL_SLOTS);
+}
+
+static ME_HOT void sample_ring_put(sample_ring_t* r, uint64_t t, double v)
+{
+    portENTER_CRITICAL(&sample_ring_mux);
+    r->t[r->head] = t;
+    r->v[r->head] = v;
+    r->head = (r->head + 1) % SAMPLE_RING_LEN;
+    if (r->count < SAMPLE_RING_LEN)
+        r->count++;
+    portEXIT_CRITICAL(&sample_ring_mux);
+}
+
+// one tick of the wheel: sample the channels that are due, and queue a row when one is due
+static ME_HOT void sample_wheel_tick(sample_timer_t* st)
+{
+    int i;
+    uint8_t due;
+    uint64_t now = (uint64_t)esp_timer_get_time();
+    int8_t sample_method = *(st->sample_method);
+    timer_event_t evt;
+
+    due = st->wheel[st->wheel_pos];
+    st->wheel[st->wheel_pos] = 0;
+    for (i=0; i<3; i++) {
+        if ((due & (0x01<<i)) == 0)
+            continue;
+        if (st->chan_rounds[i] > 0) {
+            st->chan_rounds[i]--;
+            st->wheel[st->wheel_pos] |= (0x01<<i); // due on a later turn
+            continue;
+        }
+        st->latest[i] = get_sample(&st->reader, i);
+        sample_ring_put(&st->ring[i], now, st->latest[i]);
+        sample_wheel_add(st, i);
+    }
+    st->wheel_pos = (st->wheel_pos + 1) % SAMPLE_WHEEL_SLOTS;
+
+    st->row_count++;
+    if (st->row_count >= st->row_ticks) {
+        st->row_count = 0;
+        evt.event = 0;
+        evt.countval = now;
+        for (i=0; i<3; i++) {
+            evt.meas[i] = (sample_method & (0x01<<i)) ? st->latest[i] : 0;
+        }
+        xQueueSend(st->queue, &evt, 0);
+    }
+}
+
+static uint32_t sample_gcd(uint32_t a, uint32_t b)
+{
+    uint32_t t;
+    while (b != 0) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return(a);
+}
+
+// works out the wheel tick for the common period and the enabled channels' periods, and schedules
+// every enabled channel for the first tick
+static void sample_wheel_setup(sample_timer_t* st, uint32_t usec)
+{
+    int i;
+    uint32_t p;
+    uint32_t tick = usec;
+    int8_t sample_method = *(st->sample_method);
+    for (i=0; i<3; i++) {
+        if ((sample_method & (0x01<<i)) && (st->chan_period_usec[i] > 0))
+            tick = sample_gcd(tick, st->chan_period_usec[i]);
+    }
+    if (tick < SAMPLE_TICK_MIN_USEC)
+        tick = SAMPLE_TICK_MIN_USEC; // periods are rounded to whole ticks
+    st->tick_usec = tick;
+    st->row_ticks = (usec + tick/2) / tick;
+    if (st->row_ticks == 0)
+        st->row_ticks = 1;
+    st->row_count = 0;
+    st->wheel_pos = 0;
+    memset(st->wheel, 0, sizeof(st->wheel));
+    portENTER_CRITICAL(&sample_ring_mux);
+    memset(st->ring, 0, sizeof(st->ring));
+    portEXIT_CRITICAL(&sample_ring_mux);
+    for (i=0; i<3; i++) {
+        st->latest[i] = 0;
+        p = (st->chan_period_usec[i] > 0) ? st->chan_period_usec[i] : usec;
+        st->chan_ticks[i] = (p + tick/2) / tick;
+        if (st->chan_ticks[i] == 0)
+            st->chan_ticks[i] = 1;
+        st->chan_rounds[i] = 0;
+        if (sample_method & (0x01<<i))
+            st->wheel[0] |= (0x01<<i);
+    }
+}
+
+void sample_timer_set_period(sample_timer_t* st, int chan, uint32_t usec)
+{
+    if ((chan < 0) || (chan >= 3))
+        return;
+    st->chan_period_usec[chan] = usec;
+}
+
+uint32_t sample_timer_chan_period(sample_timer_t* st, int chan, uint32_t common_usec)
+{
+    if ((chan < 0) || (chan >= 3))
+        return(0);
+    if (st->multirate && st->active)
+        return(st->chan_ticks[chan] * st->tick_usec); // as rounded to the wheel
+    return((st->chan_period_usec[chan] > 0) ? st->chan_period_usec[chan] : common_usec);
+}
+
+char sample_timer_multirate(sample_timer_t* st)
+{
+    int i;
+    for (i=0; i<3; i++) {
+        if (st->chan_period_usec[i] > 0)
+            return(1);
+    }
+    return(0);
+}
+
+int sample_ring_read(sample_timer_t* st, int chan, uint64_t* t, double* v)
+{
+    int i, n, pos;
+    sample_ring_t* r;
+    if ((chan < 0) || (chan >= 3))
+        return(0);
+    r = &st->ring[chan];
+    portENTER_CRITICAL(&sample_ring_mux);
+    n = r->count;
+    pos = (r->head + SAMPLE_RING_LEN - n) % SAMPLE_RING_LEN;
+    for (i=0; i<n; i++) {
+        if (t != NULL) t[i] = r->t[pos];
+        if (v != NULL) v[i] = r->v[pos];
+        pos = (pos + 1) % SAMPLE_RING_LEN;
+    }
+    portEXIT_CRITICAL(&sample_ring_mux);
+    return(n);
+}
 
-    xQueueSendFromISR(timer_queue, &evt, NULL); // probably should use a non-ISR send function
+ME_HOT void sample_timer_callback(void* arg)
+{
+    sample_timer_t* st = (sample_timer_t*)arg;
+    timer_event_t evt;
+    if (st->multirate) {
+        sample_wheel_tick(st);
+        return;
+    }
+    sample_fill_event(st, &evt);
+
+    xQueueSendFromISR(st->queue, &evt, NULL); // probably should use a non-ISR send function
+}
+
+ME_HOT void sample_pll_callback(void* arg)
+{
+    sample_timer_t* st = (sample_timer_t*)arg;
+    timer_event_t evt;
+    sample_fill_event(st, &evt);
+    xQueueOverwrite(st->pll_mailbox, &evt);
 }
 
-void sample_timer_init(void)
+void sample_timer_init(sample_timer_t* st, int8_t* sample_method)
 {
     const esp_timer_create_args_t sample_timer_args = {
         .callback = &sample_timer_callback,
+        .arg = st,
         .name = "sample"
     };
-    ESP_ERROR_CHECK(esp_timer_create(&sample_timer_args, &sample_timer));
+    const esp_timer_create_args_t pll_timer_args = {
+        .callback = &sample_pll_callback,
+        .arg = st,
+        .name = "samplepll"
+    };
+    memset(st, 0, sizeof(sample_timer_t));
+    st->sample_method = sample_method;
+    acq_reader_init(&st->reader);
+    st->queue = xQueueCreateStatic(SAMPLE_QUEUE_LEN, sizeof(timer_event_t), st->queue_store, &st->queue_buf);
+    st->pll_mailbox = xQueueCreateStatic(1, sizeof(timer_event_t), st->pll_mailbox_store, &st->pll_mailbox_buf);
+    ESP_ERROR_CHECK(esp_timer_create(&sample_timer_args, &st->timer));
+    ESP_ERROR_CHECK(esp_timer_create(&pll_timer_args, &st->pll_timer));
+}
+
+void sample_timer_start(sample_timer_t* st, uint64_t usec) {
+    st->multirate = sample_timer_multirate(st);
+    if (st->multirate) {
+        sample_wheel_setup(st, (uint32_t)usec);
+        usec = st->tick_usec;
+    }
+    acq_reader_restart(&st->reader); // the rate may have changed
+    ESP_ERROR_CHECK(esp_timer_start_periodic(st->timer, usec));
+    st->active=1;
+}
+
+void sample_timer_stop(sample_timer_t* st) {
+    if (st->active) {
+        ESP_ERROR_CHECK(esp_timer_stop(st->timer));
+        st->active=0;
+    }
+}
+
+void sample_timer_get(sample_timer_t* st, timer_event_t* evt, uint32_t wait_ms)
+{
+    if (xQueueReceive(st->queue, evt, wait_ms / portTICK_PERIOD_MS) != pdTRUE) {
+        evt->event = 1;
+    }
+}
+
+// ********** phase-locked sampling **********
+// In real-time mode the calculator polls once per period. Rather than free-running
+// the sample timer (where the queued data ages relative to the poll, and the queue
+// can grow or run dry), we learn the poll cadence with a software PLL and schedule
+// a one-shot conversion SAMPLE_PLL_LEAD_USEC before each expected poll.
+// The converted sample is held in a single-entry mailbox, so nothing builds up.
+
+// schedule the next conversion just ahead of the predicted poll
+static void sample_pll_schedule(sample_timer_t* st, int64_t now)
+{
+    int64_t due;
+    esp_timer_stop(st->pll_timer); // may not be running, so ignore the result
+    due = st->pll_next_poll - SAMPLE_PLL_LEAD_USEC - now;
+    if (due < SAMPLE_PLL_MIN_DELAY_USEC)
+        due = SAMPLE_PLL_MIN_DELAY_USEC;
+    esp_timer_start_once(st->pll_timer, (uint64_t)due);
+}
+
+void sample_pll_start(sample_timer_t* st, uint32_t period_usec)
+{
+    sample_pll_stop(st);
+    xQueueReset(st->pll_mailbox);
+    acq_reader_restart(&st->reader);
+    memset(&st->pll_stats, 0, sizeof(sample_pll_stats_t));
+    st->pll_nominal_usec = period_usec;
+    st->pll_period_usec = ((int64_t)period_usec) << 8;
+    st->pll_stats.period_usec = period_usec;
+    st->pll_locked = 0; // the first poll sets the phase
+    st->pll_active = 1;
+}
+
+void sample_pll_stop(sample_timer_t* st)
+{
+    if (st->pll_active) {
+        esp_timer_stop(st->pll_timer);
+        st->pll_active = 0;
+    }
 }
 
-void sample_timer_start(uint64_t usec) {
-    ESP_ERROR_CHECK(esp_timer_start_periodic(sample_timer, usec));
-    sample_timer_active=1;
+char sample_pll_active(sample_timer_t* st)
+{
+    return(st->pll_active);
 }
 
-void sample_timer_stop(void) {
-    if (sample_timer_active) {
-        ESP_ERROR_CHECK(esp_timer_stop(sample_timer));
-        sample_timer_active=0;
+// called when the calculator polls for a real-time sample. Updates the loop
+// and returns the freshest sample in evt.
+void sample_pll_poll(sample_timer_t* st, timer_event_t* evt)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t err;
+    int64_t aerr;
+    int64_t period = st->pll_period_usec >> 8;
+    int64_t nominal = ((int64_t)st->pll_nominal_usec) << 8;
+    int64_t lim = nominal / SAMPLE_PLL_MAX_DRIFT_DIV;
+    sample_pll_stats_t* stats = &st->pll_stats;
+    uint32_t age;
+
+    stats->polls++;
+    if (st->pll_locked) {
+        err = now - st->pll_next_poll;
+        aerr = (err < 0) ? -err : err;
+        if (aerr > (period / 2)) {
+            // the calculator skipped or delayed a poll, so start again from this one
+            stats->relocks++;
+            st->pll_next_poll = now + period;
+        } else {
+            // second order loop: phase correction plus a slower frequency correction
+            st->pll_period_usec += (err * 256) >> SAMPLE_PLL_KI_SHIFT; // err can be negative, so not err << 8
+            if (st->pll_period_usec > nominal + lim)
+                st->pll_period_usec = nominal + lim;
+            if (st->pll_period_usec < nominal - lim)
+                st->pll_period_usec = nominal - lim;
+            st->pll_next_poll = st->pll_next_poll + (st->pll_period_usec >> 8) + (err >> SAMPLE_PLL_KP_SHIFT);
+            stats->phase_err_usec = (int32_t)err;
+            if (aerr > stats->phase_err_max_usec)
+                stats->phase_err_max_usec = (uint32_t)aerr;
+            stats->phase_err_avg_usec = stats->phase_err_avg_usec - (stats->phase_err_avg_usec >> 3) + (uint32_t)(aerr >> 3);
+        }
+    } else {
+        st->pll_locked = 1;
+        st->pll_next_poll = now + period;
     }
+    stats->period_usec = (uint32_t)(st->pll_period_usec >> 8);
+    stats->drift_ppm = (int32_t)(((st->pll_period_usec - nominal) * 1000000LL) / nominal);
+
+    // collect the pre-converted sample, or convert now if it did not arrive in time
+    if ((xQueueReceive(st->pll_mailbox, evt, 0) != pdTRUE) || ((now - (int64_t)evt->countval) > (period / 2))) {
+        stats->late++;
+        sample_fill_event(st, evt);
+    }
+    age = (uint32_t)(esp_timer_get_time() - (int64_t)evt->countval);
+    if (age > stats->age_max_usec)
+        stats->age_max_usec = age;
+    stats->age_avg_usec = stats->age_avg_usec - (stats->age_avg_usec >> 3) + (age >> 3);
+
+    if (st->pll_active)
+        sample_pll_schedule(st, now);
+}
+
+void sample_pll_get_stats(sample_timer_t* st, sample_pll_stats_t* stats)
+{
+    memcpy(stats, &st->pll_stats, sizeof(sample_pll_stats_t));
 }
 
 
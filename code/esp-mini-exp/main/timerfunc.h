@@ -3,6 +3,11 @@
 #ifndef _TIMERFUNC_HEADER_FILE_H
 #define _TIMERFUNC_HEADER_FILE_H
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
+#include "acq.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -11,15 +16,104 @@ extern "C" {
 typedef struct timer_event_s {
     int timernum;
     int event;
-    uint64_t countval;
+    uint64_t countval; // esp_timer time (usec) at which the measurement was taken
     double meas[3]; // 3 is CHAN_MAX
 } timer_event_t;
 
 // timer functions
+// each Casio link has its own sample timer, and its own phase-locked loop
+
+#define SAMPLE_QUEUE_LEN 10             // rows waiting for the calculator
+
+// phase-locked sampling for real-time mode
+#define SAMPLE_PLL_DEFAULT 1            // set to 0 to use the free-running sample timer by default
+#define SAMPLE_PLL_LEAD_USEC 2000       // convert this long before the expected poll
+#define SAMPLE_PLL_MIN_DELAY_USEC 100
+#define SAMPLE_PLL_KP_SHIFT 2           // phase gain 1/4
+#define SAMPLE_PLL_KI_SHIFT 5           // frequency gain 1/32
+#define SAMPLE_PLL_MAX_DRIFT_DIV 20     // period estimate is limited to nominal +/- 5%
+
+typedef struct sample_pll_stats_s {
+    uint32_t polls;               // calculator polls seen since start
+    uint32_t late;                // polls where the scheduled sample wasn't ready
+    uint32_t relocks;             // polls too far from the prediction, loop restarted
+    uint32_t period_usec;         // learned poll period
+    int32_t drift_ppm;            // learned period relative to the requested one
+    int32_t phase_err_usec;       // last poll time minus predicted time
+    uint32_t phase_err_avg_usec;  // smoothed absolute phase error
+    uint32_t phase_err_max_usec;
+    uint32_t age_avg_usec;        // smoothed age of the sample when sent
+    uint32_t age_max_usec;
+} sample_pll_stats_t;
+
+// multi-rate sampling
+// Each channel can have its own sample period. One esp_timer then ticks at the
+// greatest common divisor of the periods (at least SAMPLE_TICK_MIN_USEC), and a
+// timer wheel of SAMPLE_WHEEL_SLOTS slots holds the channels due at each tick.
+// A channel with a period longer than the wheel waits a number of turns. Every
+// sample goes into its channel's ring, and the rows queued for the calculator at
+// the common period hold the newest sample of each channel, so a slow channel
+// is only converted as often as it needs to be.
+#define SAMPLE_WHEEL_SLOTS 16
+#define SAMPLE_TICK_MIN_USEC 1000
+#define SAMPLE_RING_LEN 16              // one ring fits in a 2001 result list
+
+typedef struct sample_ring_s {
+    uint64_t t[SAMPLE_RING_LEN];        // esp_timer time of each sample
+    double v[SAMPLE_RING_LEN];
+    uint8_t head;                       // next entry written
+    uint8_t count;
+} sample_ring_t;
+
+typedef struct sample_timer_s {
+    esp_timer_handle_t timer;       // free-running periodic sampling
+    QueueHandle_t queue;
+    StaticQueue_t queue_buf;        // the queues are held here, not on the heap
+    uint8_t queue_store[SAMPLE_QUEUE_LEN*sizeof(timer_event_t)];
+    char active;
+    int8_t* sample_method;          // bitmask of channels to sample, owned by the link
+    acq_reader_t reader;            // the link's filters and statistics, run at the sampling rate
+    esp_timer_handle_t pll_timer;   // one-shot phase-locked sampling
+    QueueHandle_t pll_mailbox;
+    StaticQueue_t pll_mailbox_buf;
+    uint8_t pll_mailbox_store[sizeof(timer_event_t)];
+    char pll_active;
+    char pll_locked;
+    uint32_t pll_nominal_usec;
+    int64_t pll_period_usec;        // estimated poll period, in 1/256 usec units
+    int64_t pll_next_poll;          // predicted time of the next poll
+    sample_pll_stats_t pll_stats;
+    // multi-rate sampling
+    uint32_t chan_period_usec[3];   // 0 follows the common period
+    char multirate;                 // the timer is running the wheel
+    uint32_t tick_usec;
+    uint32_t chan_ticks[3];         // wheel ticks between samples of each channel
+    uint16_t chan_rounds[3];        // turns of the wheel left before the channel is due
+    uint8_t wheel[SAMPLE_WHEEL_SLOTS]; // channels due at each slot
+    uint8_t wheel_pos;
+    uint32_t row_ticks;             // wheel ticks between rows for the calculator
+    uint32_t row_count;
+    double latest[3];
+    sample_ring_t ring[3];
+} sample_timer_t;
+
+void sample_timer_init(sample_timer_t* st, int8_t* sample_method);
+void sample_timer_start(sample_timer_t* st, uint64_t usec);
+void sample_timer_stop(sample_timer_t* st);
+void sample_timer_get(sample_timer_t* st, timer_event_t* evt, uint32_t wait_ms); // evt->event is nonzero if nothing arrived
+void sample_timer_set_period(sample_timer_t* st, int chan, uint32_t usec); // chan 0..2, usec 0 follows the common period
+uint32_t sample_timer_chan_period(sample_timer_t* st, int chan, uint32_t common_usec); // the period the channel is sampled at
+char sample_timer_multirate(sample_timer_t* st); // 1 if any channel has its own period
+int sample_ring_read(sample_timer_t* st, int chan, uint64_t* t, double* v); // oldest first, returns the number of samples
+void sample_fill_event(sample_timer_t* st, timer_event_t* evt); // samples the enabled channels now, as the timer does
+
+extern char sample_pll_enabled;
 
-void sample_timer_init(void);
-void sample_timer_start(uint64_t usec);
-void sample_timer_stop(void);
+void sample_pll_start(sample_timer_t* st, uint32_t period_usec);
+void sample_pll_stop(sample_timer_t* st);
+char sample_pll_active(sample_timer_t* st);
+void sample_pll_poll(sample_timer_t* st, timer_event_t* evt);
+void sample_pll_get_stats(sample_timer_t* st, sample_pll_stats_t* stats);
 
 // general time functions
 uint16_t get_year(void); // useful for seeing if NTP has worked.
@@ -0,0 +1,326 @@
+// virtual channels
+// rev 1 - expressions compiled to Q16.16 stack operations
+// rev 2 - constants and channel readings are clamped before they're converted, and inf or nan are refused
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "miniexp.h"
+#include "vchan.h"
+#include "memstat.h"
+
+#define VCHAN_ONE 65536
+
+typedef struct vchan_parse_s {
+    const char* p;
+    vchan_t* vc;
+    int depth;                      // stack depth when the operations so far are run
+    int err;
+} vchan_parse_t;
+
+static SemaphoreHandle_t vchan_lock;
+static StaticSemaphore_t vchan_lock_buf;
+static vchan_t vchans[VCHAN_MAX];
+static uint32_t vchan_gen;          // last definition number handed out
+
+
+static int32_t vchan_sat(int64_t v)
+{
+    if (v>INT32_MAX) return(INT32_MAX);
+    if (v<INT32_MIN) return(INT32_MIN);
+    return((int32_t)v);
+}
+
+// volts to Q16.16, saturating. The double is clamped first, as casting one out of range is undefined
+static int32_t vchan_fixed(double d)
+{
+    if (isnan(d)) return(0);
+    d=d*VCHAN_ONE;
+    if (d>=(double)INT32_MAX) return(INT32_MAX);
+    if (d<=(double)INT32_MIN) return(INT32_MIN);
+    return((int32_t)d);
+}
+
+static void vchan_skip(vchan_parse_t* ps)
+{
+    while (isspace((unsigned char)*ps->p)) ps->p++;
+}
+
+static void vchan_emit(vchan_parse_t* ps, uint8_t code, uint8_t chan, int32_t k)
+{
+    vchan_op_t* op;
+    if (ps->err) return;
+    if (ps->vc->nops>=VCHAN_OPS_MAX) {
+        printf("vchan: expression is too long\r\n");
+        ps->err=1;
+        return;
+    }
+    op=&ps->vc->op[ps->vc->nops];
+    memset(op, 0, sizeof(vchan_op_t));
+    op->code=code;
+    op->chan=chan;
+    op->k=k;
+    ps->vc->nops++;
+    switch(code) {
+        case VCHAN_OP_CHAN:
+        case VCHAN_OP_CONST:
+            ps->depth++;
+            break;
+        case VCHAN_OP_ADD:
+        case VCHAN_OP_SUB:
+        case VCHAN_OP_MUL:
+        case VCHAN_OP_DIV:
+            ps->depth--;
+            break;
+        default:
+            break;
+    }
+    if (ps->depth>VCHAN_STACK_MAX) {
+        printf("vchan: expression is too deeply nested\r\n");
+        ps->err=1;
+    }
+}
+
+static void vchan_expr_sum(vchan_parse_t* ps);
+
+// number, chN, d(...), i(...) or (...)
+static void vchan_primary(vchan_parse_t* ps)
+{
+    char* end;
+    double d;
+    uint8_t code;
+    vchan_skip(ps);
+    if (ps->err) return;
+    if ((ps->p[0]=='c') && (ps->p[1]=='h') && (ps->p[2]>='1') && (ps->p[2]<'1'+CHAN_MAX)) {
+        vchan_emit(ps, VCHAN_OP_CHAN, ps->p[2]-'1', 0);
+        ps->vc->chanmask|=0x01<<(ps->p[2]-'1');
+        ps->p+=3;
+    } else if (((ps->p[0]=='d') || (ps->p[0]=='i')) && (ps->p[1]=='(')) {
+        code=(ps->p[0]=='d') ? VCHAN_OP_DERIV : VCHAN_OP_INTEG;
+        ps->p+=2;
+        vchan_expr_sum(ps);
+        vchan_skip(ps);
+        if (*ps->p!=')') {
+            ps->err=1;
+            return;
+        }
+        ps->p++;
+        vchan_emit(ps, code, 0, 0);
+    } else if (*ps->p=='(') {
+        ps->p++;
+        vchan_expr_sum(ps);
+        vchan_skip(ps);
+        if (*ps->p!=')') {
+            ps->err=1;
+            return;
+        }
+        ps->p++;
+    } else {
+        d=strtod(ps->p, &end);
+        if ((end==ps->p) || (!isfinite(d))) {
+            ps->err=1;
+            return;
+        }
+        ps->p=end;
+        vchan_emit(ps, VCHAN_OP_CONST, 0, vchan_fixed(d));
+    }
+}
+
+static void vchan_unary(vchan_parse_t* ps)
+{
+    vchan_skip(ps);
+    if (*ps->p=='-') {
+        ps->p++;
+        vchan_unary(ps);
+        vchan_emit(ps, VCHAN_OP_NEG, 0, 0);
+        return;
+    }
+    vchan_primary(ps);
+}
+
+static void vchan_term(vchan_parse_t* ps)
+{
+    char c;
+    vchan_unary(ps);
+    for (;;) {
+        vchan_skip(ps);
+        c=*ps->p;
+        if (ps->err || ((c!='*') && (c!='/'))) return;
+        ps->p++;
+        vchan_unary(ps);
+        vchan_emit(ps, (c=='*') ? VCHAN_OP_MUL : VCHAN_OP_DIV, 0, 0);
+    }
+}
+
+static void vchan_expr_sum(vchan_parse_t* ps)
+{
+    char c;
+    vchan_term(ps);
+    for (;;) {
+        vchan_skip(ps);
+        c=*ps->p;
+        if (ps->err || ((c!='+') && (c!='-'))) return;
+        ps->p++;
+        vchan_term(ps);
+        vchan_emit(ps, (c=='+') ? VCHAN_OP_ADD : VCHAN_OP_SUB, 0, 0);
+    }
+}
+
+void vchan_init(void)
+{
+    vchan_lock=xSemaphoreCreateMutexStatic(&vchan_lock_buf);
+    memset(vchans, 0, sizeof(vchans));
+    mem_static_add("acquisition", sizeof(vchan_lock_buf) + sizeof(vchans));
+}
+
+int vchan_define(int v, const char* expr)
+{
+    vchan_t vc;
+    vchan_parse_t ps;
+    if ((v<0) || (v>=VCHAN_MAX) || (strlen(expr)>=VCHAN_EXPR_LEN))
+        return(-1);
+    memset(&vc, 0, sizeof(vchan_t));
+    strcpy(vc.expr, expr);
+    ps.p=vc.expr;
+    ps.vc=&vc;
+    ps.depth=0;
+    ps.err=0;
+    vchan_expr_sum(&ps);
+    vchan_skip(&ps);
+    if (ps.err || (*ps.p!='\0') || (ps.depth!=1)) {
+        printf("vchan: can't use '%s' at '%s'\r\n", expr, ps.p);
+        return(-1);
+    }
+    xSemaphoreTake(vchan_lock, portMAX_DELAY);
+    vc.gen=++vchan_gen;
+    memcpy(&vchans[v], &vc, sizeof(vchan_t));
+    xSemaphoreGive(vchan_lock);
+    return(0);
+}
+
+void vchan_clear(int v)
+{
+    int i;
+    xSemaphoreTake(vchan_lock, portMAX_DELAY);
+    for (i=0; i<VCHAN_MAX; i++) {
+        if ((v<0) || (v==i))
+            memset(&vchans[i], 0, sizeof(vchan_t));
+    }
+    xSemaphoreGive(vchan_lock);
+}
+
+char vchan_defined(int v)
+{
+    if ((v<0) || (v>=VCHAN_MAX))
+        return(0);
+    return(vchans[v].nops>0);
+}
+
+const char* vchan_expr(int v)
+{
+    if (!vchan_defined(v))
+        return("");
+    return(vchans[v].expr);
+}
+
+uint8_t vchan_chanmask(int v)
+{
+    if (!vchan_defined(v))
+        return(0);
+    return(vchans[v].chanmask);
+}
+
+void vchan_restart(int v, vchan_state_t* st)
+{
+    if (!vchan_defined(v))
+        return;
+    xSemaphoreTake(vchan_lock, portMAX_DELAY);
+    memset(st->op, 0, sizeof(st->op));
+    st->gen=vchans[v].gen;
+    xSemaphoreGive(vchan_lock);
+}
+
+double vchan_eval(int v, const double* phys, int64_t t_usec, vchan_state_t* vst)
+{
+    int i;
+    int sp=0;
+    int32_t st[VCHAN_STACK_MAX];
+    int32_t x;
+    int64_t dt;
+    vchan_op_t* op;
+    vchan_opstate_t* os;
+    if (!vchan_defined(v))
+        return(0.0);
+    xSemaphoreTake(vchan_lock, portMAX_DELAY);
+    if (vst->gen!=vchans[v].gen) {
+        // the expression has changed since this link last ran it
+        memset(vst->op, 0, sizeof(vst->op));
+        vst->gen=vchans[v].gen;
+    }
+    for (i=0; i<vchans[v].nops; i++) {
+        op=&vchans[v].op[i];
+        os=&vst->op[i];
+        switch(op->code) {
+            case VCHAN_OP_CHAN:
+                st[sp++]=vchan_fixed(phys[op->chan]);
+                break;
+            case VCHAN_OP_CONST:
+                st[sp++]=op->k;
+                break;
+            case VCHAN_OP_ADD:
+                sp--;
+                st[sp-1]=vchan_sat((int64_t)st[sp-1] + st[sp]);
+                break;
+            case VCHAN_OP_SUB:
+                sp--;
+                st[sp-1]=vchan_sat((int64_t)st[sp-1] - st[sp]);
+                break;
+            case VCHAN_OP_MUL:
+                sp--;
+                st[sp-1]=vchan_sat(((int64_t)st[sp-1] * st[sp]) >> 16);
+                break;
+            case VCHAN_OP_DIV:
+                sp--;
+                if (st[sp]==0)
+                    st[sp-1]=(st[sp-1]<0) ? INT32_MIN : INT32_MAX;
+                else
+                    st[sp-1]=vchan_sat(((int64_t)st[sp-1] * VCHAN_ONE) / st[sp]);
+                break;
+            case VCHAN_OP_NEG:
+                st[sp-1]=vchan_sat(-(int64_t)st[sp-1]);
+                break;
+            case VCHAN_OP_DERIV:
+                x=st[sp-1];
+                dt=t_usec - os->t_prev;
+                if (os->primed && (dt>0))
+                    os->last=vchan_sat(((int64_t)x - os->prev) * 1000000 / dt);
+                os->prev=x;
+                os->t_prev=t_usec;
+                os->primed=1;
+                st[sp-1]=os->last;
+                break;
+            case VCHAN_OP_INTEG:
+                // trapezoids
+                x=st[sp-1];
+                dt=t_usec - os->t_prev;
+                if (os->primed && (dt>0))
+                    os->acc+=(((int64_t)x + os->prev) * dt) / 2;
+                os->prev=x;
+                os->t_prev=t_usec;
+                os->primed=1;
+                st[sp-1]=vchan_sat(os->acc / 1000000);
+                break;
+            default:
+                break;
+        }
+    }
+    xSemaphoreGive(vchan_lock);
+    return(((double)st[0])/VCHAN_ONE);
+}
@@ -0,0 +1,82 @@
+
+#ifndef _VCHAN_HEADER_FILE_H
+#define _VCHAN_HEADER_FILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// virtual channels
+// Channels 4 to 7 can be defined as expressions over the physical channels
+// ch1 to ch3, for example "ch1-ch2", "ch2/ch1", "(ch1+ch2)*0.5", "d(ch1)"
+// (derivative, volts per second) or "i(ch2)" (running integral, volt seconds).
+// Numbers and the operators + - * / and brackets can be used too.
+// Each expression is compiled once into a list of stack operations on Q16.16
+// fixed-point values, which is run on every sample row. The derivative and the
+// integral use the time of each row, so they are correct for any sample rate.
+// Their running state is kept apart from the expression, one set per calculator
+// link, so two calculators reading the same channel don't disturb each other.
+
+#define VCHAN_MAX 4
+#define VCHAN_FIRST 4               // calculator channel number of the first virtual channel
+#define VCHAN_OPS_MAX 16
+#define VCHAN_STACK_MAX 8
+#define VCHAN_EXPR_LEN 48
+
+#define VCHAN_OP_CHAN 1
+#define VCHAN_OP_CONST 2
+#define VCHAN_OP_ADD 3
+#define VCHAN_OP_SUB 4
+#define VCHAN_OP_MUL 5
+#define VCHAN_OP_DIV 6
+#define VCHAN_OP_NEG 7
+#define VCHAN_OP_DERIV 8
+#define VCHAN_OP_INTEG 9
+
+typedef struct vchan_op_s {
+    uint8_t code;
+    uint8_t chan;                   // VCHAN_OP_CHAN
+    int32_t k;                      // VCHAN_OP_CONST
+} vchan_op_t;
+
+typedef struct vchan_s {
+    char expr[VCHAN_EXPR_LEN];
+    int nops;                       // 0 if the channel isn't defined
+    uint8_t chanmask;               // physical channels read by the expression
+    uint32_t gen;                   // changes each time the channel is defined
+    vchan_op_t op[VCHAN_OPS_MAX];
+} vchan_t;
+
+// running state of VCHAN_OP_DERIV and VCHAN_OP_INTEG, at the same index as the op
+typedef struct vchan_opstate_s {
+    uint8_t primed;                 // the op has seen a row
+    int32_t prev;                   // value and time of the previous row
+    int64_t t_prev;
+    int32_t last;                   // last derivative, kept if two rows have the same time
+    int64_t acc;                    // integral, in Q16.16 volt microseconds
+} vchan_opstate_t;
+
+// one per virtual channel and link, all zero to start
+typedef struct vchan_state_s {
+    uint32_t gen;                   // definition the state belongs to, it's reset when they differ
+    vchan_opstate_t op[VCHAN_OPS_MAX];
+} vchan_state_t;
+
+void vchan_init(void);
+int vchan_define(int v, const char* expr); // v is 0..VCHAN_MAX-1, returns 0 on success
+void vchan_clear(int v);                   // -1 clears them all
+char vchan_defined(int v);
+const char* vchan_expr(int v);
+uint8_t vchan_chanmask(int v);
+void vchan_restart(int v, vchan_state_t* st); // starts derivatives and integrals again
+double vchan_eval(int v, const double* phys, int64_t t_usec, vchan_state_t* st); // phys holds volts for ch1 to ch3
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _VCHAN_HEADER_FILE_H */
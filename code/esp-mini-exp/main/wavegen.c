@@ -0,0 +1,212 @@
+// waveform generator
+// rev 1 - I2S built-in DAC mode, fed from a phase accumulator
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "driver/i2s.h"
+#include "wavegen.h"
+#include "memstat.h"
+
+#define WAVE_TASK_PRIORITY 6
+#define WAVE_TASK_STACK (1024*3)
+#define WAVE_PI 3.14159265358979323846
+
+static uint8_t wave_lut[WAVE_LUT_LEN];      // one cycle of a sine, 0 to 255
+static uint8_t wave_tbl[WAVE_LEN_MAX];
+static volatile int wave_len=0;
+static volatile uint32_t wave_step=0;       // phase added per DAC update, a whole cycle is 2^32
+static volatile uint32_t wave_count=0;
+static volatile uint32_t wave_cycles=0;
+static volatile char wave_playing=0;
+static double wave_freq=0.0;
+static uint16_t wave_buf[WAVE_CHUNK*2];     // both DACs, the value is in the top 8 bits
+static StackType_t wave_stack[WAVE_TASK_STACK];
+static StaticTask_t wave_tcb;
+
+
+static uint8_t wave_volts_to_dac(double v)
+{
+    double d=v*WAVE_COUNTS_PER_VOLT + 0.5;
+    if (d<=0.0) return(0);
+    if (d>=255.0) return(255);
+    return((uint8_t)d);
+}
+
+static void wave_task(void* arg)
+{
+    int i;
+    uint32_t phase=0;
+    uint32_t prev;
+    size_t written;
+    char running=0;
+    char finished=0;    // the last cycle of a counted play has been written
+    uint16_t v=0;
+    for (;;) {
+        if (!wave_playing) {
+            if (running) {
+                if (finished) {
+                    // the DMA buffers still hold the end of the waveform. Writing a chunk of silence
+                    // for each buffer waits until it has all been played out
+                    memset(wave_buf, 0, sizeof(wave_buf));
+                    for (i=0; i<WAVE_DMA_BUFS; i++) {
+                        i2s_write(I2S_NUM_0, wave_buf, sizeof(wave_buf), &written, portMAX_DELAY);
+                    }
+                    finished=0;
+                }
+                i2s_zero_dma_buffer(I2S_NUM_0);
+                i2s_stop(I2S_NUM_0);
+                running=0;
+            }
+            vTaskDelay(pdMS_TO_TICKS(20));
+            continue;
+        }
+        if (!running) {
+            phase=0;
+            i2s_start(I2S_NUM_0);
+            running=1;
+        }
+        for (i=0; i<WAVE_CHUNK; i++) {
+            v=((uint16_t)wave_tbl[((uint64_t)phase * wave_len) >> 32]) << 8;
+            wave_buf[i*2]=v;
+            wave_buf[i*2+1]=v;
+            prev=phase;
+            phase+=wave_step;
+            if (phase<prev) {
+                wave_cycles++;
+                if ((wave_count>0) && (wave_cycles>=wave_count)) {
+                    wave_playing=0;
+                    finished=1;
+                    i++;
+                    break;
+                }
+            }
+        }
+        i2s_write(I2S_NUM_0, wave_buf, i*2*sizeof(uint16_t), &written, portMAX_DELAY);
+    }
+}
+
+void wavegen_init(void)
+{
+    int i;
+    i2s_config_t cfg;
+    for (i=0; i<WAVE_LUT_LEN; i++) {
+        wave_lut[i]=(uint8_t)lround(127.5 + 127.5*sin(2.0*WAVE_PI*i/WAVE_LUT_LEN));
+    }
+    memset(&cfg, 0, sizeof(i2s_config_t));
+    cfg.mode=(i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_TX | I2S_MODE_DAC_BUILT_IN);
+    cfg.sample_rate=WAVE_FS_HZ;
+    cfg.bits_per_sample=I2S_BITS_PER_SAMPLE_16BIT;
+    cfg.channel_format=I2S_CHANNEL_FMT_RIGHT_LEFT;
+    cfg.communication_format=I2S_COMM_FORMAT_STAND_MSB;
+    cfg.dma_buf_count=WAVE_DMA_BUFS;
+    cfg.dma_buf_len=WAVE_CHUNK;
+    cfg.use_apll=false;
+    if (i2s_driver_install(I2S_NUM_0, &cfg, 0, NULL)!=ESP_OK) {
+        printf("wavegen: can't set up I2S\r\n");
+        return;
+    }
+    i2s_set_pin(I2S_NUM_0, NULL); // built-in DAC
+    i2s_set_dac_mode(I2S_DAC_CHANNEL_BOTH_EN);
+    i2s_stop(I2S_NUM_0);
+    mem_task_create(wave_task, "wavegen", WAVE_TASK_STACK, NULL, WAVE_TASK_PRIORITY, wave_stack, &wave_tcb);
+    mem_static_add("wavegen", sizeof(wave_lut) + sizeof(wave_tbl) + sizeof(wave_buf) + sizeof(wave_stack) + sizeof(wave_tcb));
+}
+
+int wavegen_load(int first, const double* volts, int n)
+{
+    int i;
+    if ((first<0) || (first>wave_len) || (first+n>WAVE_LEN_MAX))
+        return(-1);
+    for (i=0; i<n; i++) {
+        wave_tbl[first+i]=wave_volts_to_dac(volts[i]);
+    }
+    if (first==0) {
+        wave_len=n; // a new table
+    } else if (first+n>wave_len) {
+        wave_len=first+n;
+    }
+    return(wave_len);
+}
+
+static int wave_start(double freq, uint32_t count)
+{
+    if ((wave_len==0) || (freq<=0.0) || (freq>=WAVE_FS_HZ/2))
+        return(-1);
+    wave_freq=freq;
+    wave_step=(uint32_t)((freq/WAVE_FS_HZ)*4294967296.0);
+    if (wave_step==0) wave_step=1;
+    wave_count=count;
+    wave_cycles=0;
+    wave_playing=1;
+    return(0);
+}
+
+int wavegen_play(double rate, uint32_t count)
+{
+    if (wave_len==0)
+        return(-1);
+    return(wave_start(rate/wave_len, count));
+}
+
+int wavegen_shape(int shape, double freq, double amp, double offset)
+{
+    int i;
+    double v;
+    if ((shape<WAVE_SINE) || (shape>WAVE_SAW))
+        return(-1);
+    wave_playing=0;
+    for (i=0; i<WAVE_LUT_LEN; i++) {
+        switch(shape) {
+            case WAVE_SINE:
+                v=(wave_lut[i]-127.5)/127.5;
+                break;
+            case WAVE_SQUARE:
+                v=(i<WAVE_LUT_LEN/2) ? 1.0 : -1.0;
+                break;
+            case WAVE_TRIANGLE:
+                v=(i<WAVE_LUT_LEN/2) ? -1.0 + 4.0*i/WAVE_LUT_LEN : 3.0 - 4.0*i/WAVE_LUT_LEN;
+                break;
+            default:
+                v=-1.0 + 2.0*i/WAVE_LUT_LEN;
+                break;
+        }
+        wave_tbl[i]=wave_volts_to_dac(offset + amp*v);
+    }
+    wave_len=WAVE_LUT_LEN;
+    return(wave_start(freq, 0));
+}
+
+void wavegen_stop(void)
+{
+    wave_playing=0;
+}
+
+void wavegen_get_status(wave_status_t* st)
+{
+    st->playing=wave_playing;
+    st->len=wave_len;
+    st->freq=wave_freq;
+    st->count=wave_count;
+    st->cycles=wave_cycles;
+}
+
+const char* wavegen_shape_name(int shape)
+{
+    switch(shape) {
+        case WAVE_SINE:
+            return("sine");
+        case WAVE_SQUARE:
+            return("square");
+        case WAVE_TRIANGLE:
+            return("triangle");
+        case WAVE_SAW:
+            return("saw");
+        default:
+            return("none");
+    }
+}
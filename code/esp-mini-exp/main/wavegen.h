@@ -0,0 +1,57 @@
+
+#ifndef _WAVEGEN_HEADER_FILE_H
+#define _WAVEGEN_HEADER_FILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// waveform generator
+// Plays a waveform on the ESP32 DAC outputs, GPIO25 and GPIO26 (both carry the
+// same signal, 0 to about 3.3V, with 8-bit resolution). I2S0 runs in built-in
+// DAC mode at WAVE_FS_HZ, and its DMA clocks the samples out. A task keeps the
+// DMA buffers filled from a phase accumulator stepping through the waveform
+// table, so any rate or frequency can be played without changing the I2S clock.
+// The table either holds values uploaded from the calculator, played at a
+// given number of points per second, or one cycle of a built-in shape made
+// from a sine lookup table, played at a given frequency. A play of a given
+// number of cycles ends once the DMA has clocked out the last of them, while
+// stopping it cuts the output straight away.
+
+#define WAVE_FS_HZ 40000                // DAC update rate
+#define WAVE_LEN_MAX 999                // the longest calculator list
+#define WAVE_LUT_LEN 256                // points in one cycle of a built-in shape
+#define WAVE_CHUNK 256                  // samples written to the DMA buffers at a time
+#define WAVE_DMA_BUFS 4
+#define WAVE_COUNTS_PER_VOLT (255.0/3.3)
+
+#define WAVE_SINE 1
+#define WAVE_SQUARE 2
+#define WAVE_TRIANGLE 3
+#define WAVE_SAW 4
+
+typedef struct wave_status_s {
+    char playing;
+    int len;                            // points in the table
+    double freq;                        // cycles per second
+    uint32_t count;                     // cycles to play, 0 for continuously
+    uint32_t cycles;                    // cycles played so far
+} wave_status_t;
+
+void wavegen_init(void);
+int wavegen_load(int first, const double* volts, int n); // first is 0-based, 0 starts a new table. Returns the table length, or -1
+int wavegen_play(double rate, uint32_t count);       // rate is table points per second. Returns 0 on success
+int wavegen_shape(int shape, double freq, double amp, double offset); // amp is the peak, in volts. Returns 0 on success
+void wavegen_stop(void);
+void wavegen_get_status(wave_status_t* st);
+const char* wavegen_shape_name(int shape);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _WAVEGEN_HEADER_FILE_H */
@@ -8,6 +8,7 @@
  
 #include "mbed.h"
 #include "Si1133.h"
+#include "../common/casio_core.h"
 
 // defines
 //#define TX_PIN          USBTX
@@ -15,38 +16,30 @@
 #define LED_PIN         LED0
 #define TOGGLE_RATE     (0.5f)
 #define BUFF_LENGTH     5
-#define COMM_BUFF_LENGTH 30
-#define CASIO_START_INDICATOR 0x15
-#define CODEA_OK 0x13
-#define CODEB_OK 0x06
-#define CODEA_RETRY 0x05
-#define CODEB_RETRY 0x05
-#define CODEA_ERROR 0x22
-#define CODEB_ERROR 0x22
-#define DIR_CASIO_SEND 'N'
-#define DIR_CASIO_RECV 'R'
-#define TYPE_ASCII 'A'
-#define TYPE_HEX 'H'
-#define START_HEADER_ERROR -10
-#define COMM_IDLE 0
-#define COMM_WAITING_INSTRUCTION 1
-#define COMM_WAITING_DATA 2
-#define COMM_WAITING_RX_HEADER_ACK 3
-#define COMM_WAITING_RX_PACKET_ACK 4
-#define COMM_WAITING_PERFORM_ROLESWAP 5
-#define PROC_NULL 0
-#define PROC_SEND38K 1
-#define PROC_RECV38K 2
-#define BRIEF 1
-#define HL_IDLE 0
-#define HL_SENDING 1
-#define TOK_MAX 6
+#define COMM_BUFF_LENGTH 256        // room for a 2001 batch of TOK_MAX tokens
 #define CHAN_MAX 3
-#define TRIG_MODE_NRT 0
-#define TRIG_MODE_RT 1
-#define TOK_TYPE_INT 0
-#define TOK_TYPE_FLOAT 1
 #define ENV_ENA_PIN PF9
+#define SENSOR_TICK_RATE (0.05f)    // sensor scheduler tick, in seconds
+#define LIGHT_PERIOD_TICKS 2        // Si1133 conversion every 0.1 sec, ahead of the fastest calculator sample rate
+#define SI7021_PERIOD_TICKS 4       // humidity and temperature take 23 msec to convert, and change slowly
+#define BMP280_PERIOD_TICKS 2       // pressure takes under 7 msec to convert at 1x oversampling
+#define SI7021_ADDR 0x80            // 8-bit I2C addresses
+#define BMP280_ADDR 0xEE
+#define BMP280_CTRL_FORCED 0x25     // one temperature and one pressure conversion, 1x oversampling
+// the sensor devices, read in turn by the sensor scheduler
+#define SENS_SI1133 0
+#define SENS_SI7021 1
+#define SENS_BMP280 2
+#define SENS_MAX 3
+// the quantities a channel can report, scaled to suit the calculator's -10 to +10 range
+#define SENSOR_LIGHT 0              // klux
+#define SENSOR_UV 1                 // UV index
+#define SENSOR_HUMIDITY 2           // tens of %RH
+#define SENSOR_TEMPERATURE 3        // tens of degrees C
+#define SENSOR_PRESSURE 4           // bar
+#define CH1_SENSOR SENSOR_LIGHT
+#define CH2_SENSOR SENSOR_TEMPERATURE
+#define CH3_SENSOR SENSOR_PRESSURE
 
 
 // debug settings, set these to 0 or 1
@@ -55,55 +48,80 @@
 #define DEVELOPER 1
 #define HLPP 1
 
-#define SYS_IDLE 0
-#define SYS_INIT 1
-
 
 // typedef
-typedef struct casio_cmd_s {
-    char direction;
-    char type;
-    char form;
-    uint16_t line;
-    uint32_t offset;
-    uint16_t psize;
-    char area;
-    char csum;
-    uint16_t datapacksize; // packet size including start and checksum
-    char direction2;
-    char type2;
-    char form2;
-    char csum2;
-    char command;
-} casio_cmd_t;
-
-typedef struct cmd_tok_s {
-    int tokint;
-    double tokfloat;
-    char toktype;
-} cmd_tok_t;
-
 typedef struct chan_setup_s {
     char operation;
+    char sensor;        // quantity reported on the channel
 } chan_setup_t;
 
+// latest results of a sensor, filled in by the sensor scheduler
+typedef struct sensor_cache_s {
+    float value[2];
+    bool valid;
+    uint32_t reads;
+    uint32_t errors;
+    uint8_t period;     // ticks between conversions
+    uint8_t countdown;  // ticks until the next conversion
+    uint8_t step;       // next transfer of a conversion in progress, 0 when idle
+    uint8_t wait;       // ticks to wait before the next transfer
+} sensor_cache_t;
+
+// BMP280 calibration, read from the device once
+typedef struct bmp280_cal_s {
+    uint16_t t1;
+    int16_t t2, t3;
+    uint16_t p1;
+    int16_t p2, p3, p4, p5, p6, p7, p8, p9;
+    bool loaded;
+} bmp280_cal_t;
+
 typedef struct samp_trig_setup_s {
     uint32_t period_usec;
     unsigned int numsamp;
     char mode;
 } samp_trig_setup_t;
 
+// the protocol state of the Casio link, a casio_core link
+typedef struct tb_link_s {
+    casio_cmd_t casio_cmd;
+    char procedure;
+    char comm_state;
+    char sys_state;
+    char hl_state;
+    chan_setup_t chan_setup[CHAN_MAX];
+    samp_trig_setup_t samp_trig_setup;
+    uint8_t casio_rx_buf[COMM_BUFF_LENGTH + 1];
+    uint8_t casio_tx_buf[1024];
+    uint16_t sampnum;
+    int8_t stream_chan;     // when 0..2, every Receive38K of a variable gets a new sample from this channel
+    double batch_res[BATCH_MAX]; // results of a 2001 batch, sent as one list
+    int batch_len;
+    unsigned int list_len;  // values promised in the last list header
+} tb_link_t;
+
 
 
 // globals
 Serial usb_serial(USBTX, USBRX);
 Serial casio_serial(PC11, PC10, NULL, 38400);
-casio_cmd_t casio_cmd;
-char procedure=PROC_NULL;
-chan_setup_t chan_setup[CHAN_MAX];
-samp_trig_setup_t samp_trig_setup;
+tb_link_t casio_link;
 DigitalOut env_en(ENV_ENA_PIN, 1);
 Si1133* light_sensor;
+bool light_sensor_ok = false;
+I2C sensor_i2c(PC4, PC5);   // the environment sensor bus, shared with the Si1133 driver
+event_callback_t i2cEventCb;
+sensor_cache_t sensors[SENS_MAX];
+bmp280_cal_t bmp280_cal;
+LowPowerTicker sensor_ticker;
+volatile bool sensor_due = false;
+volatile bool i2c_busy = false;
+volatile bool i2c_done = false;
+volatile int i2c_events = 0;
+int i2c_owner = 0;          // device of the transfer in progress
+int sensor_next = 0;        // round-robin position
+char i2c_tx[2];
+char i2c_rx[24];
 
 LowPowerTicker      blinker;
 bool                blinking = false;
@@ -111,956 +129,385 @@ event_callback_t    serialEventCb;
 event_callback_t    casioEventCb;
 DigitalOut          LED(LED_PIN);
 uint8_t             rx_buf[BUFF_LENGTH + 1];
-uint8_t             casio_rx_buf[COMM_BUFF_LENGTH + 1];
-//uint8_t             casio_tx_buf[COMM_BUFF_LENGTH + 1];
-uint8_t             casio_tx_buf[1024];
-char comm_state = COMM_IDLE;
-char sys_state = SYS_IDLE;
-char hl_state = HL_IDLE;
-uint16_t sampnum = 0;
 
-double value=-10.0;
+void casio_callback(int events);
 
-// functions
-
-// com_seek_char searches the casio comms rx buffer for a particular
-// character v. Returns the position of v. Returns -1 if it was not found.
-int
-comm_seek_char(char v)
-{
-    int i;
-    char found=0;
-    for (i=0; i<COMM_BUFF_LENGTH; i++) {
-        if(casio_rx_buf[i] == v){
-            found=1;
-            break;
-        }
+// the board side of the protocol core. There is just the one Casio serial port
+struct tb_platform {
+    typedef tb_link_t link_t;
+    enum { chan_total=CHAN_MAX, rx_len=COMM_BUFF_LENGTH, verbose=VERBOSE, pingpong=PINGPONG, developer=DEVELOPER, hlpp=HLPP };
+    static void send(tb_link_t* lk, const uint8_t* buf, uint16_t len)
+    {
+        casio_serial.write(buf, len, NULL);
     }
-    if (found)
-        return (i);
-    else
-        return(-1);
-}
+    static void receive(tb_link_t* lk, int len, int match)
+    {
+        casio_serial.read(lk->casio_rx_buf, len, casio_callback, SERIAL_EVENT_RX_ALL, (match<0) ? SERIAL_RESERVED_CHAR_MATCH : match);
+    }
+    static void print(const char* fmt, ...)
+    {
+        va_list ap;
+        va_start(ap, fmt);
+        usb_serial.vprintf(fmt, ap);
+        va_end(ap);
+    }
+    static double read_sample(int chan);
+    static int64_t usec(void)
+    {
+        return((int64_t)us_ticker_read());
+    }
+    static char status(void)
+    {
+        return('1'); // running, there's no network on this board
+    }
+    static int active_chans(tb_link_t* lk);
+    static int read_row(tb_link_t* lk, double* vals, char type);
+    static void chan_setup(tb_link_t* lk, int chan, int type)
+    {
+        if ((type!=2) && DEVELOPER) usb_serial.printf("error, unsupported chan type\r\n");
+    }
+    // the sensors are always converting, there's nothing to start or stop
+    static void clear_channels(tb_link_t* lk) {}
+    static void trigger(tb_link_t* lk) {}
+    static void sampling_done(tb_link_t* lk) {}
+    // and there are no 2001 operations or lists beyond the ones in the core
+    static int op_nargs(int op)
+    {
+        return(1);
+    }
+    static double op_2001(tb_link_t* lk, cmd_tok_t* op, int nargs, char in_batch)
+    {
+        return(0.0);
+    }
+    static unsigned int list_begin(tb_link_t* lk)
+    {
+        return(0);
+    }
+    static double list_value(void* ctx, unsigned int idx)
+    {
+        return(-1.0);
+    }
+    static void list_end(tb_link_t* lk, int state) {}
+};
+typedef casio_core<tb_platform> tb_core;
 
-void
-casio_send_response(char r)
-{
-    casio_serial.write((const uint8_t *)&r, 1, NULL);
-}
+// functions
 
+// sensor scheduler
+// The sensors are slow I2C devices, and casio_callback runs in interrupt context,
+// so the protocol handler never talks to them. A ticker marks conversions due,
+// the main loop performs them ahead of time, and the protocol handler answers
+// straight away from the latest values in the cache.
+// The Si7021 and BMP280 are read with asynchronous I2C transfers, a step at a
+// time: the main loop starts one transfer, and its completion callback wakes the
+// main loop again. The devices take turns on the bus, round-robin, and a device
+// waiting for a conversion doesn't hold the bus. The Si1133 library only has
+// blocking transfers, so it is read in its turn while the bus is otherwise idle.
+
+// the BMP280 compensation from its datasheet. Returns the temperature in degrees C
+// and the pressure in hPa
 void
-casio_send_buf(uint8_t* buf, uint8_t len)
+bmp280_compensate(int32_t adc_t, int32_t adc_p, float* temp, float* pres)
 {
-    casio_serial.write(buf, len, NULL);
+    int32_t v1, v2, t_fine;
+    int64_t w1, w2, p;
+    bmp280_cal_t* c=&bmp280_cal;
+    v1=((((adc_t>>3) - ((int32_t)c->t1<<1))) * ((int32_t)c->t2)) >> 11;
+    v2=(((((adc_t>>4) - ((int32_t)c->t1)) * ((adc_t>>4) - ((int32_t)c->t1))) >> 12) * ((int32_t)c->t3)) >> 14;
+    t_fine=v1+v2;
+    *temp=(float)((t_fine*5+128)>>8)/100.0f;
+    w1=((int64_t)t_fine) - 128000;
+    w2=w1*w1*(int64_t)c->p6;
+    w2=w2 + ((w1*(int64_t)c->p5)<<17);
+    w2=w2 + (((int64_t)c->p4)<<35);
+    w1=((w1*w1*(int64_t)c->p3)>>8) + ((w1*(int64_t)c->p2)<<12);
+    w1=(((((int64_t)1)<<47)+w1))*((int64_t)c->p1)>>33;
+    if (w1==0) {
+        *pres=0.0f; // not calibrated
+        return;
+    }
+    p=1048576-adc_p;
+    p=(((p<<31)-w2)*3125)/w1;
+    w1=(((int64_t)c->p9) * (p>>13) * (p>>13)) >> 25;
+    w2=(((int64_t)c->p8) * p) >> 19;
+    p=((p + w1 + w2) >> 8) + (((int64_t)c->p7)<<4);
+    *pres=(float)p/25600.0f; // p is in Pa, with 8 fractional bits
 }
 
-// hex_print: used to print the entire passed buffer of length len
-// if brief is set to 1 then it will only print the hex values
-// otherwise it will also print the ascii text for the buffer too.
-// Output example: 3a,31,32,2c,31,40  text: ':12,1@'
-// where 0x3a is the start byte, and 0x40 is the checksum
-// 
 void
-hex_print(uint8_t* buf, char len, char brief=0)
+bmp280_load_cal(uint8_t* b)
 {
-    int i;
-    char printable=0;
-    if (len<1) return;
-    usb_serial.printf("%02x", buf[0]);
-    for (i=1; i<len; i++) {
-        usb_serial.printf(",%02x", buf[i]);
-    }
-    
-    if (brief) return;
-    
-    usb_serial.printf("  text: '");
-    for (i=0; i<len; i++) {
-        printable=1;
-        if ((buf[i]<32) || (buf[i]>126))
-            printable=0;
-        if (printable)
-            usb_serial.printf("%c", buf[i]);
-        else
-            usb_serial.printf(".");
-    }
-    //usb_serial.printf("'\r\n");
+    bmp280_cal_t* c=&bmp280_cal;
+    c->t1=(uint16_t)(b[0] | (b[1]<<8));
+    c->t2=(int16_t)(b[2] | (b[3]<<8));
+    c->t3=(int16_t)(b[4] | (b[5]<<8));
+    c->p1=(uint16_t)(b[6] | (b[7]<<8));
+    c->p2=(int16_t)(b[8] | (b[9]<<8));
+    c->p3=(int16_t)(b[10] | (b[11]<<8));
+    c->p4=(int16_t)(b[12] | (b[13]<<8));
+    c->p5=(int16_t)(b[14] | (b[15]<<8));
+    c->p6=(int16_t)(b[16] | (b[17]<<8));
+    c->p7=(int16_t)(b[18] | (b[19]<<8));
+    c->p8=(int16_t)(b[20] | (b[21]<<8));
+    c->p9=(int16_t)(b[22] | (b[23]<<8));
+    c->loaded=true;
 }
 
-void
-asc_print(uint8_t* buf, char len)
+// starts an asynchronous transfer for device dev, using i2c_tx and i2c_rx
+bool
+sensor_i2c_start(int dev, int addr, int txlen, int rxlen)
 {
-    int i;
-    char printable=0;
-    if (len<1) return;
-
-    for (i=0; i<len; i++) {
-        printable=1;
-        if ((buf[i]<32) || (buf[i]>126))
-            printable=0;
-        if (printable)
-            usb_serial.printf("%c", buf[i]);
-        else
-            usb_serial.printf(".");
+    i2c_owner=dev;
+    i2c_done=false;
+    i2c_busy=true;
+    if (sensor_i2c.transfer(addr, i2c_tx, txlen, i2c_rx, rxlen, i2cEventCb, I2C_EVENT_ALL)!=0) {
+        i2c_busy=false;
+        return(false);
     }
+    return(true);
 }
 
-void get_tokens(uint8_t* buf, uint16_t len, cmd_tok_t* tok_arr, char* total)
+// performs the next step of a conversion. Returns false if the step failed to start
+bool
+sensor_step(int dev)
 {
-    char* token;
-    const char s[2]=",";
-    char tot=0;
-    buf[len]='\0'; // bit naughty, writing outside the length specified. We don't need the checksum so it will get overwritten
-    
-    token=strtok((char*)buf, s);
-    
-    while(token != NULL) {
-        sscanf(token, "%d", &(tok_arr[tot].tokint));
-        tok_arr[tot].toktype=TOK_TYPE_INT;
-        if (strstr(token, ".")!=NULL) {
-            sscanf(token, "%lf", &(tok_arr[tot].tokfloat));
-            tok_arr[tot].toktype=TOK_TYPE_FLOAT;
-        }
-        tot++;
-        if (tot>=TOK_MAX) {
-            if(DEVELOPER) usb_serial.printf("Reached TOK_MAX number of allowed tokens\r\n");
-            break;
-        }
-        token = strtok(NULL, s); // get next token
+    sensor_cache_t* s=&sensors[dev];
+    float light, uv;
+    switch(dev) {
+        case SENS_SI1133:
+            if (light_sensor->get_light_and_uv(&light, &uv)) {
+                s->value[0]=light;
+                s->value[1]=uv;
+                s->valid=true;
+                s->reads++;
+            } else {
+                s->errors++;
+            }
+            s->step=0;
+            return(true);
+        case SENS_SI7021:
+            switch(s->step) {
+                case 1: // measure humidity, no hold master
+                    i2c_tx[0]=0xf5;
+                    return(sensor_i2c_start(dev, SI7021_ADDR, 1, 0));
+                case 2: // humidity result
+                    return(sensor_i2c_start(dev, SI7021_ADDR, 0, 2));
+                default: // the temperature measured along with the humidity
+                    i2c_tx[0]=0xe0;
+                    return(sensor_i2c_start(dev, SI7021_ADDR, 1, 2));
+            }
+        default: // SENS_BMP280
+            switch(s->step) {
+                case 1: // calibration
+                    i2c_tx[0]=0x88;
+                    return(sensor_i2c_start(dev, BMP280_ADDR, 1, 24));
+                case 2: // start a conversion
+                    i2c_tx[0]=0xf4;
+                    i2c_tx[1]=BMP280_CTRL_FORCED;
+                    return(sensor_i2c_start(dev, BMP280_ADDR, 2, 0));
+                default: // pressure and temperature results
+                    i2c_tx[0]=0xf7;
+                    return(sensor_i2c_start(dev, BMP280_ADDR, 1, 6));
+            }
     }
-    if(DEVELOPER) usb_serial.printf("number of tokens found: %d\r\n", tot);
-    *total=tot;
 }
 
+// handles the end of a transfer, and moves the conversion on to its next step
 void
-instruction_print(char do_pingpong=0)
+sensor_finish(int dev, bool ok)
 {
-    char dirprint=0;
-    char typeprint=0;
-    char formprint=0;
-    if (casio_cmd.direction2!=0) {
-        dirprint = DIR_CASIO_RECV;
-    } else {
-        dirprint = DIR_CASIO_SEND;
+    sensor_cache_t* s=&sensors[dev];
+    uint8_t* b=(uint8_t*)i2c_rx;
+    float temp, pres;
+    if (!ok) {
+        s->errors++;
+        s->step=0; // try again next period
+        return;
     }
-    if(!do_pingpong)
-        usb_serial.printf("instruction: {\r\n");
-    switch(dirprint) {
-        case DIR_CASIO_SEND:
-            if (do_pingpong)
-                usb_serial.printf("  |---N");
-            else
-                usb_serial.printf("  direction : send,\r\n");
-            break;
-        case DIR_CASIO_RECV:
-            if (do_pingpong)
-                usb_serial.printf("  |---------------R");
-            else
-                usb_serial.printf("  direction : recv,\r\n");
-            break;
-        default:
-            if (do_pingpong)
-                usb_serial.printf("  |?---X");
-            else
-                usb_serial.printf("  direction : unknown '%c',\r\n", casio_cmd.direction);
-            break;
-    }
-    if (dirprint==DIR_CASIO_RECV)
-        typeprint=casio_cmd.type2;
-    else
-        typeprint=casio_cmd.type;
-    switch(typeprint) {
-        case 'A':
-            if (do_pingpong)
-                usb_serial.printf("A");
-            else
-                usb_serial.printf("  type : ascii,\r\n");
-            break;
-        case 'H':
-            if (do_pingpong)
-                usb_serial.printf("H");
-            else
-                usb_serial.printf("  type : hex,\r\n");
-            break;
-        default:
-            if (do_pingpong)
-                usb_serial.printf("X");
-            else
-                usb_serial.printf("  type : unknown '%c',\r\n", typeprint);
-            break;
-    }
-    if (dirprint==DIR_CASIO_RECV)
-        formprint=casio_cmd.form2;
-    else
-        formprint=casio_cmd.form;
-    switch(formprint) {
-        case 'V':
-            if (do_pingpong)
-                usb_serial.printf("V");
-            else
-                usb_serial.printf("  form : variable,\r\n");
-            break;
-        case 'L':
-            if (do_pingpong)
-                usb_serial.printf("L");
-            else
-                usb_serial.printf("  form : list,\r\n");
-            break;
-        default:
-            if (do_pingpong)
-                usb_serial.printf("X");
-            else
-                usb_serial.printf("  form : unknown '%c',\r\n", formprint);
-            break;
-    }
-    if (dirprint==DIR_CASIO_SEND) {
-        // these fields only make sense for send from casio
-        if (do_pingpong) {
-            usb_serial.printf(",L=%u,O=%lu,P=%u,", casio_cmd.line, casio_cmd.offset, casio_cmd.psize);
-        } else {
-            usb_serial.printf("  line : %u,\r\n", casio_cmd.line);
-            usb_serial.printf("  offset : %lu,\r\n", casio_cmd.offset);
-            usb_serial.printf("  packet_size : %u,\r\n", casio_cmd.psize);
-        }
-        if (do_pingpong) {
-            // tidy the length for pingpong properly later
-            if (casio_cmd.psize>9)
-                usb_serial.printf("%c---------->|\r\n", casio_cmd.area);
-            else
-                usb_serial.printf("%c----------->|\r\n", casio_cmd.area);
-        } else {
-            switch(casio_cmd.area) {
-                case 'A':
-                    usb_serial.printf("  area : all,\r\n");
+    switch(dev) {
+        case SENS_SI7021:
+            switch(s->step) {
+                case 1:
+                    s->step=2;
+                    s->wait=2; // at least one whole tick
                     break;
-                case 'S':
-                    usb_serial.printf("  area : start,\r\n");
+                case 2:
+                    s->value[0]=(125.0f*((b[0]<<8) | b[1]))/65536.0f - 6.0f;
+                    s->step=3;
                     break;
-                case 'M':
-                    usb_serial.printf("  area : middle,\r\n");
+                default:
+                    s->value[1]=(175.72f*((b[0]<<8) | b[1]))/65536.0f - 46.85f;
+                    s->valid=true;
+                    s->reads++;
+                    s->step=0;
+                    break;
+            }
+            break;
+        case SENS_BMP280:
+            switch(s->step) {
+                case 1:
+                    bmp280_load_cal(b);
+                    s->step=2;
                     break;
-                case 'E':
-                    usb_serial.printf("  area : end,\r\n");
+                case 2:
+                    s->step=3;
+                    s->wait=2;
                     break;
                 default:
-                    usb_serial.printf("  area : unknown '%c',\r\n", casio_cmd.form);
+                    bmp280_compensate((b[3]<<12) | (b[4]<<4) | (b[5]>>4), (b[0]<<12) | (b[1]<<4) | (b[2]>>4), &temp, &pres);
+                    s->value[0]=pres;
+                    s->value[1]=temp;
+                    s->valid=true;
+                    s->reads++;
+                    s->step=0;
                     break;
             }
-        }
-    } else {
-        // DIR_CASIO_RECV
-        if (do_pingpong) usb_serial.printf("------------->|\r\n");
-    }
-    if (!do_pingpong) {
-        usb_serial.printf("  checksum : 0x%02x\r\n", casio_cmd.csum);
-        usb_serial.printf("}\r\n");
+            break;
+        default:
+            break;
     }
 }
 
+// called on every tick, counts down to the next conversion of each device
 void
-print_hlpp_r38(uint8_t* buf, uint16_t len, char f)
+sensor_tick_all(void)
 {
-    int8_t plen;
     int i;
-    char padding[24];
-    
-    usb_serial.printf("  |<--R38K: ");
-    if (f=='A') { // ASCII
-        if (len<20) {
-            plen=(int8_t)len;
-            asc_print(buf, plen);
-        } else {
-            plen=20;
-            asc_print(buf, plen-3);
-            usb_serial.printf("etc");
-        }     
-        for (i=0; i<(20-plen); i++) {
-            padding[i]='-';
-        }
-        padding[20-plen]='\0';
-        usb_serial.printf(padding);
-        usb_serial.printf("---|\r\n");
-    } else if (f=='H') { // Hex
-        usb_serial.printf("0x");
-        if (len<6) {
-            plen=(int8_t)len;
-            hex_print(buf, plen, BRIEF);
-        } else {
-            plen=6;
-            hex_print(buf, plen-1, BRIEF);
-            usb_serial.printf("..");
-        }     
-        for (i=0; i<(17-plen); i++) {
-            padding[i]='-';
+    sensor_cache_t* s;
+    for (i=0; i<SENS_MAX; i++) {
+        s=&sensors[i];
+        if ((i==SENS_SI1133) && (!light_sensor_ok)) continue;
+        if (s->wait>0) s->wait--;
+        if (s->countdown>0) s->countdown--;
+        if ((s->countdown==0) && (s->step==0)) {
+            s->countdown=s->period;
+            s->step=1;
+            if ((i==SENS_BMP280) && bmp280_cal.loaded) s->step=2;
         }
-        padding[17-plen]='\0';
-        usb_serial.printf(padding);
-        usb_serial.printf("-|\r\n");    
-    } else {
-        // unknown format
-        usb_serial.printf("unknown format!--------|\r\n");
     }
 }
 
-// convert a floating point value into ascii text 
-// this function always returns 6 characters such as "1.2345" but no end of string!!
-void float2ascii(double v, uint8_t* buf)
+// called from the main loop, finishes the last transfer and starts the next one
+void
+sensor_service(void)
 {
-    int idx=0;
-    int i;
-    int l;
-    char found=0;
-    uint8_t x;
-    uint8_t tbuf[10];
-    snprintf((char*)tbuf, 9, "%lf", v);
-    tbuf[6]='\0';
-    //printf("input is  '%s'\n", tbuf);
-    for (i=0; i<10;i++) {
-        found=0;
-        x=tbuf[i];
-        if (x=='-') {
-            found=1;
-        } else if (x=='.') {
-            found=1;
-        } else if ((x>='0') && (x<='9')) {
-            found=1;
-        } else if (x=='\0') {
-            found=2;
-        }
-        switch(found) {
-            case 0:
-                // perhaps space?
-                break;
-            case 1: // found valid char
-                buf[idx]=x;
-                idx++;
-                if (idx>=6) {
-                    //buf[6]='\0';
-                    i=10;
-                }
-                break;
-            case 2: // found end of string
-                l=strlen((char*)buf);
-                if (l<6) {
-                    // zero pad from the beginning
-                    for (i=5; i>=0; i--) {
-                        l--;
-                        if (l>=0) {
-                            if(buf[i-(5-l)]=='-') {
-                                found=3;
-                                buf[i]='0';
-                            } else {
-                                buf[i]=buf[i-(5-l)];
-                            }
-                        } else {
-                            buf[i]='0';
-                        }
-                    }
-                } else {
-                    //buf[6]='\0';
-                }
-                if (found==3) {
-                    buf[0]='-';
-                }
-                //buf[6]='\0';
-                break;
-            default:
-                // should not occur
-                break;
+    int i, dev;
+    if (i2c_busy) return;
+    if (i2c_done) {
+        i2c_done=false;
+        sensor_finish(i2c_owner, (i2c_events & I2C_EVENT_ALL)==I2C_EVENT_TRANSFER_COMPLETE);
+    }
+    for (i=0; i<SENS_MAX; i++) {
+        dev=(sensor_next+i) % SENS_MAX;
+        if ((sensors[dev].step!=0) && (sensors[dev].wait==0)) {
+            sensor_next=(dev+1) % SENS_MAX;
+            if (!sensor_step(dev)) {
+                sensors[dev].errors++;
+                sensors[dev].step=0;
+            }
+            break;
         }
+    }
+}
 
+// latest value of a quantity, in calculator units
+double
+sensor_value(char quantity)
+{
+    switch(quantity) {
+        case SENSOR_LIGHT:
+            return((double)sensors[SENS_SI1133].value[0]/1000.0);
+        case SENSOR_UV:
+            return((double)sensors[SENS_SI1133].value[1]);
+        case SENSOR_HUMIDITY:
+            return((double)sensors[SENS_SI7021].value[0]/10.0);
+        case SENSOR_TEMPERATURE:
+            return((double)sensors[SENS_SI7021].value[1]/10.0);
+        case SENSOR_PRESSURE:
+            return((double)sensors[SENS_BMP280].value[0]/1000.0);
+        default:
+            return(0.0);
     }
-    //printf("output is '%s'\n", buf);
 }
 
-void clear_buf(uint8_t* buf, char len)
+double
+tb_platform::read_sample(int chan)
+{
+    return(sensor_value(casio_link.chan_setup[chan].sensor));
+}
+
+// a channel is reported if the calculator set it up. If none are set up, channel 1 is
+char
+chan_active(int chan)
 {
     int i;
-    for (i=0; i<len; i++) {
-        buf[i]=0;
+    char any=0;
+    for (i=0; i<CHAN_MAX; i++) {
+        if (casio_link.chan_setup[i].operation!=0) any=1;
     }
+    if (!any) return(chan==0);
+    return(casio_link.chan_setup[chan].operation!=0);
 }
 
-int8_t
-calc_checksum(uint8_t* buf, int len, char* calc_result)
+char
+count_active_chan(void)
 {
-    int i;
     char tot=0;
-    if(len<3) {
-        printf("error, buffer too small for calculating checksum!\r\n");
-        return(-1);
-    }
-    // loop through buffer except the start and end bytes
-    for (i=1; i<(len-1); i++) {
-        tot=tot+buf[i];
+    int i;
+    for (i=0; i<CHAN_MAX; i++) {
+        if (chan_active(i)) tot++;
     }
-    *calc_result = (0xff - tot)+1;
-    return(0);
+    return(tot);
 }
 
-
-int8_t
-decode_instruction(uint8_t* buf)
+// reads the active channels into vals, returns how many there are
+int
+get_active_row(double* vals)
 {
-    int8_t retval=0;
-    char csum;
-    // sanity check
-    if (buf[0]!=':') {
-        usb_serial.printf("error, start_header is not ':'!\r\n");
-        return(START_HEADER_ERROR);
-    }
-    if ((buf[1]!='N') && (buf[1]!='R')) {
-        usb_serial.printf("error, direction is not 'N' or 'R'!\r\n");
-        return(-1);
-    }
-    calc_checksum(buf, 15, &csum);
-    if (csum!=buf[14]) {
-        usb_serial.printf("error, I compute checksum should be %02x\r\n", csum);
-        return(-1);
+    int i;
+    int n=0;
+    uint32_t mask=0;
+    double row[CHAN_MAX];
+    for (i=0; i<CHAN_MAX; i++) {
+        if (chan_active(i)) mask|=(0x01<<i);
     }
-    
-    if (buf[1]==DIR_CASIO_SEND) {
-        casio_cmd.direction=buf[1];
-        casio_cmd.type=buf[2];
-        casio_cmd.form=buf[3];
-        casio_cmd.line=(uint16_t)buf[4];
-        casio_cmd.line=(casio_cmd.line<<8) | ((uint16_t)buf[5]);
-        casio_cmd.offset=((uint32_t)buf[6])<<24;
-        casio_cmd.offset=casio_cmd.offset | (((uint32_t)buf[7])<<16);
-        casio_cmd.offset=casio_cmd.offset | (((uint32_t)buf[8])<<8);
-        casio_cmd.offset=casio_cmd.offset | ((uint32_t)buf[9]);
-        casio_cmd.psize=(uint16_t)buf[10];
-        casio_cmd.psize=(casio_cmd.psize<<8) | ((uint16_t)buf[11]);
-        casio_cmd.area=buf[13];
-        casio_cmd.csum=buf[14];
-        casio_cmd.direction2=0;
-    } else { // DIR_CASIO_RECV
-        casio_cmd.direction2=buf[1];
-        casio_cmd.type2=buf[2];
-        casio_cmd.form2=buf[3];
-        casio_cmd.csum2=buf[14];
+    tb_core::read_row(row, mask, CHAN_MAX);
+    for (i=0; i<CHAN_MAX; i++) {
+        if (mask & (0x01<<i)) vals[n++]=row[i];
     }
-    
-    if(DEVELOPER) usb_serial.printf("instruction decoded\r\n");
-    return(0);
+    return(n);
+}
+
+int
+tb_platform::active_chans(tb_link_t* lk)
+{
+    return(count_active_chan());
 }
 
+int
+tb_platform::read_row(tb_link_t* lk, double* vals, char type)
+{
+    return(get_active_row(vals));
+}
 
 // callbacks
 void blink(void) {
     LED = !LED;
 }
 
-void casio_callback(int events) {
-    int8_t res;
-    uint16_t n;
-    int txbytes_total=0;
-    double scaled;
-    uint16_t scaled_u16;
-    int8_t plen;
-    int i;
-    char padding[24];
-    char doerror=0;
-    char numtok=0;
-    //int16_t tok_arr[TOK_MAX];
-    cmd_tok_t tok_arr[TOK_MAX];
-    float light, uv;
-    
-    
-    
-    switch(comm_state) {
-        case COMM_IDLE:
-            procedure=PROC_NULL;
-            if (comm_seek_char(CASIO_START_INDICATOR) >= 0) {
-                // casio has sent a start indicator. We should send CODEA_OK
-                // but first prepare for the 15 byte response
-                comm_state=COMM_WAITING_INSTRUCTION;
-                clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-                if(PINGPONG) usb_serial.printf("  |                                |\r\n");
-                if(PINGPONG) usb_serial.printf("  |                          **COMM_IDLE**\r\n");
-                if(PINGPONG) usb_serial.printf("  |------0x15-CASIO-START-IND----->|\r\n");     
-                if(PINGPONG) usb_serial.printf("  |<-----------CODEA_OK------------|\r\n");
-                if(DEVELOPER) usb_serial.printf("waiting instruction\r\n");
-                casio_serial.read(casio_rx_buf, 15, casio_callback);
-                // send CODEA_OK
-                casio_send_response(CODEA_OK);
-            } else {
-                // we didn't receive a start indication from casio.
-                if(DEVELOPER) usb_serial.printf("received junk, ignoring:\r\n");
-                if(DEVELOPER) { hex_print(casio_rx_buf, 15); usb_serial.printf("'\r\n"); }
-                if(DEVELOPER) usb_serial.printf("waiting start indicator\r\n");
-                if(PINGPONG) {
-                    usb_serial.printf("  |                                |\r\n");
-                    usb_serial.printf("  |                          **COMM_IDLE**\r\n");
-                    usb_serial.printf("  |-JUNK-");
-                    hex_print(casio_rx_buf, 3);
-                    usb_serial.printf("etc-->|\r\n");
-                }
-                clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-                casio_serial.read(casio_rx_buf, 15, casio_callback, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
-            }
-            break;
-        case COMM_WAITING_INSTRUCTION:
-            if (DEVELOPER) usb_serial.printf("received instruction:\r\n");
-            if (DEVELOPER) { hex_print(casio_rx_buf, 15); usb_serial.printf("'\r\n"); }
-            if(PINGPONG) usb_serial.printf("  |                    COMM_WAITING_INSTRUCTION\r\n");
-            res=decode_instruction(casio_rx_buf);
-            if (res==START_HEADER_ERROR) {
-                if(DEVELOPER) usb_serial.printf("revert to waiting for start indicator\r\n");
-                if(PINGPONG) usb_serial.printf("  |------[START HEADER ERROR]----->|\r\n");
-                comm_state=COMM_IDLE;
-                clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-                casio_serial.read(casio_rx_buf, 15, casio_callback, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
-            } else {
-                if (casio_rx_buf[1]==DIR_CASIO_SEND)
-                    procedure=PROC_SEND38K;
-                else
-                    procedure=PROC_RECV38K;
-                if (VERBOSE) instruction_print();
-                if(PINGPONG) instruction_print(1);
-                if (casio_rx_buf[1]==DIR_CASIO_SEND) {
-                    // casio will now send data, when we issue CODEB_OK
-                    if(PINGPONG) usb_serial.printf("  |<-----------CODEB_OK------------|\r\n");
-                    clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-                    if (casio_cmd.type==TYPE_ASCII) {
-                        casio_cmd.datapacksize=casio_cmd.psize+2; 
-                    } else {
-                        usb_serial.printf("error, cannot handle type '%c'\r\n", casio_cmd.type);
-                        casio_cmd.datapacksize=casio_cmd.psize+2; 
-                    }
-                    if (n>COMM_BUFF_LENGTH) {
-                        usb_serial.printf("error, length %u is larger than buffer size!\r\n", n);
-                        n=COMM_BUFF_LENGTH;
-                    }
-                    casio_serial.read(casio_rx_buf, casio_cmd.datapacksize, casio_callback);
-                    comm_state = COMM_WAITING_DATA;
-                    casio_send_response(CODEB_OK);
-                } else { // DIR_CASIO_RECV
-                    // we are now expected to receive CODEB after sending a header
-                    casio_serial.read(casio_rx_buf, 1, casio_callback, SERIAL_EVENT_RX_ALL, CODEB_OK);
-                    comm_state=COMM_WAITING_RX_HEADER_ACK;
-                    if (casio_cmd.form2=='L') { // think we can now send header for voltage packets?
-                        casio_cmd.command=99; // magic code for now
-                        if (VERBOSE) usb_serial.printf("building header for list response\r\n");
-                        casio_tx_buf[0]=':';
-                        casio_tx_buf[1]='N';
-                        if (casio_cmd.type2=='A') {
-                            casio_tx_buf[2]='A';
-                        } else {
-                            casio_tx_buf[2]='H'; //H
-                        }
-                        casio_tx_buf[3]='L';
-                        casio_tx_buf[4]=0;
-                        casio_tx_buf[5]=1;
-                        casio_tx_buf[6]=0;
-                        casio_tx_buf[7]=0;
-                        casio_tx_buf[8]=0;
-                        casio_tx_buf[9]=1;
-                        casio_tx_buf[10]=0;
-                        if (casio_cmd.type2=='A') {
-                            casio_tx_buf[11]=6; // hard-coded for now, always 6 characters. Should be sufficient.
-                            if(PINGPONG) usb_serial.printf("  |<---NAL,L=1,O=1,P=3,A-----------|\r\n");
-                        } else if (samp_trig_setup.mode==TRIG_MODE_NRT) { // non-real-time chunk, used for faster sampling. Doesn't work.
-                            casio_tx_buf[10]=0x01;
-                            casio_tx_buf[11]=0x90; //400 bytes for 200 hex values.. this doesn't work anyway
-                            if(PINGPONG) usb_serial.printf("  |<---NAL,L=1,O=1,P=2,A-----------|\r\n");
-                        } else { // real-time mode (slower sampling, data sent one sample at a time)
-                            casio_tx_buf[11]=2; // 2 bytes for hex value
-                            if(PINGPONG) usb_serial.printf("  |<---NAL,L=1,O=1,P=2,A-----------|\r\n");
-                        }
-                        casio_tx_buf[12]=0xff;
-                        if (sampnum==0) {
-                            casio_tx_buf[13]='A';
-                        } else if (sampnum==100) {
-                            casio_tx_buf[13]='E';
-                        } else {
-                            casio_tx_buf[13]='M';
-                        }
-                        calc_checksum(casio_tx_buf, 15, (char*)&casio_tx_buf[14]);
-                        if(DEVELOPER) usb_serial.printf("sending list header, waiting for CODEB_OK\r\n");
-                        casio_send_buf(casio_tx_buf, 15);
-                    }
-                    
-                    if (casio_cmd.command=='7') {
-                        if(DEVELOPER) usb_serial.printf("building header for status check (command 7) response\r\n");
-                        if (casio_cmd.line==1) {
-                            if(DEVELOPER) usb_serial.printf("building header for line 1\r\n");
-                            casio_tx_buf[0]=':';
-                            casio_tx_buf[1]='N';
-                            casio_tx_buf[2]='A';
-                            casio_tx_buf[3]='L';
-                            casio_tx_buf[4]=0;
-                            casio_tx_buf[5]=1;
-                            casio_tx_buf[6]=0;
-                            casio_tx_buf[7]=0;
-                            casio_tx_buf[8]=0;
-                            casio_tx_buf[9]=1;
-                            casio_tx_buf[10]=0;
-                            casio_tx_buf[11]=1;
-                            casio_tx_buf[12]=0xff;
-                            casio_tx_buf[13]='A';
-                            calc_checksum(casio_tx_buf, 15, (char*)&casio_tx_buf[14]);
-                            if(DEVELOPER) usb_serial.printf("sending header, waiting for CODEB_OK\r\n");
-                            if(PINGPONG) usb_serial.printf("  |<---NAL,L=1,O=1,P=1,A-----------|\r\n");
-                            casio_send_buf(casio_tx_buf, 15);
-                        }
-                    }
-                    switch(sys_state) {
-                        case SYS_IDLE:
-                            sys_state = SYS_INIT;
-                            break;
-                        default:
-                            if(DEVELOPER) usb_serial.printf("error, unrecognized sys_state %d\r\n", sys_state);
-                            break;
-                    }   
-                    
-                }
-                
-            }
-            break;
-        case COMM_WAITING_DATA:
-            if(DEVELOPER) usb_serial.printf("received data packet:\r\n");
-            if(DEVELOPER) { hex_print(casio_rx_buf, casio_cmd.datapacksize); usb_serial.printf("'\r\n"); }
-            if(PINGPONG) usb_serial.printf("  |                       COMM_WAITING_DATA\r\n");
-            if(HLPP) {
-                if (procedure==PROC_SEND38K) {
-                    usb_serial.printf("  |---S38K: ");
-                    if (casio_cmd.type==TYPE_ASCII) {
-                        plen=(int8_t)casio_cmd.datapacksize-2;
-                        if(plen<20) {
-                            asc_print(casio_rx_buf+1, plen);
-                        } else {
-                            plen=20;
-                            asc_print(casio_rx_buf+1, plen-3);
-                            usb_serial.printf("etc");
-                        }
-                        for (i=0; i<(20-plen); i++) {
-                            padding[i]='-';
-                        }
-                        padding[20-plen]='\0';
-                        usb_serial.printf(padding);
-                        usb_serial.printf("-->|\r\n");
-                    } else if (casio_cmd.type==TYPE_HEX) {
-                        // not fully tested for now
-                        plen=(int8_t)casio_cmd.datapacksize-2;
-                        if(plen<6) {
-                            hex_print(casio_rx_buf+1, plen);
-                        } else {
-                            plen=5;
-                            hex_print(casio_rx_buf+1, plen);
-                            usb_serial.printf("..");
-                        }
-                        for (i=0; i<(20-plen); i++) {
-                            padding[i]='-';
-                        }
-                        padding[20-plen]='\0';
-                        usb_serial.printf(padding);
-                        usb_serial.printf("-->|\r\n");
-                    } else {
-                        // unexpected format
-                        usb_serial.printf("unknown format!------->|\r\n");
-                    }
-                } else {
-                    // we don't expect any other procedure if we're in state COM_WAITING_DATA
-                }
-            }
-            // is the first byte ':'? If not, then reject with a CODEB_ERROR for now
-            if (casio_rx_buf[0]!=':') {
-                if(DEVELOPER) usb_serial.printf("error, invalid data, send CODEB_ERROR\r\n");
-                doerror=1;
-            }
-            
-            get_tokens(&casio_rx_buf[1], casio_cmd.datapacksize-2, tok_arr, &numtok);
-            // handle the commands!
-            switch(tok_arr[0].tokint) {
-                case 1: // channel setup command
-                    if(DEVELOPER)usb_serial.printf("received channel setup data\r\n");
-                    if(PINGPONG) usb_serial.printf("  |--------1-CHAN_SETUP----------->|\r\n");
-                    if (numtok>=3) {
-                        if (tok_arr[1].tokint<=CHAN_MAX) {
-                            chan_setup[tok_arr[1].tokint].operation = tok_arr[2].tokint;
-                            if(DEVELOPER)usb_serial.printf("CH%d set to type %d\r\n", tok_arr[1].tokint, tok_arr[2].tokint);
-                            if (tok_arr[2].tokint!=2) {
-                                if(DEVELOPER)usb_serial.printf("error, unsupported chan type\r\n");
-                            }
-                        }
-                    } else {
-                        // wrong amount of tokens!
-                    }
-                    break;
-                case 3: // sample rate and num samples
-                    if(DEVELOPER)usb_serial.printf("received sampling rate\r\n");
-                    if(PINGPONG) usb_serial.printf("  |--------3-SAMPLERATE----------->|\r\n");
-                    if (numtok>=3) {
-                        if (tok_arr[1].toktype==TOK_TYPE_INT) {
-                            samp_trig_setup.period_usec=((uint32_t)(tok_arr[1].tokint))*1E6;
-                        } else {
-                            samp_trig_setup.period_usec=(uint32_t)(tok_arr[1].tokfloat*1000000.0);
-                        }
-                        if(DEVELOPER)usb_serial.printf("sample rate: %u usec\r\n", samp_trig_setup.period_usec);
-                        if (tok_arr[2].tokint==-1) {
-                            samp_trig_setup.mode=TRIG_MODE_RT;
-                            samp_trig_setup.numsamp=0; // sampled with each data request
-                            if(DEVELOPER)usb_serial.printf("num samples: per data request\r\n");
-                        } else {
-                            samp_trig_setup.numsamp=(unsigned int)tok_arr[2].tokint;
-                            if(DEVELOPER)usb_serial.printf("num samples: %u\r\n", samp_trig_setup.numsamp);
-                        }
-                        
-                    } else {
-                        // wrong amount of tokens!   
-                    }
-                    break;
-                case 7: // status check command 7
-                    casio_cmd.command='7';
-                    if(DEVELOPER) usb_serial.printf("received status check command '7'\r\n");
-                    if(PINGPONG) usb_serial.printf("  |--------7-STATUS_CHECK--------->|\r\n");
-                    break;
-                case 8: // trigger command to start sampling
-                    sampnum=0;
-                    hl_state=HL_SENDING;
-                    if(DEVELOPER)usb_serial.printf("entering state HL_SENDING\r\n");
-                    if(PINGPONG) usb_serial.printf("  |--------8-TRIGGER-------------->|\r\n");
-                    break;
-                case 12: // real time mode
-                    if (numtok==2) {
-                        if (tok_arr[1].tokint==1) {
-                            samp_trig_setup.mode=TRIG_MODE_RT; // real-time mode, single result
-                            if(DEVELOPER)usb_serial.printf("entering realtime mode\r\n");
-                            if(PINGPONG) usb_serial.printf("  |--------12-REALTIME------------>|\r\n");
-                        } else {
-                            samp_trig_setup.mode=TRIG_MODE_NRT; // non-real-time, batched. can't get this to work..
-                            if(DEVELOPER)usb_serial.printf("entering unusable non-realtime mode (batch)\r\n");
-                            if(PINGPONG) usb_serial.printf("  |--------12-NONREALTIME--------->|\r\n");
-                        }
-                    } else {
-                        // wrong number of tokens! Should not occur.
-                    }
-                default:
-                    if(PINGPONG) {
-                        usb_serial.printf("  |--[PAK ");
-                        plen=(int8_t)casio_cmd.datapacksize-2;
-                        if(plen<20) {
-                            asc_print(casio_rx_buf+1, plen);
-                        } else {
-                            plen=20;
-                            asc_print(casio_rx_buf+1, plen-3);
-                            usb_serial.printf("etc");
-                        }
-                        usb_serial.printf("]");
-                        for (i=0; i<(20-plen); i++) {
-                            padding[i]='-';
-                        }
-                        padding[20-plen]='\0';
-                        usb_serial.printf(padding);
-                        usb_serial.printf("--->|\r\n");
-                    }
-                    break;
-            }
-            
-            // we can now send CODEB_OK and go back to idle state
-            if(PINGPONG) {
-                if (doerror) {
-                    usb_serial.printf("  |<---------CODEB_ERROR-----------|\r\n");
-                } else {
-                    usb_serial.printf("  |<-----------CODEB_OK------------|\r\n");
-                }
-            }
-            comm_state=COMM_IDLE;
-            clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-            casio_serial.read(casio_rx_buf, 15, casio_callback, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
-            if (doerror) {
-                casio_send_response(CODEB_ERROR);
-            } else {
-                casio_send_response(CODEB_OK);
-            }
-            break;
-        case COMM_WAITING_RX_HEADER_ACK:
-            if(PINGPONG) usb_serial.printf("  |                  COMM_WAITING_RX_HEADER_ACK\r\n");
-            switch(casio_rx_buf[0]) {
-                case CODEB_OK:
-                    if(DEVELOPER) usb_serial.printf("received CODEB_OK\r\n");
-                    if(PINGPONG) usb_serial.printf("  |------------CODEB_OK----------->|\r\n");
-                    // we are now expected to receive a CODEB after sending a packet
-                    casio_serial.read(casio_rx_buf, 1, casio_callback, SERIAL_EVENT_RX_ALL, CODEB_OK);
-                    if (casio_cmd.command=='7') {
-                        if(DEVELOPER) usb_serial.printf("building packet for status check (command 7) response\r\n");
-                        if (casio_cmd.line==1) {
-                            if(DEVELOPER) usb_serial.printf("building packet for line 1\r\n");
-                            if(PINGPONG) usb_serial.printf("  |<-------1-STATUS_READY----------|\r\n");
-                            if (HLPP) usb_serial.printf("  |<--R38K: 1----------------------|\r\n");
-                            casio_tx_buf[0]=':';
-                            casio_tx_buf[1]='1';
-                            txbytes_total=3;
-                            calc_checksum(casio_tx_buf, txbytes_total, (char*)&casio_tx_buf[txbytes_total-1]);
-                            if(DEVELOPER) usb_serial.printf("sending packet, waiting for CODEB_OK\r\n");
-                            comm_state=COMM_WAITING_RX_PACKET_ACK;
-                            casio_send_buf(casio_tx_buf, txbytes_total);
-                        }
-                    }
-                    if (casio_cmd.command==99) {
-                        if (VERBOSE) usb_serial.printf("building packet with voltage value response\r\n");
-                        if (1/*casio_cmd.line==1*/) {
-                            if (casio_cmd.type2=='A') {
-                                if (VERBOSE) usb_serial.printf("building ascii packet for line 1\r\n");
-                                if(PINGPONG) usb_serial.printf("  |<-----[MEASUREMENT ASCII]-------|\r\n");
-                                casio_tx_buf[0]=':';
-                                light_sensor->get_light_and_uv(&light, &uv);
-                                float2ascii((double)light/1000.0, &casio_tx_buf[1]); // populate 6 bytes with the ASCII representation
-                                //casio_tx_buf[1]='3';
-                                //casio_tx_buf[2]='.';
-                                //casio_tx_buf[3]='6';
-                                txbytes_total=6+2; // 6 bytes from float2ascii, and two bytes for ':' and the checksum
-                                if (HLPP) print_hlpp_r38(&casio_tx_buf[1], txbytes_total-2, 'A');
-                                calc_checksum(casio_tx_buf, txbytes_total, (char*)&casio_tx_buf[txbytes_total-1]);
-                            } else if (casio_cmd.type2=='H') { // is this hex format?
-                                if (VERBOSE) usb_serial.printf("building hex packet for line 1\r\n");
-                                if(PINGPONG) usb_serial.printf("  |<------[MEASUREMENT HEX]--------|\r\n");
-                                casio_tx_buf[0]=':';
-                                light_sensor->get_light_and_uv(&light, &uv);
-                                value=(double)light/1000.0;
-                                if (value>10.0) value=10.0;
-                                if (value<-10.0) value = -10.0;
-                                // convert value to a 12-bit number
-                                scaled=10.92+value;
-                                scaled=scaled*4096;
-                                scaled=scaled/21.555;
-                                scaled_u16=(uint16_t)scaled;
-                                scaled_u16=scaled_u16&0x0fff;
-                                
-                                //value=value+0.1;
-                                //if (value>10.0) value=-10;
-                                
-                                
-                                casio_tx_buf[1]=(uint8_t)(scaled_u16 & 0x00ff);
-                                casio_tx_buf[2]=(uint8_t)((scaled_u16 >> 8) & 0x00ff);
-                                //casio_tx_buf[3]=(uint8_t)(scaled_u16 & 0x00ff);
-                                //casio_tx_buf[4]=(uint8_t)((scaled_u16 >> 8) & 0x00ff);
-                                //casio_tx_buf[5]=(uint8_t)(scaled_u16 & 0x00ff);
-                                //casio_tx_buf[6]=(uint8_t)((scaled_u16 >> 8) & 0x00ff);
-                                //casio_tx_buf[7]=(uint8_t)(scaled_u16 & 0x00ff);
-                                //casio_tx_buf[8]=(uint8_t)((scaled_u16 >> 8) & 0x00ff);
-                                txbytes_total=4;
-                                sampnum=sampnum+1;
-                             
-                                // non-real-time mode is used for fast sample rates. Doesn't work : (
-                                if ((hl_state==HL_SENDING) && (samp_trig_setup.mode==TRIG_MODE_NRT)){
-                                    for (i=0; i<100; i++) {
-                                        scaled=10.92+value;
-                                        scaled=scaled*4096;
-                                        scaled=scaled/21.555;
-                                        scaled_u16=(uint16_t)scaled;
-                                        scaled_u16=scaled_u16&0x0fff;
-                                        value=value+0.1;
-                                        if (value>10.0) value=-10;
-                                        casio_tx_buf[(i*4)+1]=(uint8_t)(scaled_u16 & 0x00ff);
-                                        casio_tx_buf[(i*4)+2]=(uint8_t)((scaled_u16 >> 8) & 0x00ff);
-                                        casio_tx_buf[(i*4)+3]=0x00;
-                                        casio_tx_buf[(i*4)+4]=0x00;
-                                    }
-                                    txbytes_total=(200*2)+2;
-                                    sampnum=sampnum+100;
-                                }                           
-                              
-                                if (HLPP) print_hlpp_r38(&casio_tx_buf[1], txbytes_total-2, 'H');
-                                calc_checksum(casio_tx_buf, txbytes_total, (char*)&casio_tx_buf[txbytes_total-1]);
-                                //sampnum=sampnum+100;
-                            } else {
-                                usb_serial.printf("error, unrecognizable type '%c'!\r\n", casio_cmd.type2);
-                            }
-                            //sampnum++;
-                            if(DEVELOPER)usb_serial.printf("sending voltage sample %u, waiting for CODEB_OK\r\n", sampnum);
-                            if ((hl_state==HL_SENDING) && (samp_trig_setup.mode==TRIG_MODE_NRT)){
-                                if (sampnum>=100) {
-                                    hl_state=HL_IDLE;
-                                    //comm_state=COMM_WAITING_RX_PACKET_ACK;
-                                    comm_state=COMM_WAITING_PERFORM_ROLESWAP;
-                                    if(DEVELOPER)usb_serial.printf("Entering state HL_IDLE\r\n");
-                                } else {
-                                    // we will stay in this state if we are sending multiple data packets
-                                    if(DEVELOPER)usb_serial.printf("then ready to send next data packet\r\n");
-                                    
-                                }
-                                
-                            } else {
-                                comm_state=COMM_WAITING_RX_PACKET_ACK;
-                            }
-                            casio_send_buf(casio_tx_buf, txbytes_total /*15*/);
-                        }
-                    }
-                    break;
-                case CODEB_RETRY:
-                    if(DEVELOPER) usb_serial.printf("received CODEB_RETRY\r\n");
-                    if(PINGPONG) usb_serial.printf("  |----------CODEB_RETRY---------->|\r\n");
-                    break;
-                case CODEB_ERROR:
-                    if(DEVELOPER) usb_serial.printf("received CODEB_ERROR\r\n");
-                    if(PINGPONG) usb_serial.printf("  |----------CODEB_ERROR---------->|\r\n");
-                    break;
-                default:
-                    if(DEVELOPER) usb_serial.printf("received unexpected value '%u', expected CODEB\r\n", casio_rx_buf[0]);
-                    if(PINGPONG) usb_serial.printf("  |---------CODEB_UNKNOWN!-------->|\r\n");
-                    break;
-            }
-            break;
-        case COMM_WAITING_RX_PACKET_ACK:
-            if(PINGPONG) usb_serial.printf("  |                COMM_WAITING_RX_PACKET_ACK\r\n");
-            switch(casio_rx_buf[0]) {
-                case CODEB_OK:
-                    if(DEVELOPER) usb_serial.printf("received CODEB_OK, finished\r\n");
-                    if(PINGPONG) usb_serial.printf("  |------------CODEB_OK----------->|\r\n");
-                    casio_cmd.direction=0;
-                    casio_cmd.direction2=0;
-                    casio_serial.read(casio_rx_buf, 15, casio_callback, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
-                    clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-                    comm_state=COMM_IDLE;
-                    break;
-                case CODEB_RETRY:
-                    if(DEVELOPER) usb_serial.printf("received CODEB_RETRY\r\n");
-                    if(PINGPONG) usb_serial.printf("  |----------CODEB_RETRY---------->|\r\n");
-                    break;
-                case CODEB_ERROR:
-                    if(DEVELOPER) usb_serial.printf("received CODEB_ERROR\r\n");
-                    if(PINGPONG) usb_serial.printf("  |----------CODEB_ERROR---------->|\r\n");
-                    break;
-                default:
-                    if(DEVELOPER) usb_serial.printf("received unexpected value '%u', expected CODEB\r\n", casio_rx_buf[0]);
-                    if(PINGPONG) usb_serial.printf("  |---------CODEB_UNKNOWN!-------->|\r\n");
-                    break;
-            }
-            break;
-        case COMM_WAITING_PERFORM_ROLESWAP:
-            casio_cmd.direction=0;
-            casio_cmd.direction2=0;
-            casio_serial.read(casio_rx_buf, 15, casio_callback, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
-            clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-            comm_state=COMM_IDLE;
-            casio_tx_buf[0]=':';
-            casio_tx_buf[0]='R';
-            casio_tx_buf[0]='A';
-            casio_tx_buf[0]='L';
-            casio_tx_buf[4]=0xff;
-            casio_tx_buf[5]=0xff;
-            casio_tx_buf[6]=0xff;
-            casio_tx_buf[7]=0xff;
-            casio_tx_buf[8]=0xff;
-            casio_tx_buf[9]=0xff;
-            casio_tx_buf[10]=0xff;
-            casio_tx_buf[11]=0xff;
-            casio_tx_buf[12]=0xff;
-            casio_tx_buf[13]=0xff;
-            if(DEVELOPER)usb_serial.printf("Sending Roleswap\r\n");
-            calc_checksum(casio_tx_buf, 15, (char*)&casio_tx_buf[14]);
-            casio_send_buf(casio_tx_buf, 15);   
-            break;
-        default:
-            if(DEVELOPER) usb_serial.printf("unexpected comm state. Going to COMM_IDLE\r\n");
-            if(PINGPONG) usb_serial.printf("  |                          COMM_UNKNOWN!\r\n");
-            comm_state=COMM_IDLE;
-            clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
-            casio_serial.read(casio_rx_buf, 15, casio_callback, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
-            break;
-    }
+void sensor_tick(void) {
+    sensor_due = true;
+}
+
+void i2cCb(int events) {
+    i2c_events = events;
+    i2c_busy = false;
+    i2c_done = true;
+}
 
+// the Casio serial port has received what tb_platform::receive() asked for
+void casio_callback(int events) {
+    tb_core::process(&casio_link);
 }
 
 /**
@@ -1110,15 +557,23 @@ int main()
 {
     int i=0;
     
-    clear_buf(casio_rx_buf, COMM_BUFF_LENGTH);
+    memset(&casio_link, 0, sizeof(tb_link_t));
+    casio_link.procedure=PROC_NULL;
+    casio_link.comm_state=COMM_IDLE;
+    casio_link.sys_state=SYS_IDLE;
+    casio_link.hl_state=HL_IDLE;
+    casio_link.stream_chan=-1;
     // defaults, these should NOT be changed since they match the Casio calculator defaults
-    samp_trig_setup.period_usec=200000; // 0.2 sec default
-    samp_trig_setup.numsamp=101;
-    samp_trig_setup.mode=TRIG_MODE_NRT;
+    casio_link.samp_trig_setup.period_usec=200000; // 0.2 sec default
+    casio_link.samp_trig_setup.numsamp=101;
+    casio_link.samp_trig_setup.mode=TRIG_MODE_NRT;
     
     for (i=0; i<CHAN_MAX; i++) {
-        chan_setup[i].operation=0;
+        casio_link.chan_setup[i].operation=0;
     }
+    casio_link.chan_setup[0].sensor=CH1_SENSOR;
+    casio_link.chan_setup[1].sensor=CH2_SENSOR;
+    casio_link.chan_setup[2].sensor=CH3_SENSOR;
     
     serialEventCb.attach(serialCb);
     //serialEventCb.attach(callback(this,serialCb));
@@ -1133,7 +588,20 @@ int main()
     light_sensor = new Si1133(PC4, PC5);
     if(!light_sensor->open()) {
         usb_serial.printf("error, light sensor failed!\r\n");
+    } else {
+        light_sensor_ok = true;
+    }
+    memset(sensors, 0, sizeof(sensors));
+    memset(&bmp280_cal, 0, sizeof(bmp280_cal_t));
+    sensors[SENS_SI1133].period=LIGHT_PERIOD_TICKS;
+    sensors[SENS_SI7021].period=SI7021_PERIOD_TICKS;
+    sensors[SENS_BMP280].period=BMP280_PERIOD_TICKS;
+    i2cEventCb.attach(i2cCb);
+    if (light_sensor_ok) {
+        sensors[SENS_SI1133].step=1;
+        sensor_step(SENS_SI1133); // the first conversion, so the light level is never empty
     }
+    sensor_ticker.attach(sensor_tick, SENSOR_TICK_RATE);
     
     if((PINGPONG) || (HLPP)) usb_serial.printf("CASIO                            MiniE\r\n");
     if((PINGPONG) || (HLPP)) usb_serial.printf("  |                                |\r\n");
@@ -1144,8 +612,15 @@ int main()
     
     //casio_serial.printf("Hello");
     casioEventCb.attach(casio_callback);
-    casio_serial.read(casio_rx_buf, 15, casio_callback, SERIAL_EVENT_RX_ALL, CASIO_START_INDICATOR);
+    tb_platform::receive(&casio_link, CASIO_HEADER_LEN, CASIO_START_INDICATOR);
     
-    /* Let the callbacks take care of everything */
-    while(1) sleep();
+    /* Let the callbacks take care of everything, apart from the sensor conversions */
+    while(1) {
+        if (sensor_due) {
+            sensor_due = false;
+            sensor_tick_all();
+        }
+        sensor_service();
+        sleep(); // any interrupt wakes this, a tick that arrives just before is picked up on the next one
+    }
 }